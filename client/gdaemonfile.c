@@ -695,6 +695,15 @@ do_async_path_call (GFile *file,
 }
 
 
+/* GDaemonFileEnumerator handles GotInfoCompact. Setting
+ * GVFS_ENUMERATE_NO_COMPACT asks for the infos one attribute at a
+ * time instead, so the two can be compared with the same build. */
+static gboolean
+enumerate_use_compact (void)
+{
+  return g_getenv ("GVFS_ENUMERATE_NO_COMPACT") == NULL;
+}
+
 static GFileEnumerator *
 g_daemon_file_enumerate_children (GFile      *file,
 				  const char *attributes,
@@ -704,6 +713,7 @@ g_daemon_file_enumerate_children (GFile      *file,
 {
   DBusMessage *reply;
   dbus_uint32_t flags_dbus;
+  dbus_bool_t compact;
   char *obj_path;
   GDaemonFileEnumerator *enumerator;
   DBusConnection *connection;
@@ -718,6 +728,7 @@ g_daemon_file_enumerate_children (GFile      *file,
   if (attributes == NULL)
     attributes = "";
   flags_dbus = flags;
+  compact = enumerate_use_compact ();
   reply = do_sync_path_call (file, 
 			     G_VFS_DBUS_MOUNT_OP_ENUMERATE,
 			     NULL, &connection,
@@ -726,6 +737,7 @@ g_daemon_file_enumerate_children (GFile      *file,
 			     DBUS_TYPE_STRING, &attributes,
 			     DBUS_TYPE_UINT32, &flags_dbus,
 			     DBUS_TYPE_STRING, &uri,
+			     DBUS_TYPE_BOOLEAN, &compact,
 			     0);
   g_free (uri);
   g_free (obj_path);
@@ -2420,6 +2432,7 @@ g_daemon_file_enumerate_children_async (GFile                      *file,
                                         gpointer                    user_data)
 {
   dbus_uint32_t flags_dbus;
+  dbus_bool_t compact;
   char *obj_path;
   GDaemonFileEnumerator *enumerator;
   char *uri;
@@ -2432,6 +2445,7 @@ g_daemon_file_enumerate_children_async (GFile                      *file,
   if (attributes == NULL)
     attributes = "";
   flags_dbus = flags;
+  compact = enumerate_use_compact ();
   do_async_path_call (file, 
                       G_VFS_DBUS_MOUNT_OP_ENUMERATE,
                       cancellable,
@@ -2441,6 +2455,7 @@ g_daemon_file_enumerate_children_async (GFile                      *file,
                       DBUS_TYPE_STRING, &attributes,
                       DBUS_TYPE_UINT32, &flags_dbus,
                       DBUS_TYPE_STRING, &uri,
+                      DBUS_TYPE_BOOLEAN, &compact,
                       0);
   g_free (uri);
   g_free (obj_path);
@@ -30,6 +30,7 @@
 #include <gio/gio.h>
 #include <gvfsdaemondbus.h>
 #include <gvfsdaemonprotocol.h>
+#include <gvfsfileinfo.h>
 
 #define OBJ_PATH_PREFIX "/org/gtk/vfs/client/enumerator/"
 
@@ -48,6 +49,10 @@ struct _GDaemonFileEnumerator
   /* protected by infos lock */
   GList *infos;
   gboolean done;
+  gboolean failed; /* Some infos couldn't be read */
+
+  /* Attribute names of GotInfoCompact, only used by the filter */
+  GPtrArray *attributes;
 
   /* For async ops, also protected by infos lock */
   int async_requested_files;
@@ -107,6 +112,9 @@ g_daemon_file_enumerator_finalize (GObject *object)
 
   free_info_list (daemon->infos);
 
+  g_ptr_array_foreach (daemon->attributes, (GFunc)g_free, NULL);
+  g_ptr_array_free (daemon->attributes, TRUE);
+
   if (daemon->sync_connection)
     dbus_connection_unref (daemon->sync_connection);
   
@@ -137,6 +145,7 @@ g_daemon_file_enumerator_init (GDaemonFileEnumerator *daemon)
   char *path;
   
   daemon->id = g_atomic_int_exchange_and_add (&path_counter, 1);
+  daemon->attributes = g_ptr_array_new ();
 
   path = g_daemon_file_enumerator_get_object_path (daemon);
   _g_dbus_register_vfs_filter (path, g_daemon_file_enumerator_dbus_filter,
@@ -174,9 +183,14 @@ trigger_async_done (GDaemonFileEnumerator *daemon, gboolean ok)
 	}
       daemon->infos = rest;
       
-      g_simple_async_result_set_op_res_gpointer (daemon->async_res,
-						 l,
-						 (GDestroyNotify)free_info_list);
+      if (l == NULL && daemon->failed)
+	g_simple_async_result_set_error (daemon->async_res,
+					 G_IO_ERROR, G_IO_ERROR_FAILED,
+					 _("Invalid file info format"));
+      else
+	g_simple_async_result_set_op_res_gpointer (daemon->async_res,
+						   l,
+						   (GDestroyNotify)free_info_list);
     }
 
   g_simple_async_result_complete_in_idle (daemon->async_res);
@@ -197,6 +211,61 @@ trigger_async_done (GDaemonFileEnumerator *daemon, gboolean ok)
   daemon->async_res = NULL;
 }
 
+/* Sets *failed if not all infos in the message could be read */
+static GList *
+get_compact_infos (GDaemonFileEnumerator *enumerator,
+		   DBusMessage           *message,
+		   gboolean              *failed)
+{
+  DBusMessageIter iter;
+  GInputStream *memstream;
+  GDataInputStream *in;
+  GFileInfo *info;
+  GList *infos;
+  char **new_attributes, *data;
+  int n_new_attributes, data_len, i;
+  dbus_uint32_t n_infos, j;
+
+  dbus_message_iter_init (message, &iter);
+  if (!_g_dbus_message_iter_get_args (&iter, NULL,
+				      DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+				      &new_attributes, &n_new_attributes,
+				      DBUS_TYPE_UINT32, &n_infos,
+				      DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+				      &data, &data_len,
+				      0))
+    {
+      *failed = TRUE;
+      return NULL;
+    }
+
+  /* The table takes over the strings */
+  for (i = 0; i < n_new_attributes; i++)
+    g_ptr_array_add (enumerator->attributes, new_attributes[i]);
+  g_free (new_attributes);
+
+  memstream = g_memory_input_stream_new_from_data (data, data_len, NULL);
+  in = g_data_input_stream_new (memstream);
+  g_object_unref (memstream);
+
+  infos = NULL;
+  for (j = 0; j < n_infos; j++)
+    {
+      info = gvfs_file_info_demarshal_compact (in, enumerator->attributes);
+      if (info == NULL)
+	{
+	  *failed = TRUE;
+	  break;
+	}
+
+      infos = g_list_prepend (infos, info);
+    }
+
+  g_object_unref (in);
+
+  return g_list_reverse (infos);
+}
+
 static DBusHandlerResult
 g_daemon_file_enumerator_dbus_filter (DBusConnection     *connection,
 				      DBusMessage        *message,
@@ -252,6 +321,33 @@ g_daemon_file_enumerator_dbus_filter (DBusConnection     *connection,
       G_UNLOCK (infos);
       return DBUS_HANDLER_RESULT_HANDLED;
     }
+  else if (strcmp (member, G_VFS_DBUS_ENUMERATOR_OP_GOT_INFO_COMPACT) == 0)
+    {
+      gboolean failed = FALSE;
+
+      infos = get_compact_infos (enumerator, message, &failed);
+
+      G_LOCK (infos);
+      if (enumerator->failed)
+	{
+	  /* Don't skip over the infos that were lost */
+	  free_info_list (infos);
+	  infos = NULL;
+	}
+      if (failed)
+	{
+	  /* Reported once the infos before it are consumed */
+	  enumerator->failed = TRUE;
+	  enumerator->done = TRUE;
+	}
+      enumerator->infos = g_list_concat (enumerator->infos, infos);
+      if (enumerator->async_requested_files > 0 &&
+	  (enumerator->done ||
+	   g_list_length (enumerator->infos) >= enumerator->async_requested_files))
+	trigger_async_done (enumerator, TRUE);
+      G_UNLOCK (infos);
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
 
   return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
@@ -294,7 +390,12 @@ g_daemon_file_enumerator_next_file (GFileEnumerator *enumerator,
 	  daemon->infos = g_list_delete_link (daemon->infos, daemon->infos);
 	}
       else if (daemon->done)
-	done = TRUE;
+	{
+	  done = TRUE;
+	  if (daemon->failed)
+	    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+				 _("Invalid file info format"));
+	}
       G_UNLOCK (infos);
 
       if (info)
@@ -66,6 +66,18 @@
 
 #define MAX_READ_SIZE (4*1024*1024)
 
+/* Small reads are served from a buffer of this size, and while it is
+   consumed a READ for the next one is already outstanding. Can be
+   changed with GVFS_READ_PREFETCH_SIZE, 0 disables it. */
+#define DEFAULT_PREFETCH_SIZE (128*1024)
+
+static gsize prefetch_size = DEFAULT_PREFETCH_SIZE;
+
+/* Set GVFS_READ_PREFETCH_DEBUG to print how many reads were served
+   from prefetched data (hits) and how many needed a READ request
+   (misses) when a stream is freed */
+static gboolean prefetch_debug = FALSE;
+
 typedef enum {
   INPUT_STATE_IN_REPLY_HEADER,
   INPUT_STATE_IN_BLOCK
@@ -94,6 +106,9 @@ typedef struct {
   /* Input */
   char *buffer;
   gsize buffer_size;
+  /* Set if buffer was replaced by the prefetch buffer */
+  char *user_buffer;
+  gsize user_buffer_size;
   /* Output */
   gssize ret_val;
   GError *ret_error;
@@ -211,10 +226,21 @@ struct _GDaemonFileInputStream {
   goffset current_offset;
 
   GList *pre_reads;
+
+  /* Prefetch buffer */
+  char *prefetch_buffer;
+  gsize prefetch_pos;
+  gsize prefetch_len;
+  int prefetch_seek_generation;
+  guint32 prefetch_seq_nr;   /* Last prefetch READ request sent */
+  guint32 last_reply_seq_nr; /* Last READ request we got a reply for */
+  guint prefetch_hits;
+  guint prefetch_misses;
   
   InputState input_state;
   gsize input_block_size;
   int input_block_seek_generation;
+  gboolean input_block_prefetched;
   GString *input_buffer;
   
   GString *output_buffer;
@@ -325,6 +351,11 @@ g_daemon_file_input_stream_finalize (GObject *object)
   
   g_string_free (file->input_buffer, TRUE);
   g_string_free (file->output_buffer, TRUE);
+  g_free (file->prefetch_buffer);
+
+  if (prefetch_debug)
+    g_printerr ("gvfs: input stream %p: prefetch size %"G_GSIZE_FORMAT", %u hits, %u misses\n",
+		file, prefetch_size, file->prefetch_hits, file->prefetch_misses);
   
   if (G_OBJECT_CLASS (g_daemon_file_input_stream_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_daemon_file_input_stream_parent_class)->finalize) (object);
@@ -336,9 +367,15 @@ g_daemon_file_input_stream_class_init (GDaemonFileInputStreamClass *klass)
   GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
   GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS (klass);
   GFileInputStreamClass *file_stream_class = G_FILE_INPUT_STREAM_CLASS (klass);
+  const char *env;
   
   gobject_class->finalize = g_daemon_file_input_stream_finalize;
 
+  env = g_getenv ("GVFS_READ_PREFETCH_SIZE");
+  if (env != NULL)
+    prefetch_size = MIN (g_ascii_strtoull (env, NULL, 10), MAX_READ_SIZE);
+  prefetch_debug = g_getenv ("GVFS_READ_PREFETCH_DEBUG") != NULL;
+
   stream_class->read_fn = g_daemon_file_input_stream_read;
   if (0) stream_class->skip = g_daemon_file_input_stream_skip;
   stream_class->close_fn = g_daemon_file_input_stream_close;
@@ -385,6 +422,16 @@ g_daemon_file_input_stream_new (int fd,
   return G_FILE_INPUT_STREAM (stream);
 }
 
+/* Forget the prefetch state, after a seek it is of no use */
+static void
+reset_prefetch (GDaemonFileInputStream *file)
+{
+  file->prefetch_pos = 0;
+  file->prefetch_len = 0;
+  file->prefetch_seq_nr = 0;
+  file->last_reply_seq_nr = 0;
+}
+
 static gboolean
 error_is_cancel (GError *error)
 {
@@ -566,6 +613,21 @@ iterate_read_state_machine (GDaemonFileInputStream *file, IOOperationData *io_op
 	  /* Initial state for read op */
 	case READ_STATE_INIT:
 
+	  if (file->prefetch_pos < file->prefetch_len)
+	    {
+	      if (file->prefetch_seek_generation == file->seek_generation)
+		{
+		  len = MIN (op->buffer_size, file->prefetch_len - file->prefetch_pos);
+		  memcpy (op->buffer, file->prefetch_buffer + file->prefetch_pos, len);
+		  file->prefetch_pos += len;
+		  file->prefetch_hits++;
+		  op->ret_val = len;
+		  op->ret_error = NULL;
+		  return STATE_OP_DONE;
+		}
+	      file->prefetch_pos = file->prefetch_len = 0;
+	    }
+
 	  while (file->pre_reads)
 	    {
 	      pre = file->pre_reads->data;
@@ -597,13 +659,26 @@ iterate_read_state_machine (GDaemonFileInputStream *file, IOOperationData *io_op
 		  return STATE_OP_DONE;
 		}
 	    }
-	  
+
+	  /* Read small requests into the prefetch buffer, we hand out
+	     the rest on the next reads */
+	  if (op->buffer_size < prefetch_size)
+	    {
+	      if (file->prefetch_buffer == NULL)
+		file->prefetch_buffer = g_malloc (prefetch_size);
+	      op->user_buffer = op->buffer;
+	      op->user_buffer_size = op->buffer_size;
+	      op->buffer = file->prefetch_buffer;
+	      op->buffer_size = prefetch_size;
+	    }
 	  
 	  /* If we're already reading some data, but we didn't read all, just use that
 	     and don't even send a request */
 	  if (file->input_state == INPUT_STATE_IN_BLOCK &&
 	      file->seek_generation == file->input_block_seek_generation)
 	    {
+	      if (file->input_block_prefetched)
+		file->prefetch_hits++;
 	      op->state = READ_STATE_READ_BLOCK;
 	      io_op->io_buffer = op->buffer;
 	      io_op->io_size = MIN (op->buffer_size, file->input_block_size);
@@ -611,8 +686,27 @@ iterate_read_state_machine (GDaemonFileInputStream *file, IOOperationData *io_op
 	      return STATE_OP_READ;
 	    }
 
-	  append_request (file, G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_READ,
-			  op->buffer_size, 0, 0, &op->seq_nr);
+	  /* If the prefetch READ is still outstanding its data is next
+	     on the wire, so we wait for that instead of asking again.
+	     Small reads then queue a prefetch READ for the chunk after
+	     the one they get, so it is on its way while this one is
+	     consumed. Large reads already ask for at least that much. */
+	  if (file->prefetch_seq_nr > file->last_reply_seq_nr)
+	    {
+	      file->prefetch_hits++;
+	      op->seq_nr = file->prefetch_seq_nr;
+	    }
+	  else
+	    {
+	      file->prefetch_misses++;
+	      append_request (file, G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_READ,
+			      op->buffer_size, 0, 0, &op->seq_nr);
+	    }
+	  
+	  if (op->user_buffer)
+	    append_request (file, G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_READ,
+			    prefetch_size, 0, 0, &file->prefetch_seq_nr);
+	  
 	  op->state = READ_STATE_WROTE_COMMAND;
 	  io_op->io_buffer = file->output_buffer->str;
 	  io_op->io_size = file->output_buffer->len;
@@ -746,6 +840,14 @@ iterate_read_state_machine (GDaemonFileInputStream *file, IOOperationData *io_op
 	    char *data;
 	    data = decode_reply (file->input_buffer, &reply);
 
+	    if ((reply.type == G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_ERROR ||
+		 reply.type == G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_DATA) &&
+		reply.seq_nr > file->last_reply_seq_nr)
+	      file->last_reply_seq_nr = reply.seq_nr;
+
+	    /* Errors for a prefetch READ we don't wait for are dropped,
+	       the read that needs that data asks again and gets the
+	       error itself */
 	    if (reply.type == G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_ERROR &&
 		reply.seq_nr == op->seq_nr)
 	      {
@@ -760,6 +862,8 @@ iterate_read_state_machine (GDaemonFileInputStream *file, IOOperationData *io_op
 		file->input_state = INPUT_STATE_IN_BLOCK;
 		file->input_block_size = reply.arg1;
 		file->input_block_seek_generation = reply.arg2;
+		file->input_block_prefetched =
+		  reply.seq_nr == file->prefetch_seq_nr;
 		op->state = READ_STATE_HANDLE_INPUT_BLOCK;
 		break;
 	      }
@@ -794,6 +898,16 @@ iterate_read_state_machine (GDaemonFileInputStream *file, IOOperationData *io_op
 	  
 	  op->ret_val = io_op->io_res;
 	  op->ret_error = NULL;
+
+	  if (op->user_buffer)
+	    {
+	      len = MIN (op->user_buffer_size, io_op->io_res);
+	      memcpy (op->user_buffer, op->buffer, len);
+	      file->prefetch_len = io_op->io_res;
+	      file->prefetch_pos = len;
+	      file->prefetch_seek_generation = file->input_block_seek_generation;
+	      op->ret_val = len;
+	    }
 	  return STATE_OP_DONE;
 	  
 	default:
@@ -1153,7 +1267,10 @@ iterate_seek_state_machine (GDaemonFileInputStream *file, IOOperationData *io_op
 	  /* We weren't cancelled before first byte sent, so now we will send
 	   * the seek request. Increase the seek generation now. */
 	  if (!op->sent_seek)
-	    file->seek_generation++;
+	    {
+	      file->seek_generation++;
+	      reset_prefetch (file);
+	    }
 	  op->sent_seek = TRUE;
 	  
 	  /* Clear any pre-read data blocks */
@@ -1365,6 +1482,10 @@ iterate_query_state_machine (GDaemonFileInputStream *file,
 	{
 	  /* Initial state for read op */
 	case QUERY_STATE_INIT:
+	  /* Replies to outstanding READs end up in pre_reads now */
+	  file->prefetch_seq_nr = 0;
+	  file->last_reply_seq_nr = 0;
+	  
 	  request = G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_QUERY_INFO;
 	  append_request (file, request,
 			  0,
@@ -1559,6 +1680,7 @@ iterate_query_state_machine (GDaemonFileInputStream *file,
 		file->input_state = INPUT_STATE_IN_BLOCK;
 		file->input_block_size = reply.arg1;
 		file->input_block_seek_generation = reply.arg2;
+		file->input_block_prefetched = FALSE;
 		op->state = QUERY_STATE_HANDLE_INPUT_BLOCK;
 		break;
 	      }
@@ -53,6 +53,42 @@
 
 #define DEBUG_ENABLED 0
 
+/* Seconds that attributes fetched by readdir or getattr are reused, by
+ * us as well as by the kernel */
+#define ATTR_CACHE_TTL          2
+#define ATTR_CACHE_MAX_ENTRIES  10000
+
+/* Everything getattr and access need, so one query serves both */
+#define STAT_ATTRIBUTES                         \
+  G_FILE_ATTRIBUTE_STANDARD_TYPE ","            \
+  G_FILE_ATTRIBUTE_STANDARD_NAME ","            \
+  G_FILE_ATTRIBUTE_STANDARD_IS_SYMLINK ","      \
+  G_FILE_ATTRIBUTE_STANDARD_SIZE ","            \
+  G_FILE_ATTRIBUTE_UNIX_MODE ","                \
+  G_FILE_ATTRIBUTE_TIME_CHANGED ","             \
+  G_FILE_ATTRIBUTE_TIME_MODIFIED ","            \
+  G_FILE_ATTRIBUTE_TIME_ACCESS ","              \
+  G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE ","          \
+  G_FILE_ATTRIBUTE_UNIX_BLOCKS ","              \
+  G_FILE_ATTRIBUTE_ACCESS_CAN_READ ","          \
+  G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE ","         \
+  G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE
+
+/* Number of independently locked parts the file handle maps are split in */
+#define FH_MAP_SHARDS           16
+
+/* Reads at different offsets get a stream each, up to this many per
+ * handle, instead of seeking one stream back and forth */
+#define READ_STREAMS_MAX        4
+
+/* Default bound, in bytes, on what is kept per handle of files read
+ * through streams that can't seek. Overridden by GVFS_FUSE_SPILL_CACHE_SIZE,
+ * 0 turns it off. */
+#define SPILL_CACHE_DEFAULT_SIZE  (64 * 1024 * 1024)
+#define SPILL_SKIP_BUFFER_SIZE    (64 * 1024)
+
+#define STAGING_BUFFER_SIZE       (64 * 1024)
+
 #define GET_FILE_HANDLE(fi)     ((gpointer) (fi)->fh)
 #define SET_FILE_HANDLE(fi, fh) ((fi)->fh = (guint64) (fh))
 
@@ -69,15 +105,64 @@ typedef enum {
 } FileOp;
 
 typedef struct {
-  gint      refcount;
+  GStaticMutex  mutex;
+  GHashTable   *map;
+} FileHandleShard;
+
+typedef struct {
+  GInputStream *stream;
+  goffset       pos;
+  gboolean      busy;
+} ReadStream;
 
-  GMutex   *mutex;
-  gchar    *path;
-  FileOp    op;
-  gpointer  stream;
-  goffset   pos;
+typedef struct {
+  goffset start;
+  goffset end;
+} DirtyExtent;
+
+typedef struct {
+  gint             refcount;
+
+  GMutex          *mutex;
+  GCond           *cond;          /* Signalled when a read stream is returned */
+  gchar           *path;
+  FileHandleShard *shard;         /* Path shard, changes along with path */
+  FileOp           op;
+
+  /* FILE_OP_WRITE */
+  gpointer         stream;
+  goffset          pos;
+
+  /* FILE_OP_READ: ReadStreams, most recently used first. Busy streams
+   * are being read from without holding the mutex. */
+  GList           *read_streams;
+  gint             n_read_streams;
+  gint             n_read_busy;
+
+  /* Unlinked temporary file holding bytes [0, spill_len) of the file,
+   * as streamed by non-seekable read streams, so reads behind them
+   * don't need a new stream. -1 if not created. */
+  gint             spill_fd;
+  goffset          spill_len;
+
+  /* Write-back staging, for writes the output stream can't take or, with
+   * GVFS_FUSE_WRITE_BACK set, for all writes. The unlinked staging file
+   * has the new contents at their offsets, but only the dirty extents
+   * and everything from staging_base on are valid in it; the rest is
+   * still read from the original. Uploaded on flush. -1 if not staging. */
+  gint             staging_fd;
+  GArray          *staging_dirty;        /* DirtyExtent, sorted, disjoint */
+  goffset          staging_size;         /* Size of the new contents */
+  goffset          staging_base;         /* Original bytes used up to here */
+  goffset          staging_orig_size;    /* Size of the original */
 } FileHandle;
 
+typedef struct {
+  struct stat stat;
+  gint        access;   /* R_OK, W_OK and X_OK bits that are granted */
+  time_t      time;
+} AttrCacheEntry;
+
 static GThread        *subthread             = NULL;
 static GMainLoop      *subthread_main_loop   = NULL;
 static GVfs           *gvfs                  = NULL;
@@ -92,9 +177,18 @@ static time_t          daemon_creation_time;
 static uid_t           daemon_uid;
 static gid_t           daemon_gid;
 
-static GStaticMutex    global_mutex          = G_STATIC_MUTEX_INIT;
-static GHashTable     *global_path_to_fh_map = NULL;
-static GHashTable     *global_active_fh_map  = NULL;
+/* Handles are found by path in the shard for their path, and validated
+ * in the shard for their address. If both locks are needed, the path
+ * shard's is taken first. */
+static FileHandleShard path_to_fh_shards [FH_MAP_SHARDS];
+static FileHandleShard active_fh_shards  [FH_MAP_SHARDS];
+
+static goffset         spill_cache_size      = SPILL_CACHE_DEFAULT_SIZE;
+static gboolean        write_back_staging    = FALSE;
+
+/* Full path -> AttrCacheEntry */
+static GStaticMutex    attr_cache_mutex      = G_STATIC_MUTEX_INIT;
+static GHashTable     *attr_cache            = NULL;
 
 /* ------- *
  * Helpers *
@@ -183,18 +277,56 @@ errno_from_error (GError *error)
   return EIO;
 }
 
+static FileHandleShard *
+path_shard (const gchar *path)
+{
+  return &path_to_fh_shards [g_str_hash (path) % FH_MAP_SHARDS];
+}
+
+static FileHandleShard *
+active_shard (gpointer file_handle)
+{
+  return &active_fh_shards [((gsize) file_handle >> 4) % FH_MAP_SHARDS];
+}
+
+/* The handle's path, and with it its shard, may change under us until
+ * we hold the shard's lock */
+static FileHandleShard *
+lock_path_shard (FileHandle *file_handle)
+{
+  FileHandleShard *shard;
+
+  while (TRUE)
+    {
+      shard = file_handle->shard;
+      g_static_mutex_lock (&shard->mutex);
+      if (shard == file_handle->shard)
+        return shard;
+      g_static_mutex_unlock (&shard->mutex);
+    }
+}
+
+/* Called with the path shard locked */
 static FileHandle *
 file_handle_new (const gchar *path)
 {
-  FileHandle *file_handle;
+  FileHandle      *file_handle;
+  FileHandleShard *active;
 
   file_handle = g_new0 (FileHandle, 1);
   file_handle->refcount = 1;
   file_handle->mutex = g_mutex_new ();
+  file_handle->cond = g_cond_new ();
   file_handle->op = FILE_OP_NONE;
   file_handle->path = g_strdup (path);
+  file_handle->shard = path_shard (path);
+  file_handle->spill_fd = -1;
+  file_handle->staging_fd = -1;
 
-  g_hash_table_insert (global_active_fh_map, file_handle, file_handle);
+  active = active_shard (file_handle);
+  g_static_mutex_lock (&active->mutex);
+  g_hash_table_insert (active->map, file_handle, file_handle);
+  g_static_mutex_unlock (&active->mutex);
 
   return file_handle;
 }
@@ -211,56 +343,171 @@ file_handle_unref (FileHandle *file_handle)
 {
   if (g_atomic_int_dec_and_test (&file_handle->refcount))
     {
-      gint refs;
+      FileHandleShard *shard;
+      FileHandleShard *active;
+      gint             refs;
 
-      g_static_mutex_lock (&global_mutex);
+      shard = lock_path_shard (file_handle);
+      active = active_shard (file_handle);
+      g_static_mutex_lock (&active->mutex);
 
       /* Test again, since e.g. get_file_handle_for_path() might have
-       * snatched the global mutex and revived the file handle between
-       * g_atomic_int_dec_and_test() and us obtaining the global lock. */
+       * snatched the shard lock and revived the file handle between
+       * g_atomic_int_dec_and_test() and us obtaining the locks. */
 
       refs = g_atomic_int_get (&file_handle->refcount);
 
       if (refs == 0)
-        g_hash_table_remove (global_path_to_fh_map, file_handle->path);
+        g_hash_table_remove (shard->map, file_handle->path);
 
-      g_static_mutex_unlock (&global_mutex);
+      g_static_mutex_unlock (&active->mutex);
+      g_static_mutex_unlock (&shard->mutex);
     }
 }
 
+/* Called with the handle's mutex held, if anyone else could be using it */
+static void
+file_handle_close_read_streams (FileHandle *file_handle)
+{
+  GList *l;
+
+  while (file_handle->n_read_busy > 0)
+    g_cond_wait (file_handle->cond, file_handle->mutex);
+
+  for (l = file_handle->read_streams; l; l = l->next)
+    {
+      ReadStream *read_stream = l->data;
+
+      g_input_stream_close (read_stream->stream, NULL, NULL);
+      g_object_unref (read_stream->stream);
+      g_slice_free (ReadStream, read_stream);
+    }
+
+  g_list_free (file_handle->read_streams);
+  file_handle->read_streams = NULL;
+  file_handle->n_read_streams = 0;
+
+  if (file_handle->op == FILE_OP_READ)
+    file_handle->op = FILE_OP_NONE;
+}
+
 static void
 file_handle_close_stream (FileHandle *file_handle)
 {
   debug_print ("file_handle_close_stream\n");
-  if (file_handle->stream)
+
+  switch (file_handle->op)
     {
-      switch (file_handle->op)
+    case FILE_OP_READ:
+      file_handle_close_read_streams (file_handle);
+      break;
+
+    case FILE_OP_WRITE:
+      if (file_handle->stream)
         {
-        case FILE_OP_READ:
-          g_input_stream_close (file_handle->stream, NULL, NULL);
-          break;
-          
-        case FILE_OP_WRITE:
           g_output_stream_close (file_handle->stream, NULL, NULL);
-          break;
-          
-        default:
-          g_assert_not_reached ();
+          g_object_unref (file_handle->stream);
+          file_handle->stream = NULL;
         }
-      
-      g_object_unref (file_handle->stream);
-      file_handle->stream = NULL;
       file_handle->op = FILE_OP_NONE;
+      break;
+
+    default:
+      break;
+    }
+}
+
+/* For when the contents change. Called with the handle's mutex held. */
+static void
+file_handle_drop_spill (FileHandle *file_handle)
+{
+  if (file_handle->spill_fd != -1)
+    {
+      close (file_handle->spill_fd);
+      file_handle->spill_fd = -1;
+    }
+
+  file_handle->spill_len = 0;
+}
+
+/* Called with the handle's mutex held */
+static gsize
+file_handle_read_spill (FileHandle *file_handle, gchar *buf, gsize size, off_t offset)
+{
+  gssize n;
+
+  if (file_handle->spill_fd == -1 || offset >= file_handle->spill_len)
+    return 0;
+
+  n = pread (file_handle->spill_fd, buf, MIN (size, file_handle->spill_len - offset), offset);
+
+  return n > 0 ? n : 0;
+}
+
+/* Stores data that a non-seekable stream read at pos, if it continues
+ * what the spill file already has */
+static void
+file_handle_spill (FileHandle *file_handle, goffset pos, const gchar *data, gsize len)
+{
+  gchar   *filename;
+  goffset  end;
+  gssize   n;
+
+  if (spill_cache_size == 0)
+    return;
+
+  g_mutex_lock (file_handle->mutex);
+
+  if (file_handle->spill_fd == -1)
+    {
+      file_handle->spill_fd = g_file_open_tmp ("gvfs-fuse-spill-XXXXXX", &filename, NULL);
+      if (file_handle->spill_fd != -1)
+        {
+          unlink (filename);
+          g_free (filename);
+        }
+    }
+
+  end = MIN (pos + (goffset) len, spill_cache_size);
+
+  if (file_handle->spill_fd != -1 &&
+      pos <= file_handle->spill_len &&
+      end > file_handle->spill_len)
+    {
+      n = pwrite (file_handle->spill_fd,
+                  data + (file_handle->spill_len - pos),
+                  end - file_handle->spill_len,
+                  file_handle->spill_len);
+      if (n > 0)
+        file_handle->spill_len += n;
     }
+
+  g_mutex_unlock (file_handle->mutex);
 }
 
-/* Called on hash table removal */
+/* Discards staged writes. Called with the handle's mutex held. */
+static void
+file_handle_drop_staging (FileHandle *file_handle)
+{
+  if (file_handle->staging_fd == -1)
+    return;
+
+  close (file_handle->staging_fd);
+  file_handle->staging_fd = -1;
+  g_array_free (file_handle->staging_dirty, TRUE);
+  file_handle->staging_dirty = NULL;
+}
+
+/* Called on hash table removal, with both of the handle's shards locked */
 static void
 file_handle_free (FileHandle *file_handle)
 {
-  g_hash_table_remove (global_active_fh_map, file_handle);
+  g_hash_table_remove (active_shard (file_handle)->map, file_handle);
 
   file_handle_close_stream (file_handle);
+  file_handle_drop_spill (file_handle);
+  file_handle_drop_staging (file_handle);
+  g_cond_free (file_handle->cond);
   g_mutex_free (file_handle->mutex);
   g_free (file_handle->path);
   g_free (file_handle);
@@ -269,27 +516,29 @@ file_handle_free (FileHandle *file_handle)
 static FileHandle *
 get_file_handle_for_path (const gchar *path)
 {
-  FileHandle *fh;
+  FileHandleShard *shard = path_shard (path);
+  FileHandle      *fh;
 
-  g_static_mutex_lock (&global_mutex);
+  g_static_mutex_lock (&shard->mutex);
 
-  fh = g_hash_table_lookup (global_path_to_fh_map, path);
+  fh = g_hash_table_lookup (shard->map, path);
 
   if (fh)
     file_handle_ref (fh);
 
-  g_static_mutex_unlock (&global_mutex);
+  g_static_mutex_unlock (&shard->mutex);
   return fh;
 }
 
 static FileHandle *
 get_or_create_file_handle_for_path (const gchar *path)
 {
-  FileHandle *fh;
+  FileHandleShard *shard = path_shard (path);
+  FileHandle      *fh;
 
-  g_static_mutex_lock (&global_mutex);
+  g_static_mutex_lock (&shard->mutex);
 
-  fh = g_hash_table_lookup (global_path_to_fh_map, path);
+  fh = g_hash_table_lookup (shard->map, path);
 
   if (fh)
     {
@@ -298,55 +547,81 @@ get_or_create_file_handle_for_path (const gchar *path)
   else
     {
       fh = file_handle_new (path);
-      g_hash_table_insert (global_path_to_fh_map, fh->path, fh);
+      g_hash_table_insert (shard->map, fh->path, fh);
     }
 
-  g_static_mutex_unlock (&global_mutex);
+  g_static_mutex_unlock (&shard->mutex);
   return fh;
 }
 
 static FileHandle *
 get_file_handle_from_info (struct fuse_file_info *fi)
 {
-  FileHandle *fh;
-
-  g_static_mutex_lock (&global_mutex);
+  FileHandleShard *active;
+  FileHandle      *fh;
 
   fh = GET_FILE_HANDLE (fi);
+  active = active_shard (fh);
+
+  g_static_mutex_lock (&active->mutex);
 
   /* If the file handle is still valid, its value won't change. If
    * invalid, it's set to NULL. */
-  fh = g_hash_table_lookup (global_active_fh_map, fh);
+  fh = g_hash_table_lookup (active->map, fh);
 
   if (fh)
     file_handle_ref (fh);
 
-  g_static_mutex_unlock (&global_mutex);
+  g_static_mutex_unlock (&active->mutex);
   return fh;
 }
 
 static void
 reindex_file_handle_for_path (const gchar *old_path, const gchar *new_path)
 {
-  gchar      *old_path_internal;
-  FileHandle *fh;
-
-  g_static_mutex_lock (&global_mutex);
-
-  if (!g_hash_table_lookup_extended (global_path_to_fh_map, old_path,
+  FileHandleShard *old_shard = path_shard (old_path);
+  FileHandleShard *new_shard = path_shard (new_path);
+  FileHandleShard *active = NULL;
+  gchar           *old_path_internal;
+  FileHandle      *fh;
+  FileHandle      *replaced_fh;
+
+  /* Lock in array order, so two renames can't deadlock */
+  if (old_shard <= new_shard)
+    g_static_mutex_lock (&old_shard->mutex);
+  if (new_shard != old_shard)
+    g_static_mutex_lock (&new_shard->mutex);
+  if (old_shard > new_shard)
+    g_static_mutex_lock (&old_shard->mutex);
+
+  if (!g_hash_table_lookup_extended (old_shard->map, old_path,
                                      (gpointer *) &old_path_internal,
                                      (gpointer *) &fh))
       goto out;
 
-  g_hash_table_steal (global_path_to_fh_map, old_path);
+  g_hash_table_steal (old_shard->map, old_path);
 
   g_free (fh->path);
   fh->path = g_strdup (new_path);
+  fh->shard = new_shard;
+
+  /* A handle already at new_path gets freed when we replace it */
+  replaced_fh = g_hash_table_lookup (new_shard->map, new_path);
+  if (replaced_fh)
+    {
+      active = active_shard (replaced_fh);
+      g_static_mutex_lock (&active->mutex);
+    }
+
+  g_hash_table_replace (new_shard->map, fh->path, fh);
 
-  g_hash_table_insert (global_path_to_fh_map, fh->path, fh);
+  if (active)
+    g_static_mutex_unlock (&active->mutex);
 
  out:
-  g_static_mutex_unlock (&global_mutex);
+  if (new_shard != old_shard)
+    g_static_mutex_unlock (&new_shard->mutex);
+  g_static_mutex_unlock (&old_shard->mutex);
 }
 
 static MountRecord *
@@ -743,55 +1018,203 @@ file_info_get_stat_mode (GFileInfo *file_info)
   return unix_mode;
 }
 
+static void
+file_info_to_stat (GFileInfo *file_info, struct stat *sbuf)
+{
+  GTimeVal mod_time;
+
+  memset (sbuf, 0, sizeof (*sbuf));
+  sbuf->st_blksize = 4096;
+
+  sbuf->st_mode = file_info_get_stat_mode (file_info);
+  sbuf->st_size = g_file_info_get_size (file_info);
+  sbuf->st_uid = daemon_uid;
+  sbuf->st_gid = daemon_gid;
+
+  g_file_info_get_modification_time (file_info, &mod_time);
+  sbuf->st_mtime = mod_time.tv_sec;
+  sbuf->st_ctime = mod_time.tv_sec;
+  sbuf->st_atime = mod_time.tv_sec;
+
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_TIME_CHANGED))
+    sbuf->st_ctime = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_TIME_CHANGED);
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_TIME_ACCESS))
+    sbuf->st_atime = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_TIME_ACCESS);
+
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE))
+    sbuf->st_blksize = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE);
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCKS))
+    sbuf->st_blocks = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCKS);
+  else /* fake it to make 'du' work like 'du --apparent'. */
+    sbuf->st_blocks = (sbuf->st_size + 511) / 512;
+
+  /* Setting st_nlink to 1 for directories makes 'find' work */
+  sbuf->st_nlink = 1;
+}
+
 static gint
-getattr_for_file (GFile *file, struct stat *sbuf)
+file_info_get_access (GFileInfo *file_info)
 {
-  GFileInfo *file_info;
-  GError    *error  = NULL;
-  gint       result = 0;
+  gint access_mask = R_OK | W_OK | X_OK;
+
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ) &&
+      !g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ))
+    access_mask &= ~R_OK;
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE) &&
+      !g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE))
+    access_mask &= ~W_OK;
+  if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE) &&
+      !g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE))
+    access_mask &= ~X_OK;
+
+  return access_mask;
+}
 
-  file_info = g_file_query_info (file, 
-                                 G_FILE_ATTRIBUTE_STANDARD_TYPE ","
-                                 G_FILE_ATTRIBUTE_STANDARD_NAME ","
-                                 G_FILE_ATTRIBUTE_STANDARD_IS_SYMLINK ","
-                                 G_FILE_ATTRIBUTE_STANDARD_SIZE ","
-                                 G_FILE_ATTRIBUTE_UNIX_MODE ","
-                                 G_FILE_ATTRIBUTE_TIME_CHANGED ","
-                                 G_FILE_ATTRIBUTE_TIME_MODIFIED ","
-                                 G_FILE_ATTRIBUTE_TIME_ACCESS ","
-                                 G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE ","
-                                 G_FILE_ATTRIBUTE_UNIX_BLOCKS,
-                                 0, NULL, &error);
+/* readdir stores the attributes of every entry here, so the getattr the
+ * kernel does for each of them doesn't turn into another query. Anything
+ * that modifies a path must drop its entries. */
 
-  if (file_info)
+static void
+attr_cache_entry_free (AttrCacheEntry *entry)
+{
+  g_slice_free (AttrCacheEntry, entry);
+}
+
+static gboolean
+attr_cache_entry_is_expired (gpointer key, gpointer value, gpointer user_data)
+{
+  AttrCacheEntry *entry = value;
+
+  return entry->time < *(time_t *) user_data;
+}
+
+/* Takes ownership of path */
+static void
+attr_cache_insert (gchar *path, GFileInfo *file_info)
+{
+  AttrCacheEntry *entry;
+  time_t          oldest;
+
+  entry = g_slice_new (AttrCacheEntry);
+  file_info_to_stat (file_info, &entry->stat);
+  entry->access = file_info_get_access (file_info);
+  entry->time = time (NULL);
+
+  g_static_mutex_lock (&attr_cache_mutex);
+
+  if (g_hash_table_size (attr_cache) >= ATTR_CACHE_MAX_ENTRIES)
     {
-      GTimeVal mod_time;
+      oldest = entry->time - ATTR_CACHE_TTL;
+      g_hash_table_foreach_remove (attr_cache, attr_cache_entry_is_expired, &oldest);
+      if (g_hash_table_size (attr_cache) >= ATTR_CACHE_MAX_ENTRIES)
+        g_hash_table_remove_all (attr_cache);
+    }
 
-      sbuf->st_mode = file_info_get_stat_mode (file_info);
-      sbuf->st_size = g_file_info_get_size (file_info);
-      sbuf->st_uid = daemon_uid;
-      sbuf->st_gid = daemon_gid;
+  g_hash_table_replace (attr_cache, path, entry);
 
-      g_file_info_get_modification_time (file_info, &mod_time);
-      sbuf->st_mtime = mod_time.tv_sec;
-      sbuf->st_ctime = mod_time.tv_sec;
-      sbuf->st_atime = mod_time.tv_sec;
+  g_static_mutex_unlock (&attr_cache_mutex);
+}
 
-      if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_TIME_CHANGED))
-        sbuf->st_ctime = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_TIME_CHANGED);
-      if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_TIME_ACCESS))
-        sbuf->st_atime = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_TIME_ACCESS);
+static gboolean
+attr_cache_lookup (const gchar *path, struct stat *sbuf, gint *access_mask)
+{
+  AttrCacheEntry *entry;
+  gboolean        found = FALSE;
 
-      if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE))
-	sbuf->st_blksize = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCK_SIZE);
-      if (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCKS))
-	sbuf->st_blocks = file_info_get_attribute_as_uint (file_info, G_FILE_ATTRIBUTE_UNIX_BLOCKS);
-      else /* fake it to make 'du' work like 'du --apparent'. */
-	sbuf->st_blocks = (sbuf->st_size + 511) / 512;
+  g_static_mutex_lock (&attr_cache_mutex);
 
-      /* Setting st_nlink to 1 for directories makes 'find' work */
-      sbuf->st_nlink = 1;
+  entry = g_hash_table_lookup (attr_cache, path);
+  if (entry)
+    {
+      if (entry->time + ATTR_CACHE_TTL < time (NULL))
+        {
+          g_hash_table_remove (attr_cache, path);
+        }
+      else
+        {
+          if (sbuf)
+            *sbuf = entry->stat;
+          if (access_mask)
+            *access_mask = entry->access;
+          found = TRUE;
+        }
+    }
+
+  g_static_mutex_unlock (&attr_cache_mutex);
+
+  return found;
+}
+
+static void
+attr_cache_remove_parent (const gchar *path)
+{
+  const gchar *s;
+  gchar       *parent;
+
+  s = strrchr (path, '/');
+  if (s == NULL || s == path)
+    return;
+
+  parent = g_strndup (path, s - path);
+  g_hash_table_remove (attr_cache, parent);
+  g_free (parent);
+}
+
+static gboolean
+attr_cache_key_is_below (gpointer key, gpointer value, gpointer user_data)
+{
+  const gchar *prefix = user_data;
+  gsize        len = strlen (prefix);
+
+  return strncmp (key, prefix, len) == 0 &&
+         (((gchar *) key)[len] == '/' || ((gchar *) key)[len] == '\0');
+}
+
+/* For changes to a file's contents or attributes */
+static void
+attr_cache_invalidate (const gchar *path)
+{
+  g_static_mutex_lock (&attr_cache_mutex);
+  g_hash_table_remove (attr_cache, path);
+  g_static_mutex_unlock (&attr_cache_mutex);
+}
+
+/* For files appearing or going away, which also changes the directory */
+static void
+attr_cache_invalidate_with_parent (const gchar *path)
+{
+  g_static_mutex_lock (&attr_cache_mutex);
+  g_hash_table_remove (attr_cache, path);
+  attr_cache_remove_parent (path);
+  g_static_mutex_unlock (&attr_cache_mutex);
+}
 
+/* For directories going away, which takes everything below with them */
+static void
+attr_cache_invalidate_tree (const gchar *path)
+{
+  g_static_mutex_lock (&attr_cache_mutex);
+  g_hash_table_foreach_remove (attr_cache, attr_cache_key_is_below, (gpointer) path);
+  attr_cache_remove_parent (path);
+  g_static_mutex_unlock (&attr_cache_mutex);
+}
+
+static gint
+getattr_for_file (GFile *file, const gchar *path, struct stat *sbuf)
+{
+  GFileInfo *file_info;
+  GError    *error  = NULL;
+  gint       result = 0;
+
+  if (attr_cache_lookup (path, sbuf, NULL))
+    return 0;
+
+  file_info = g_file_query_info (file, STAT_ATTRIBUTES, 0, NULL, &error);
+
+  if (file_info)
+    {
+      file_info_to_stat (file_info, sbuf);
+      attr_cache_insert (g_strdup (path), file_info);
       g_object_unref (file_info);
     }
   else
@@ -850,111 +1273,604 @@ vfs_getattr (const gchar *path, struct stat *sbuf)
     {
       /* Submount */
 
-      result = getattr_for_file (file, sbuf);
+      FileHandle *fh;
+
+      result = getattr_for_file (file, path, sbuf);
       g_object_unref (file);
+
+      /* Staged writes aren't visible remotely yet */
+      if (result == 0 && (fh = get_file_handle_for_path (path)))
+        {
+          g_mutex_lock (fh->mutex);
+          if (fh->staging_fd != -1)
+            {
+              sbuf->st_size = fh->staging_size;
+              sbuf->st_blocks = (sbuf->st_size + 511) / 512;
+            }
+          g_mutex_unlock (fh->mutex);
+          file_handle_unref (fh);
+        }
     }
   else
     {
       result = -ENOENT;
     }
 
-  debug_print ("vfs_getattr: -> %s\n", g_strerror (-result));
+  debug_print ("vfs_getattr: -> %s\n", g_strerror (-result));
+
+  return result;
+}
+
+static gint
+vfs_readlink (const gchar *path, gchar *target, size_t size)
+{
+  debug_print ("vfs_readlink: %s\n", path);
+
+  return 0;
+}
+
+/* Hands out a read stream for reading at offset: preferably one left
+ * there by the previous read, else a non-seekable one that can skip
+ * forward to it, else a new one, else the least recently used idle
+ * one. Called with fh->mutex held; the stream is marked busy so the
+ * read itself can be done without the lock. */
+static gint
+file_handle_take_read_stream (FileHandle *fh, GFile *file, off_t offset, ReadStream **read_stream)
+{
+  GFileInputStream *stream;
+  ReadStream       *rs;
+  ReadStream       *idle;
+  ReadStream       *behind;
+  ReadStream       *stale;
+  GError           *error = NULL;
+  GList            *l;
+  gint              result;
+
+  if (fh->op == FILE_OP_WRITE)
+    {
+      debug_print ("file_handle_take_read_stream: doing write\n");
+      file_handle_close_stream (fh);
+    }
+
+  while (TRUE)
+    {
+      idle = NULL;
+      behind = NULL;
+      stale = NULL;
+
+      for (l = fh->read_streams; l; l = l->next)
+        {
+          rs = l->data;
+
+          if (rs->busy)
+            continue;
+          if (rs->pos == offset)
+            break;
+
+          if (g_seekable_can_seek (G_SEEKABLE (rs->stream)))
+            idle = rs;
+          else if (rs->pos < offset)
+            {
+              if (behind == NULL || rs->pos > behind->pos)
+                behind = rs;
+            }
+          else
+            stale = rs;
+        }
+
+      if (l != NULL)
+        goto found;
+
+      /* A new stream would have to skip forward from the start */
+      if (behind != NULL)
+        {
+          rs = behind;
+          goto found;
+        }
+
+      if (fh->n_read_streams < READ_STREAMS_MAX)
+        break;
+
+      if (idle != NULL)
+        {
+          rs = idle;
+          goto found;
+        }
+
+      if (stale != NULL)
+        {
+          /* Past offset with no way back, make room for a new one */
+          fh->read_streams = g_list_remove (fh->read_streams, stale);
+          fh->n_read_streams--;
+
+          g_input_stream_close (stale->stream, NULL, NULL);
+          g_object_unref (stale->stream);
+          g_slice_free (ReadStream, stale);
+          break;
+        }
+
+      g_cond_wait (fh->cond, fh->mutex);
+    }
+
+  /* Open another stream. Counting it as busy meanwhile keeps writers out. */
+
+  debug_print ("file_handle_take_read_stream: opening stream %d\n", fh->n_read_streams);
+
+  fh->n_read_streams++;
+  fh->n_read_busy++;
+  fh->op = FILE_OP_READ;
+
+  g_mutex_unlock (fh->mutex);
+  stream = g_file_read (file, NULL, &error);
+  g_mutex_lock (fh->mutex);
+
+  if (stream == NULL)
+    {
+      fh->n_read_streams--;
+      fh->n_read_busy--;
+      if (fh->n_read_streams == 0)
+        fh->op = FILE_OP_NONE;
+      g_cond_broadcast (fh->cond);
+
+      result = -errno_from_error (error);
+      g_error_free (error);
+      return result;
+    }
+
+  rs = g_slice_new (ReadStream);
+  rs->stream = G_INPUT_STREAM (stream);
+  rs->pos = 0;
+  rs->busy = TRUE;
+
+  fh->read_streams = g_list_prepend (fh->read_streams, rs);
+
+  *read_stream = rs;
+  return 0;
+
+ found:
+  rs->busy = TRUE;
+  fh->n_read_busy++;
+
+  fh->read_streams = g_list_remove (fh->read_streams, rs);
+  fh->read_streams = g_list_prepend (fh->read_streams, rs);
+
+  *read_stream = rs;
+  return 0;
+}
+
+/* Called with fh->mutex held. A stream that failed a read isn't trusted
+ * to be in a usable state, so it's dropped. */
+static void
+file_handle_return_read_stream (FileHandle *fh, ReadStream *rs, gboolean failed)
+{
+  rs->busy = FALSE;
+  fh->n_read_busy--;
+
+  if (failed)
+    {
+      fh->read_streams = g_list_remove (fh->read_streams, rs);
+      fh->n_read_streams--;
+      if (fh->n_read_streams == 0)
+        fh->op = FILE_OP_NONE;
+
+      g_input_stream_close (rs->stream, NULL, NULL);
+      g_object_unref (rs->stream);
+      g_slice_free (ReadStream, rs);
+    }
+
+  g_cond_broadcast (fh->cond);
+}
+
+static gint
+setup_output_stream (GFile *file, FileHandle *fh)
+{
+  GError *error  = NULL;
+  gint    result = 0;
+
+  if (fh->op == FILE_OP_READ)
+    file_handle_close_read_streams (fh);
+
+  file_handle_drop_spill (fh);
+
+  if (!fh->stream)
+    {
+      fh->stream = g_file_append_to (file, 0, NULL, &error);
+      if (fh->stream)
+        fh->pos = g_seekable_tell (G_SEEKABLE (fh->stream));
+    }
+
+  if (fh->stream)
+    fh->op = FILE_OP_WRITE;
+  else
+    fh->op = FILE_OP_NONE;
+
+  if (error)
+    {
+      result = -errno_from_error (error);
+      g_error_free (error);
+    }
+
+  return result;
+}
+
+/* Whether pos is to be read from the staging file rather than the
+ * original, and up to where that holds */
+static gboolean
+staging_range_is_local (FileHandle *fh, goffset pos, goffset *limit)
+{
+  DirtyExtent *extent;
+  guint        i;
+
+  if (pos >= fh->staging_base)
+    {
+      *limit = fh->staging_size;
+      return TRUE;
+    }
+
+  for (i = 0; i < fh->staging_dirty->len; i++)
+    {
+      extent = &g_array_index (fh->staging_dirty, DirtyExtent, i);
+
+      if (pos < extent->start)
+        {
+          *limit = MIN (extent->start, fh->staging_base);
+          return FALSE;
+        }
+      if (pos < extent->end)
+        {
+          *limit = extent->end;
+          return TRUE;
+        }
+    }
+
+  *limit = fh->staging_base;
+  return FALSE;
+}
+
+static void
+staging_add_dirty (FileHandle *fh, goffset start, goffset end)
+{
+  DirtyExtent *extent;
+  DirtyExtent  merged;
+  guint        i = 0;
+
+  while (i < fh->staging_dirty->len &&
+         g_array_index (fh->staging_dirty, DirtyExtent, i).end < start)
+    i++;
+
+  /* Swallow every extent this overlaps or touches */
+  while (i < fh->staging_dirty->len)
+    {
+      extent = &g_array_index (fh->staging_dirty, DirtyExtent, i);
+      if (extent->start > end)
+        break;
+
+      start = MIN (start, extent->start);
+      end = MAX (end, extent->end);
+      g_array_remove_index (fh->staging_dirty, i);
+    }
+
+  merged.start = start;
+  merged.end = end;
+  g_array_insert_val (fh->staging_dirty, i, merged);
+}
+
+/* Switches the handle to staging its writes locally. Called with
+ * fh->mutex held. */
+static gint
+file_handle_start_staging (FileHandle *fh, GFile *file)
+{
+  GFileInfo *info;
+  GError    *error = NULL;
+  gchar     *filename;
+  goffset    size = 0;
+  gint       fd;
+
+  /* What the stream wrote so far becomes part of the original */
+  file_handle_close_stream (fh);
+
+  info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_SIZE, 0, NULL, &error);
+  if (info)
+    {
+      size = g_file_info_get_size (info);
+      g_object_unref (info);
+    }
+  else if (error->domain == G_IO_ERROR && error->code == G_IO_ERROR_NOT_FOUND)
+    {
+      g_error_free (error);
+      error = NULL;
+    }
+  else
+    {
+      gint result = -errno_from_error (error);
+      g_error_free (error);
+      return result;
+    }
+
+  fd = g_file_open_tmp ("gvfs-fuse-staging-XXXXXX", &filename, &error);
+  if (fd == -1)
+    {
+      debug_print ("file_handle_start_staging: %s\n", error->message);
+      g_error_free (error);
+      return -EIO;
+    }
+
+  unlink (filename);
+  g_free (filename);
+
+  if (ftruncate (fd, size) != 0)
+    {
+      gint errsv = errno;
+      close (fd);
+      return -errsv;
+    }
+
+  debug_print ("file_handle_start_staging: %s, %" G_GINT64_FORMAT " bytes\n", fh->path, size);
+
+  fh->staging_fd = fd;
+  fh->staging_dirty = g_array_new (FALSE, FALSE, sizeof (DirtyExtent));
+  fh->staging_size = size;
+  fh->staging_base = size;
+  fh->staging_orig_size = size;
+
+  return 0;
+}
+
+/* Called with fh->mutex held */
+static gint
+write_staging (FileHandle *fh, const gchar *buf, size_t len, off_t offset)
+{
+  gssize n;
+
+  n = pwrite (fh->staging_fd, buf, len, offset);
+  if (n < 0)
+    return -errno;
+
+  if (n > 0)
+    {
+      staging_add_dirty (fh, offset, offset + n);
+      fh->staging_size = MAX (fh->staging_size, offset + n);
+    }
+
+  return n;
+}
+
+/* Called with fh->mutex held */
+static gint
+truncate_staging (FileHandle *fh, goffset size)
+{
+  DirtyExtent *extent;
+  guint        i;
+
+  if (ftruncate (fh->staging_fd, size) != 0)
+    return -errno;
+
+  for (i = 0; i < fh->staging_dirty->len; )
+    {
+      extent = &g_array_index (fh->staging_dirty, DirtyExtent, i);
+
+      if (extent->start >= size)
+        {
+          g_array_remove_index (fh->staging_dirty, i);
+          continue;
+        }
+
+      extent->end = MIN (extent->end, size);
+      i++;
+    }
+
+  /* Original bytes past here are gone, and read back as zeroes if the
+   * file grows again */
+  fh->staging_base = MIN (fh->staging_base, size);
+  fh->staging_size = size;
+
+  return 0;
+}
+
+static gboolean
+staging_upload (FileHandle *fh, GOutputStream *stream, goffset from, goffset to, GError **error)
+{
+  gchar    *buffer;
+  gssize    n;
+  gboolean  res = TRUE;
+
+  buffer = g_malloc (STAGING_BUFFER_SIZE);
+
+  while (from < to)
+    {
+      n = pread (fh->staging_fd, buffer, MIN (STAGING_BUFFER_SIZE, to - from), from);
+      if (n <= 0)
+        {
+          gint errsv = n < 0 ? errno : EIO;
+
+          g_set_error_literal (error, G_IO_ERROR,
+                               g_io_error_from_errno (errsv),
+                               g_strerror (errsv));
+          res = FALSE;
+          break;
+        }
+
+      if (!g_output_stream_write_all (stream, buffer, n, NULL, NULL, error))
+        {
+          res = FALSE;
+          break;
+        }
+
+      from += n;
+    }
+
+  g_free (buffer);
+  return res;
+}
+
+/* Copies the untouched parts of the original into the staging file, so
+ * that it holds all of the new contents */
+static gboolean
+staging_fetch_original (FileHandle *fh, GFile *file, GError **error)
+{
+  GFileInputStream *in;
+  gchar            *buffer;
+  goffset           pos, p, limit, chunk_end;
+  gssize            n;
+  gboolean          res = TRUE;
+
+  in = g_file_read (file, NULL, error);
+  if (in == NULL)
+    return FALSE;
+
+  buffer = g_malloc (STAGING_BUFFER_SIZE);
+
+  for (pos = 0; res && pos < fh->staging_base; pos = chunk_end)
+    {
+      n = g_input_stream_read (G_INPUT_STREAM (in), buffer,
+                               MIN (STAGING_BUFFER_SIZE, fh->staging_base - pos),
+                               NULL, error);
+      if (n < 0)
+        {
+          res = FALSE;
+          break;
+        }
+      if (n == 0)
+        break;
+
+      chunk_end = pos + n;
+
+      for (p = pos; p < chunk_end; p = limit)
+        {
+          gboolean local = staging_range_is_local (fh, p, &limit);
+
+          limit = MIN (limit, chunk_end);
+          if (!local && pwrite (fh->staging_fd, buffer + (p - pos), limit - p, p) != limit - p)
+            {
+              gint errsv = errno;
 
-  return result;
-}
+              g_set_error_literal (error, G_IO_ERROR,
+                                   g_io_error_from_errno (errsv),
+                                   g_strerror (errsv));
+              res = FALSE;
+              break;
+            }
+        }
+    }
 
-static gint
-vfs_readlink (const gchar *path, gchar *target, size_t size)
-{
-  debug_print ("vfs_readlink: %s\n", path);
+  g_free (buffer);
+  g_input_stream_close (G_INPUT_STREAM (in), NULL, NULL);
+  g_object_unref (in);
 
-  return 0;
+  return res;
 }
 
+/* Uploads staged writes, touching as little of the remote file as the
+ * backend allows: appending if only new bytes were added, seeking to
+ * the dirty extents if the stream can seek, and otherwise replacing the
+ * whole file. Called with fh->mutex held. */
 static gint
-setup_input_stream (GFile *file, FileHandle *fh)
+file_handle_commit_staging (FileHandle *fh, GFile *file)
 {
-  GError *error  = NULL;
-  gint    result = 0;
+  GFileOutputStream *stream;
+  DirtyExtent       *extent;
+  GError            *error = NULL;
+  gboolean           appending;
+  gboolean           res = FALSE;
+  gint               result;
+  guint              i;
 
-  if (fh->stream)
-    {
-      debug_print ("setup_input_stream: have stream\n");
+  if (fh->staging_fd == -1)
+    return 0;
 
-      if (fh->op == FILE_OP_READ)
-        {
-          debug_print ("setup_input_stream: doing read\n");
-        }
-      else
-        {
-          debug_print ("setup_input_stream: doing write\n");
+  debug_print ("file_handle_commit_staging: %s\n", fh->path);
 
-          g_output_stream_close (fh->stream, NULL, NULL);
-          g_object_unref (fh->stream);
-          fh->stream = NULL;
-        }
-    }
+  /* Readers of the original must be done with it */
+  file_handle_close_stream (fh);
 
-  if (!fh->stream)
-    {
-      debug_print ("setup_input_stream: no stream\n");
-      fh->stream = g_file_read (file, NULL, &error);
-      fh->pos = 0;
-    }
+  appending = fh->staging_base == fh->staging_orig_size &&
+              (fh->staging_dirty->len == 0 ||
+               g_array_index (fh->staging_dirty, DirtyExtent, 0).start >= fh->staging_orig_size);
 
-  if (fh->stream)
-    fh->op = FILE_OP_READ;
-  else
-    fh->op = FILE_OP_NONE;
+  stream = g_file_append_to (file, 0, NULL, &error);
 
-  if (error)
+  if (stream && appending)
     {
-      debug_print ("setup_input_stream: error\n");
-      result = -errno_from_error (error);
-      g_error_free (error);
+      res = staging_upload (fh, G_OUTPUT_STREAM (stream),
+                            fh->staging_orig_size, fh->staging_size, &error);
     }
+  else if (stream &&
+           g_seekable_can_seek (G_SEEKABLE (stream)) &&
+           (fh->staging_size >= fh->staging_orig_size ||
+            g_seekable_can_truncate (G_SEEKABLE (stream))))
+    {
+      res = TRUE;
 
-  return result;
-}
+      for (i = 0; res && i < fh->staging_dirty->len; i++)
+        {
+          extent = &g_array_index (fh->staging_dirty, DirtyExtent, i);
+          if (extent->start >= fh->staging_base)
+            break;
 
-static gint
-setup_output_stream (GFile *file, FileHandle *fh)
-{
-  GError *error  = NULL;
-  gint    result = 0;
+          res = g_seekable_seek (G_SEEKABLE (stream), extent->start, G_SEEK_SET, NULL, &error) &&
+                staging_upload (fh, G_OUTPUT_STREAM (stream), extent->start,
+                                MIN (extent->end, fh->staging_base), &error);
+        }
 
-  if (fh->stream)
+      if (res && fh->staging_size > fh->staging_base)
+        res = g_seekable_seek (G_SEEKABLE (stream), fh->staging_base, G_SEEK_SET, NULL, &error) &&
+              staging_upload (fh, G_OUTPUT_STREAM (stream), fh->staging_base, fh->staging_size, &error);
+
+      if (res && fh->staging_size < fh->staging_orig_size)
+        res = g_seekable_truncate (G_SEEKABLE (stream), fh->staging_size, NULL, &error);
+    }
+  else
     {
-      if (fh->op == FILE_OP_WRITE)
+      if (stream)
         {
+          g_output_stream_close (G_OUTPUT_STREAM (stream), NULL, NULL);
+          g_object_unref (stream);
+          stream = NULL;
         }
-      else
+      if (error)
+        {
+          g_error_free (error);
+          error = NULL;
+        }
+
+      if (staging_fetch_original (fh, file, &error))
         {
-          g_input_stream_close (fh->stream, NULL, NULL);
-          g_object_unref (fh->stream);
-          fh->stream = NULL;
+          stream = g_file_replace (file, NULL, FALSE, 0, NULL, &error);
+          if (stream)
+            res = staging_upload (fh, G_OUTPUT_STREAM (stream), 0, fh->staging_size, &error);
         }
     }
 
-  if (!fh->stream)
+  if (stream)
     {
-      fh->stream = g_file_append_to (file, 0, NULL, &error);
-      if (fh->stream)
-        fh->pos = g_seekable_tell (G_SEEKABLE (fh->stream));
+      if (res)
+        res = g_output_stream_close (G_OUTPUT_STREAM (stream), NULL, &error);
+      else
+        g_output_stream_close (G_OUTPUT_STREAM (stream), NULL, NULL);
+      g_object_unref (stream);
     }
 
-  if (fh->stream)
-    fh->op = FILE_OP_WRITE;
-  else
-    fh->op = FILE_OP_NONE;
-
-  if (error)
+  if (!res)
     {
-      result = -errno_from_error (error);
-      g_error_free (error);
+      if (error)
+        {
+          debug_print ("file_handle_commit_staging: %s\n", error->message);
+          result = -errno_from_error (error);
+          g_error_free (error);
+        }
+      else
+        {
+          result = -EIO;
+        }
+
+      /* The staged data is kept for another try on the next flush */
+      return result;
     }
 
-  return result;
+  file_handle_drop_staging (fh);
+  file_handle_drop_spill (fh);
+
+  return 0;
 }
 
 static gint
@@ -993,9 +1909,18 @@ vfs_open (const gchar *path, struct fuse_file_info *fi)
               /* Set up a stream here, so we can check for errors */
 
               if (fi->flags & O_WRONLY || fi->flags & O_RDWR)
-                result = setup_output_stream (file, fh);
+                {
+                  result = setup_output_stream (file, fh);
+                }
               else
-                result = setup_input_stream (file, fh);
+                {
+                  ReadStream *rs;
+
+                  /* Left in the pool for the first read */
+                  result = file_handle_take_read_stream (fh, file, 0, &rs);
+                  if (result == 0)
+                    file_handle_return_read_stream (fh, rs, FALSE);
+                }
 
               g_mutex_unlock (fh->mutex);
 
@@ -1090,6 +2015,8 @@ vfs_create (const gchar *path, mode_t mode, struct fuse_file_info *fi)
 
               g_mutex_unlock (fh->mutex);
 
+              attr_cache_invalidate_with_parent (path);
+
               /* The added reference to the file handle is released in vfs_release() */
             }
           else
@@ -1118,6 +2045,23 @@ vfs_release (const gchar *path, struct fuse_file_info *fi)
 
   debug_print ("vfs_release: %s\n", path);
 
+  if (fh)
+    {
+      GFile *file;
+
+      /* Normally flush already uploaded staged writes */
+      g_mutex_lock (fh->mutex);
+      if (fh->staging_fd != -1 && (file = file_from_full_path (path)))
+        {
+          file_handle_commit_staging (fh, file);
+          g_object_unref (file);
+        }
+      g_mutex_unlock (fh->mutex);
+    }
+
+  /* Closing a written stream may be what commits the new contents */
+  attr_cache_invalidate (path);
+
   if (fh)
     {
       /* get_file_handle_from_info () adds a "working ref", so unref twice. */
@@ -1128,8 +2072,44 @@ vfs_release (const gchar *path, struct fuse_file_info *fi)
   return 0;
 }
 
+/* Reads forward to offset, keeping what goes by in the spill file */
+static gint
+skip_stream_into_spill (FileHandle *fh, ReadStream *rs, off_t offset)
+{
+  gchar  *buffer;
+  gssize  n;
+  gint    result = 0;
+  GError *error  = NULL;
+
+  buffer = g_malloc (SPILL_SKIP_BUFFER_SIZE);
+
+  while (rs->pos < offset)
+    {
+      n = g_input_stream_read (rs->stream, buffer,
+                               MIN (SPILL_SKIP_BUFFER_SIZE, offset - rs->pos),
+                               NULL, &error);
+      if (n < 0)
+        {
+          result = -errno_from_error (error);
+          g_error_free (error);
+          break;
+        }
+      else if (n == 0)
+        {
+          /* End of file, the read will come back empty */
+          break;
+        }
+
+      file_handle_spill (fh, rs->pos, buffer, n);
+      rs->pos += n;
+    }
+
+  g_free (buffer);
+  return result;
+}
+
 static gint
-read_stream (FileHandle *fh, gchar *output_buf, size_t output_buf_size, off_t offset)
+read_stream (FileHandle *fh, ReadStream *rs, gchar *output_buf, size_t output_buf_size, off_t offset)
 {
   GInputStream *input_stream;
   gint          n_bytes_skipped = 0;
@@ -1137,9 +2117,9 @@ read_stream (FileHandle *fh, gchar *output_buf, size_t output_buf_size, off_t of
   gint          result          = 0;
   GError       *error           = NULL;
 
-  input_stream = fh->stream;
+  input_stream = rs->stream;
 
-  if (offset != fh->pos)
+  if (offset != rs->pos)
     {
       if (g_seekable_can_seek (G_SEEKABLE (input_stream)))
         {
@@ -1149,7 +2129,7 @@ read_stream (FileHandle *fh, gchar *output_buf, size_t output_buf_size, off_t of
 
           if (g_seekable_seek (G_SEEKABLE (input_stream), offset, G_SEEK_SET, NULL, &error))
             {
-              fh->pos = offset;
+              rs->pos = offset;
             }
           else
             {
@@ -1157,27 +2137,34 @@ read_stream (FileHandle *fh, gchar *output_buf, size_t output_buf_size, off_t of
               g_error_free (error);
             }
         }
-      else if (offset > fh->pos)
+      else if (offset > rs->pos)
         {
           /* Can skip ahead */
 
           debug_print ("read_stream: skipping to offset %d.\n", offset);
 
-          n_bytes_skipped = g_input_stream_skip (input_stream, offset - fh->pos, NULL, &error);
+          if (spill_cache_size > 0)
+            {
+              result = skip_stream_into_spill (fh, rs, offset);
+            }
+          else
+            {
+              n_bytes_skipped = g_input_stream_skip (input_stream, offset - rs->pos, NULL, &error);
 
-          if (n_bytes_skipped > 0)
-            fh->pos += n_bytes_skipped;
+              if (n_bytes_skipped > 0)
+                rs->pos += n_bytes_skipped;
 
-          if (n_bytes_skipped != offset - fh->pos)
-            {
-              if (error)
-                {
-                  result = -errno_from_error (error);
-                  g_error_free (error);
-                }
-              else
+              if (n_bytes_skipped != offset - rs->pos)
                 {
-                  result = -EIO;
+                  if (error)
+                    {
+                      result = -errno_from_error (error);
+                      g_error_free (error);
+                    }
+                  else
+                    {
+                      result = -EIO;
+                    }
                 }
             }
         }
@@ -1206,12 +2193,15 @@ read_stream (FileHandle *fh, gchar *output_buf, size_t output_buf_size, off_t of
                                                  &error);
 
           n_bytes_read += part_bytes_read;
-          fh->pos += part_bytes_read;
+          rs->pos += part_bytes_read;
 
           if (!part_result || part_bytes_read == 0)
             break;
         }
 
+      if (n_bytes_read > 0 && !g_seekable_can_seek (G_SEEKABLE (input_stream)))
+        file_handle_spill (fh, offset, output_buf, n_bytes_read);
+
       result = n_bytes_read;
 
       if (n_bytes_read < output_buf_size)
@@ -1229,6 +2219,112 @@ read_stream (FileHandle *fh, gchar *output_buf, size_t output_buf_size, off_t of
   return result;
 }
 
+/* Whatever a non-seekable stream already went past comes from the spill
+ * file, the rest from a stream. Called with fh->mutex held, which is
+ * dropped while reading so other reads on this handle can proceed in
+ * parallel on other streams. */
+static gint
+read_unstaged (FileHandle *fh, GFile *file, gchar *buf, size_t size, off_t offset)
+{
+  ReadStream *rs;
+  gsize       n_spilled;
+  gint        result;
+
+  n_spilled = file_handle_read_spill (fh, buf, size, offset);
+  if (n_spilled == size)
+    return n_spilled;
+
+  result = file_handle_take_read_stream (fh, file, offset + n_spilled, &rs);
+  if (result != 0)
+    {
+      debug_print ("vfs_read: failed to setup input_stream!\n");
+      return result;
+    }
+
+  g_mutex_unlock (fh->mutex);
+  result = read_stream (fh, rs, buf + n_spilled, size - n_spilled, offset + n_spilled);
+  g_mutex_lock (fh->mutex);
+
+  file_handle_return_read_stream (fh, rs, result < 0);
+
+  if (result >= 0)
+    result += n_spilled;
+
+  return result;
+}
+
+/* Reads for a handle with staged writes: what the staging file has comes
+ * from there, the rest from the original through a read stream. Called
+ * with fh->mutex held. */
+static gint
+read_staged (FileHandle *fh, GFile *file, gchar *buf, size_t size, off_t offset)
+{
+  ReadStream *rs;
+  goffset     pos, end, limit;
+  gsize       n_read = 0;
+  gssize      n;
+  gint        result = 0;
+
+  /* A flush from another thread may end staging while the lock is
+   * dropped for a remote read */
+  while (n_read < size && fh->staging_fd != -1)
+    {
+      pos = offset + n_read;
+      end = MIN (offset + (goffset) size, fh->staging_size);
+      if (pos >= end)
+        break;
+
+      if (staging_range_is_local (fh, pos, &limit))
+        {
+          n = pread (fh->staging_fd, buf + n_read, MIN (end, limit) - pos, pos);
+          if (n <= 0)
+            {
+              result = n < 0 ? -errno : -EIO;
+              break;
+            }
+        }
+      else
+        {
+          result = file_handle_take_read_stream (fh, file, pos, &rs);
+          if (result != 0)
+            break;
+
+          g_mutex_unlock (fh->mutex);
+          n = read_stream (fh, rs, buf + n_read, MIN (end, limit) - pos, pos);
+          g_mutex_lock (fh->mutex);
+
+          file_handle_return_read_stream (fh, rs, n < 0);
+
+          if (n < 0)
+            {
+              result = n;
+              break;
+            }
+          if (n == 0)
+            break;
+        }
+
+      n_read += n;
+    }
+
+  /* Staging ended meanwhile; a short read would get zero-filled into the
+   * page cache, so read the rest from the uploaded file */
+  if (result == 0 && fh->staging_fd == -1 && n_read < size)
+    {
+      result = read_unstaged (fh, file, buf + n_read, size - n_read, offset + n_read);
+      if (result >= 0)
+        {
+          n_read += result;
+          result = 0;
+        }
+    }
+
+  if (result < 0)
+    return result;
+
+  return n_read;
+}
+
 static gint
 vfs_read (const gchar *path, gchar *buf, size_t size,
           off_t offset, struct fuse_file_info *fi)
@@ -1246,18 +2342,13 @@ vfs_read (const gchar *path, gchar *buf, size_t size,
         {
           g_mutex_lock (fh->mutex);
 
-          result = setup_input_stream (file, fh);
-
-          if (result == 0)
-            {
-              result = read_stream (fh, buf, size, offset);
-            }
+          if (fh->staging_fd != -1)
+            result = read_staged (fh, file, buf, size, offset);
           else
-            {
-              debug_print ("vfs_read: failed to setup input_stream!\n");
-            }
+            result = read_unstaged (fh, file, buf, size, offset);
 
           g_mutex_unlock (fh->mutex);
+
           file_handle_unref (fh);
         }
       else
@@ -1374,13 +2465,30 @@ vfs_write (const gchar *path, const gchar *buf, size_t len, off_t offset,
         {
           g_mutex_lock (fh->mutex);
 
-          result = setup_output_stream (file, fh);
+          if (fh->staging_fd == -1 && write_back_staging)
+            {
+              result = file_handle_start_staging (fh, file);
+            }
+          else if (fh->staging_fd == -1)
+            {
+              result = setup_output_stream (file, fh);
+
+              /* Out of order writes the stream can't take get staged */
+              if (result == 0 && offset != fh->pos &&
+                  !g_seekable_can_seek (G_SEEKABLE (fh->stream)))
+                result = file_handle_start_staging (fh, file);
+            }
+
           if (result == 0)
             {
-              result = write_stream (fh, buf, len, offset);
+              if (fh->staging_fd != -1)
+                result = write_staging (fh, buf, len, offset);
+              else
+                result = write_stream (fh, buf, len, offset);
             }
 
           g_mutex_unlock (fh->mutex);
+          attr_cache_invalidate (path);
           file_handle_unref (fh);
         }
       else
@@ -1406,9 +2514,33 @@ vfs_write (const gchar *path, const gchar *buf, size_t len, off_t offset,
 static gint
 vfs_flush (const gchar *path, struct fuse_file_info *fi)
 {
+  FileHandle *fh;
+  GFile      *file;
+  gint        result = 0;
+
   debug_print ("vfs_flush: %s\n", path);
 
-  return 0;
+  fh = get_file_handle_from_info (fi);
+
+  if (fh)
+    {
+      g_mutex_lock (fh->mutex);
+
+      if (fh->staging_fd != -1 && (file = file_from_full_path (path)))
+        {
+          result = file_handle_commit_staging (fh, file);
+          g_object_unref (file);
+        }
+
+      g_mutex_unlock (fh->mutex);
+      file_handle_unref (fh);
+
+      attr_cache_invalidate (path);
+    }
+
+  debug_print ("vfs_flush: -> %s\n", g_strerror (-result));
+
+  return result;
 }
 
 static gint
@@ -1442,7 +2574,7 @@ vfs_opendir (const gchar *path, struct fuse_file_info *fi)
 }
 
 static gint
-readdir_for_file (GFile *base_file, gpointer buf, fuse_fill_dir_t filler)
+readdir_for_file (GFile *base_file, const gchar *path, gpointer buf, fuse_fill_dir_t filler)
 {
   GFileEnumerator *enumerator;
   GFileInfo       *file_info;
@@ -1450,7 +2582,9 @@ readdir_for_file (GFile *base_file, gpointer buf, fuse_fill_dir_t filler)
 
   g_assert (base_file != NULL);
 
-  enumerator = g_file_enumerate_children (base_file, G_FILE_ATTRIBUTE_STANDARD_NAME, 0, NULL, &error);
+  /* Fetch the attributes along with the names, so the getattr calls that
+   * follow for each entry are served from the cache */
+  enumerator = g_file_enumerate_children (base_file, STAT_ATTRIBUTES, 0, NULL, &error);
   if (!enumerator)
     {
       gint result;
@@ -1475,7 +2609,13 @@ readdir_for_file (GFile *base_file, gpointer buf, fuse_fill_dir_t filler)
 
   while ((file_info = g_file_enumerator_next_file (enumerator, NULL, &error)) != NULL)
     {
-      filler (buf, g_file_info_get_name (file_info), NULL, 0);
+      const gchar *name = g_file_info_get_name (file_info);
+      struct stat  sbuf;
+
+      file_info_to_stat (file_info, &sbuf);
+      attr_cache_insert (g_build_path ("/", path, name, NULL), file_info);
+
+      filler (buf, name, &sbuf, 0);
       g_object_unref (file_info);
     }
 
@@ -1517,7 +2657,7 @@ vfs_readdir (const gchar *path, gpointer buf, fuse_fill_dir_t filler, off_t offs
     {
       /* Submount */
 
-      result = readdir_for_file (base_file, buf, filler);
+      result = readdir_for_file (base_file, path, buf, filler);
 
       g_object_unref (base_file);
     }
@@ -1551,6 +2691,7 @@ vfs_rename (const gchar *old_path, const gchar *new_path)
       if (fh)
         {
           g_mutex_lock (fh->mutex);
+          file_handle_commit_staging (fh, old_file);
           file_handle_close_stream (fh);
         }
 
@@ -1568,6 +2709,9 @@ vfs_rename (const gchar *old_path, const gchar *new_path)
           reindex_file_handle_for_path (old_path, new_path);
         }
 
+      attr_cache_invalidate_tree (old_path);
+      attr_cache_invalidate_tree (new_path);
+
       if (fh)
         {
           g_mutex_unlock (fh->mutex);
@@ -1613,6 +2757,7 @@ vfs_unlink (const gchar *path)
       if (fh)
         {
           g_mutex_lock (fh->mutex);
+          file_handle_drop_staging (fh);
           file_handle_close_stream (fh);
         }
 
@@ -1631,6 +2776,10 @@ vfs_unlink (const gchar *path)
           result = -errno_from_error (error);
           g_error_free (error);
         }
+      else
+        {
+          attr_cache_invalidate_with_parent (path);
+        }
 
       g_object_unref (file);
     }
@@ -1662,6 +2811,7 @@ vfs_mkdir (const gchar *path, mode_t mode)
           /* Ignore errors setting the mode. We already created the directory, and that's
            * good enough. */
           g_file_set_attribute_uint32 (file, G_FILE_ATTRIBUTE_UNIX_MODE, mode, 0, NULL, NULL);
+          attr_cache_invalidate_with_parent (path);
         }
 
       if (error)
@@ -1709,6 +2859,10 @@ vfs_rmdir (const gchar *path)
                   result = -errno_from_error (error);
                   g_error_free (error);
                 }
+              else
+                {
+                  attr_cache_invalidate_tree (path);
+                }
             }
           else
             {
@@ -1738,26 +2892,43 @@ vfs_rmdir (const gchar *path)
   return result;
 }
 
+/* Called with fh->mutex held */
 static gboolean
 file_handle_get_size (FileHandle *fh,
+		      GFile *file,
 		      goffset *size)
 {
   GFileInfo *info;
+  ReadStream *rs;
+  GList *l;
   gboolean res;
 
-  if (fh->stream == NULL)
-    return FALSE;
-  
   info = NULL;
   if (fh->op == FILE_OP_READ)
-    info = g_file_input_stream_query_info (fh->stream,
-					   G_FILE_ATTRIBUTE_STANDARD_SIZE,
-					   NULL, NULL);
-  else if (fh->op == FILE_OP_WRITE)
+    {
+      /* Streams in use are read without the lock, and can't take a
+       * second operation */
+      for (l = fh->read_streams; l != NULL; l = l->next)
+        {
+          rs = l->data;
+          if (!rs->busy)
+            {
+              info = g_file_input_stream_query_info (G_FILE_INPUT_STREAM (rs->stream),
+                                                     G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                                                     NULL, NULL);
+              break;
+            }
+        }
+    }
+  else if (fh->op == FILE_OP_WRITE && fh->stream != NULL)
     info = g_file_output_stream_query_info (fh->stream,
 					    G_FILE_ATTRIBUTE_STANDARD_SIZE,
 					    NULL, NULL);
 
+  /* Nothing is being written, so the file has the size */
+  if (info == NULL && fh->op == FILE_OP_READ)
+    info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_SIZE, 0, NULL, NULL);
+
   res = FALSE;
   if (info)
     {
@@ -1791,9 +2962,12 @@ vfs_ftruncate (const gchar *path, off_t size, struct fuse_file_info *fi)
         {
           g_mutex_lock (fh->mutex);
 
-          result = setup_output_stream (file, fh);
+          if (fh->staging_fd != -1)
+            result = truncate_staging (fh, size);
+          else
+            result = setup_output_stream (file, fh);
 
-          if (result == 0)
+          if (result == 0 && fh->staging_fd == -1)
             {
               if (g_seekable_can_truncate (G_SEEKABLE (fh->stream)))
                 {
@@ -1817,14 +2991,17 @@ vfs_ftruncate (const gchar *path, off_t size, struct fuse_file_info *fi)
                       fh->stream = NULL;
                     }
                 }
-              else if (file_handle_get_size (fh, &current_size) &&
+              else if (file_handle_get_size (fh, file, &current_size) &&
 		       current_size == size)
 		{
 		  /* Don't have to do anything to succeed */
 		}
 	      else
 		{
-		  result = -ENOTSUP;
+		  /* The stream can't do it, stage it */
+		  result = file_handle_start_staging (fh, file);
+		  if (result == 0)
+		    result = truncate_staging (fh, size);
                 }
 
               if (error)
@@ -1842,6 +3019,7 @@ vfs_ftruncate (const gchar *path, off_t size, struct fuse_file_info *fi)
           result = -EINVAL;
         }
 
+      attr_cache_invalidate (path);
       g_object_unref (file);
     }
   else
@@ -1875,7 +3053,12 @@ vfs_truncate (const gchar *path, off_t size)
       if (fh)
         g_mutex_lock (fh->mutex);
 
-      if (size == 0)
+      if (fh && fh->staging_fd != -1)
+        {
+          /* Writes to the file are pending, truncate those too */
+          result = truncate_staging (fh, size);
+        }
+      else if (size == 0)
         {
           file_output_stream = g_file_replace (file, 0, FALSE, 0, NULL, &error);
         }
@@ -1900,10 +3083,12 @@ vfs_truncate (const gchar *path, off_t size)
 
       if (fh)
         {
+          file_handle_drop_spill (fh);
           g_mutex_unlock (fh->mutex);
           file_handle_unref (fh);
         }
 
+      attr_cache_invalidate (path);
       g_object_unref (file);
     }
   else
@@ -1936,6 +3121,10 @@ vfs_symlink (const gchar *path_old, const gchar *path_new)
           result = -errno_from_error (error);
           g_error_free (error);
         }
+      else
+        {
+          attr_cache_invalidate_with_parent (path_new);
+        }
     }
   else
     {
@@ -1961,22 +3150,20 @@ vfs_access (const gchar *path, gint mode)
   if (file)
     {
       GFileInfo *file_info;
+      gint       access_mask;
 
-      file_info = g_file_query_info (file,
-                                     G_FILE_ATTRIBUTE_ACCESS_CAN_READ ","
-                                     G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE ","
-                                     G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE ",",
-                                     0, NULL, &error);
-      if (file_info)
+      if (attr_cache_lookup (path, NULL, &access_mask))
+        {
+          if (mode & ~access_mask & (R_OK | W_OK | X_OK))
+            result = -EACCES;
+        }
+      else if ((file_info = g_file_query_info (file, STAT_ATTRIBUTES, 0, NULL, &error)))
         {
-          if ((mode & R_OK && (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ) &&
-                               !g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ))) ||
-              (mode & W_OK && (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE) &&
-                               !g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE))) ||
-              (mode & X_OK && (g_file_info_has_attribute (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE) &&
-                               !g_file_info_get_attribute_boolean (file_info, G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE))))
+          access_mask = file_info_get_access (file_info);
+          if (mode & ~access_mask & (R_OK | W_OK | X_OK))
             result = -EACCES;
 
+          attr_cache_insert (g_strdup (path), file_info);
           g_object_unref (file_info);
         }
       else if (error)
@@ -2045,6 +3232,8 @@ vfs_utimens (const gchar *path, const struct timespec tv [2])
                                 0, NULL, &error);
         }
 
+      attr_cache_invalidate (path);
+
       if (error)
         {
           result = -errno_from_error (error);
@@ -2078,6 +3267,7 @@ vfs_chmod (const gchar *path, mode_t mode)
   if (file)
     {
       g_file_set_attribute_uint32 (file, G_FILE_ATTRIBUTE_UNIX_MODE, mode, 0, NULL, &error);
+      attr_cache_invalidate (path);
 
       if (error)
         {
@@ -2126,6 +3316,11 @@ mount_tracker_unmounted_cb (GVolumeMonitor *volume_monitor,
       
       if (g_file_equal (root, mount_record->root))
         {
+          gchar *path = g_strconcat ("/", mount_record->name, NULL);
+
+          attr_cache_invalidate_tree (path);
+          g_free (path);
+
           mount_list = g_list_delete_link (mount_list, l);
           mount_record_free (mount_record);
           break;
@@ -2207,16 +3402,31 @@ vfs_init (struct fuse_conn_info *conn)
 	DBusConnection *dbus_conn;
   DBusMessage *message;
 	DBusError error;
+  const gchar *env;
+  gint i;
   
   daemon_creation_time = time (NULL);
   daemon_uid = getuid ();
   daemon_gid = getgid ();
 
   mount_list_mutex = g_mutex_new ();
-  global_path_to_fh_map = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                                 NULL, (GDestroyNotify) file_handle_free);
-  global_active_fh_map = g_hash_table_new_full (g_direct_hash, g_direct_equal,
-                                                NULL, NULL);
+
+  env = g_getenv ("GVFS_FUSE_SPILL_CACHE_SIZE");
+  if (env != NULL)
+    spill_cache_size = g_ascii_strtoull (env, NULL, 10);
+
+  write_back_staging = g_getenv ("GVFS_FUSE_WRITE_BACK") != NULL;
+  for (i = 0; i < FH_MAP_SHARDS; i++)
+    {
+      g_static_mutex_init (&path_to_fh_shards [i].mutex);
+      path_to_fh_shards [i].map = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                         NULL, (GDestroyNotify) file_handle_free);
+      g_static_mutex_init (&active_fh_shards [i].mutex);
+      active_fh_shards [i].map = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                        NULL, NULL);
+    }
+  attr_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                      g_free, (GDestroyNotify) attr_cache_entry_free);
 
 	dbus_error_init (&error);
 
@@ -2317,8 +3527,18 @@ static struct fuse_operations vfs_oper =
 gint
 main (gint argc, gchar *argv [])
 {
+  struct fuse_args args = FUSE_ARGS_INIT (argc, argv);
+  gint             result;
+
   g_type_init ();
   g_thread_init (NULL);
 
-  return fuse_main (argc, argv, &vfs_oper, NULL /* user data */);
+  /* Let the kernel hold on to lookups and attributes as long as we do */
+  fuse_opt_add_arg (&args, "-oentry_timeout=" G_STRINGIFY (ATTR_CACHE_TTL)
+                           ",attr_timeout=" G_STRINGIFY (ATTR_CACHE_TTL));
+
+  result = fuse_main (args.argc, args.argv, &vfs_oper, NULL /* user data */);
+
+  fuse_opt_free_args (&args);
+  return result;
 }
@@ -83,6 +83,11 @@ G_BEGIN_DECLS
 #define G_VFS_DBUS_ENUMERATOR_INTERFACE "org.gtk.vfs.Enumerator"
 #define G_VFS_DBUS_ENUMERATOR_OP_DONE "Done"
 #define G_VFS_DBUS_ENUMERATOR_OP_GOT_INFO "GotInfo"
+/* Sent instead of GotInfo if the client asked for it. Args are the
+   attribute names added to the table of the enumeration (as), the
+   number of infos (u) and the infos written by
+   gvfs_file_info_marshal_compact() (ay) */
+#define G_VFS_DBUS_ENUMERATOR_OP_GOT_INFO_COMPACT "GotInfoCompact"
 
 #define G_VFS_DBUS_MONITOR_INTERFACE "org.gtk.vfs.Monitor"
 #define G_VFS_DBUS_MONITOR_OP_SUBSCRIBE "Subscribe"
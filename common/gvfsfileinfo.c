@@ -58,24 +58,22 @@ read_string (GDataInputStream *in)
   return str;
 }
 
-char *
-gvfs_file_info_marshal (GFileInfo *info,
-			gsize     *size)
+/* Writes the attributes of info to out. With attribute_ids the names
+ * are replaced by their index in the table, and names not in it yet
+ * are added to it and to new_attributes */
+static void
+put_attributes (GDataOutputStream *out,
+		GFileInfo         *info,
+		GHashTable        *attribute_ids,
+		GPtrArray         *new_attributes)
 {
-  GOutputStream *memstream;
-  GDataOutputStream *out;
   GFileAttributeType type;
   GFileAttributeStatus status;
   GObject *obj;
   char **attrs, *attr;
-  char *data;
+  gpointer id;
   int i;
 
-  memstream = g_memory_output_stream_new (NULL, 0, g_realloc, NULL);
-
-  out = g_data_output_stream_new (memstream);
-  g_object_unref (memstream);
-
   attrs = g_file_info_list_attributes (info, NULL);
 
   g_data_output_stream_put_uint32 (out,
@@ -89,7 +87,20 @@ gvfs_file_info_marshal (GFileInfo *info,
       type = g_file_info_get_attribute_type  (info, attr);
       status = g_file_info_get_attribute_status  (info, attr);
       
-      put_string (out, attr);
+      if (attribute_ids == NULL)
+	put_string (out, attr);
+      else
+	{
+	  if (!g_hash_table_lookup_extended (attribute_ids, attr, NULL, &id))
+	    {
+	      id = GUINT_TO_POINTER (g_hash_table_size (attribute_ids));
+	      attr = g_strdup (attr);
+	      g_hash_table_insert (attribute_ids, attr, id);
+	      g_ptr_array_add (new_attributes, attr);
+	    }
+	  g_data_output_stream_put_uint32 (out, GPOINTER_TO_UINT (id),
+					   NULL, NULL);
+	}
       g_data_output_stream_put_byte (out, type, 
 				     NULL, NULL);
       g_data_output_stream_put_byte (out, status, 
@@ -140,10 +151,19 @@ gvfs_file_info_marshal (GFileInfo *info,
 	      char *icon_str;
 
 	      icon_str = g_icon_to_string (G_ICON (obj));
-	      g_data_output_stream_put_byte (out, 1,
-					     NULL, NULL);
-	      put_string (out, icon_str);
-	      g_free (icon_str);
+	      if (icon_str == NULL)
+		{
+		  /* Not serializable, send it as NULL */
+		  g_data_output_stream_put_byte (out, 0,
+						 NULL, NULL);
+		}
+	      else
+		{
+		  g_data_output_stream_put_byte (out, 1,
+						 NULL, NULL);
+		  put_string (out, icon_str);
+		  g_free (icon_str);
+		}
 	    }
 	  else
 	    {
@@ -159,37 +179,75 @@ gvfs_file_info_marshal (GFileInfo *info,
 	}
     }
 
+  g_strfreev (attrs);
+}
+
+char *
+gvfs_file_info_marshal (GFileInfo *info,
+			gsize     *size)
+{
+  GOutputStream *memstream;
+  GDataOutputStream *out;
+  char *data;
+
+  memstream = g_memory_output_stream_new (NULL, 0, g_realloc, NULL);
+
+  out = g_data_output_stream_new (memstream);
+  g_object_unref (memstream);
+
+  put_attributes (out, info, NULL, NULL);
+
   data = g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (memstream));
   *size = g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (memstream));
   g_object_unref (out);
-  g_strfreev (attrs);
   return data;
 }
 
-GFileInfo *
-gvfs_file_info_demarshal (char      *data,
-			  gsize      size)
+/* Like gvfs_file_info_marshal(), but appends to out and refers to the
+ * attributes by index in a table shared by all infos written with the
+ * same attribute_ids. The names that got added to the table are
+ * appended to new_attributes, and must reach the reader before the
+ * data does. attribute_ids must own its keys (g_free). */
+void
+gvfs_file_info_marshal_compact (GFileInfo         *info,
+				GDataOutputStream *out,
+				GHashTable        *attribute_ids,
+				GPtrArray         *new_attributes)
 {
-  guint32 num_attrs, i;
-  GInputStream *memstream;
-  GDataInputStream *in;
-  GFileInfo *info;
+  put_attributes (out, info, attribute_ids, new_attributes);
+}
+
+/* Reads attributes written by put_attributes() into info, looking up
+ * the names in attributes if they were written as indexes. Returns
+ * FALSE if the data couldn't be understood. */
+static gboolean
+get_attributes (GDataInputStream *in,
+		GFileInfo        *info,
+		GPtrArray        *attributes)
+{
+  guint32 num_attrs, i, id;
   char *attr, *str;
   GFileAttributeType type;
   GFileAttributeStatus status;
   GObject *obj;
   int objtype;
 
-  memstream = g_memory_input_stream_new_from_data (data, size, NULL);
-  in = g_data_input_stream_new (memstream);
-  g_object_unref (memstream);
-
-  info = g_file_info_new ();
   num_attrs = g_data_input_stream_read_uint32 (in, NULL, NULL);
 
   for (i = 0; i < num_attrs; i++)
     {
-      attr = read_string (in);
+      if (attributes == NULL)
+	attr = read_string (in);
+      else
+	{
+	  id = g_data_input_stream_read_uint32 (in, NULL, NULL);
+	  if (id >= attributes->len)
+	    {
+	      g_warning ("Unknown GFileInfo attribute id %u\n", id);
+	      return FALSE;
+	    }
+	  attr = g_strdup (g_ptr_array_index (attributes, id));
+	}
       type = g_data_input_stream_read_byte (in, NULL, NULL);
       status = g_data_input_stream_read_byte (in, NULL, NULL);
 
@@ -242,6 +300,7 @@ gvfs_file_info_demarshal (char      *data,
 	  objtype = g_data_input_stream_read_byte (in, NULL, NULL);
 	  obj = NULL;
 
+	  /* 0 == NULL */
 	  if (objtype == 1)
 	    {
 	      char *icon_str;
@@ -250,13 +309,14 @@ gvfs_file_info_demarshal (char      *data,
 	      obj = (GObject *)g_icon_new_for_string  (icon_str, NULL);
 	      g_free (icon_str);
 	    }
-	  else
+	  else if (objtype != 0)
 	    {
 	      g_warning ("Unsupported GFileInfo object type %d\n", objtype);
 	      g_free (attr);
-	      goto out;
+	      return FALSE;
 	    }
-	  g_file_info_set_attribute_object (info, attr, obj);
+	  /* g_file_info_set_attribute_object() doesn't take NULL */
+	  g_file_info_set_attribute (info, attr, G_FILE_ATTRIBUTE_TYPE_OBJECT, obj);
 	  if (obj)
 	    g_object_unref (obj);
 	  break;
@@ -264,15 +324,51 @@ gvfs_file_info_demarshal (char      *data,
 	default:
 	  g_warning ("Unsupported GFileInfo attribute type %d\n", type);
 	  g_free (attr);
-	  goto out;
+	  return FALSE;
 	  break;
 	}
       g_free (attr);
     }
-  
- out:
+
+  return TRUE;
+}
+
+GFileInfo *
+gvfs_file_info_demarshal (char      *data,
+			  gsize      size)
+{
+  GInputStream *memstream;
+  GDataInputStream *in;
+  GFileInfo *info;
+
+  memstream = g_memory_input_stream_new_from_data (data, size, NULL);
+  in = g_data_input_stream_new (memstream);
+  g_object_unref (memstream);
+
+  info = g_file_info_new ();
+  get_attributes (in, info, NULL);
+
   g_object_unref (in);
   return info;
 }
 
+/* Reads one info written by gvfs_file_info_marshal_compact(), with
+ * attributes being the table built from all the new_attributes so far.
+ * Returns NULL if the data couldn't be understood. */
+GFileInfo *
+gvfs_file_info_demarshal_compact (GDataInputStream *in,
+				  GPtrArray        *attributes)
+{
+  GFileInfo *info;
+
+  info = g_file_info_new ();
+  if (!get_attributes (in, info, attributes))
+    {
+      g_object_unref (info);
+      return NULL;
+    }
+
+  return info;
+}
+
 
@@ -24,6 +24,7 @@
 #define __G_VFS_FILE_INFO_H__
 
 #include <glib.h>
+#include <gio/gio.h>
 
 G_BEGIN_DECLS
 
@@ -32,6 +33,13 @@ char *     gvfs_file_info_marshal   (GFileInfo *info,
 GFileInfo *gvfs_file_info_demarshal (char      *data,
 				     gsize      size);
 
+void       gvfs_file_info_marshal_compact   (GFileInfo         *info,
+					     GDataOutputStream *out,
+					     GHashTable        *attribute_ids,
+					     GPtrArray         *new_attributes);
+GFileInfo *gvfs_file_info_demarshal_compact (GDataInputStream  *in,
+					     GPtrArray         *attributes);
+
 G_END_DECLS
 
 #endif /* __G_VFS_FILE_INFO_H__ */
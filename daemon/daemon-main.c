@@ -24,6 +24,7 @@
 
 #include <unistd.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <string.h>
 #include <locale.h>
 
@@ -39,6 +40,7 @@ static char *spawner_id = NULL;
 static char *spawner_path = NULL;
 
 static gboolean print_debug = FALSE;
+static int max_job_threads_arg = 0;
 
 static void
 log_debug (const gchar   *log_domain,
@@ -131,6 +133,52 @@ send_spawned (DBusConnection *connection, gboolean succeeded, char *error_messag
   dbus_connection_flush (connection);
 }
 
+/* Returns the number of threads in @str, or 0 if it is not a
+ * number of at least 1 */
+static int
+parse_max_job_threads (const char *str)
+{
+  char *end;
+  long value;
+
+  errno = 0;
+  value = strtol (str, &end, 10);
+  if (errno != 0 || end == str || *end != 0 ||
+      value < 1 || value > G_MAXINT)
+    return 0;
+
+  return value;
+}
+
+/* The --max-job-threads argument (from the .mount file) overrides the
+ * GVFS_MAX_JOB_THREADS environment variable, which overrides the
+ * compiled in default of the backend */
+static int
+get_max_job_threads (int default_max_job_threads)
+{
+  const char *env;
+  int max_job_threads, env_max_job_threads;
+
+  max_job_threads = default_max_job_threads;
+
+  env = g_getenv ("GVFS_MAX_JOB_THREADS");
+  if (env != NULL)
+    {
+      env_max_job_threads = parse_max_job_threads (env);
+      if (env_max_job_threads != 0)
+        max_job_threads = env_max_job_threads;
+      else
+        g_printerr ("Ignoring invalid GVFS_MAX_JOB_THREADS value '%s'\n", env);
+    }
+
+  if (max_job_threads_arg != 0)
+    max_job_threads = max_job_threads_arg;
+
+  g_debug ("Using %d job threads\n", max_job_threads);
+  
+  return max_job_threads;
+}
+
 GMountSpec *
 daemon_parse_args (int argc, char *argv[], const char *default_type)
 {
@@ -142,6 +190,20 @@ daemon_parse_args (int argc, char *argv[], const char *default_type)
       argc--;
       argv++;
     }
+
+  /* Passed by the main daemon from the MaxJobThreads key of the .mount file */
+  if (argc > 2 && strcmp (argv[1], "--max-job-threads") == 0)
+    {
+      max_job_threads_arg = parse_max_job_threads (argv[2]);
+      if (max_job_threads_arg == 0)
+	{
+	  g_printerr (_("Invalid number of job threads: %s"), argv[2]);
+	  g_printerr ("\n");
+	  exit (1);
+	}
+      argc -= 2;
+      argv += 2;
+    }
   
   mount_spec = NULL;
   if (argc > 1 && strcmp (argv[1], "--spawner") == 0)
@@ -273,7 +335,7 @@ daemon_main (int argc,
       exit (1);
     }
 
-  g_vfs_daemon_set_max_threads (daemon, max_job_threads);  
+  g_vfs_daemon_set_max_threads (daemon, get_max_job_threads (max_job_threads));
   
   send_spawned (connection, TRUE, NULL);
 	  
@@ -75,6 +75,12 @@ struct _GVfsBackendPrivate
   char *prefered_filename_encoding;
   gboolean user_visible;
   GMountSpec *mount_spec;
+
+  /* Jobs run on worker threads take this shared, unless their type
+   * isn't in parallel_job_types in which case they take it exclusively.
+   * parallel_job_types == NULL means no job type is parallel-safe. */
+  GStaticRWLock job_lock;
+  GArray *parallel_job_types;
 };
 
 
@@ -151,6 +157,9 @@ g_vfs_backend_finalize (GObject *object)
   g_free (backend->priv->prefered_filename_encoding);
   if (backend->priv->mount_spec)
     g_mount_spec_unref (backend->priv->mount_spec);
+  if (backend->priv->parallel_job_types)
+    g_array_free (backend->priv->parallel_job_types, TRUE);
+  g_static_rw_lock_free (&backend->priv->job_lock);
   
   if (G_OBJECT_CLASS (g_vfs_backend_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_backend_parent_class)->finalize) (object);
@@ -200,6 +209,7 @@ g_vfs_backend_init (GVfsBackend *backend)
   backend->priv->display_name = g_strdup ("");
   backend->priv->stable_name = g_strdup ("");
   backend->priv->user_visible = TRUE;
+  g_static_rw_lock_init (&backend->priv->job_lock);
 }
 
 static void
@@ -273,6 +283,86 @@ g_vfs_backend_get_daemon (GVfsBackend *backend)
   return backend->priv->daemon;
 }
 
+/**
+ * g_vfs_backend_set_parallel_job_types:
+ * @backend: backend
+ * @first_job_type: the first job type, or %G_TYPE_INVALID
+ * @...: more job types, terminated by %G_TYPE_INVALID
+ *
+ * Declares which job types may run at the same time as other jobs
+ * when the daemon uses more than one worker thread. Jobs of any
+ * other type are run exclusively, i.e. they wait for all running
+ * jobs of the backend to finish and block new ones until done.
+ *
+ * If this function isn't called all jobs are run exclusively, so
+ * raising the number of worker threads can't break backends that
+ * were never checked for thread safety. Passing %G_VFS_TYPE_JOB
+ * allows all job types, for backends that do their own locking.
+ *
+ * This only affects the blocking (non-try_) calls, the try_ calls
+ * always run on the main thread.
+ **/
+void
+g_vfs_backend_set_parallel_job_types (GVfsBackend *backend,
+				      GType        first_job_type,
+				      ...)
+{
+  va_list var_args;
+  GType job_type;
+
+  if (backend->priv->parallel_job_types)
+    g_array_free (backend->priv->parallel_job_types, TRUE);
+  backend->priv->parallel_job_types = g_array_new (FALSE, FALSE, sizeof (GType));
+
+  va_start (var_args, first_job_type);
+  for (job_type = first_job_type;
+       job_type != G_TYPE_INVALID;
+       job_type = va_arg (var_args, GType))
+    g_array_append_val (backend->priv->parallel_job_types, job_type);
+  va_end (var_args);
+}
+
+static gboolean
+job_is_parallel_safe (GVfsBackend *backend,
+		      GVfsJob     *job)
+{
+  GArray *types;
+  guint i;
+
+  types = backend->priv->parallel_job_types;
+  if (types == NULL)
+    return FALSE;
+
+  for (i = 0; i < types->len; i++)
+    {
+      if (G_TYPE_CHECK_INSTANCE_TYPE (job, g_array_index (types, GType, i)))
+	return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Called on the worker thread around the blocking run of a job */
+void
+g_vfs_backend_job_enter (GVfsBackend *backend,
+			 GVfsJob     *job)
+{
+  if (job_is_parallel_safe (backend, job))
+    g_static_rw_lock_reader_lock (&backend->priv->job_lock);
+  else
+    g_static_rw_lock_writer_lock (&backend->priv->job_lock);
+}
+
+void
+g_vfs_backend_job_leave (GVfsBackend *backend,
+			 GVfsJob     *job)
+{
+  if (job_is_parallel_safe (backend, job))
+    g_static_rw_lock_reader_unlock (&backend->priv->job_lock);
+  else
+    g_static_rw_lock_writer_unlock (&backend->priv->job_lock);
+}
+
 
 void
 g_vfs_backend_set_display_name (GVfsBackend *backend,
@@ -452,6 +452,13 @@ char      **g_vfs_backend_get_x_content_types            (GVfsBackend        *ba
 GIcon      *g_vfs_backend_get_icon                       (GVfsBackend        *backend);
 GMountSpec *g_vfs_backend_get_mount_spec                 (GVfsBackend        *backend);
 GVfsDaemon *g_vfs_backend_get_daemon                     (GVfsBackend        *backend);
+void        g_vfs_backend_set_parallel_job_types         (GVfsBackend        *backend,
+							  GType               first_job_type,
+							  ...);
+void        g_vfs_backend_job_enter                      (GVfsBackend        *backend,
+							  GVfsJob            *job);
+void        g_vfs_backend_job_leave                      (GVfsBackend        *backend,
+							  GVfsJob            *job);
 
 void        g_vfs_backend_add_auto_info                  (GVfsBackend           *backend,
 							  GFileAttributeMatcher *matcher,
@@ -25,12 +25,18 @@
 
 #include <glib/gi18n.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
 #include <archive.h>
 #include <archive_entry.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include "gvfsbackendarchive.h"
 #include "gvfsjobopenforread.h"
 #include "gvfsjobread.h"
+#include "gvfsjobcloseread.h"
 #include "gvfsjobseekread.h"
 #include "gvfsjobopenforwrite.h"
 #include "gvfsjobwrite.h"
@@ -56,11 +62,22 @@
 
 /*** TYPE DEFINITIONS ***/
 
+/* Nodes are allocated this many at a time */
+#define ARCHIVE_FILE_CHUNK_SIZE 1024
+/* Directories with more children than this get a hash index */
+#define CHILDREN_INDEX_MIN 16
+
 typedef struct _ArchiveFile ArchiveFile;
 struct _ArchiveFile {
-  char *	name;			/* name of the file inside the archive */
+  const char *	name;			/* name of the file inside the archive, interned */
   GFileInfo *	info;			/* file info created from archive_entry */
-  GSList *	children;		/* (unordered) list of child files */
+  ArchiveFile *	children;		/* (unordered) list of child files */
+  ArchiveFile *	next;			/* next sibling */
+  GHashTable *	children_index;		/* name -> child, NULL for small directories */
+  guint		n_children;
+  gint64	header_offset;		/* offset of the header in the uncompressed archive, -1 if none */
+  gint64	compressed_offset;	/* offset of the header in the archive file, -1 if none */
+  gint64	data_offset;		/* offset of the data if stored as is, -1 otherwise */
 };
 
 struct _GVfsBackendArchive
@@ -69,21 +86,293 @@ struct _GVfsBackendArchive
 
   GFile *		file;
   ArchiveFile *		files;		/* the tree of files */
+  GStringChunk *	names;		/* interned names of the files */
+  GSList *		file_chunks;	/* arrays the files are allocated from */
+  guint			n_free_files;	/* unused files in the first chunk */
+  gboolean		seekable_entries; /* entries can be read by seeking to their header */
+#ifdef HAVE_ZLIB
+  GStaticMutex		checkpoints_lock;
+  GPtrArray *		checkpoints;	/* ArchiveCheckpoints, by offset */
+#endif
 };
 
 G_DEFINE_TYPE (GVfsBackendArchive, g_vfs_backend_archive, G_VFS_TYPE_BACKEND)
 
 /*** AN ARCHIVE WE CAN OPERATE ON ***/
 
+/* Amount of decompressed data kept around so short backward seeks
+ * don't need to decompress the entry again */
+#define HISTORY_SIZE (1024 * 1024)
+
+#ifdef HAVE_ZLIB
+/* Gzip compressed archives are decompressed here instead of by
+ * libarchive, so libarchive sees an uncompressed archive that can be
+ * read from any entry header. The state of the decompressor is saved
+ * every CHECKPOINT_SPACING bytes of compressed input, so getting to an
+ * offset only decompresses from the nearest checkpoint before it.
+ * Checkpoints are shared by all open files of the mount. */
+#define CHECKPOINT_SPACING (4 * 1024 * 1024)
+
+typedef struct {
+  z_stream	zstream;	/* copy of the decompressor state */
+  goffset	in_offset;	/* compressed data consumed */
+  goffset	out_offset;	/* uncompressed data produced */
+} ArchiveCheckpoint;
+#endif
+
 typedef struct {
   struct archive *  archive;
+  GVfsBackendArchive *backend;
   GFile *	    file;
   GFileInputStream *stream;
+  goffset	    start_offset; /* where libarchive should start reading */
   GVfsJob *	    job;
   GError *	    error;
   guchar	    data[4096];
+
+  /* Only used by open files */
+  char *	    pathname;	      /* entry name in the archive */
+  gint64	    header_offset;    /* where to restart reading, -1 for the start */
+  gint64	    data_offset;      /* read the data directly from stream, -1 if compressed */
+  goffset	    size;
+  goffset	    position;	      /* position of the file handle */
+  goffset	    stream_position;  /* how much of the entry libarchive decoded */
+  guchar *	    history;	      /* ring buffer of the last decoded data */
+  gsize		    history_start;
+  gsize		    history_len;
+
+#ifdef HAVE_ZLIB
+  gboolean	    gzip;	      /* we decompress, see CHECKPOINT_SPACING */
+  gboolean	    zstream_eof;
+  z_stream	    zstream;
+  guchar	    zdata[4096];
+  goffset	    in_offset;	      /* position in the archive file */
+  goffset	    out_offset;	      /* position in the uncompressed archive */
+#endif
 } GVfsArchive;
 
+#ifdef HAVE_ZLIB
+static void
+gvfs_archive_gzip_reset (GVfsArchive *d)
+{
+  inflateReset (&d->zstream);
+  d->zstream.next_in = d->zdata;
+  d->zstream.avail_in = 0;
+  d->zstream_eof = FALSE;
+  d->in_offset = 0;
+  d->out_offset = 0;
+}
+
+/* Called when all input was consumed, d->in_offset is where the
+ * next input comes from */
+static void
+gvfs_archive_gzip_checkpoint (GVfsArchive *d)
+{
+  GVfsBackendArchive *ba = d->backend;
+  ArchiveCheckpoint *cp;
+  goffset last_in_offset;
+
+  g_static_mutex_lock (&ba->checkpoints_lock);
+
+  last_in_offset = 0;
+  if (ba->checkpoints->len > 0)
+    {
+      cp = g_ptr_array_index (ba->checkpoints, ba->checkpoints->len - 1);
+      last_in_offset = cp->in_offset;
+    }
+
+  if (d->in_offset >= last_in_offset + CHECKPOINT_SPACING)
+    {
+      cp = g_new (ArchiveCheckpoint, 1);
+      if (inflateCopy (&cp->zstream, &d->zstream) == Z_OK)
+	{
+	  cp->in_offset = d->in_offset;
+	  cp->out_offset = d->out_offset;
+	  DEBUG ("checkpoint %d at %d\n", (int) cp->in_offset, (int) cp->out_offset);
+	  g_ptr_array_add (ba->checkpoints, cp);
+	}
+      else
+	g_free (cp);
+    }
+
+  g_static_mutex_unlock (&ba->checkpoints_lock);
+}
+
+static gssize
+gvfs_archive_gzip_read (GVfsArchive *d,
+			void        *buffer,
+			gsize        count)
+{
+  gssize read_bytes;
+  guint avail_out;
+  int res;
+
+  d->zstream.next_out = buffer;
+  d->zstream.avail_out = count;
+
+  while (d->zstream.avail_out == count && !d->zstream_eof)
+    {
+      if (d->zstream.avail_in == 0)
+	{
+	  gvfs_archive_gzip_checkpoint (d);
+	  read_bytes = g_input_stream_read (G_INPUT_STREAM (d->stream),
+					    d->zdata,
+					    sizeof (d->zdata),
+					    d->job->cancellable,
+					    &d->error);
+	  if (read_bytes < 0)
+	    return -1;
+	  if (read_bytes == 0)
+	    {
+	      d->zstream_eof = TRUE;
+	      break;
+	    }
+	  d->zstream.next_in = d->zdata;
+	  d->zstream.avail_in = read_bytes;
+	  d->in_offset += read_bytes;
+	}
+
+      avail_out = d->zstream.avail_out;
+      res = inflate (&d->zstream, Z_NO_FLUSH);
+      d->out_offset += avail_out - d->zstream.avail_out;
+
+      if (res == Z_STREAM_END)
+	{
+	  /* Concatenated gzip members continue the archive */
+	  inflateReset (&d->zstream);
+	}
+      else if (res != Z_OK && res != Z_BUF_ERROR)
+	{
+	  /* Garbage after the last member is ignored, like gzip does */
+	  if (d->zstream.total_out == 0 && d->out_offset > 0)
+	    {
+	      d->zstream_eof = TRUE;
+	      break;
+	    }
+	  g_set_error_literal (&d->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+			       _("Invalid compressed data"));
+	  return -1;
+	}
+    }
+
+  return count - d->zstream.avail_out;
+}
+
+/* Positions the decompressor at @offset of the uncompressed archive */
+static gboolean
+gvfs_archive_gzip_seek (GVfsArchive *d,
+			goffset      offset)
+{
+  GVfsBackendArchive *ba = d->backend;
+  ArchiveCheckpoint *cp, *best;
+  guchar buffer[4096];
+  gssize read_bytes;
+  guint i;
+
+  g_static_mutex_lock (&ba->checkpoints_lock);
+
+  best = NULL;
+  for (i = 0; i < ba->checkpoints->len; i++)
+    {
+      cp = g_ptr_array_index (ba->checkpoints, i);
+      if (cp->out_offset > offset)
+	break;
+      best = cp;
+    }
+
+  /* Going on from where we are is cheaper if no checkpoint is closer */
+  if (offset < d->out_offset ||
+      (best != NULL && best->out_offset > d->out_offset))
+    {
+      if (best != NULL)
+	{
+	  DEBUG ("resuming from checkpoint at %d\n", (int) best->out_offset);
+	  inflateEnd (&d->zstream);
+	  inflateCopy (&d->zstream, &best->zstream);
+	  d->zstream.next_in = d->zdata;
+	  d->zstream.avail_in = 0;
+	  d->zstream_eof = FALSE;
+	  d->in_offset = best->in_offset;
+	  d->out_offset = best->out_offset;
+	}
+      else
+	gvfs_archive_gzip_reset (d);
+
+      g_static_mutex_unlock (&ba->checkpoints_lock);
+
+      if (!g_seekable_seek (G_SEEKABLE (d->stream),
+			    d->in_offset,
+			    G_SEEK_SET,
+			    d->job->cancellable,
+			    &d->error))
+	return FALSE;
+    }
+  else
+    g_static_mutex_unlock (&ba->checkpoints_lock);
+
+  while (d->out_offset < offset)
+    {
+      read_bytes = gvfs_archive_gzip_read (d, buffer,
+					   MIN (sizeof (buffer), offset - d->out_offset));
+      if (read_bytes < 0)
+	return FALSE;
+      if (read_bytes == 0)
+	{
+	  g_set_error_literal (&d->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+			       _("Invalid compressed data"));
+	  return FALSE;
+	}
+    }
+
+  return TRUE;
+}
+#endif
+
+/* The archive as libarchive sees it, decompressed if we do that */
+static gboolean
+gvfs_archive_stream_seek (GVfsArchive *d,
+			  goffset      offset)
+{
+#ifdef HAVE_ZLIB
+  if (d->gzip)
+    return gvfs_archive_gzip_seek (d, offset);
+#endif
+
+  return g_seekable_seek (G_SEEKABLE (d->stream),
+			  offset,
+			  G_SEEK_SET,
+			  d->job->cancellable,
+			  &d->error);
+}
+
+static goffset
+gvfs_archive_stream_tell (GVfsArchive *d)
+{
+#ifdef HAVE_ZLIB
+  if (d->gzip)
+    return d->out_offset;
+#endif
+
+  return g_seekable_tell (G_SEEKABLE (d->stream));
+}
+
+static gssize
+gvfs_archive_stream_read (GVfsArchive *d,
+			  void        *buffer,
+			  gsize        count)
+{
+#ifdef HAVE_ZLIB
+  if (d->gzip)
+    return gvfs_archive_gzip_read (d, buffer, count);
+#endif
+
+  return g_input_stream_read (G_INPUT_STREAM (d->stream),
+			      buffer,
+			      count,
+			      d->job->cancellable,
+			      &d->error);
+}
+
 #define gvfs_archive_return(d) ((d)->error ? ARCHIVE_FATAL : ARCHIVE_OK)
 
 static int
@@ -97,6 +386,47 @@ gvfs_archive_open (struct archive *archive,
   d->stream = g_file_read (d->file,
 			   d->job->cancellable,
 			   &d->error);
+
+#ifdef HAVE_ZLIB
+  /* We can only go back to checkpoints in files we can seek in */
+  d->gzip = FALSE;
+  gvfs_archive_gzip_reset (d);
+  if (d->stream && g_seekable_can_seek (G_SEEKABLE (d->stream)))
+    {
+      guchar magic[2];
+      gsize bytes_read;
+
+      if (g_input_stream_read_all (G_INPUT_STREAM (d->stream),
+                                   magic, sizeof (magic), &bytes_read,
+                                   d->job->cancellable, &d->error) &&
+          bytes_read == sizeof (magic) &&
+          magic[0] == 0x1f && magic[1] == 0x8b)
+        d->gzip = TRUE;
+
+      if (!d->error)
+        g_seekable_seek (G_SEEKABLE (d->stream), 0, G_SEEK_SET,
+                         d->job->cancellable, &d->error);
+      if (d->error)
+        return gvfs_archive_return (d);
+    }
+#endif
+
+  if (d->stream && d->start_offset > 0)
+    {
+      /* Start reading at an entry, if that fails the caller notices
+       * the wrong header and reads from the start */
+      if (!g_seekable_can_seek (G_SEEKABLE (d->stream)) ||
+          !gvfs_archive_stream_seek (d, d->start_offset))
+        {
+          g_clear_error (&d->error);
+          d->start_offset = 0;
+#ifdef HAVE_ZLIB
+          if (d->gzip)
+            gvfs_archive_gzip_seek (d, 0);
+#endif
+        }
+    }
+
   return gvfs_archive_return (d);
 }
 
@@ -109,11 +439,7 @@ gvfs_archive_read (struct archive *archive,
   gssize read_bytes;
 
   *buffer = d->data;
-  read_bytes = g_input_stream_read (G_INPUT_STREAM (d->stream),
-				    d->data,
-				    sizeof (d->data),
-				    d->job->cancellable,
-				    &d->error);
+  read_bytes = gvfs_archive_stream_read (d, d->data, sizeof (d->data));
 
   DEBUG ("READ %d\n", (int) read_bytes);
   return read_bytes;
@@ -126,6 +452,12 @@ gvfs_archive_skip (struct archive *archive,
 {
   GVfsArchive *d = data;
 
+#ifdef HAVE_ZLIB
+  /* libarchive reads and drops the data itself */
+  if (d->gzip)
+    return 0;
+#endif
+
   if (g_seekable_can_seek (G_SEEKABLE (d->stream)))
     g_seekable_seek (G_SEEKABLE (d->stream),
 		     request,
@@ -153,7 +485,8 @@ gvfs_archive_close (struct archive *archive,
   GVfsArchive *d = data;
 
   DEBUG ("CLOSE\n");
-  g_object_unref (d->stream);
+  if (d->stream)
+    g_object_unref (d->stream);
   d->stream = NULL;
   return ARCHIVE_OK;
 }
@@ -198,20 +531,28 @@ gvfs_archive_finish (GVfsArchive *archive)
   gvfs_archive_pop_job (archive);
 
   archive_read_finish (archive->archive);
+#ifdef HAVE_ZLIB
+  inflateEnd (&archive->zstream);
+#endif
+  g_free (archive->pathname);
+  g_free (archive->history);
   g_slice_free (GVfsArchive, archive);
 }
 
-/* NB: assumes an GVfsArchive initialized with ARCHIVE_DATA_INIT */
-static GVfsArchive *
-gvfs_archive_new (GVfsBackendArchive *ba, GVfsJob *job)
+/* Frees the archive without reporting anything to the job */
+static void
+gvfs_archive_discard (GVfsArchive *archive)
 {
-  GVfsArchive *d;
-  
-  d = g_slice_new0 (GVfsArchive);
-
-  d->file = ba->file;
-  gvfs_archive_push_job (d, job);
+  archive->job = NULL;
+  g_clear_error (&archive->error);
+  gvfs_archive_finish (archive);
+}
 
+static void
+gvfs_archive_open_archive (GVfsArchive *d, goffset start_offset)
+{
+  d->start_offset = start_offset;
+  
   d->archive = archive_read_new ();
   archive_read_support_compression_all (d->archive);
   archive_read_support_format_all (d->archive);
@@ -221,12 +562,170 @@ gvfs_archive_new (GVfsBackendArchive *ba, GVfsJob *job)
 		      gvfs_archive_read,
 		      gvfs_archive_skip,
 		      gvfs_archive_close);
+}
+
+/* NB: assumes an GVfsArchive initialized with ARCHIVE_DATA_INIT */
+static GVfsArchive *
+gvfs_archive_new (GVfsBackendArchive *ba, GVfsJob *job, goffset start_offset)
+{
+  GVfsArchive *d;
+  
+  d = g_slice_new0 (GVfsArchive);
+
+  d->backend = ba;
+  d->file = ba->file;
+#ifdef HAVE_ZLIB
+  /* windowBits 15 + 32 detects the gzip header */
+  inflateInit2 (&d->zstream, 15 + 32);
+#endif
+  d->header_offset = -1;
+  d->data_offset = -1;
+  gvfs_archive_push_job (d, job);
+
+  gvfs_archive_open_archive (d, start_offset);
 
   return d;
 }
 
+/* Reads headers until the one for pathname. If only_first is set,
+ * only the next header is looked at. */
+static gboolean
+gvfs_archive_find_entry (GVfsArchive *archive,
+			 const char  *pathname,
+			 gboolean     only_first)
+{
+  struct archive_entry *entry;
+  int result;
+
+  do
+    {
+      result = archive_read_next_header (archive->archive, &entry);
+      if (result >= ARCHIVE_WARN && result <= ARCHIVE_OK)
+        {
+	  if (result < ARCHIVE_OK) {
+	    DEBUG ("gvfs_archive_find_entry: result = %d, error = '%s'\n", result, archive_error_string (archive->archive));
+	    archive_set_error (archive->archive, ARCHIVE_OK, "No error");
+	    archive_clear_error (archive->archive);
+	  }
+                              
+          if (g_str_equal (archive_entry_pathname (entry), pathname))
+            return TRUE;
+          else if (only_first)
+            return FALSE;
+          else
+            archive_read_data_skip (archive->archive);
+        }
+    }
+  while (result != ARCHIVE_FATAL && result != ARCHIVE_EOF);
+
+  return FALSE;
+}
+
+/* Starts decoding the open entry from the beginning again */
+static gboolean
+gvfs_archive_restart_entry (GVfsArchive *archive)
+{
+  DEBUG ("restarting %s\n", archive->pathname);
+  
+  archive->stream_position = 0;
+  archive->history_start = 0;
+  archive->history_len = 0;
+  
+  if (archive->header_offset > 0)
+    {
+      archive_read_finish (archive->archive);
+      gvfs_archive_open_archive (archive, archive->header_offset);
+      if (archive->start_offset == archive->header_offset &&
+          gvfs_archive_find_entry (archive, archive->pathname, TRUE))
+        return TRUE;
+      g_clear_error (&archive->error);
+    }
+
+  archive_read_finish (archive->archive);
+  gvfs_archive_open_archive (archive, 0);
+  if (gvfs_archive_find_entry (archive, archive->pathname, FALSE))
+    return TRUE;
+
+  if (!gvfs_archive_in_error (archive))
+    g_set_error_literal (&archive->error,
+                         G_IO_ERROR,
+                         G_IO_ERROR_NOT_FOUND,
+                         _("File doesn't exist"));
+  return FALSE;
+}
+
+static void
+gvfs_archive_history_append (GVfsArchive *archive,
+			     const char  *data,
+			     gsize        len)
+{
+  gsize end, first;
+
+  if (archive->history == NULL)
+    archive->history = g_malloc (HISTORY_SIZE);
+
+  if (len >= HISTORY_SIZE)
+    {
+      memcpy (archive->history, data + len - HISTORY_SIZE, HISTORY_SIZE);
+      archive->history_start = 0;
+      archive->history_len = HISTORY_SIZE;
+      return;
+    }
+
+  end = (archive->history_start + archive->history_len) % HISTORY_SIZE;
+  first = MIN (len, HISTORY_SIZE - end);
+  memcpy (archive->history + end, data, first);
+  memcpy (archive->history, data + first, len - first);
+
+  if (archive->history_len + len > HISTORY_SIZE)
+    {
+      archive->history_start = (archive->history_start + archive->history_len + len - HISTORY_SIZE) % HISTORY_SIZE;
+      archive->history_len = HISTORY_SIZE;
+    }
+  else
+    archive->history_len += len;
+}
+
+/* Copies data at archive->position out of the history */
+static gsize
+gvfs_archive_history_read (GVfsArchive *archive,
+			   char        *buffer,
+			   gsize        count)
+{
+  gsize pos, first;
+
+  g_assert (archive->position >= archive->stream_position - archive->history_len);
+  g_assert (archive->position < archive->stream_position);
+
+  count = MIN (count, archive->stream_position - archive->position);
+  pos = (archive->history_start + archive->history_len -
+         (archive->stream_position - archive->position)) % HISTORY_SIZE;
+  first = MIN (count, HISTORY_SIZE - pos);
+  memcpy (buffer, archive->history + pos, first);
+  memcpy (buffer + first, archive->history, count - first);
+
+  return count;
+}
+
 /*** BACKEND ***/
 
+#ifdef HAVE_ZLIB
+static void
+archive_checkpoints_free (GVfsBackendArchive *ba)
+{
+  ArchiveCheckpoint *cp;
+  guint i;
+
+  for (i = 0; i < ba->checkpoints->len; i++)
+    {
+      cp = g_ptr_array_index (ba->checkpoints, i);
+      inflateEnd (&cp->zstream);
+      g_free (cp);
+    }
+  g_ptr_array_set_size (ba->checkpoints, 0);
+}
+#endif
+
 static void
 g_vfs_backend_archive_finalize (GObject *object)
 {
@@ -234,6 +733,12 @@ g_vfs_backend_archive_finalize (GObject *object)
 
   g_assert (archive->file == NULL);
 
+#ifdef HAVE_ZLIB
+  archive_checkpoints_free (archive);
+  g_ptr_array_free (archive->checkpoints, TRUE);
+  g_static_mutex_free (&archive->checkpoints_lock);
+#endif
+
   if (G_OBJECT_CLASS (g_vfs_backend_archive_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_backend_archive_parent_class)->finalize) (object);
 }
@@ -241,69 +746,129 @@ g_vfs_backend_archive_finalize (GObject *object)
 static void
 g_vfs_backend_archive_init (GVfsBackendArchive *archive)
 {
+#ifdef HAVE_ZLIB
+  g_static_mutex_init (&archive->checkpoints_lock);
+  archive->checkpoints = g_ptr_array_new ();
+#endif
+
+  /* The file tree is only modified while mounting, and every
+   * open file has its own struct archive */
+  g_vfs_backend_set_parallel_job_types (G_VFS_BACKEND (archive),
+					G_VFS_TYPE_JOB_OPEN_FOR_READ,
+					G_VFS_TYPE_JOB_READ,
+					G_VFS_TYPE_JOB_SEEK_READ,
+					G_VFS_TYPE_JOB_CLOSE_READ,
+					G_VFS_TYPE_JOB_QUERY_INFO,
+					G_VFS_TYPE_JOB_ENUMERATE,
+					G_TYPE_INVALID);
 }
 
 /*** FILE TREE HANDLING ***/
 
+static ArchiveFile *
+archive_file_new (GVfsBackendArchive *ba, const char *name)
+{
+  ArchiveFile *file;
+
+  if (ba->n_free_files == 0)
+    {
+      ba->file_chunks = g_slist_prepend (ba->file_chunks,
+                                         g_new (ArchiveFile, ARCHIVE_FILE_CHUNK_SIZE));
+      ba->n_free_files = ARCHIVE_FILE_CHUNK_SIZE;
+    }
+
+  file = (ArchiveFile *) ba->file_chunks->data + ARCHIVE_FILE_CHUNK_SIZE - ba->n_free_files;
+  ba->n_free_files--;
+
+  memset (file, 0, sizeof (ArchiveFile));
+  file->name = g_string_chunk_insert_const (ba->names, name);
+  file->header_offset = -1;
+  file->compressed_offset = -1;
+  file->data_offset = -1;
+
+  return file;
+}
+
+static ArchiveFile *
+archive_file_find_child (ArchiveFile *file, const char *name)
+{
+  ArchiveFile *walk;
+
+  if (file->children_index)
+    return g_hash_table_lookup (file->children_index, name);
+
+  for (walk = file->children; walk; walk = walk->next)
+    {
+      if (g_str_equal (walk->name, name))
+        return walk;
+    }
+  return NULL;
+}
+
+static void
+archive_file_add_child (ArchiveFile *file, ArchiveFile *child)
+{
+  ArchiveFile *walk;
+
+  child->next = file->children;
+  file->children = child;
+  file->n_children++;
+
+  if (file->children_index)
+    g_hash_table_insert (file->children_index, (char *) child->name, child);
+  else if (file->n_children > CHILDREN_INDEX_MIN)
+    {
+      file->children_index = g_hash_table_new (g_str_hash, g_str_equal);
+      for (walk = file->children; walk; walk = walk->next)
+        g_hash_table_insert (file->children_index, (char *) walk->name, walk);
+    }
+}
+
 /* NB: filename must NOT start with a slash */
 static ArchiveFile *
-archive_file_get_from_path (ArchiveFile *file, const char *filename, gboolean add)
+archive_file_get_from_path (GVfsBackendArchive *ba, const char *filename, gboolean add)
 {
-  char **names = g_strsplit (filename, "/", -1);
-  ArchiveFile *cur;
-  GSList *walk;
-  guint i;
+  ArchiveFile *file, *cur;
+  char *path, *name, *end;
 
   DEBUG ("%s %s\n", add ? "add" : "find", filename);
-  for (i = 0; file && names[i] != NULL; i++)
+  path = g_strdup (filename);
+  file = ba->files;
+  for (name = path; file && name != NULL; name = end)
     {
-      cur = NULL;
-      for (walk = file->children; walk; walk = walk->next)
-	{
-	  cur = walk->data;
-	  if (g_str_equal (cur->name, names[i]))
-	    break;
-	  cur = NULL;
-	}
+      end = strchr (name, '/');
+      if (end)
+        *end++ = 0;
+
+      /* happens with directories, their path ends with a /
+       * Can also happen with "." in e.g. iso files */
+      if (name[0] == 0 || strcmp (name, ".") == 0)
+        continue;
+
+      cur = archive_file_find_child (file, name);
       if (cur == NULL && add != FALSE)
 	{
-	  DEBUG ("adding node %s to %s\n", names[i], file->name);
-	  /* (hopefully) clever trick to avoid string copy */
-	  if (names[i][0] != 0 &&
-              strcmp (names[i], ".") != 0)
-	    {
-	      cur = g_slice_new0 (ArchiveFile);
-	      cur->name = names[i];
-	      names[i] = NULL;
-	      file->children = g_slist_prepend (file->children, cur);
-	    }
-	  else
-	    {
-	      /* happens when adding directories, their path ends with a / */
-              /* Can also happen with "." in e.g. iso files */
-	      g_assert (names[i + 1] == NULL);
-	      g_free (names[i]);
-	      names[i] = NULL;
-	      cur = file;
-	    }
+	  DEBUG ("adding node %s to %s\n", name, file->name);
+	  cur = archive_file_new (ba, name);
+	  archive_file_add_child (file, cur);
 	}
       file = cur;
     }
-  g_strfreev (names);
+  g_free (path);
   return file;
 }
-#define archive_file_find(ba, filename) archive_file_get_from_path((ba)->files, (filename) + 1, FALSE)
+#define archive_file_find(ba, filename) archive_file_get_from_path((ba), (filename) + 1, FALSE)
 
 static void
 create_root_file (GVfsBackendArchive *ba)
 {
-  ArchiveFile *root = g_slice_new0 (ArchiveFile);
+  ArchiveFile *root;
   GFileInfo *info;
   char *s, *display_name;
   GIcon *icon;
 
-  root = g_slice_new0 (ArchiveFile);
-  root->name = g_strdup ("/");
+  ba->names = g_string_chunk_new (4096);
+  root = archive_file_new (ba, "/");
   ba->files = root;
 
   info = g_file_info_new ();
@@ -337,33 +902,67 @@ create_root_file (GVfsBackendArchive *ba)
 }
 
 static void
-archive_file_set_info_from_entry (ArchiveFile *	        file, 
-				  struct archive_entry *entry)
+archive_file_set_info (ArchiveFile *file,
+		       GFileType    type,
+		       goffset      size,
+		       const char  *symlink_target,
+		       guint64      atime,
+		       guint32      atime_usec,
+		       guint64      ctime,
+		       guint32      ctime_usec,
+		       guint64      mtime,
+		       guint32      mtime_usec)
 {
   GFileInfo *info = g_file_info_new ();
-  GFileType type;
-  file->info = info;
 
-  DEBUG ("setting up %s (%s)\n", archive_entry_pathname (entry), file->name);
+  if (file->info)
+    g_object_unref (file->info);
+  file->info = info;
 
   g_file_info_set_attribute_uint64 (info,
 				    G_FILE_ATTRIBUTE_TIME_ACCESS,
-				    archive_entry_atime (entry));
+				    atime);
   g_file_info_set_attribute_uint32 (info,
 				    G_FILE_ATTRIBUTE_TIME_ACCESS_USEC,
-				    archive_entry_atime_nsec (entry) / 1000);
+				    atime_usec);
   g_file_info_set_attribute_uint64 (info,
 				    G_FILE_ATTRIBUTE_TIME_CHANGED,
-				    archive_entry_ctime (entry));
+				    ctime);
   g_file_info_set_attribute_uint32 (info,
 				    G_FILE_ATTRIBUTE_TIME_CHANGED_USEC,
-				    archive_entry_ctime_nsec (entry) / 1000);
+				    ctime_usec);
   g_file_info_set_attribute_uint64 (info,
 				    G_FILE_ATTRIBUTE_TIME_MODIFIED,
-				    archive_entry_mtime (entry));
+				    mtime);
   g_file_info_set_attribute_uint32 (info,
 				    G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC,
-				    archive_entry_mtime_nsec (entry) / 1000);
+				    mtime_usec);
+
+  if (type == G_FILE_TYPE_SYMBOLIC_LINK)
+    g_file_info_set_symlink_target (info, symlink_target);
+
+  g_file_info_set_name (info, file->name);
+  gvfs_file_info_populate_default (info,
+				   file->name,
+				   type);
+
+  g_file_info_set_size (info, size);
+
+  g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ, TRUE);
+  g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE, FALSE);
+  g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_DELETE, FALSE);
+  g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE, type == G_FILE_TYPE_DIRECTORY);
+  g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_TRASH, FALSE);
+  g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_RENAME, FALSE);
+}
+
+static void
+archive_file_set_info_from_entry (ArchiveFile *	        file, 
+				  struct archive_entry *entry)
+{
+  GFileType type;
+
+  DEBUG ("setting up %s (%s)\n", archive_entry_pathname (entry), file->name);
 
   switch (archive_entry_filetype (entry))
     {
@@ -371,8 +970,6 @@ archive_file_set_info_from_entry (ArchiveFile *	        file,
 	type = G_FILE_TYPE_REGULAR;
 	break;
       case AE_IFLNK:
-	g_file_info_set_symlink_target (info,
-	                                archive_entry_symlink (entry));
 	type = G_FILE_TYPE_SYMBOLIC_LINK;
 	break;
       case AE_IFDIR:
@@ -388,20 +985,17 @@ archive_file_set_info_from_entry (ArchiveFile *	        file,
 	type = G_FILE_TYPE_SPECIAL;
 	break;
     }
-  g_file_info_set_name (info, file->name);
-  gvfs_file_info_populate_default (info,
-				   file->name,
-				   type);
 
-  g_file_info_set_size (info,
-			archive_entry_size (entry));
-
-  g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ, TRUE);
-  g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE, FALSE);
-  g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_DELETE, FALSE);
-  g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE, type == G_FILE_TYPE_DIRECTORY);
-  g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_TRASH, FALSE);
-  g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_RENAME, FALSE);
+  archive_file_set_info (file,
+			 type,
+			 archive_entry_size (entry),
+			 archive_entry_symlink (entry),
+			 archive_entry_atime (entry),
+			 archive_entry_atime_nsec (entry) / 1000,
+			 archive_entry_ctime (entry),
+			 archive_entry_ctime_nsec (entry) / 1000,
+			 archive_entry_mtime (entry),
+			 archive_entry_mtime_nsec (entry) / 1000);
 
   /* FIXME: add info for these
 dev_t			 archive_entry_dev(struct archive_entry *);
@@ -429,7 +1023,7 @@ const char		*archive_entry_uname(struct archive_entry *);
 static void
 fixup_dirs (ArchiveFile *file)
 {
-  GSList *l;
+  ArchiveFile *l;
 
   if (file->info == NULL)
     {
@@ -443,17 +1037,372 @@ fixup_dirs (ArchiveFile *file)
     }
   
   for (l = file->children; l != NULL; l = l->next)
-    fixup_dirs (l->data);
+    fixup_dirs (l);
+}
+
+static void archive_tree_free (GVfsBackendArchive *ba);
+
+/*** INDEX CACHE ***/
+
+/* The file tree is saved in the user's cache dir after the first
+ * mount, so mounting the same archive again doesn't need to
+ * decompress it all. The index is only used if the archive's size
+ * and mtime still match.
+ *
+ * Archives with few entries are cheap to scan and get no index. The
+ * indexes in the cache dir are kept below INDEX_CACHE_MAX_SIZE bytes
+ * by removing the least recently used ones, loading an index touches
+ * its mtime. The newest index is always kept, so archives whose index
+ * alone is bigger than that still get one.
+ */
+
+#define INDEX_MAGIC "GVfsArchiveIndex3"
+#define INDEX_MIN_ENTRIES 256
+#define INDEX_CACHE_MAX_SIZE (32*1024*1024)
+
+static char *
+index_get_filename (GVfsBackendArchive *ba)
+{
+  char *uri, *checksum, *filename;
+
+  uri = g_file_get_uri (ba->file);
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_MD5, uri, -1);
+  filename = g_build_filename (g_get_user_cache_dir (), "gvfs", "archive-index",
+			       checksum, NULL);
+  g_free (checksum);
+  g_free (uri);
+
+  return filename;
+}
+
+typedef struct {
+  char *filename;
+  goffset size;
+  time_t mtime;
+} IndexCacheEntry;
+
+static int
+index_cache_entry_compare (gconstpointer a, gconstpointer b)
+{
+  const IndexCacheEntry *ea = a, *eb = b;
+
+  /* Newest first */
+  if (ea->mtime != eb->mtime)
+    return ea->mtime < eb->mtime ? 1 : -1;
+  return 0;
+}
+
+/* Removes the least recently used indexes until the ones in @dirname
+ * fit in INDEX_CACHE_MAX_SIZE. @keep is the index that was just
+ * written, it is never removed, even if it alone is bigger. */
+static void
+index_cache_trim (const char *dirname, const char *keep, goffset keep_size)
+{
+  GDir *dir;
+  const char *name;
+  GList *entries, *l;
+  IndexCacheEntry *entry;
+  struct stat stat_buf;
+  goffset total;
+
+  dir = g_dir_open (dirname, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  entries = NULL;
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      entry = g_new (IndexCacheEntry, 1);
+      entry->filename = g_build_filename (dirname, name, NULL);
+      if (strcmp (entry->filename, keep) == 0 ||
+	  g_stat (entry->filename, &stat_buf) != 0 ||
+	  !S_ISREG (stat_buf.st_mode))
+	{
+	  g_free (entry->filename);
+	  g_free (entry);
+	  continue;
+	}
+      entry->size = stat_buf.st_size;
+      entry->mtime = stat_buf.st_mtime;
+      entries = g_list_prepend (entries, entry);
+    }
+  g_dir_close (dir);
+
+  entries = g_list_sort (entries, index_cache_entry_compare);
+
+  total = keep_size;
+  for (l = entries; l != NULL; l = l->next)
+    {
+      entry = l->data;
+      total += entry->size;
+      if (total > INDEX_CACHE_MAX_SIZE)
+	{
+	  DEBUG ("removing index %s\n", entry->filename);
+	  g_unlink (entry->filename);
+	}
+      g_free (entry->filename);
+      g_free (entry);
+    }
+  g_list_free (entries);
+}
+
+static void
+index_put_uint32 (GString *s, guint32 v)
+{
+  v = GUINT32_TO_BE (v);
+  g_string_append_len (s, (char *)&v, 4);
+}
+
+static void
+index_put_uint64 (GString *s, guint64 v)
+{
+  v = GUINT64_TO_BE (v);
+  g_string_append_len (s, (char *)&v, 8);
 }
 
 static void
-create_file_tree (GVfsBackendArchive *ba, GVfsJob *job)
+index_put_string (GString *s, const char *str)
+{
+  if (str == NULL)
+    str = "";
+  index_put_uint32 (s, strlen (str));
+  g_string_append (s, str);
+}
+
+typedef struct {
+  const char *data;
+  gsize len;
+  gboolean error;
+} IndexReader;
+
+static gboolean
+index_get_data (IndexReader *r, gpointer out, gsize len)
+{
+  if (r->error || r->len < len)
+    {
+      r->error = TRUE;
+      return FALSE;
+    }
+  memcpy (out, r->data, len);
+  r->data += len;
+  r->len -= len;
+  return TRUE;
+}
+
+static guint32
+index_get_uint32 (IndexReader *r)
+{
+  guint32 v = 0;
+  index_get_data (r, &v, 4);
+  return GUINT32_FROM_BE (v);
+}
+
+static guint64
+index_get_uint64 (IndexReader *r)
+{
+  guint64 v = 0;
+  index_get_data (r, &v, 8);
+  return GUINT64_FROM_BE (v);
+}
+
+/* Returns a newly allocated string */
+static char *
+index_get_string (IndexReader *r)
+{
+  guint32 len;
+  char *str;
+
+  len = index_get_uint32 (r);
+  if (r->error || r->len < len)
+    {
+      r->error = TRUE;
+      return NULL;
+    }
+  str = g_strndup (r->data, len);
+  r->data += len;
+  r->len -= len;
+  return str;
+}
+
+static void
+index_put_file (GString *s, ArchiveFile *file, const char *path, guint32 *n_entries)
+{
+  GFileInfo *info = file->info;
+  ArchiveFile *child;
+  char *child_path;
+
+  /* Implicit directories get recreated by fixup_dirs() */
+  if (file->header_offset >= 0)
+    {
+      index_put_string (s, path);
+      index_put_uint32 (s, g_file_info_get_file_type (info));
+      index_put_uint64 (s, g_file_info_get_size (info));
+      index_put_string (s, g_file_info_get_symlink_target (info));
+      index_put_uint64 (s, g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_ACCESS));
+      index_put_uint32 (s, g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_ACCESS_USEC));
+      index_put_uint64 (s, g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_CHANGED));
+      index_put_uint32 (s, g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_CHANGED_USEC));
+      index_put_uint64 (s, g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED));
+      index_put_uint32 (s, g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC));
+      index_put_uint64 (s, file->header_offset);
+      index_put_uint64 (s, file->compressed_offset);
+      index_put_uint64 (s, file->data_offset);
+      (*n_entries)++;
+    }
+
+  for (child = file->children; child != NULL; child = child->next)
+    {
+      if (*path)
+	child_path = g_strconcat (path, "/", child->name, NULL);
+      else
+	child_path = g_strdup (child->name);
+      index_put_file (s, child, child_path, n_entries);
+      g_free (child_path);
+    }
+}
+
+static void
+index_save (GVfsBackendArchive *ba, guint64 size, guint64 mtime)
+{
+  GString *s;
+  char *filename, *dirname;
+  guint32 n_entries, n_entries_be;
+
+  s = g_string_new (INDEX_MAGIC);
+  g_string_append_c (s, 0);
+  index_put_uint64 (s, size);
+  index_put_uint64 (s, mtime);
+  index_put_uint32 (s, ba->seekable_entries);
+  index_put_uint32 (s, 0); /* Number of entries, filled in below */
+
+  n_entries = 0;
+  index_put_file (s, ba->files, "", &n_entries);
+  if (n_entries < INDEX_MIN_ENTRIES)
+    {
+      g_string_free (s, TRUE);
+      return;
+    }
+  n_entries_be = GUINT32_TO_BE (n_entries);
+  memcpy (s->str + sizeof (INDEX_MAGIC) + 8 + 8 + 4, &n_entries_be, 4);
+
+  filename = index_get_filename (ba);
+  dirname = g_path_get_dirname (filename);
+  if (g_mkdir_with_parents (dirname, 0700) == 0 &&
+      g_file_set_contents (filename, s->str, s->len, NULL))
+    index_cache_trim (dirname, filename, s->len);
+  
+  g_free (dirname);
+  g_free (filename);
+  g_string_free (s, TRUE);
+}
+
+/* Returns TRUE and builds the file tree if a valid index was found */
+static gboolean
+index_load (GVfsBackendArchive *ba, guint64 size, guint64 mtime)
+{
+  IndexReader r;
+  char *filename, *contents, *path, *symlink;
+  gsize len;
+  guint32 n_entries, i, type;
+  guint64 entry_size, times[3];
+  guint32 usecs[3];
+  ArchiveFile *file;
+
+  filename = index_get_filename (ba);
+  if (!g_file_get_contents (filename, &contents, &len, NULL))
+    {
+      g_free (filename);
+      return FALSE;
+    }
+  /* Mark it as recently used */
+  g_utime (filename, NULL);
+  g_free (filename);
+
+  r.data = contents;
+  r.len = len;
+  r.error = FALSE;
+
+  if (len < sizeof (INDEX_MAGIC) ||
+      memcmp (contents, INDEX_MAGIC, sizeof (INDEX_MAGIC)) != 0)
+    {
+      g_free (contents);
+      return FALSE;
+    }
+  r.data += sizeof (INDEX_MAGIC);
+  r.len -= sizeof (INDEX_MAGIC);
+
+  if (index_get_uint64 (&r) != size ||
+      index_get_uint64 (&r) != mtime)
+    {
+      g_free (contents);
+      return FALSE;
+    }
+
+  ba->seekable_entries = index_get_uint32 (&r);
+  n_entries = index_get_uint32 (&r);
+
+  for (i = 0; i < n_entries && !r.error; i++)
+    {
+      path = index_get_string (&r);
+      type = index_get_uint32 (&r);
+      entry_size = index_get_uint64 (&r);
+      symlink = index_get_string (&r);
+      times[0] = index_get_uint64 (&r);
+      usecs[0] = index_get_uint32 (&r);
+      times[1] = index_get_uint64 (&r);
+      usecs[1] = index_get_uint32 (&r);
+      times[2] = index_get_uint64 (&r);
+      usecs[2] = index_get_uint32 (&r);
+
+      if (!r.error)
+	{
+	  file = archive_file_get_from_path (ba, path, TRUE);
+	  if (file != ba->files)
+	    archive_file_set_info (file, type, entry_size, symlink,
+				   times[0], usecs[0],
+				   times[1], usecs[1],
+				   times[2], usecs[2]);
+	  file->header_offset = index_get_uint64 (&r);
+	  file->compressed_offset = index_get_uint64 (&r);
+	  file->data_offset = index_get_uint64 (&r);
+	}
+      
+      g_free (path);
+      g_free (symlink);
+    }
+
+  g_free (contents);
+
+  if (r.error)
+    {
+      /* Start over with a clean tree */
+      archive_tree_free (ba);
+      create_root_file (ba);
+      ba->seekable_entries = FALSE;
+      return FALSE;
+    }
+  
+  fixup_dirs (ba->files);
+  return TRUE;
+}
+
+static void
+create_file_tree (GVfsBackendArchive *ba, GVfsJob *job, guint64 size, guint64 mtime)
 {
   GVfsArchive *archive;
   struct archive_entry *entry;
   int result;
+  int format;
+  gint64 data_start, data_end, entry_size;
+
+  if (index_load (ba, size, mtime))
+    {
+      DEBUG ("using index\n");
+      g_vfs_job_succeeded (job);
+      return;
+    }
 
-  archive = gvfs_archive_new (ba, job);
+  archive = gvfs_archive_new (ba, job, 0);
 
   g_assert (ba->files != NULL);
 
@@ -468,18 +1417,49 @@ create_file_tree (GVfsBackendArchive *ba, GVfsJob *job)
   	    archive_clear_error (archive->archive);
 	  }
   
-	  ArchiveFile *file = archive_file_get_from_path (ba->files, 
+	  ArchiveFile *file = archive_file_get_from_path (ba, 
 	                                                  archive_entry_pathname (entry), 
 							  TRUE);
+          data_start = archive_position_uncompressed (archive->archive);
+          entry_size = archive_entry_size (entry);
           /* Don't set info for root */
           if (file != ba->files)
-            archive_file_set_info_from_entry (file, entry);
+            {
+              archive_file_set_info_from_entry (file, entry);
+              file->header_offset = archive_read_header_position (archive->archive);
+              file->compressed_offset = archive_position_compressed (archive->archive);
+              file->data_offset = -1;
+            }
 	  archive_read_data_skip (archive->archive);
+          data_end = archive_position_uncompressed (archive->archive);
+
+          /* If the entry took exactly as much space as its data (plus
+           * tar padding or a zip data descriptor) it is stored as is and
+           * can be read without libarchive. For zip this is checked
+           * again against the local header when opening. */
+          if (file != ba->files &&
+              archive_entry_filetype (entry) == AE_IFREG &&
+              (data_end - data_start == ((entry_size + 511) & ~(gint64)511) ||
+               data_end - data_start == entry_size ||
+               data_end - data_start == entry_size + 12 ||
+               data_end - data_start == entry_size + 16))
+            file->data_offset = data_start;
 	}
     }
   while (result != ARCHIVE_FATAL && result != ARCHIVE_EOF);
 
   fixup_dirs (ba->files);
+
+  /* Formats that store entries one after another can be read by
+   * starting at the header, as long as libarchive doesn't have to
+   * decompress (gzip is decompressed by us, see CHECKPOINT_SPACING) */
+  format = archive_format (archive->archive) & ARCHIVE_FORMAT_BASE_MASK;
+  ba->seekable_entries =
+    archive_compression (archive->archive) == ARCHIVE_COMPRESSION_NONE &&
+    (format == ARCHIVE_FORMAT_TAR || format == ARCHIVE_FORMAT_ZIP);
+
+  if (result == ARCHIVE_EOF && !gvfs_archive_in_error (archive))
+    index_save (ba, size, mtime);
   
   gvfs_archive_finish (archive);
 }
@@ -487,11 +1467,29 @@ create_file_tree (GVfsBackendArchive *ba, GVfsJob *job)
 static void
 archive_file_free (ArchiveFile *file)
 {
-  g_slist_foreach (file->children, (GFunc) archive_file_free, NULL);
-  g_slist_free (file->children);
+  ArchiveFile *child;
+
+  for (child = file->children; child != NULL; child = child->next)
+    archive_file_free (child);
+  if (file->children_index)
+    g_hash_table_destroy (file->children_index);
   if (file->info)
     g_object_unref (file->info);
-  g_free (file->name);
+}
+
+static void
+archive_tree_free (GVfsBackendArchive *ba)
+{
+  archive_file_free (ba->files);
+  ba->files = NULL;
+
+  g_slist_foreach (ba->file_chunks, (GFunc) g_free, NULL);
+  g_slist_free (ba->file_chunks);
+  ba->file_chunks = NULL;
+  ba->n_free_files = 0;
+
+  g_string_chunk_free (ba->names);
+  ba->names = NULL;
 }
 
 static void
@@ -577,7 +1575,9 @@ do_mount (GVfsBackend *backend,
   g_vfs_backend_set_icon_name (backend, MOUNT_ICON_NAME);
 
   create_root_file (archive);
-  create_file_tree (archive, G_VFS_JOB (job));
+  create_file_tree (archive, G_VFS_JOB (job),
+                    g_file_info_get_size (info),
+                    g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED));
   g_object_unref (info);
 }
 
@@ -588,12 +1588,67 @@ do_unmount (GVfsBackend *backend,
   GVfsBackendArchive *ba = G_VFS_BACKEND_ARCHIVE (backend);
 
   g_object_unref (ba->file);
-  archive_file_free (ba->files);
-  ba->files = NULL;
+  archive_tree_free (ba);
+#ifdef HAVE_ZLIB
+  archive_checkpoints_free (ba);
+#endif
 
   g_vfs_job_succeeded (G_VFS_JOB (job));
 }
 
+/* Tar entries are always stored as is, zip entries only when the local
+ * header says so and their data follows it directly.
+ * Leaves the stream where libarchive expects it. */
+static gboolean
+gvfs_archive_entry_is_stored (GVfsArchive *archive,
+			      ArchiveFile *file)
+{
+  guchar header[30];
+  gsize bytes_read;
+  gssize res;
+  goffset old_offset;
+  gboolean stored;
+
+  old_offset = gvfs_archive_stream_tell (archive);
+  if (!gvfs_archive_stream_seek (archive, file->header_offset))
+    {
+      g_clear_error (&archive->error);
+      return FALSE;
+    }
+
+  for (bytes_read = 0; bytes_read < sizeof (header); bytes_read += res)
+    {
+      res = gvfs_archive_stream_read (archive, header + bytes_read,
+                                      sizeof (header) - bytes_read);
+      if (res <= 0)
+        break;
+    }
+
+  if (res < 0)
+    {
+      g_clear_error (&archive->error);
+      stored = FALSE;
+    }
+  else if (bytes_read < 4 || memcmp (header, "PK\003\004", 4) != 0)
+    stored = TRUE;
+  else if (bytes_read < sizeof (header))
+    stored = FALSE;
+  /* Not encrypted, method "stored" */
+  else if ((header[6] & 1) != 0 ||
+           (header[8] | (header[9] << 8)) != 0)
+    stored = FALSE;
+  else
+    stored = file->header_offset + sizeof (header) +
+             (header[26] | (header[27] << 8)) +
+             (header[28] | (header[29] << 8)) == file->data_offset;
+
+  if (!stored &&
+      !gvfs_archive_stream_seek (archive, old_offset))
+    return FALSE;
+
+  return stored;
+}
+
 static void
 do_open_for_read (GVfsBackend *       backend,
 		  GVfsJobOpenForRead *job,
@@ -601,8 +1656,6 @@ do_open_for_read (GVfsBackend *       backend,
 {
   GVfsBackendArchive *ba = G_VFS_BACKEND_ARCHIVE (backend);
   GVfsArchive *archive;
-  struct archive_entry *entry;
-  int result;
   ArchiveFile *file;
 
   file = archive_file_find (ba, filename);
@@ -623,41 +1676,57 @@ do_open_for_read (GVfsBackend *       backend,
       return;
     }
   
-  archive = gvfs_archive_new (ba, G_VFS_JOB (job));
+  /* Try going straight to the entry */
+  if (ba->seekable_entries && file->header_offset > 0)
+    {
+      archive = gvfs_archive_new (ba, G_VFS_JOB (job), file->header_offset);
+      if (archive->start_offset != file->header_offset ||
+          !gvfs_archive_find_entry (archive, filename + 1, TRUE))
+        {
+          DEBUG ("seeking to %s failed, reading from the start\n", filename);
+          gvfs_archive_discard (archive);
+          archive = NULL;
+        }
+    }
+  else
+    archive = NULL;
 
-  do
+  if (archive == NULL)
     {
-      result = archive_read_next_header (archive->archive, &entry);
-      if (result >= ARCHIVE_WARN && result <= ARCHIVE_OK)
+      archive = gvfs_archive_new (ba, G_VFS_JOB (job), 0);
+      if (!gvfs_archive_find_entry (archive, filename + 1, FALSE))
         {
-	  if (result < ARCHIVE_OK) {
-	    DEBUG ("do_open_for_read: result = %d, error = '%s'\n", result, archive_error_string (archive->archive));
-	    archive_set_error (archive->archive, ARCHIVE_OK, "No error");
-	    archive_clear_error (archive->archive);
-	  }
-                              
-          if (g_str_equal (archive_entry_pathname (entry), filename + 1))
+          if (!gvfs_archive_in_error (archive))
             {
-              /* SUCCESS */
-              g_vfs_job_open_for_read_set_handle (job, archive);
-              g_vfs_job_open_for_read_set_can_seek (job, FALSE);
-              gvfs_archive_pop_job (archive);
-              return;
+              g_set_error_literal (&archive->error,
+                                   G_IO_ERROR,
+                                   G_IO_ERROR_NOT_FOUND,
+                                   _("File doesn't exist"));
             }
-          else
-            archive_read_data_skip (archive->archive);
+          gvfs_archive_finish (archive);
+          return;
         }
     }
-  while (result != ARCHIVE_FATAL && result != ARCHIVE_EOF);
 
-  if (!gvfs_archive_in_error (archive))
+  /* SUCCESS */
+  archive->pathname = g_strdup (filename + 1);
+  archive->size = g_file_info_get_size (file->info);
+  if (ba->seekable_entries)
     {
-      g_set_error_literal (&archive->error,
-			   G_IO_ERROR,
-			   G_IO_ERROR_NOT_FOUND,
-			   _("File doesn't exist"));
+      archive->header_offset = file->header_offset;
+      if (file->data_offset >= 0 &&
+          gvfs_archive_entry_is_stored (archive, file))
+        archive->data_offset = file->data_offset;
+      if (gvfs_archive_in_error (archive))
+        {
+          gvfs_archive_finish (archive);
+          return;
+        }
     }
-  gvfs_archive_finish (archive);
+  
+  g_vfs_job_open_for_read_set_handle (job, archive);
+  g_vfs_job_open_for_read_set_can_seek (job, TRUE);
+  gvfs_archive_pop_job (archive);
 }
 
 static void
@@ -682,12 +1751,106 @@ do_read (GVfsBackend *backend,
   gssize bytes_read;
 
   gvfs_archive_push_job (archive, G_VFS_JOB (job));
-  bytes_read = archive_read_data (archive->archive, buffer, bytes_requested);
+
+  if (archive->data_offset >= 0)
+    {
+      /* Stored data, read it straight from the archive file */
+      bytes_read = 0;
+      if (archive->position < archive->size &&
+          gvfs_archive_stream_seek (archive, archive->data_offset + archive->position))
+        bytes_read = gvfs_archive_stream_read (archive,
+                                               buffer,
+                                               MIN (bytes_requested, archive->size - archive->position));
+      if (bytes_read >= 0)
+        {
+          archive->position += bytes_read;
+          g_vfs_job_read_set_size (job, bytes_read);
+        }
+      gvfs_archive_pop_job (archive);
+      return;
+    }
+
+  /* Seeked back further than we remember, decode the entry again */
+  if (archive->position < archive->stream_position - (goffset) archive->history_len &&
+      !gvfs_archive_restart_entry (archive))
+    {
+      gvfs_archive_pop_job (archive);
+      return;
+    }
+
+  /* Seeked forward, decode up to the new position */
+  while (archive->position > archive->stream_position)
+    {
+      bytes_read = archive_read_data (archive->archive, buffer,
+                                      MIN (bytes_requested, archive->position - archive->stream_position));
+      if (bytes_read <= 0)
+        break;
+      gvfs_archive_history_append (archive, buffer, bytes_read);
+      archive->stream_position += bytes_read;
+    }
+  
+  if (archive->position < archive->stream_position)
+    bytes_read = gvfs_archive_history_read (archive, buffer, bytes_requested);
+  else if (archive->position == archive->stream_position)
+    {
+      bytes_read = archive_read_data (archive->archive, buffer, bytes_requested);
+      if (bytes_read > 0)
+        {
+          gvfs_archive_history_append (archive, buffer, bytes_read);
+          archive->stream_position += bytes_read;
+        }
+    }
+  else
+    bytes_read = 0; /* Past the end */
+  
   if (bytes_read >= 0)
-    g_vfs_job_read_set_size (job, bytes_read);
+    {
+      archive->position += bytes_read;
+      g_vfs_job_read_set_size (job, bytes_read);
+    }
   gvfs_archive_pop_job (archive);
 }
 
+static void
+do_seek_on_read (GVfsBackend *backend,
+		 GVfsJobSeekRead *job,
+		 GVfsBackendHandle handle,
+		 goffset    offset,
+		 GSeekType  type)
+{
+  GVfsArchive *archive = handle;
+
+  switch (type)
+    {
+    case G_SEEK_SET:
+      break;
+    case G_SEEK_CUR:
+      offset += archive->position;
+      break;
+    case G_SEEK_END:
+      offset += archive->size;
+      break;
+    default:
+      g_vfs_job_failed (G_VFS_JOB (job),
+			G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+			_("Unsupported seek type"));
+      return;
+    }
+
+  if (offset < 0)
+    {
+      g_vfs_job_failed (G_VFS_JOB (job),
+			G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+			_("Invalid argument"));
+      return;
+    }
+
+  /* The data is only decoded when reading */
+  archive->position = offset;
+  g_vfs_job_seek_read_set_offset (job, offset);
+  g_vfs_job_succeeded (G_VFS_JOB (job));
+}
+
 static void
 do_query_info (GVfsBackend *backend,
 	       GVfsJobQueryInfo *job,
@@ -726,7 +1889,7 @@ do_enumerate (GVfsBackend *backend,
 {
   GVfsBackendArchive *ba = G_VFS_BACKEND_ARCHIVE (backend);
   ArchiveFile *file;
-  GSList *walk;
+  ArchiveFile *walk;
 
   file = archive_file_find (ba, filename);
   if (file == NULL)
@@ -752,7 +1915,7 @@ do_enumerate (GVfsBackend *backend,
 
   for (walk = file->children; walk; walk = walk->next)
     {
-      GFileInfo *info = g_file_info_dup (((ArchiveFile *) walk->data)->info);
+      GFileInfo *info = g_file_info_dup (walk->info);
       g_vfs_job_enumerate_add_info (job, info);
       g_object_unref (info);
     }
@@ -787,6 +1950,7 @@ g_vfs_backend_archive_class_init (GVfsBackendArchiveClass *klass)
   backend_class->open_for_read = do_open_for_read;
   backend_class->close_read = do_close_read;
   backend_class->read = do_read;
+  backend_class->seek_on_read = do_seek_on_read;
   backend_class->enumerate = do_enumerate;
   backend_class->query_info = do_query_info;
   backend_class->try_query_fs_info = try_query_fs_info;
@@ -38,6 +38,7 @@
 /* LibXML2 includes */
 #include <libxml/parser.h>
 #include <libxml/tree.h>
+#include <libxml/SAX2.h>
 #include <libxml/xpath.h>
 #include <libxml/xpathInternals.h>
 
@@ -50,8 +51,11 @@
 #include "gvfsjobseekread.h"
 #include "gvfsjobopenforwrite.h"
 #include "gvfsjobwrite.h"
+#include "gvfsjobclosewrite.h"
 #include "gvfsjobseekwrite.h"
 #include "gvfsjobsetdisplayname.h"
+#include "gvfsjobcopy.h"
+#include "gvfsjobmove.h"
 #include "gvfsjobqueryinfo.h"
 #include "gvfsjobqueryfsinfo.h"
 #include "gvfsjobqueryattributes.h"
@@ -66,6 +70,13 @@
 #include "gvfsdnssdresolver.h"
 #endif
 
+/* default time in seconds for which file infos from PROPFIND replies
+ * are used without asking the server, can be changed with the
+ * GVFS_DAV_INFO_CACHE_TTL environment variable, 0 disables the cache */
+#define INFO_CACHE_TTL 10
+/* maximum number of cached file infos */
+#define INFO_CACHE_MAX_ENTRIES 10000
+
 typedef struct _MountAuthData MountAuthData;
 
 static void mount_auth_info_free (MountAuthData *info);
@@ -102,6 +113,11 @@ struct _GVfsBackendDav
 
   MountAuthData auth_info;
 
+  /* file infos from recent PROPFIND replies */
+  GStaticMutex  info_cache_lock;
+  GHashTable   *info_cache;      /* path => InfoCacheEntry */
+  guint         info_cache_ttl;
+
 #ifdef HAVE_AVAHI
   /* only set if we're handling a [dav|davs]+sd:// mounts */
   GVfsDnsSdResolver *resolver;
@@ -126,15 +142,33 @@ g_vfs_backend_dav_finalize (GObject *object)
 #endif
 
   mount_auth_info_free (&(dav_backend->auth_info));
+
+  g_hash_table_destroy (dav_backend->info_cache);
+  g_static_mutex_free (&dav_backend->info_cache_lock);
   
   if (G_OBJECT_CLASS (g_vfs_backend_dav_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_backend_dav_parent_class)->finalize) (object);
 }
 
+static void info_cache_entry_free (gpointer data);
+
 static void
 g_vfs_backend_dav_init (GVfsBackendDav *backend)
 {
+  const char *ttl;
+
   g_vfs_backend_set_user_visible (G_VFS_BACKEND (backend), TRUE);
+
+  g_static_mutex_init (&backend->info_cache_lock);
+  backend->info_cache = g_hash_table_new_full (g_str_hash,
+                                               g_str_equal,
+                                               g_free,
+                                               info_cache_entry_free);
+  backend->info_cache_ttl = INFO_CACHE_TTL;
+
+  ttl = g_getenv ("GVFS_DAV_INFO_CACHE_TTL");
+  if (ttl != NULL)
+    backend->info_cache_ttl = strtoul (ttl, NULL, 10);
 }
 
 /* ************************************************************************* */
@@ -1013,6 +1047,173 @@ ms_response_to_file_type (MsResponse *response)
   return file_type;
 }
 
+/* ************************************************************************* */
+/* Streaming multistatus parsing */
+
+/* A multistatus response can be big, so instead of parsing it as a whole
+ * the body is fed to a push parser as it arrives. Every <response> is
+ * handed to a callback as soon as its end tag was read, and is then
+ * removed from the document. */
+
+typedef struct _MsParser MsParser;
+
+typedef void (*MsParserResponseFunc) (MsParser *parser, MsResponse *response);
+
+struct _MsParser {
+
+  Multistatus           multistatus;
+  SoupMessage          *msg;
+  xmlParserCtxtPtr      ctxt;
+
+  MsParserResponseFunc  func;
+  gpointer              user_data;
+  guint                 n_responses;
+
+};
+
+static void
+ms_parser_end_element (void          *ctx,
+                       const xmlChar *localname,
+                       const xmlChar *prefix,
+                       const xmlChar *URI)
+{
+  xmlParserCtxtPtr ctxt;
+  MsParser        *parser;
+  xmlNodePtr       node;
+  xmlNodeIter      iter;
+  MsResponse       response;
+
+  ctxt = ctx;
+  parser = ctxt->_private;
+  node = ctxt->node;
+
+  xmlSAX2EndElementNs (ctx, localname, prefix, URI);
+
+  if (node == NULL || node->parent == NULL ||
+      node->parent->parent != (xmlNodePtr) ctxt->myDoc ||
+      ! node_has_name_ns (node->parent, "multistatus", "DAV:") ||
+      ! node_has_name_ns (node, "response", "DAV:"))
+    return;
+
+  iter.cur_node = node;
+  iter.next_node = node->next;
+  iter.name = "response";
+  iter.ns_href = "DAV:";
+  iter.user_data = &parser->multistatus;
+
+  if (multistatus_get_response (&iter, &response))
+    {
+      parser->n_responses++;
+      parser->func (parser, &response);
+    }
+
+  xmlUnlinkNode (node);
+  xmlFreeNode (node);
+}
+
+static void
+ms_parser_got_chunk (SoupMessage *msg, SoupBuffer *chunk, gpointer user_data)
+{
+  MsParser    *parser = user_data;
+  xmlSAXHandler sax;
+
+  /* Ignore the bodies of auth challenges, redirects and errors */
+  if (msg->status_code != SOUP_STATUS_MULTI_STATUS)
+    return;
+
+  if (parser->ctxt == NULL)
+    {
+      memset (&sax, 0, sizeof (sax));
+      xmlSAXVersion (&sax, 2);
+      sax.endElementNs = ms_parser_end_element;
+
+      parser->ctxt = xmlCreatePushParserCtxt (&sax, NULL, NULL, 0,
+                                              "response.xml");
+      xmlCtxtUseOptions (parser->ctxt,
+                         XML_PARSE_NONET |
+                         XML_PARSE_NOWARNING |
+                         XML_PARSE_NOBLANKS |
+                         XML_PARSE_NSCLEAN |
+                         XML_PARSE_NOCDATA |
+                         XML_PARSE_COMPACT);
+      parser->ctxt->_private = parser;
+
+      /* the uri changes on redirects, so look at it only now */
+      parser->multistatus.target = soup_message_get_uri (msg);
+    }
+
+  xmlParseChunk (parser->ctxt, chunk->data, chunk->length, 0);
+}
+
+static void
+ms_parser_init (MsParser             *parser,
+                SoupMessage          *msg,
+                MsParserResponseFunc  func,
+                gpointer              user_data)
+{
+  memset (parser, 0, sizeof (MsParser));
+  parser->msg = msg;
+  parser->func = func;
+  parser->user_data = user_data;
+
+  /* The body is consumed by the parser, don't keep it around */
+  soup_message_body_set_accumulate (msg->response_body, FALSE);
+  g_signal_connect (msg, "got_chunk",
+                    G_CALLBACK (ms_parser_got_chunk), parser);
+}
+
+static gboolean
+ms_parser_finish (MsParser *parser, GError **error)
+{
+  SoupMessage *msg;
+  xmlNodePtr   root;
+
+  msg = parser->msg;
+  g_signal_handlers_disconnect_by_func (msg, G_CALLBACK (ms_parser_got_chunk), parser);
+
+  if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
+    {
+      g_set_error (error, G_IO_ERROR, http_to_gio_error (msg->status_code),
+                   _("HTTP Error: %s"), msg->reason_phrase);
+      return FALSE;
+    }
+
+  if (parser->ctxt)
+    xmlParseChunk (parser->ctxt, NULL, 0, 1);
+
+  if (parser->ctxt == NULL ||
+      parser->ctxt->myDoc == NULL ||
+      ! parser->ctxt->wellFormed)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+	                   _("Could not parse response"));
+      return FALSE;
+    }
+
+  root = xmlDocGetRootElement (parser->ctxt->myDoc);
+
+  if (root == NULL || parser->n_responses == 0)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+	                   _("Empty response"));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+ms_parser_free (MsParser *parser)
+{
+  if (parser->ctxt == NULL)
+    return;
+
+  if (parser->ctxt->myDoc)
+    xmlFreeDoc (parser->ctxt->myDoc);
+  xmlFreeParserCtxt (parser->ctxt);
+  parser->ctxt = NULL;
+}
+
 #define PROPSTAT_XML_BEGIN                        \
   "<?xml version=\"1.0\" encoding=\"utf-8\" ?>\n" \
   " <D:propfind xmlns:D=\"DAV:\">\n"
@@ -1741,7 +1942,8 @@ do_mount (GVfsBackend  *backend,
                     G_CALLBACK (soup_authenticate_from_data),
                     data);
 
-  /* also auth the workaround async session we need for SoupInputStream */
+  /* also auth the async session we need for SoupInputStream and
+   * SoupOutputStream */
   g_signal_connect (G_VFS_BACKEND_HTTP (backend)->session_async, "authenticate",
                     G_CALLBACK (soup_authenticate_from_data),
                     data);
@@ -1750,6 +1952,221 @@ do_mount (GVfsBackend  *backend,
   g_debug ("- mount\n");
 }
 
+/* ************************************************************************* */
+/* file info cache */
+
+/* Listings are usually followed by a query_info for every entry, so the
+ * infos from PROPFIND replies are kept for a short time. Entries that
+ * expired are revalidated with a conditional HEAD if they have an ETag.
+ */
+
+typedef struct _InfoCacheEntry {
+
+  GFileInfo          *info;
+  GFileQueryInfoFlags flags;
+  glong               time;
+
+} InfoCacheEntry;
+
+static void
+info_cache_entry_free (gpointer data)
+{
+  InfoCacheEntry *entry = data;
+
+  g_object_unref (entry->info);
+  g_slice_free (InfoCacheEntry, entry);
+}
+
+/* paths are used without trailing slashes */
+static char *
+info_cache_key (const char *path, const char *name)
+{
+  char  *key;
+  gsize  len;
+
+  if (name)
+    key = g_build_path ("/", path, name, NULL);
+  else
+    key = g_strdup (path);
+
+  len = strlen (key);
+  while (len > 1 && key[len - 1] == '/')
+    key[--len] = '\0';
+
+  return key;
+}
+
+static gboolean
+info_cache_entry_is_expired (gpointer key, gpointer value, gpointer user_data)
+{
+  InfoCacheEntry *entry = value;
+  glong          *oldest = user_data;
+
+  return entry->time < *oldest;
+}
+
+/* takes ownership of key, copies info */
+static void
+info_cache_insert (GVfsBackendDav      *dav_backend,
+                   char                *key,
+                   GFileInfo           *info,
+                   GFileQueryInfoFlags  flags)
+{
+  InfoCacheEntry *entry;
+  GTimeVal        now;
+  glong           oldest;
+
+  if (dav_backend->info_cache_ttl == 0)
+    {
+      g_free (key);
+      return;
+    }
+
+  g_get_current_time (&now);
+
+  entry = g_slice_new (InfoCacheEntry);
+  entry->info = g_file_info_dup (info);
+  entry->flags = flags;
+  entry->time = now.tv_sec;
+
+  g_static_mutex_lock (&dav_backend->info_cache_lock);
+
+  if (g_hash_table_size (dav_backend->info_cache) >= INFO_CACHE_MAX_ENTRIES)
+    {
+      oldest = now.tv_sec - dav_backend->info_cache_ttl;
+      g_hash_table_foreach_remove (dav_backend->info_cache,
+                                   info_cache_entry_is_expired,
+                                   &oldest);
+      if (g_hash_table_size (dav_backend->info_cache) >= INFO_CACHE_MAX_ENTRIES)
+        g_hash_table_remove_all (dav_backend->info_cache);
+    }
+
+  g_hash_table_replace (dav_backend->info_cache, key, entry);
+
+  g_static_mutex_unlock (&dav_backend->info_cache_lock);
+}
+
+static gboolean
+info_cache_key_is_below (gpointer key, gpointer value, gpointer user_data)
+{
+  const char *prefix = user_data;
+  gsize       len = strlen (prefix);
+
+  return strncmp (key, prefix, len) == 0 &&
+         (((char *) key)[len] == '/' || ((char *) key)[len] == '\0');
+}
+
+/* Drops path, everything below it and its parent directory, whose
+ * modification time changes with it. */
+static void
+info_cache_invalidate (GVfsBackendDav *dav_backend, const char *path)
+{
+  char *key;
+  char *parent;
+
+  key = info_cache_key (path, NULL);
+  parent = g_path_get_dirname (key);
+
+  g_static_mutex_lock (&dav_backend->info_cache_lock);
+
+  if (strcmp (key, "/") == 0)
+    g_hash_table_remove_all (dav_backend->info_cache);
+  else
+    g_hash_table_foreach_remove (dav_backend->info_cache,
+                                 info_cache_key_is_below,
+                                 key);
+  g_hash_table_remove (dav_backend->info_cache, parent);
+
+  g_static_mutex_unlock (&dav_backend->info_cache_lock);
+
+  g_free (parent);
+  g_free (key);
+}
+
+/* Asks the server whether a cached file is unchanged */
+static gboolean
+info_cache_revalidate (GVfsBackend *backend,
+                       const char  *filename,
+                       const char  *etag)
+{
+  SoupMessage *msg;
+  SoupURI     *uri;
+  guint        status;
+
+  uri = http_backend_uri_for_filename (backend, filename, FALSE);
+  msg = soup_message_new_from_uri (SOUP_METHOD_HEAD, uri);
+  soup_uri_free (uri);
+
+  soup_message_headers_append (msg->request_headers, "If-None-Match", etag);
+  status = g_vfs_backend_dav_send_message (backend, msg);
+  g_object_unref (msg);
+
+  return status == SOUP_STATUS_NOT_MODIFIED;
+}
+
+/* Returns a copy of the cached info for filename, or NULL */
+static GFileInfo *
+info_cache_lookup (GVfsBackend         *backend,
+                   const char          *filename,
+                   GFileQueryInfoFlags  flags)
+{
+  GVfsBackendDav *dav_backend = G_VFS_BACKEND_DAV (backend);
+  InfoCacheEntry *entry;
+  GFileInfo      *info;
+  GTimeVal        now;
+  char           *key;
+  char           *etag;
+  gboolean        expired;
+
+  if (dav_backend->info_cache_ttl == 0)
+    return NULL;
+
+  key = info_cache_key (filename, NULL);
+  info = NULL;
+  etag = NULL;
+  expired = FALSE;
+
+  g_get_current_time (&now);
+
+  g_static_mutex_lock (&dav_backend->info_cache_lock);
+
+  entry = g_hash_table_lookup (dav_backend->info_cache, key);
+  if (entry && entry->flags == flags)
+    {
+      info = g_file_info_dup (entry->info);
+      if (now.tv_sec - entry->time >= (glong) dav_backend->info_cache_ttl)
+        {
+          expired = TRUE;
+          if (g_file_info_get_file_type (info) != G_FILE_TYPE_DIRECTORY)
+            etag = g_strdup (g_file_info_get_etag (info));
+        }
+    }
+
+  g_static_mutex_unlock (&dav_backend->info_cache_lock);
+
+  if (expired)
+    {
+      if (etag && info_cache_revalidate (backend, filename, etag))
+        {
+          g_static_mutex_lock (&dav_backend->info_cache_lock);
+          entry = g_hash_table_lookup (dav_backend->info_cache, key);
+          if (entry)
+            entry->time = now.tv_sec;
+          g_static_mutex_unlock (&dav_backend->info_cache_lock);
+        }
+      else
+        {
+          g_object_unref (info);
+          info = NULL;
+        }
+    }
+
+  g_free (etag);
+  g_free (key);
+  return info;
+}
+
+/* ************************************************************************* */
 static PropName ls_propnames[] = {
     {"creationdate",     NULL},
     {"displayname",      NULL},
@@ -1775,11 +2192,21 @@ do_query_info (GVfsBackend           *backend,
   xmlNodeIter  iter;
   gboolean     res;
   GError      *error;
+  GFileInfo   *cached;
 
   error   = NULL;
 
   g_debug ("Query info %s\n", filename);
 
+  cached = info_cache_lookup (backend, filename, flags);
+  if (cached)
+    {
+      g_file_info_copy_into (cached, job->file_info);
+      g_object_unref (cached);
+      g_vfs_job_succeeded (G_VFS_JOB (job));
+      return;
+    }
+
   msg = propfind_request_new (backend, filename, 0, ls_propnames);
 
   if (msg == NULL)
@@ -1818,6 +2245,9 @@ do_query_info (GVfsBackend           *backend,
       if (ms_response_is_target (&response))
         {
           ms_response_to_file_info (&response, job->file_info);
+          info_cache_insert (G_VFS_BACKEND_DAV (backend),
+                             info_cache_key (filename, NULL),
+                             job->file_info, flags);
           res = TRUE;
         }
     }
@@ -1836,6 +2266,38 @@ do_query_info (GVfsBackend           *backend,
 
 
 /* *** enumerate *** */
+static void
+enumerate_response (MsParser *parser, MsResponse *response)
+{
+  GVfsJobEnumerate *job = parser->user_data;
+  GVfsBackendDav   *dav_backend = G_VFS_BACKEND_DAV (job->backend);
+  GFileInfo        *info;
+  char             *key;
+
+  /* The first response proves the request worked, so the listing
+   * can start while the rest is still arriving */
+  if (parser->n_responses == 1)
+    g_vfs_job_succeeded (G_VFS_JOB (job));
+
+  info = g_file_info_new ();
+  ms_response_to_file_info (response, info);
+
+  if (ms_response_is_target (response))
+    {
+      info_cache_insert (dav_backend, info_cache_key (job->filename, NULL),
+                         info, job->flags);
+      g_object_unref (info);
+      return;
+    }
+
+  /* cache it before the attribute mask of the job gets applied */
+  key = info_cache_key (job->filename, g_file_info_get_name (info));
+  info_cache_insert (dav_backend, key, info, job->flags);
+
+  g_vfs_job_enumerate_add_info (job, info);
+  g_object_unref (info);
+}
+
 static void
 do_enumerate (GVfsBackend           *backend,
               GVfsJobEnumerate      *job,
@@ -1844,8 +2306,7 @@ do_enumerate (GVfsBackend           *backend,
               GFileQueryInfoFlags    flags)
 {
   SoupMessage *msg;
-  Multistatus  ms;
-  xmlNodeIter  iter;
+  MsParser     parser;
   gboolean     res;
   GError      *error;
  
@@ -1866,40 +2327,31 @@ do_enumerate (GVfsBackend           *backend,
 
   message_add_redirect_header (msg, flags);
 
+  ms_parser_init (&parser, msg, enumerate_response, job);
+
   g_vfs_backend_dav_send_message (backend, msg);
 
-  res = multistatus_parse (msg, &ms, &error);
+  res = ms_parser_finish (&parser, &error);
 
   if (res == FALSE)
     {
-      g_vfs_job_failed_from_error (G_VFS_JOB (job), error);
-      g_error_free (error);
-      g_object_unref (msg);
-      return;
-    }
-
-  multistatus_get_response_iter (&ms, &iter);
-
-  while (xml_node_iter_next (&iter))
-    {
-      MsResponse  response;
-      GFileInfo  *info;
-
-      if (! multistatus_get_response (&iter, &response))
-        continue;
-
-      if (ms_response_is_target (&response))
-        continue;
+      if (parser.n_responses == 0)
+        {
+          g_vfs_job_failed_from_error (G_VFS_JOB (job), error);
+          g_error_free (error);
+          ms_parser_free (&parser);
+          g_object_unref (msg);
+          return;
+        }
 
-      info = g_file_info_new ();
-      ms_response_to_file_info (&response, info);
-      g_vfs_job_enumerate_add_info (job, info);
+      /* The job succeeded already, all we can do is to end the listing */
+      g_debug ("  broken multistatus response: %s\n", error->message);
+      g_error_free (error);
     }
 
-  multistatus_free (&ms);
+  ms_parser_free (&parser);
   g_object_unref (msg);
 
-  g_vfs_job_succeeded (G_VFS_JOB (job)); /* should that be called earlier? */
   g_vfs_job_enumerate_done (G_VFS_JOB_ENUMERATE (job));
 }
 
@@ -1934,9 +2386,14 @@ try_create_tested_existence (SoupSession *session, SoupMessage *msg,
    * Doesn't work with apache > 2.2.9
    * soup_message_headers_append (put_msg->request_headers, "If-None-Match", "*");
    */
-  stream = soup_output_stream_new (op_backend->session, put_msg, -1);
+  stream = soup_output_stream_new (op_backend->session_async, put_msg, -1);
   g_object_unref (put_msg);
 
+  /* remembered to invalidate cached infos once the file is written */
+  g_object_set_data_full (G_OBJECT (stream), "dav-filename",
+                          g_strdup (G_VFS_JOB_OPEN_FOR_WRITE (job)->filename),
+                          g_free);
+
   g_vfs_job_open_for_write_set_handle (G_VFS_JOB_OPEN_FOR_WRITE (job), stream);
   g_vfs_job_succeeded (job);
 }  
@@ -1950,9 +2407,11 @@ try_create (GVfsBackend *backend,
   SoupMessage *msg;
   SoupURI     *uri;
 
-  /* TODO: if SoupOutputStream supported chunked requests, we could
-   * use a PUT with "If-None-Match: *" and "Expect: 100-continue"
+  /* TODO: now that SoupOutputStream streams the request, we could
+   * skip the HEAD and use a PUT with "If-None-Match: *"
    */
+  info_cache_invalidate (G_VFS_BACKEND_DAV (backend), filename);
+
   uri = http_backend_uri_for_filename (backend, filename, FALSE);
   msg = soup_message_new_from_uri (SOUP_METHOD_HEAD, uri);
   soup_uri_free (uri);
@@ -1976,9 +2435,14 @@ open_for_replace_succeeded (GVfsBackendHttp *op_backend, GVfsJob *job,
   if (etag)
     soup_message_headers_append (put_msg->request_headers, "If-Match", etag);
 
-  stream = soup_output_stream_new (op_backend->session, put_msg, -1);
+  stream = soup_output_stream_new (op_backend->session_async, put_msg, -1);
   g_object_unref (put_msg);
 
+  /* remembered to invalidate cached infos once the file is written */
+  g_object_set_data_full (G_OBJECT (stream), "dav-filename",
+                          g_strdup (G_VFS_JOB_OPEN_FOR_WRITE (job)->filename),
+                          g_free);
+
   g_vfs_job_open_for_write_set_handle (G_VFS_JOB_OPEN_FOR_WRITE (job), stream);
   g_vfs_job_succeeded (job);
 }
@@ -2015,8 +2479,8 @@ try_replace (GVfsBackend *backend,
   GVfsBackendHttp *op_backend;
   SoupURI         *uri;
 
-  /* TODO: if SoupOutputStream supported chunked requests, we could
-   * use a PUT with "If-Match: ..." and "Expect: 100-continue"
+  /* TODO: now that SoupOutputStream streams the request, we could
+   * skip the HEAD and use a PUT with "If-Match: ..."
    */
 
   op_backend = G_VFS_BACKEND_HTTP (backend);
@@ -2032,6 +2496,8 @@ try_replace (GVfsBackend *backend,
 
 
 
+  info_cache_invalidate (G_VFS_BACKEND_DAV (backend), filename);
+
   uri = http_backend_uri_for_filename (backend, filename, FALSE);
 
   if (etag)
@@ -2116,6 +2582,7 @@ close_write_ready (GObject      *source_object,
   GVfsJob       *job;
   GError        *error;
   gboolean       res;
+  const char    *filename;
 
   error = NULL;
   job = G_VFS_JOB (user_data);
@@ -2123,6 +2590,14 @@ close_write_ready (GObject      *source_object,
   res = g_output_stream_close_finish (stream,
                                       result,
                                       &error);
+
+  /* the size and etag changed with the upload, forget them before
+   * the client can ask again */
+  filename = g_object_get_data (G_OBJECT (stream), "dav-filename");
+  if (filename)
+    info_cache_invalidate (G_VFS_BACKEND_DAV (G_VFS_JOB_CLOSE_WRITE (job)->backend),
+                           filename);
+
   if (res == FALSE)
     {
       g_vfs_job_failed_literal (G_VFS_JOB (job),
@@ -2170,6 +2645,7 @@ do_make_directory (GVfsBackend          *backend,
   soup_uri_free (uri);
 
   status = g_vfs_backend_dav_send_message (backend, msg);
+  info_cache_invalidate (G_VFS_BACKEND_DAV (backend), filename);
 
   if (! SOUP_STATUS_IS_SUCCESSFUL (status))
     if (status == SOUP_STATUS_METHOD_NOT_ALLOWED)
@@ -2222,6 +2698,7 @@ do_delete (GVfsBackend   *backend,
   msg = soup_message_new_from_uri (SOUP_METHOD_DELETE, uri);
 
   status = g_vfs_backend_dav_send_message (backend, msg);
+  info_cache_invalidate (G_VFS_BACKEND_DAV (backend), filename);
 
   if (!SOUP_STATUS_IS_SUCCESSFUL (status))
     g_vfs_job_failed_literal (G_VFS_JOB (job),
@@ -2259,6 +2736,8 @@ do_set_display_name (GVfsBackend           *backend,
   message_add_overwrite_header (msg, FALSE);
 
   status = g_vfs_backend_dav_send_message (backend, msg);
+  info_cache_invalidate (G_VFS_BACKEND_DAV (backend), filename);
+  info_cache_invalidate (G_VFS_BACKEND_DAV (backend), target_path);
 
   /*
    * The precondition of SOUP_STATUS_PRECONDITION_FAILED (412) in
@@ -2299,6 +2778,135 @@ do_set_display_name (GVfsBackend           *backend,
   soup_uri_free (source);
 }
 
+/* *** copy () and move () *** */
+
+/* Copies or moves on the server with the COPY or MOVE method. Errors
+ * that mean the server won't do it are reported as not supported, so
+ * the client falls back to copying the data itself. */
+static void
+do_copy_or_move (GVfsBackend    *backend,
+                 GVfsJob        *job,
+                 const char     *source,
+                 const char     *destination,
+                 GFileCopyFlags  flags,
+                 gboolean        is_move)
+{
+  SoupMessage *msg;
+  SoupURI     *source_uri;
+  SoupURI     *target_uri;
+  GFileType    source_type;
+  GFileType    target_type;
+  guint        status;
+  GError      *error;
+
+  error = NULL;
+
+  if (flags & G_FILE_COPY_BACKUP)
+    {
+      /* Let the generic code handle backups */
+      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        _("Operation not supported by backend"));
+      return;
+    }
+
+  source_uri = http_backend_uri_for_filename (backend, source, FALSE);
+
+  if (! stat_location (backend, source_uri, &source_type, NULL, &error))
+    {
+      g_vfs_job_failed_from_error (job, error);
+      g_error_free (error);
+      soup_uri_free (source_uri);
+      return;
+    }
+
+  target_uri = http_backend_uri_for_filename (backend, destination,
+                                              source_type == G_FILE_TYPE_DIRECTORY);
+
+  /* "Overwrite: T" would replace a whole directory */
+  if ((flags & G_FILE_COPY_OVERWRITE) &&
+      stat_location (backend, target_uri, &target_type, NULL, NULL) &&
+      target_type == G_FILE_TYPE_DIRECTORY)
+    {
+      if (source_type != G_FILE_TYPE_DIRECTORY)
+        g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_IS_DIRECTORY,
+                          _("Can't copy file over directory"));
+      else if (is_move)
+        g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_WOULD_MERGE,
+                          _("Can't move directory over directory"));
+      else
+        g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_WOULD_MERGE,
+                          _("Can't copy directory over directory"));
+
+      soup_uri_free (source_uri);
+      soup_uri_free (target_uri);
+      return;
+    }
+
+  msg = soup_message_new_from_uri (is_move ? SOUP_METHOD_MOVE : SOUP_METHOD_COPY,
+                                   source_uri);
+  message_add_destination_header (msg, target_uri);
+  message_add_overwrite_header (msg, flags & G_FILE_COPY_OVERWRITE);
+
+  if (source_type == G_FILE_TYPE_DIRECTORY)
+    soup_message_headers_append (msg->request_headers, "Depth", "infinity");
+
+  status = g_vfs_backend_dav_send_message (backend, msg);
+
+  if (is_move)
+    info_cache_invalidate (G_VFS_BACKEND_DAV (backend), source);
+  info_cache_invalidate (G_VFS_BACKEND_DAV (backend), destination);
+
+  /* See do_set_display_name () for why redirects mean the target exists */
+  if (status == SOUP_STATUS_CREATED || status == SOUP_STATUS_NO_CONTENT)
+    g_vfs_job_succeeded (job);
+  else if (status == SOUP_STATUS_PRECONDITION_FAILED ||
+           SOUP_STATUS_IS_REDIRECTION (status))
+    g_vfs_job_failed (job, G_IO_ERROR,
+                      G_IO_ERROR_EXISTS,
+                      _("Target file already exists"));
+  else if (status == SOUP_STATUS_METHOD_NOT_ALLOWED ||
+           status == SOUP_STATUS_NOT_IMPLEMENTED ||
+           status == SOUP_STATUS_BAD_GATEWAY)
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                      _("Operation not supported by backend"));
+  else if (status == SOUP_STATUS_CONFLICT)
+    /* the parent of the destination doesn't exist */
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                      "%s", msg->reason_phrase);
+  else
+    g_vfs_job_failed (job, G_IO_ERROR,
+                      http_error_code_from_status (status),
+                      "%s", msg->reason_phrase);
+
+  g_object_unref (msg);
+  soup_uri_free (source_uri);
+  soup_uri_free (target_uri);
+}
+
+static void
+do_copy (GVfsBackend           *backend,
+         GVfsJobCopy           *job,
+         const char            *source,
+         const char            *destination,
+         GFileCopyFlags         flags,
+         GFileProgressCallback  progress_callback,
+         gpointer               progress_callback_data)
+{
+  do_copy_or_move (backend, G_VFS_JOB (job), source, destination, flags, FALSE);
+}
+
+static void
+do_move (GVfsBackend           *backend,
+         GVfsJobMove           *job,
+         const char            *source,
+         const char            *destination,
+         GFileCopyFlags         flags,
+         GFileProgressCallback  progress_callback,
+         gpointer               progress_callback_data)
+{
+  do_copy_or_move (backend, G_VFS_JOB (job), source, destination, flags, TRUE);
+}
+
 static gboolean
 try_unmount (GVfsBackend    *backend,
              GVfsJobUnmount *job)
@@ -2331,5 +2939,7 @@ g_vfs_backend_dav_class_init (GVfsBackendDavClass *klass)
   backend_class->make_directory    = do_make_directory;
   backend_class->delete            = do_delete;
   backend_class->set_display_name  = do_set_display_name;
+  backend_class->copy              = do_copy;
+  backend_class->move              = do_move;
   backend_class->try_unmount       = try_unmount;
 }
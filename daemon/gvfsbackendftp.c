@@ -26,10 +26,13 @@
 #include <config.h>
 
 #include <errno.h> /* for strerror (EAGAIN) */
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
 #include <libsoup/soup.h>
 
 #include "gvfsbackendftp.h"
@@ -44,6 +47,7 @@
 #include "gvfsjobqueryfsinfo.h"
 #include "gvfsjobqueryattributes.h"
 #include "gvfsjobenumerate.h"
+#include "gvfsjobpull.h"
 #include "gvfsdaemonprotocol.h"
 #include "gvfsdaemonutils.h"
 #include "gvfskeyring.h"
@@ -61,6 +65,29 @@
 /* timeout for network connect/send/receive (use 0 for none) */
 #define TIMEOUT_IN_SECONDS 30
 
+/* replies read after an ABOR before the connection is given up on */
+#define ABORT_MAX_REPLIES 4
+
+/* default time in seconds after which cached directory listings get 
+ * refreshed, can be changed with the GVFS_FTP_DIRECTORY_CACHE_TTL
+ * environment variable, 0 disables the cache */
+#define DIRECTORY_CACHE_TTL 30
+/* listings older than this many TTLs are not used, but read again */
+#define DIRECTORY_CACHE_MAX_STALE 4
+/* limits for the directory cache */
+#define DIRECTORY_CACHE_MAX_ENTRIES 1000
+#define DIRECTORY_CACHE_MAX_BYTES (4 * 1024 * 1024)
+
+/* size of the buffer used when pulling files */
+#define PULL_BUFFER_SIZE (64 * 1024)
+/* how often a pull tries to resume after the data connection broke
+ * without making any progress */
+#define PULL_MAX_RETRIES 5
+/* files at least this big are pulled in ranges over several connections */
+#define PULL_SEGMENTED_MIN_SIZE (8 * 1024 * 1024)
+/* maximum number of connections used for one pull */
+#define PULL_MAX_SEGMENTS 4
+
 /*
  * about filename interpretation in the ftp backend
  *
@@ -100,6 +127,7 @@ typedef enum {
   FTP_FEATURE_TVFS = (1 << 2),
   FTP_FEATURE_EPSV = (1 << 3),
   FTP_FEATURE_UTF8 = (1 << 4),
+  FTP_FEATURE_MLST = (1 << 5),
 } FtpFeatures;
 #define FTP_FEATURES_DEFAULT (FTP_FEATURE_EPSV)
 
@@ -143,7 +171,18 @@ struct _GVfsBackendFtp
 
   /* caching results from dir queries */
   GStaticRWLock		directory_cache_lock;
-  GHashTable *		directory_cache;
+  GHashTable *		directory_cache;	/* FtpFile * => FtpDirCacheEntry * */
+  guint			directory_cache_ttl;
+  GThreadPool *		directory_cache_refresh_pool;
+  GCancellable *	directory_cache_refresh_cancellable;	/* cancelled on unmount */
+  /* protects the fields below, taken after directory_cache_lock */
+  GStaticMutex		directory_cache_lru_lock;
+  GQueue *		directory_cache_lru;	/* most recently used first */
+  gsize			directory_cache_bytes;
+  guint64		directory_cache_hits;
+  guint64		directory_cache_misses;
+  guint64		directory_cache_evictions;
+  guint64		directory_cache_refreshes;
 };
 
 G_DEFINE_TYPE (GVfsBackendFtp, g_vfs_backend_ftp, G_VFS_TYPE_BACKEND)
@@ -159,6 +198,7 @@ struct _FtpConnection
   /* per-job data */
   GError *		error;
   GVfsJob *		job;
+  GCancellable *	cancellable;	/* used when there's no job */
 
   FtpFeatures		features;
   FtpSystem		system;
@@ -170,8 +210,14 @@ struct _FtpConnection
   gsize			read_bytes;
 
   SoupSocket *		data;
+
+  /* replies are out of sync with commands, don't reuse */
+  gboolean		broken;
 };
 
+/* background refreshes of the directory cache run without a job */
+#define ftp_connection_get_cancellable(conn) ((conn)->job ? (conn)->job->cancellable : (conn)->cancellable)
+
 static void
 ftp_connection_free (FtpConnection *conn)
 {
@@ -357,8 +403,6 @@ ftp_connection_receive (FtpConnection *conn,
   } reply_state = FIRST_LINE;
   guint response = 0;
 
-  g_assert (conn->job != NULL);
-
   if (ftp_connection_in_error (conn))
     return 0;
 
@@ -398,7 +442,7 @@ ftp_connection_receive (FtpConnection *conn,
                                          2,
                                          &n_bytes,
                                          &got_boundary,
-                                         conn->job->cancellable,
+                                         ftp_connection_get_cancellable (conn),
                                          &conn->error);
 
         conn->read_bytes += n_bytes;
@@ -508,21 +552,18 @@ ftp_connection_receive (FtpConnection *conn,
  * Returns: 0 on error or the receied FTP code otherwise.
  *     
  **/
-static guint
-ftp_connection_sendv (FtpConnection *conn,
-		      ResponseFlags  flags,
-		      const char *   format,
-		      va_list	     varargs)
+/* Sends a command without waiting for the reply */
+static gboolean
+ftp_connection_write_commandv (FtpConnection *conn,
+			       const char *   format,
+			       va_list	      varargs)
 {
   GString *command;
   SoupSocketIOStatus status;
   gsize n_bytes;
-  guint response;
-
-  g_assert (conn->job != NULL);
 
   if (ftp_connection_in_error (conn))
-    return 0;
+    return FALSE;
 
   command = g_string_new ("");
   g_string_append_vprintf (command, format, varargs);
@@ -537,7 +578,7 @@ ftp_connection_sendv (FtpConnection *conn,
 			      command->str,
 			      command->len,
 			      &n_bytes,
-			      conn->job->cancellable,
+			      ftp_connection_get_cancellable (conn),
 			      &conn->error);
   switch (status)
     {
@@ -550,15 +591,45 @@ ftp_connection_sendv (FtpConnection *conn,
 	/* fall through */
       case SOUP_SOCKET_ERROR:
 	g_string_free (command, TRUE);
-	return 0;
+	return FALSE;
       case SOUP_SOCKET_WOULD_BLOCK:
       default:
 	g_assert_not_reached ();
     }
   g_string_free (command, TRUE);
 
-  response = ftp_connection_receive (conn, flags);
-  return response;
+  return TRUE;
+}
+
+static gboolean
+ftp_connection_write_command (FtpConnection *conn,
+			      const char *   format,
+			      ...) G_GNUC_PRINTF (2, 3);
+static gboolean
+ftp_connection_write_command (FtpConnection *conn,
+			      const char *   format,
+			      ...)
+{
+  va_list varargs;
+  gboolean result;
+
+  va_start (varargs, format);
+  result = ftp_connection_write_commandv (conn, format, varargs);
+  va_end (varargs);
+
+  return result;
+}
+
+static guint
+ftp_connection_sendv (FtpConnection *conn,
+		      ResponseFlags  flags,
+		      const char *   format,
+		      va_list	     varargs)
+{
+  if (!ftp_connection_write_commandv (conn, format, varargs))
+    return 0;
+
+  return ftp_connection_receive (conn, flags);
 }
 
 static guint
@@ -647,6 +718,7 @@ ftp_connection_parse_features (FtpConnection *conn)
     { "TVFS", FTP_FEATURE_TVFS },
     { "EPSV", FTP_FEATURE_EPSV },
     { "UTF8", FTP_FEATURE_UTF8 },
+    { "MLST", FTP_FEATURE_MLST },
   };
   char **supported;
   guint i, j;
@@ -675,9 +747,13 @@ ftp_connection_parse_features (FtpConnection *conn)
       if (len > 0 && feature[len-1] == '\r')
 	      feature[len-1] = '\0';
 
+      /* features may be followed by parameters, like
+       * "MLST type*;size*;modify*;" */
       for (j = 0; j < G_N_ELEMENTS (features); j++)
 	{
-	  if (g_ascii_strcasecmp (feature, features[j].name) == 0)
+	  len = strlen (features[j].name);
+	  if (g_ascii_strncasecmp (feature, features[j].name, len) == 0 &&
+	      (feature[len] == 0 || feature[len] == ' '))
 	    {
 	      DEBUG ("feature %s supported\n", features[j].name);
 	      conn->features |= features[j].enable;
@@ -844,7 +920,7 @@ ftp_connection_open_data_connection (FtpConnection *conn, SoupAddress *addr)
 				"timeout", TIMEOUT_IN_SECONDS,
 				NULL);
   g_object_unref (addr);
-  status = soup_socket_connect_sync (conn->data, conn->job->cancellable);
+  status = soup_socket_connect_sync (conn->data, ftp_connection_get_cancellable (conn));
   if (!SOUP_STATUS_IS_SUCCESSFUL (status))
     {
       /* FIXME: better error messages depending on status please */
@@ -986,6 +1062,52 @@ ftp_connection_close_data_connection (FtpConnection *conn)
   conn->data = NULL;
 }
 
+/**
+ * ftp_connection_abort_data_connection:
+ * @conn: the connection
+ *
+ * Stops a transfer that might not be finished yet. Servers answer an
+ * aborted transfer with a 426 and a 226, or with one or two 2xx replies
+ * if it was complete already, so a PWD is sent after the ABOR and all
+ * replies up to its 257 are skipped. If that doesn't work out, @conn is
+ * marked as broken and g_vfs_backend_ftp_push_connection() drops it. An
+ * error already set on @conn is kept.
+ **/
+static void
+ftp_connection_abort_data_connection (FtpConnection *conn)
+{
+  GError *error;
+  guint response = 0;
+  guint i;
+
+  ftp_connection_close_data_connection (conn);
+
+  error = conn->error;
+  conn->error = NULL;
+
+  if (ftp_connection_write_command (conn, "ABOR") &&
+      ftp_connection_write_command (conn, "PWD"))
+    {
+      for (i = 0; i < ABORT_MAX_REPLIES; i++)
+        {
+          response = ftp_connection_receive (conn,
+                                             RESPONSE_PASS_100 | RESPONSE_PASS_300 |
+                                             RESPONSE_PASS_400 | RESPONSE_PASS_500);
+          if (response == 0 || response == 257)
+            break;
+        }
+    }
+
+  if (response != 257)
+    {
+      DEBUG ("could not resync after ABOR, dropping connection\n");
+      conn->broken = TRUE;
+    }
+
+  g_clear_error (&conn->error);
+  conn->error = error;
+}
+
 /*** FILE MAPPINGS ***/
 
 /* FIXME: This most likely needs adaption to non-unix like directory structures.
@@ -1069,6 +1191,38 @@ ftp_connection_try_cd (FtpConnection *conn, const FtpFile *file)
   return TRUE;
 }
 
+/*** directory reading ***/
+
+/* Gets the gvfs path the symlink at @path with target @link points to */
+static char *
+ftp_symlink_resolve (const char *path, const char *link)
+{
+  char *str = g_path_get_dirname (path);
+  char *symlink_file = g_build_path ("/", str, link, NULL);
+
+  g_free (str);
+  while ((str = strstr (symlink_file, "/../")))
+    {
+      char *end = str + 4;
+      char *start;
+      start = str - 1;
+      while (start >= symlink_file && *start != '/')
+	start--;
+
+      if (start < symlink_file) {
+	      *symlink_file = '/';
+	      start = symlink_file;
+      }
+
+      memmove (start + 1, end, strlen (end) + 1);
+    }
+  str = symlink_file + strlen (symlink_file) - 1;
+  while (*str == '/' && str > symlink_file)
+    *str-- = 0;
+
+  return symlink_file;
+}
+
 /*** default directory reading ***/
 
 static void
@@ -1185,31 +1339,7 @@ dir_default_iter_process (gpointer        iter,
       g_file_info_set_is_symlink (info, TRUE);
 
       if (symlink)
-	{
-	  char *str = g_path_get_dirname (s);
-	  char *symlink_file = g_build_path ("/", str, link, NULL);
-
-	  g_free (str);
-	  while ((str = strstr (symlink_file, "/../")))
-	    {
-	      char *end = str + 4;
-	      char *start;
-	      start = str - 1;
-	      while (start >= symlink_file && *start != '/')
-		start--;
-
-	      if (start < symlink_file) {
-		      *symlink_file = '/';
-		      start = symlink_file;
-	      }
-
-	      memmove (start + 1, end, strlen (end) + 1);
-	    }
-	  str = symlink_file + strlen (symlink_file) - 1;
-	  while (*str == '/' && str > symlink_file)
-	    *str-- = 0;
-	  *symlink = symlink_file;
-	}
+	*symlink = ftp_symlink_resolve (s, link);
       g_free (link);
     }
   else if (symlink)
@@ -1257,6 +1387,222 @@ static const FtpDirReader dir_default = {
   dir_default_iter_free
 };
 
+/*** MLSD directory reading ***/
+
+/* Machine readable listings as specified in RFC 3659. Each line is a
+ * list of "fact=value;" pairs followed by a space and the file name. */
+
+static void
+dir_mlsd_init_data (FtpConnection *conn, const FtpFile *dir)
+{
+  /* gets us the "not a directory" error MLSD doesn't reliably give */
+  ftp_connection_cd (conn, dir);
+  ftp_connection_ensure_data_connection (conn);
+
+  ftp_connection_send (conn,
+		       RESPONSE_PASS_100 | RESPONSE_FAIL_200,
+		       "MLSD %s", dir);
+}
+
+static gpointer
+dir_mlsd_iter_new (FtpConnection *conn)
+{
+  return NULL;
+}
+
+/* modify facts look like YYYYMMDDHHMMSS[.sss] and are in UTC */
+static gboolean
+mlsd_parse_time (const char *value, GTimeVal *tv)
+{
+  char *iso;
+  gboolean result;
+
+  if (strlen (value) < 14)
+    return FALSE;
+
+  iso = g_strdup_printf ("%.4s-%.2s-%.2sT%.2s:%.2s:%sZ",
+                         value, value + 4, value + 6,
+                         value + 8, value + 10, value + 12);
+  result = g_time_val_from_iso8601 (iso, tv);
+  g_free (iso);
+
+  return result;
+}
+
+/**
+ * mlsd_create_file_info:
+ * @conn: the connection
+ * @facts: the facts part of a MLSD or MLST line, will be modified
+ * @path: the gvfs path of the file
+ * @symlink: set to the path the symlink points to or %NULL
+ *
+ * Creates a file info from the facts of a machine readable listing.
+ *
+ * Returns: the file info
+ **/
+static GFileInfo *
+mlsd_create_file_info (FtpConnection *conn,
+                       char          *facts,
+                       const char    *path,
+                       char         **symlink)
+{
+  GFileInfo *info;
+  GFileType type = G_FILE_TYPE_REGULAR;
+  const char *perm = NULL;
+  const char *link = NULL;
+  char **list, *name, *value;
+  GTimeVal tv;
+  guint i;
+
+  info = g_file_info_new ();
+  list = g_strsplit (facts, ";", -1);
+  for (i = 0; list[i]; i++)
+    {
+      name = list[i];
+      value = strchr (name, '=');
+      if (value == NULL)
+        continue;
+      *value++ = 0;
+
+      if (g_ascii_strcasecmp (name, "type") == 0)
+        {
+          if (g_ascii_strcasecmp (value, "dir") == 0 ||
+              g_ascii_strcasecmp (value, "cdir") == 0 ||
+              g_ascii_strcasecmp (value, "pdir") == 0)
+            type = G_FILE_TYPE_DIRECTORY;
+          else if (g_ascii_strncasecmp (value, "OS.unix=slink", 13) == 0 ||
+                   g_ascii_strncasecmp (value, "OS.unix=symlink", 15) == 0)
+            {
+              type = G_FILE_TYPE_SYMBOLIC_LINK;
+              link = strchr (value, ':');
+              if (link)
+                link++;
+            }
+        }
+      else if (g_ascii_strcasecmp (name, "size") == 0)
+        g_file_info_set_size (info, g_ascii_strtoull (value, NULL, 10));
+      else if (g_ascii_strcasecmp (name, "modify") == 0)
+        {
+          if (mlsd_parse_time (value, &tv))
+            g_file_info_set_modification_time (info, &tv);
+        }
+      else if (g_ascii_strcasecmp (name, "unique") == 0)
+        g_file_info_set_attribute_string (info, G_FILE_ATTRIBUTE_ID_FILE, value);
+      else if (g_ascii_strcasecmp (name, "perm") == 0)
+        perm = value;
+    }
+
+  if (symlink)
+    *symlink = NULL;
+  if (link && *link)
+    {
+      g_file_info_set_symlink_target (info, link);
+      g_file_info_set_is_symlink (info, TRUE);
+      if (symlink)
+        *symlink = ftp_symlink_resolve (path, link);
+    }
+
+  gvfs_file_info_populate_default (info, path, type);
+
+  if (perm)
+    {
+      if (type == G_FILE_TYPE_DIRECTORY)
+        {
+          g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ,
+                                             strpbrk (perm, "lL") != NULL);
+          g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE,
+                                             strpbrk (perm, "cCmM") != NULL);
+          g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_EXECUTE,
+                                             strpbrk (perm, "eE") != NULL);
+        }
+      else
+        {
+          g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ,
+                                             strpbrk (perm, "rR") != NULL);
+          g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE,
+                                             strpbrk (perm, "wWaA") != NULL);
+        }
+      g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_DELETE,
+                                         strpbrk (perm, "dD") != NULL);
+      g_file_info_set_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_RENAME,
+                                         strpbrk (perm, "fF") != NULL);
+    }
+
+  if (conn->system == FTP_SYSTEM_UNIX)
+    {
+      name = g_path_get_basename (path);
+      g_file_info_set_is_hidden (info, name[0] == '.');
+      g_free (name);
+    }
+
+  g_strfreev (list);
+  return info;
+}
+
+static GFileInfo *
+dir_mlsd_iter_process (gpointer        iter,
+		       FtpConnection  *conn,
+		       const FtpFile  *dirname,
+		       const FtpFile  *must_match_file,
+		       const char     *line,
+		       char	     **symlink)
+{
+  GFileInfo *info;
+  FtpFile *name;
+  const char *space;
+  char *facts, *s;
+
+  /* the name is separated from the facts by the first space */
+  space = strchr (line, ' ');
+  if (space == NULL || space[1] == 0)
+    return NULL;
+
+  /* don't list . and .. directories */
+  facts = g_ascii_strdown (line, space - line);
+  if (strstr (facts, "type=cdir;") || strstr (facts, "type=pdir;") ||
+      g_str_equal (space + 1, ".") || g_str_equal (space + 1, ".."))
+    {
+      g_free (facts);
+      return NULL;
+    }
+  g_free (facts);
+
+  if (dirname)
+    name = ftp_filename_construct (conn, dirname, space + 1);
+  else
+    name = (FtpFile *) g_strdup (space + 1);
+  if (name == NULL)
+    return NULL;
+
+  if (must_match_file && !ftp_filename_equal (name, must_match_file))
+    {
+      g_free (name);
+      return NULL;
+    }
+
+  s = ftp_filename_to_gvfs_path (conn, name);
+  facts = g_strndup (line, space - line);
+  info = mlsd_create_file_info (conn, facts, s, symlink);
+  g_free (facts);
+  g_free (s);
+  g_free (name);
+
+  return info;
+}
+
+static void
+dir_mlsd_iter_free (gpointer iter)
+{
+}
+
+static const FtpDirReader dir_mlsd = {
+  dir_mlsd_init_data,
+  dir_default_get_root,
+  dir_mlsd_iter_new,
+  dir_mlsd_iter_process,
+  dir_mlsd_iter_free
+};
+
 /*** BACKEND ***/
 
 static void
@@ -1270,7 +1616,14 @@ g_vfs_backend_ftp_push_connection (GVfsBackendFtp *ftp, FtpConnection *conn)
     ftp_connection_pop_job (conn);
 
   g_mutex_lock (ftp->mutex);
-  if (ftp->queue)
+  if (conn->broken)
+    {
+      ftp_connection_free (conn);
+      ftp->connections--;
+      /* someone may be waiting to open a new one */
+      g_cond_signal (ftp->cond);
+    }
+  else if (ftp->queue)
     {
       g_queue_push_tail (ftp->queue, conn);
       g_cond_signal (ftp->cond);
@@ -1374,65 +1727,342 @@ g_vfs_backend_ftp_pop_connection (GVfsBackendFtp *ftp,
   return conn;
 }
 
-static void
-g_vfs_backend_ftp_finalize (GObject *object)
+/* Like g_vfs_backend_ftp_pop_connection(), but doesn't wait for a
+ * connection to become available. Returns %NULL without failing the job
+ * if no connection can be had right now. */
+static FtpConnection *
+g_vfs_backend_ftp_try_pop_connection (GVfsBackendFtp *ftp,
+				      GVfsJob *	      job)
 {
-  GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (object);
+  FtpConnection *conn = NULL;
+  guint maybe_max_connections;
 
-  if (ftp->addr)
-    g_object_unref (ftp->addr);
+  g_mutex_lock (ftp->mutex);
+  if (ftp->queue == NULL)
+    {
+      g_mutex_unlock (ftp->mutex);
+      return NULL;
+    }
 
-  /* has been cleared on unmount */
-  g_assert (ftp->queue == NULL);
-  g_cond_free (ftp->cond);
-  g_mutex_free (ftp->mutex);
+  conn = g_queue_pop_head (ftp->queue);
+  if (conn != NULL)
+    {
+      g_mutex_unlock (ftp->mutex);
+      ftp_connection_push_job (conn, job);
+      if (ftp_connection_send (conn, 0, "NOOP"))
+	return conn;
 
-  g_hash_table_destroy (ftp->directory_cache);
-  g_static_rw_lock_free (&ftp->directory_cache_lock);
+      ftp_connection_clear_error (conn);
+      conn->job = NULL;
+      ftp_connection_free (conn);
+      g_mutex_lock (ftp->mutex);
+      ftp->connections--;
+      g_mutex_unlock (ftp->mutex);
+      return NULL;
+    }
 
-  g_free (ftp->user);
-  g_free (ftp->password);
+  if (ftp->connections >= ftp->max_connections)
+    {
+      g_mutex_unlock (ftp->mutex);
+      return NULL;
+    }
 
-  if (G_OBJECT_CLASS (g_vfs_backend_ftp_parent_class)->finalize)
-    (*G_OBJECT_CLASS (g_vfs_backend_ftp_parent_class)->finalize) (object);
+  maybe_max_connections = ftp->connections;
+  ftp->connections++;
+  g_mutex_unlock (ftp->mutex);
+
+  conn = ftp_connection_create (ftp->addr, job);
+  ftp_connection_prepare (conn);
+  ftp_connection_login (conn, ftp->user, ftp->password);
+  ftp_connection_use (conn);
+  if (G_LIKELY (!ftp_connection_in_error (conn)))
+    return conn;
+
+  ftp_connection_clear_error (conn);
+  conn->job = NULL;
+  ftp_connection_free (conn);
+  g_mutex_lock (ftp->mutex);
+  ftp->connections--;
+  /* the server probably limits the connections, don't try again */
+  ftp->max_connections = MAX (1, MIN (ftp->max_connections, maybe_max_connections));
+  g_mutex_unlock (ftp->mutex);
+
+  return NULL;
 }
 
+/*** DIRECTORY CACHE ***/
+
+typedef struct {
+  FtpFile *		dir;
+  GList *		files;		/* lines of the listing */
+  gsize			bytes;		/* memory used by files */
+  glong			time;		/* when the listing was read */
+  GList *		lru_link;
+  gboolean		refreshing;
+} FtpDirCacheEntry;
+
 static void
-list_free (gpointer list)
+directory_cache_entry_free (gpointer data)
 {
-  g_list_foreach (list, (GFunc) g_free, NULL);
-  g_list_free (list);
+  FtpDirCacheEntry *entry = data;
+
+  g_list_foreach (entry->files, (GFunc) g_free, NULL);
+  g_list_free (entry->files);
+  g_free (entry->dir);
+  g_slice_free (FtpDirCacheEntry, entry);
 }
 
+/* NB: needs the writer lock */
 static void
-g_vfs_backend_ftp_init (GVfsBackendFtp *ftp)
+directory_cache_remove (GVfsBackendFtp *ftp, FtpDirCacheEntry *entry)
 {
-  ftp->mutex = g_mutex_new ();
-  ftp->cond = g_cond_new ();
-
-  ftp->directory_cache = g_hash_table_new_full (g_str_hash,
-					        g_str_equal,
-						g_free,
-						list_free);
-  g_static_rw_lock_init (&ftp->directory_cache_lock);
+  g_static_mutex_lock (&ftp->directory_cache_lru_lock);
+  g_queue_delete_link (ftp->directory_cache_lru, entry->lru_link);
+  ftp->directory_cache_bytes -= entry->bytes;
+  g_static_mutex_unlock (&ftp->directory_cache_lru_lock);
 
-  ftp->dir_ops = &dir_default;
+  g_hash_table_remove (ftp->directory_cache, entry->dir);
 }
 
+/* NB: needs the writer lock, takes ownership of files */
 static void
-do_mount (GVfsBackend *backend,
-	  GVfsJobMount *job,
-	  GMountSpec *mount_spec,
-	  GMountSource *mount_source,
-	  gboolean is_automount)
+directory_cache_insert (GVfsBackendFtp *ftp, const FtpFile *dir, GList *files)
 {
-  GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
-  FtpConnection *conn;
-  char *host;
-  char *prompt = NULL;
-  char *username;
-  char *password;
-  char *display_name;
+  FtpDirCacheEntry *entry;
+  GTimeVal now;
+  GList *walk;
+
+  entry = g_hash_table_lookup (ftp->directory_cache, dir);
+  if (entry)
+    directory_cache_remove (ftp, entry);
+
+  g_get_current_time (&now);
+  entry = g_slice_new0 (FtpDirCacheEntry);
+  entry->dir = (FtpFile *) g_strdup ((const char *) dir);
+  entry->files = files;
+  entry->time = now.tv_sec;
+  entry->bytes = sizeof (FtpDirCacheEntry) + strlen ((const char *) dir) + 1;
+  for (walk = files; walk; walk = walk->next)
+    entry->bytes += sizeof (GList) + strlen (walk->data) + 1;
+  g_hash_table_insert (ftp->directory_cache, entry->dir, entry);
+
+  g_static_mutex_lock (&ftp->directory_cache_lru_lock);
+  g_queue_push_head (ftp->directory_cache_lru, entry);
+  entry->lru_link = ftp->directory_cache_lru->head;
+  ftp->directory_cache_bytes += entry->bytes;
+  g_static_mutex_unlock (&ftp->directory_cache_lru_lock);
+
+  /* evict least recently used listings, but keep the new one */
+  while (ftp->directory_cache_lru->length > 1 &&
+         (ftp->directory_cache_lru->length > DIRECTORY_CACHE_MAX_ENTRIES ||
+          ftp->directory_cache_bytes > DIRECTORY_CACHE_MAX_BYTES))
+    {
+      entry = g_queue_peek_tail (ftp->directory_cache_lru);
+      DEBUG ("evicting listing of %s from cache\n", entry->dir);
+      directory_cache_remove (ftp, entry);
+      g_static_mutex_lock (&ftp->directory_cache_lru_lock);
+      ftp->directory_cache_evictions++;
+      g_static_mutex_unlock (&ftp->directory_cache_lru_lock);
+    }
+}
+
+/* forward declaration */
+static GList *do_enumerate_directory (FtpConnection *conn);
+
+/* Runs in the refresh thread. Only uses a connection if one is idle, so
+ * refreshing never delays jobs. */
+static void
+directory_cache_refresh_func (gpointer data, gpointer user_data)
+{
+  GVfsBackendFtp *ftp = user_data;
+  FtpFile *dir = data;
+  FtpDirCacheEntry *entry;
+  FtpConnection *conn = NULL;
+  GList *files = NULL;
+
+  g_mutex_lock (ftp->mutex);
+  if (ftp->queue)
+    conn = g_queue_pop_head (ftp->queue);
+  g_mutex_unlock (ftp->mutex);
+
+  if (conn)
+    {
+      conn->cancellable = ftp->directory_cache_refresh_cancellable;
+
+      /* same check as g_vfs_backend_ftp_pop_connection() */
+      if (ftp_connection_send (conn, 0, "NOOP"))
+        {
+          DEBUG ("refreshing listing of %s\n", dir);
+          ftp->dir_ops->init_data (conn, dir);
+          files = do_enumerate_directory (conn);
+        }
+
+      /* don't hand a dead or desynced connection to the next job */
+      if (ftp_connection_in_error (conn))
+        {
+          conn->broken = TRUE;
+          ftp_connection_clear_error (conn);
+        }
+      conn->cancellable = NULL;
+      g_vfs_backend_ftp_push_connection (ftp, conn);
+    }
+
+  g_static_rw_lock_writer_lock (&ftp->directory_cache_lock);
+  if (files)
+    {
+      directory_cache_insert (ftp, dir, files);
+      g_static_mutex_lock (&ftp->directory_cache_lru_lock);
+      ftp->directory_cache_refreshes++;
+      g_static_mutex_unlock (&ftp->directory_cache_lru_lock);
+    }
+  else
+    {
+      entry = g_hash_table_lookup (ftp->directory_cache, dir);
+      if (entry)
+        entry->refreshing = FALSE;
+    }
+  g_static_rw_lock_writer_unlock (&ftp->directory_cache_lock);
+
+  g_free (dir);
+}
+
+/* NB: needs the reader lock.
+ * Returns the listing of dir if it is fresh enough and schedules a refresh
+ * if it is getting old. */
+static FtpDirCacheEntry *
+directory_cache_lookup (GVfsBackendFtp *ftp, const FtpFile *dir)
+{
+  FtpDirCacheEntry *entry;
+  GTimeVal now;
+  glong age;
+
+  entry = g_hash_table_lookup (ftp->directory_cache, dir);
+
+  g_static_mutex_lock (&ftp->directory_cache_lru_lock);
+  /* With the cache disabled the listings are only kept while they
+   * are used, every lookup reads the directory again */
+  if (ftp->directory_cache_ttl == 0)
+    entry = NULL;
+  else if (entry)
+    {
+      g_get_current_time (&now);
+      age = now.tv_sec - entry->time;
+      if (age >= (glong) ftp->directory_cache_ttl * DIRECTORY_CACHE_MAX_STALE)
+        entry = NULL;
+      else if (age >= (glong) ftp->directory_cache_ttl && !entry->refreshing)
+        {
+          entry->refreshing = TRUE;
+          g_thread_pool_push (ftp->directory_cache_refresh_pool,
+                              g_strdup ((const char *) dir),
+                              NULL);
+        }
+    }
+
+  if (entry)
+    {
+      g_queue_unlink (ftp->directory_cache_lru, entry->lru_link);
+      g_queue_push_head_link (ftp->directory_cache_lru, entry->lru_link);
+      ftp->directory_cache_hits++;
+    }
+  else
+    ftp->directory_cache_misses++;
+  g_static_mutex_unlock (&ftp->directory_cache_lru_lock);
+
+  return entry;
+}
+
+static void
+directory_cache_add_stats (GVfsBackendFtp *ftp, GFileInfo *info)
+{
+  g_static_mutex_lock (&ftp->directory_cache_lru_lock);
+  g_file_info_set_attribute_uint64 (info, "ftp::cache-hits",
+                                    ftp->directory_cache_hits);
+  g_file_info_set_attribute_uint64 (info, "ftp::cache-misses",
+                                    ftp->directory_cache_misses);
+  g_file_info_set_attribute_uint64 (info, "ftp::cache-evictions",
+                                    ftp->directory_cache_evictions);
+  g_file_info_set_attribute_uint64 (info, "ftp::cache-refreshes",
+                                    ftp->directory_cache_refreshes);
+  g_file_info_set_attribute_uint32 (info, "ftp::cache-entries",
+                                    ftp->directory_cache_lru->length);
+  g_file_info_set_attribute_uint64 (info, "ftp::cache-bytes",
+                                    ftp->directory_cache_bytes);
+  g_static_mutex_unlock (&ftp->directory_cache_lru_lock);
+}
+
+static void
+g_vfs_backend_ftp_finalize (GObject *object)
+{
+  GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (object);
+
+  if (ftp->addr)
+    g_object_unref (ftp->addr);
+
+  /* has been cleared on unmount */
+  g_assert (ftp->queue == NULL);
+  g_cond_free (ftp->cond);
+  g_mutex_free (ftp->mutex);
+
+  /* waits for running refreshes */
+  g_thread_pool_free (ftp->directory_cache_refresh_pool, TRUE, TRUE);
+  g_object_unref (ftp->directory_cache_refresh_cancellable);
+  g_hash_table_destroy (ftp->directory_cache);
+  g_queue_free (ftp->directory_cache_lru);
+  g_static_mutex_free (&ftp->directory_cache_lru_lock);
+  g_static_rw_lock_free (&ftp->directory_cache_lock);
+
+  g_free (ftp->user);
+  g_free (ftp->password);
+
+  if (G_OBJECT_CLASS (g_vfs_backend_ftp_parent_class)->finalize)
+    (*G_OBJECT_CLASS (g_vfs_backend_ftp_parent_class)->finalize) (object);
+}
+
+static void
+g_vfs_backend_ftp_init (GVfsBackendFtp *ftp)
+{
+  const char *ttl;
+
+  /* every job uses its own connection from the locked queue */
+  g_vfs_backend_set_parallel_job_types (G_VFS_BACKEND (ftp),
+					G_VFS_TYPE_JOB,
+					G_TYPE_INVALID);
+
+  ftp->mutex = g_mutex_new ();
+  ftp->cond = g_cond_new ();
+
+  ftp->directory_cache = g_hash_table_new_full (g_str_hash,
+					        g_str_equal,
+						NULL,
+						directory_cache_entry_free);
+  g_static_rw_lock_init (&ftp->directory_cache_lock);
+  ftp->directory_cache_ttl = DIRECTORY_CACHE_TTL;
+  ttl = g_getenv ("GVFS_FTP_DIRECTORY_CACHE_TTL");
+  if (ttl != NULL)
+    ftp->directory_cache_ttl = strtoul (ttl, NULL, 10);
+  ftp->directory_cache_refresh_pool = g_thread_pool_new (directory_cache_refresh_func,
+                                                         ftp, 1, FALSE, NULL);
+  ftp->directory_cache_refresh_cancellable = g_cancellable_new ();
+  g_static_mutex_init (&ftp->directory_cache_lru_lock);
+  ftp->directory_cache_lru = g_queue_new ();
+
+  ftp->dir_ops = &dir_default;
+}
+
+static void
+do_mount (GVfsBackend *backend,
+	  GVfsJobMount *job,
+	  GMountSpec *mount_spec,
+	  GMountSource *mount_source,
+	  gboolean is_automount)
+{
+  GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
+  FtpConnection *conn;
+  char *host;
+  char *prompt = NULL;
+  char *username;
+  char *password;
+  char *display_name;
   gboolean aborted, anonymous, break_on_fail;
   GPasswordSave password_save = G_PASSWORD_SAVE_NEVER;
   guint port;
@@ -1614,6 +2244,9 @@ try_login:
       g_free (display_name);
       g_vfs_backend_set_icon_name (backend, "folder-remote");
 
+      if (conn->features & FTP_FEATURE_MLST)
+        ftp->dir_ops = &dir_mlsd;
+
       ftp->connections = 1;
       ftp->max_connections = G_MAXUINT;
       ftp->queue = g_queue_new ();
@@ -1665,6 +2298,9 @@ do_unmount (GVfsBackend *   backend,
   GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
   FtpConnection *conn;
 
+  /* stop a refresh that is running */
+  g_cancellable_cancel (ftp->directory_cache_refresh_cancellable);
+
   g_mutex_lock (ftp->mutex);
   while ((conn = g_queue_pop_head (ftp->queue)))
     {
@@ -1693,6 +2329,53 @@ error_550_is_directory (FtpConnection *conn, const FtpFile *file)
     }
 }
 
+/**
+ * ftp_connection_retrieve:
+ * @conn: the connection
+ * @file: file to retrieve
+ * @offset: where to start the transfer
+ *
+ * Opens a data connection and starts retrieving @file from @offset on,
+ * using REST if @offset isn't 0.
+ **/
+static void
+ftp_connection_retrieve (FtpConnection *conn, const FtpFile *file, goffset offset)
+{
+  static const Ftp550Handler retrieve_handlers[] = { error_550_is_directory, NULL };
+
+  ftp_connection_ensure_data_connection (conn);
+
+  if (offset > 0)
+    ftp_connection_send (conn,
+                         RESPONSE_PASS_300 | RESPONSE_FAIL_200,
+                         "REST %" G_GINT64_FORMAT, (gint64) offset);
+
+  ftp_connection_send_and_check (conn,
+		                 RESPONSE_PASS_100 | RESPONSE_FAIL_200, 
+		                 &retrieve_handlers[0],
+		                 file,
+		                 "RETR %s", file);
+}
+
+/* forward declaration */
+static GFileInfo *
+create_file_info (GVfsBackendFtp *ftp, FtpConnection *conn, const char *filename, char **symlink);
+
+typedef struct {
+  FtpConnection *	conn;
+  char *		filename;	/* gvfs path of the file */
+  FtpFile *		file;
+  goffset		offset;		/* position of the data connection */
+} FtpReadHandle;
+
+static void
+ftp_read_handle_free (FtpReadHandle *handle)
+{
+  g_free (handle->filename);
+  g_free (handle->file);
+  g_slice_free (FtpReadHandle, handle);
+}
+
 static void
 do_open_for_read (GVfsBackend *backend,
 		  GVfsJobOpenForRead *job,
@@ -1701,29 +2384,29 @@ do_open_for_read (GVfsBackend *backend,
   GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
   FtpConnection *conn;
   FtpFile *file;
-  static const Ftp550Handler open_read_handlers[] = { error_550_is_directory, NULL };
+  FtpReadHandle *handle;
 
   conn = g_vfs_backend_ftp_pop_connection (ftp, G_VFS_JOB (job));
   if (!conn)
     return;
 
-  ftp_connection_ensure_data_connection (conn);
-
   file = ftp_filename_from_gvfs_path (conn, filename);
-  ftp_connection_send_and_check (conn,
-		                 RESPONSE_PASS_100 | RESPONSE_FAIL_200, 
-		                 &open_read_handlers[0],
-		                 file,
-		                 "RETR %s", file);
-  g_free (file);
+  ftp_connection_retrieve (conn, file, 0);
 
   if (ftp_connection_in_error (conn))
-    g_vfs_backend_ftp_push_connection (ftp, conn);
+    {
+      g_free (file);
+      g_vfs_backend_ftp_push_connection (ftp, conn);
+    }
   else
     {
       /* don't push the connection back, it's our handle now */
-      g_vfs_job_open_for_read_set_handle (job, conn);
-      g_vfs_job_open_for_read_set_can_seek (job, FALSE);
+      handle = g_slice_new0 (FtpReadHandle);
+      handle->conn = conn;
+      handle->filename = g_strdup (filename);
+      handle->file = file;
+      g_vfs_job_open_for_read_set_handle (job, handle);
+      g_vfs_job_open_for_read_set_can_seek (job, TRUE);
       ftp_connection_pop_job (conn);
     }
 }
@@ -1734,11 +2417,15 @@ do_close_read (GVfsBackend *     backend,
 	       GVfsBackendHandle handle)
 {
   GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
-  FtpConnection *conn = handle;
+  FtpReadHandle *read_handle = handle;
+  FtpConnection *conn = read_handle->conn;
+
+  ftp_read_handle_free (read_handle);
 
   ftp_connection_push_job (conn, G_VFS_JOB (job));
-  ftp_connection_close_data_connection (conn);
-  ftp_connection_receive (conn, 0); 
+  /* the transfer may or may not be complete */
+  if (conn->data)
+    ftp_connection_abort_data_connection (conn);
   g_vfs_backend_ftp_push_connection (ftp, conn);
 }
 
@@ -1749,11 +2436,22 @@ do_read (GVfsBackend *     backend,
 	 char *            buffer,
 	 gsize             bytes_requested)
 {
-  FtpConnection *conn = handle;
+  FtpReadHandle *read_handle = handle;
+  FtpConnection *conn = read_handle->conn;
   gsize n_bytes;
 
   ftp_connection_push_job (conn, G_VFS_JOB (job));
 
+  if (conn->data == NULL)
+    {
+      /* a failed seek closed the data connection */
+      g_set_error_literal (&conn->error, G_IO_ERROR, G_IO_ERROR_CLOSED,
+			   _("Data connection closed"));
+      ftp_connection_pop_job (conn);
+      return;
+    }
+
+  n_bytes = 0;
   soup_socket_read (conn->data,
 		    buffer,
 		    bytes_requested,
@@ -1763,10 +2461,320 @@ do_read (GVfsBackend *     backend,
   /* no need to check return value, code will just do the right thing
    * depenging on wether conn->error is set */
 
+  read_handle->offset += n_bytes;
   g_vfs_job_read_set_size (job, n_bytes);
   ftp_connection_pop_job (conn);
 }
 
+static goffset
+ftp_read_handle_get_size (GVfsBackendFtp *ftp, FtpReadHandle *handle)
+{
+  FtpConnection *conn = handle->conn;
+  GFileInfo *info;
+  goffset size = -1;
+
+  if ((conn->features & FTP_FEATURE_SIZE) &&
+      ftp_connection_send (conn, RESPONSE_PASS_500, "SIZE %s", handle->file) == 213)
+    return g_ascii_strtoll (conn->read_buffer + 4, NULL, 10);
+  ftp_connection_clear_error (conn);
+
+  info = create_file_info (ftp, conn, handle->filename, NULL);
+  if (info)
+    {
+      size = g_file_info_get_size (info);
+      g_object_unref (info);
+    }
+  else if (!ftp_connection_in_error (conn))
+    g_set_error_literal (&conn->error,
+			 G_IO_ERROR,
+			 G_IO_ERROR_NOT_FOUND,
+			 _("File doesn't exist"));
+
+  return size;
+}
+
+static void
+do_seek_on_read (GVfsBackend *backend,
+		 GVfsJobSeekRead *job,
+		 GVfsBackendHandle handle,
+		 goffset offset,
+		 GSeekType type)
+{
+  GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
+  FtpReadHandle *read_handle = handle;
+  FtpConnection *conn = read_handle->conn;
+  goffset size;
+
+  ftp_connection_push_job (conn, G_VFS_JOB (job));
+
+  if (type == G_SEEK_CUR)
+    offset += read_handle->offset;
+
+  if (type == G_SEEK_SET || type == G_SEEK_CUR)
+    {
+      if (offset == read_handle->offset && conn->data != NULL)
+        {
+          g_vfs_job_seek_read_set_offset (job, offset);
+          ftp_connection_pop_job (conn);
+          return;
+        }
+    }
+  else if (type != G_SEEK_END)
+    {
+      g_set_error_literal (&conn->error,
+			   G_IO_ERROR,
+			   G_IO_ERROR_NOT_SUPPORTED,
+			   _("Unsupported seek type"));
+      ftp_connection_pop_job (conn);
+      return;
+    }
+
+  /* FTP can't seek inside a transfer, so the current one is stopped
+   * and a new one is started at the new offset. */
+  if (conn->data)
+    ftp_connection_abort_data_connection (conn);
+  ftp_connection_clear_error (conn);
+
+  if (conn->broken)
+    {
+      g_set_error_literal (&conn->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+			   _("Invalid reply"));
+      ftp_connection_pop_job (conn);
+      return;
+    }
+
+  if (type == G_SEEK_END)
+    {
+      size = ftp_read_handle_get_size (ftp, read_handle);
+      if (ftp_connection_in_error (conn))
+        {
+          ftp_connection_pop_job (conn);
+          return;
+        }
+      offset += size;
+    }
+
+  if (offset < 0)
+    {
+      g_set_error_literal (&conn->error,
+			   G_IO_ERROR,
+			   G_IO_ERROR_INVALID_ARGUMENT,
+			   _("Invalid argument"));
+      ftp_connection_pop_job (conn);
+      return;
+    }
+
+  ftp_connection_retrieve (conn, read_handle->file, offset);
+  if (ftp_connection_in_error (conn))
+    ftp_connection_close_data_connection (conn);
+  else
+    {
+      read_handle->offset = offset;
+      g_vfs_job_seek_read_set_offset (job, offset);
+    }
+  ftp_connection_pop_job (conn);
+}
+
+typedef struct {
+  const FtpFile *	file;
+  int			fd;
+  goffset		size;		/* expected size or -1 if unknown */
+  GFileProgressCallback	progress_callback;
+  gpointer		progress_callback_data;
+
+  /* shared by all segments */
+  GMutex *		mutex;
+  goffset		transferred;
+  gboolean		failed;		/* a segment failed, stop the others */
+} FtpPull;
+
+typedef struct {
+  FtpPull *		pull;
+  FtpConnection *	conn;
+  goffset		offset;		/* next byte to retrieve */
+  goffset		end;		/* end of the range or -1 for the whole file */
+} FtpPullSegment;
+
+static gboolean
+pull_write_all (int fd, const char *buffer, gsize count, goffset offset, GError **error)
+{
+  gssize res;
+  int errsv;
+
+  while (count > 0)
+    {
+      res = pwrite (fd, buffer, count, offset);
+      if (res == -1)
+        {
+          errsv = errno;
+          if (errsv == EINTR)
+            continue;
+          g_set_error_literal (error, G_IO_ERROR,
+                               g_io_error_from_errno (errsv),
+                               g_strerror (errsv));
+          return FALSE;
+        }
+      buffer += res;
+      count -= res;
+      offset += res;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+pull_add_progress (FtpPull *pull, gsize n_bytes)
+{
+  gboolean failed;
+
+  g_mutex_lock (pull->mutex);
+  pull->transferred += n_bytes;
+  if (pull->progress_callback)
+    pull->progress_callback (pull->transferred,
+                             MAX (pull->size, pull->transferred),
+                             pull->progress_callback_data);
+  failed = pull->failed;
+  g_mutex_unlock (pull->mutex);
+
+  return !failed;
+}
+
+/**
+ * ftp_connection_pull:
+ * @segment: the range of the file to pull
+ *
+ * Retrieves the range described by @segment into the local file. When the
+ * data connection breaks before all data was received, the transfer is
+ * resumed at the last offset that was written, until it doesn't make
+ * progress for %PULL_MAX_RETRIES tries.
+ **/
+static void
+ftp_connection_pull (FtpPullSegment *segment)
+{
+  FtpPull *pull = segment->pull;
+  FtpConnection *conn = segment->conn;
+  SoupSocketIOStatus status;
+  char *buffer;
+  gsize n_bytes, n_request;
+  guint retries = 0;
+  guint response;
+  gboolean progress;
+
+  buffer = g_malloc (PULL_BUFFER_SIZE);
+
+  while (!ftp_connection_in_error (conn))
+    {
+      ftp_connection_retrieve (conn, pull->file, segment->offset);
+      if (ftp_connection_in_error (conn))
+        break;
+
+      progress = FALSE;
+      do
+        {
+          n_request = PULL_BUFFER_SIZE;
+          if (segment->end >= 0)
+            n_request = MIN (n_request, segment->end - segment->offset);
+
+          n_bytes = 0;
+          status = soup_socket_read (conn->data,
+                                     buffer,
+                                     n_request,
+                                     &n_bytes,
+                                     conn->job->cancellable,
+                                     &conn->error);
+          if (n_bytes > 0)
+            {
+              if (!pull_write_all (pull->fd, buffer, n_bytes, segment->offset, &conn->error))
+                {
+                  /* local errors can't be fixed by resuming */
+                  ftp_connection_abort_data_connection (conn);
+                  goto out;
+                }
+              segment->offset += n_bytes;
+              progress = TRUE;
+              if (!pull_add_progress (pull, n_bytes))
+                {
+                  /* another segment failed, its error gets reported */
+                  ftp_connection_abort_data_connection (conn);
+                  goto out;
+                }
+            }
+        }
+      while (status == SOUP_SOCKET_OK && segment->offset != segment->end);
+
+      if (segment->offset == segment->end)
+        {
+          /* got our range, the server will complain about the rest */
+          ftp_connection_abort_data_connection (conn);
+          ftp_connection_clear_error (conn);
+          break;
+        }
+      else if (status == SOUP_SOCKET_EOF && !ftp_connection_in_error (conn))
+        {
+          ftp_connection_close_data_connection (conn);
+          /* a broken data connection may look like a regular EOF, 
+           * the server knows better */
+          response = ftp_connection_receive (conn, RESPONSE_PASS_400);
+          if (STATUS_GROUP (response) == 2)
+            {
+              /* the file got shorter since its size was queried */
+              if (segment->end >= 0)
+                g_set_error_literal (&conn->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                     _("File changed during the transfer"));
+              break;
+            }
+        }
+      else
+        {
+          ftp_connection_clear_error (conn);
+          ftp_connection_abort_data_connection (conn);
+          if (conn->broken)
+            {
+              g_set_error_literal (&conn->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                   _("Invalid reply"));
+              break;
+            }
+        }
+
+      if (g_cancellable_is_cancelled (conn->job->cancellable))
+        {
+          ftp_connection_clear_error (conn);
+          g_cancellable_set_error_if_cancelled (conn->job->cancellable, &conn->error);
+          break;
+        }
+
+      if (progress)
+        retries = 0;
+      else if (++retries >= PULL_MAX_RETRIES)
+        {
+          if (!ftp_connection_in_error (conn))
+            g_set_error_literal (&conn->error, G_IO_ERROR, G_IO_ERROR_CLOSED,
+                                 _("Data connection closed"));
+          break;
+        }
+
+      DEBUG ("data connection broke, resuming at %" G_GINT64_FORMAT "\n", (gint64) segment->offset);
+      ftp_connection_clear_error (conn);
+    }
+
+out:
+  if (ftp_connection_in_error (conn))
+    {
+      g_mutex_lock (pull->mutex);
+      pull->failed = TRUE;
+      g_mutex_unlock (pull->mutex);
+    }
+
+  g_free (buffer);
+}
+
+static gpointer
+pull_segment_thread (gpointer data)
+{
+  ftp_connection_pull (data);
+  return NULL;
+}
+
 static void
 do_start_write (GVfsBackendFtp *ftp,
 		FtpConnection *conn,
@@ -1809,8 +2817,12 @@ static void
 gvfs_backend_ftp_purge_cache_directory (GVfsBackendFtp *ftp,
 					const FtpFile * dir)
 {
+  FtpDirCacheEntry *entry;
+
   g_static_rw_lock_writer_lock (&ftp->directory_cache_lock);
-  g_hash_table_remove (ftp->directory_cache, dir);
+  entry = g_hash_table_lookup (ftp->directory_cache, dir);
+  if (entry)
+    directory_cache_remove (ftp, entry);
   g_static_rw_lock_writer_unlock (&ftp->directory_cache_lock);
 }
 
@@ -1833,10 +2845,6 @@ gvfs_backend_ftp_purge_cache_of_file (GVfsBackendFtp *ftp,
   g_free (dirname);
 }
 
-/* forward declaration */
-static GFileInfo *
-create_file_info (GVfsBackendFtp *ftp, FtpConnection *conn, const char *filename, char **symlink);
-
 static void
 do_create (GVfsBackend *backend,
 	   GVfsJobOpenForWrite *job,
@@ -2001,7 +3009,7 @@ do_enumerate_directory (FtpConnection *conn)
 				       1,
 				       &n_bytes,
 				       &got_boundary,
-				       conn->job->cancellable,
+				       ftp_connection_get_cancellable (conn),
 				       &conn->error);
 
       bytes_read += n_bytes;
@@ -2068,18 +3076,19 @@ enumerate_directory (GVfsBackendFtp *ftp,
 		     const FtpFile * dir,
 		     gboolean	     use_cache)
 {
+  FtpDirCacheEntry *entry;
   GList *files;
 
   g_static_rw_lock_reader_lock (&ftp->directory_cache_lock);
   do {
     if (use_cache)
-      files = g_hash_table_lookup (ftp->directory_cache, dir);
+      entry = directory_cache_lookup (ftp, dir);
     else
       {
 	use_cache = TRUE;
-	files = NULL;
+	entry = NULL;
       }
-    if (files == NULL)
+    if (entry == NULL)
       {
 	g_static_rw_lock_reader_unlock (&ftp->directory_cache_lock);
 	ftp->dir_ops->init_data (conn, dir);
@@ -2089,14 +3098,62 @@ enumerate_directory (GVfsBackendFtp *ftp,
 	    return NULL;
 	  }
 	g_static_rw_lock_writer_lock (&ftp->directory_cache_lock);
-	g_hash_table_insert (ftp->directory_cache, g_strdup ((const char *) dir), files);
+	directory_cache_insert (ftp, dir, files);
 	g_static_rw_lock_writer_unlock (&ftp->directory_cache_lock);
-	files = NULL;
 	g_static_rw_lock_reader_lock (&ftp->directory_cache_lock);
+	/* may have been purged in the meantime, then we try again */
+	entry = g_hash_table_lookup (ftp->directory_cache, dir);
       }
-  } while (files == NULL);
+  } while (entry == NULL);
 
-  return files;
+  return entry->files;
+}
+
+/* Gets the file info with a single MLST command instead of listing the
+ * parent directory. Returns %NULL without an error set if the file doesn't
+ * exist. */
+static GFileInfo *
+create_file_info_mlst (FtpConnection *conn, const char *filename, char **symlink)
+{
+  GFileInfo *info = NULL;
+  FtpFile *file;
+  guint response;
+  char *line, *end, *space;
+
+  file = ftp_filename_from_gvfs_path (conn, filename);
+  response = ftp_connection_send (conn, RESPONSE_PASS_500, "MLST %s", file);
+  g_free (file);
+
+  if (response == 550)
+    return NULL;
+  if (STATUS_GROUP (response) != 2)
+    {
+      if (!ftp_connection_in_error (conn))
+        ftp_connection_set_error_from_response (conn, response);
+      return NULL;
+    }
+
+  /* The facts are on the line that starts with a space */
+  for (line = strchr (conn->read_buffer, '\n'); line; line = strchr (line, '\n'))
+    {
+      line++;
+      if (line[0] != ' ')
+        continue;
+      
+      end = strpbrk (line, "\r\n");
+      if (end)
+        *end = 0;
+      space = strchr (line + 1, ' ');
+      if (space)
+        *space = 0;
+      info = mlsd_create_file_info (conn, line + 1, filename, symlink);
+      break;
+    }
+
+  if (info == NULL)
+    g_set_error_literal (&conn->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+			 _("Invalid reply"));
+  return info;
 }
 
 /* NB: This gets a file info for the given object, no matter if it's a dir 
@@ -2109,6 +3166,7 @@ create_file_info (GVfsBackendFtp *ftp, FtpConnection *conn, const char *filename
   FtpFile *dir, *file;
   GFileInfo *info;
   gpointer iter;
+  gboolean cached;
 
   if (symlink)
     *symlink = NULL;
@@ -2120,6 +3178,20 @@ create_file_info (GVfsBackendFtp *ftp, FtpConnection *conn, const char *filename
   dir = ftp_filename_from_gvfs_path (conn, dirname);
   g_free (dirname);
 
+  /* Use the listing if we have it, ask for the single file otherwise */
+  if (conn->features & FTP_FEATURE_MLST)
+    {
+      g_static_rw_lock_reader_lock (&ftp->directory_cache_lock);
+      cached = ftp->directory_cache_ttl > 0 &&
+               g_hash_table_lookup (ftp->directory_cache, dir) != NULL;
+      g_static_rw_lock_reader_unlock (&ftp->directory_cache_lock);
+      if (!cached)
+        {
+          g_free (dir);
+          return create_file_info_mlst (conn, filename, symlink);
+        }
+    }
+
   files = enumerate_directory (ftp, conn, dir, TRUE);
   if (files == NULL)
     {
@@ -2256,6 +3328,9 @@ do_query_info (GVfsBackend *backend,
     {
       g_file_info_copy_into (real, info);
       g_object_unref (real);
+      /* for debugging the directory cache */
+      if (g_file_attribute_matcher_enumerate_namespace (matcher, "ftp"))
+        directory_cache_add_stats (ftp, info);
     }
   else if (!ftp_connection_in_error (conn))
     g_set_error_literal (&conn->error,
@@ -2545,6 +3620,218 @@ out:
   g_vfs_backend_ftp_push_connection (ftp, conn);
 }
 
+static void
+do_pull (GVfsBackend *         backend,
+	 GVfsJobPull *         job,
+	 const char *          source,
+	 const char *          local_path,
+	 GFileCopyFlags        flags,
+	 gboolean              remove_source,
+	 GFileProgressCallback progress_callback,
+	 gpointer              progress_callback_data)
+{
+  GVfsBackendFtp *ftp = G_VFS_BACKEND_FTP (backend);
+  FtpConnection *conn;
+  FtpFile *file;
+  GFileInfo *info;
+  char *symlink;
+  goffset size;
+  int fd, errsv;
+  FtpPull pull;
+  FtpPullSegment segments[PULL_MAX_SEGMENTS];
+  GThread *threads[PULL_MAX_SEGMENTS] = { NULL, };
+  guint i, j, n_segments;
+
+  if (flags & G_FILE_COPY_BACKUP)
+    {
+      /* Let the generic code handle backups */
+      g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        _("Operation not supported by backend"));
+      return;
+    }
+
+  if (g_file_test (local_path, G_FILE_TEST_IS_DIR))
+    {
+      if (flags & G_FILE_COPY_OVERWRITE)
+        g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_IS_DIRECTORY,
+                          _("Can't copy file over directory"));
+      else
+        g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_EXISTS,
+                          _("Target file exists"));
+      return;
+    }
+
+  conn = g_vfs_backend_ftp_pop_connection (ftp, G_VFS_JOB (job));
+  if (conn == NULL)
+    return;
+
+  if (flags & G_FILE_COPY_NOFOLLOW_SYMLINKS)
+    info = create_file_info (ftp, conn, source, NULL);
+  else
+    {
+      info = create_file_info (ftp, conn, source, &symlink);
+      if (symlink)
+	{
+	  info = resolve_symlink (ftp, conn, info, symlink);
+	  g_free (symlink);
+	}
+    }
+
+  if (info == NULL)
+    {
+      if (!ftp_connection_in_error (conn))
+	g_set_error_literal (&conn->error,
+			     G_IO_ERROR,
+			     G_IO_ERROR_NOT_FOUND,
+			     _("File doesn't exist"));
+      g_vfs_backend_ftp_push_connection (ftp, conn);
+      return;
+    }
+
+  switch (g_file_info_get_file_type (info))
+    {
+    case G_FILE_TYPE_DIRECTORY:
+      g_set_error_literal (&conn->error, G_IO_ERROR, G_IO_ERROR_WOULD_RECURSE,
+                           _("Can't recursively copy directory"));
+      break;
+    case G_FILE_TYPE_SYMBOLIC_LINK:
+      /* Let the generic code handle this */
+      g_set_error_literal (&conn->error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                           _("Operation not supported by backend"));
+      break;
+    default:
+      break;
+    }
+  size = g_file_info_get_size (info);
+  g_object_unref (info);
+  if (ftp_connection_in_error (conn))
+    {
+      g_vfs_backend_ftp_push_connection (ftp, conn);
+      return;
+    }
+
+  fd = g_open (local_path,
+               O_WRONLY | O_CREAT | ((flags & G_FILE_COPY_OVERWRITE) ? O_TRUNC : O_EXCL),
+               0666);
+  if (fd == -1)
+    {
+      errsv = errno;
+      g_set_error_literal (&conn->error, G_IO_ERROR,
+                           g_io_error_from_errno (errsv),
+                           g_strerror (errsv));
+      g_vfs_backend_ftp_push_connection (ftp, conn);
+      return;
+    }
+
+  file = ftp_filename_from_gvfs_path (conn, source);
+  pull.file = file;
+  pull.fd = fd;
+  pull.size = size;
+  pull.progress_callback = progress_callback;
+  pull.progress_callback_data = progress_callback_data;
+  pull.mutex = g_mutex_new ();
+  pull.transferred = 0;
+  pull.failed = FALSE;
+
+  segments[0].pull = &pull;
+  segments[0].conn = conn;
+  segments[0].offset = 0;
+  segments[0].end = -1;
+  n_segments = 1;
+
+  /* Big files are split into ranges that are retrieved in parallel, 
+   * each on its own connection. This needs REST. */
+  if (size >= PULL_SEGMENTED_MIN_SIZE &&
+      ftp_connection_send (conn, RESPONSE_PASS_300 | RESPONSE_PASS_500, "REST 0") == 350)
+    {
+      while (n_segments < PULL_MAX_SEGMENTS)
+        {
+          segments[n_segments].conn = g_vfs_backend_ftp_try_pop_connection (ftp, G_VFS_JOB (job));
+          if (segments[n_segments].conn == NULL)
+            break;
+          segments[n_segments].pull = &pull;
+          n_segments++;
+        }
+    }
+  ftp_connection_clear_error (conn);
+
+  if (n_segments > 1)
+    {
+      DEBUG ("pulling %s in %u segments\n", source, n_segments);
+      /* allocate the file, so the segments can write anywhere */
+      if (ftruncate (fd, size) == -1)
+        {
+          errsv = errno;
+          g_set_error_literal (&conn->error, G_IO_ERROR,
+                               g_io_error_from_errno (errsv),
+                               g_strerror (errsv));
+        }
+      /* The first connection, which is used for more commands later,
+       * gets the tail. It runs until EOF, so it needs no ABOR. */
+      for (i = 0; i < n_segments; i++)
+        {
+          j = (i + n_segments - 1) % n_segments;
+          segments[i].offset = size / n_segments * j;
+          segments[i].end = j + 1 < n_segments ? size / n_segments * (j + 1) : -1;
+        }
+      for (i = 1; i < n_segments && !ftp_connection_in_error (conn); i++)
+        threads[i] = g_thread_create (pull_segment_thread, &segments[i], TRUE, &conn->error);
+      if (!ftp_connection_in_error (conn))
+        ftp_connection_pull (&segments[0]);
+      else
+        pull.failed = TRUE;
+
+      for (i = 1; i < n_segments; i++)
+        {
+          if (threads[i])
+            g_thread_join (threads[i]);
+          else
+            pull.failed = TRUE;
+          /* the first error is the one that made the others stop */
+          /* whatever failed may have left the replies out of sync */
+          if (ftp_connection_in_error (segments[i].conn))
+            segments[i].conn->broken = TRUE;
+          if (segments[i].conn->error && !ftp_connection_in_error (conn) && pull.failed)
+            {
+              conn->error = segments[i].conn->error;
+              segments[i].conn->error = NULL;
+            }
+          ftp_connection_clear_error (segments[i].conn);
+          /* Don't call ftp_connection_pop_job () here, the job isn't done yet */
+          segments[i].conn->job = NULL;
+          g_vfs_backend_ftp_push_connection (ftp, segments[i].conn);
+        }
+
+      /* the tail ended early, the zeroes from ftruncate() are left */
+      if (!ftp_connection_in_error (conn) && segments[0].offset < size)
+        g_set_error_literal (&conn->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             _("File changed during the transfer"));
+    }
+  else
+    ftp_connection_pull (&segments[0]);
+
+  g_mutex_free (pull.mutex);
+
+  if (close (fd) == -1 && !ftp_connection_in_error (conn))
+    {
+      errsv = errno;
+      g_set_error_literal (&conn->error, G_IO_ERROR,
+                           g_io_error_from_errno (errsv),
+                           g_strerror (errsv));
+    }
+
+  if (ftp_connection_in_error (conn))
+    g_unlink (local_path);
+  else if (remove_source)
+    {
+      ftp_connection_send (conn, 0, "DELE %s", file);
+      gvfs_backend_ftp_purge_cache_of_file (ftp, conn, file);
+    }
+
+  g_free (file);
+  g_vfs_backend_ftp_push_connection (ftp, conn);
+}
+
 static void
 g_vfs_backend_ftp_class_init (GVfsBackendFtpClass *klass)
 {
@@ -2559,6 +3846,7 @@ g_vfs_backend_ftp_class_init (GVfsBackendFtpClass *klass)
   backend_class->open_for_read = do_open_for_read;
   backend_class->close_read = do_close_read;
   backend_class->read = do_read;
+  backend_class->seek_on_read = do_seek_on_read;
   backend_class->create = do_create;
   backend_class->append_to = do_append;
   backend_class->replace = do_replace;
@@ -2570,4 +3858,5 @@ g_vfs_backend_ftp_class_init (GVfsBackendFtpClass *klass)
   backend_class->delete = do_delete;
   backend_class->make_directory = do_make_directory;
   backend_class->move = do_move;
+  backend_class->pull = do_pull;
 }
@@ -446,17 +446,13 @@ try_read (GVfsBackend        *backend,
   return TRUE;
 }
 
-static gboolean
-try_seek_on_read (GVfsBackend *backend,
-                  GVfsJobSeekRead *job,
-                  GVfsBackendHandle handle,
-                  goffset    offset,
-                  GSeekType  type)
+static void
+seek_on_read (GVfsJobSeekRead *job,
+              GInputStream    *stream,
+              goffset          offset,
+              GSeekType        type)
 {
-  GInputStream    *stream;
-  GError          *error = NULL;
-
-  stream = G_INPUT_STREAM (handle);
+  GError *error = NULL;
 
   if (!g_seekable_seek (G_SEEKABLE (stream), offset, type,
                         G_VFS_JOB (job)->cancellable, &error))
@@ -466,13 +462,57 @@ try_seek_on_read (GVfsBackend *backend,
                                 error->code,
                                 error->message);
       g_error_free (error);
-      return FALSE;
     }
   else
     {
       g_vfs_job_seek_read_set_offset (job, g_seekable_tell (G_SEEKABLE (stream)));
       g_vfs_job_succeeded (G_VFS_JOB (job));
     }
+}
+
+static void
+probe_length_ready (GObject      *source_object,
+                    GAsyncResult *result,
+                    gpointer      user_data)
+{
+  GInputStream    *stream;
+  GVfsJobSeekRead *job;
+  GError          *error;
+
+  stream = G_INPUT_STREAM (source_object);
+  job = G_VFS_JOB_SEEK_READ (user_data);
+  error = NULL;
+
+  if (!soup_input_stream_probe_length_finish (stream, result, &error))
+    {
+      g_vfs_job_failed_literal (G_VFS_JOB (job),
+                                error->domain,
+                                error->code,
+                                error->message);
+      g_error_free (error);
+      return;
+    }
+
+  seek_on_read (job, stream, job->requested_offset, job->seek_type);
+}
+
+static gboolean
+try_seek_on_read (GVfsBackend *backend,
+                  GVfsJobSeekRead *job,
+                  GVfsBackendHandle handle,
+                  goffset    offset,
+                  GSeekType  type)
+{
+  GInputStream    *stream;
+
+  stream = G_INPUT_STREAM (handle);
+
+  /* Seeking from the end needs the size of the file, which may take a
+   * HEAD request; never wait for that on the main loop. */
+  if (type == G_SEEK_END)
+    soup_input_stream_probe_length_async (stream, probe_length_ready, job);
+  else
+    seek_on_read (job, stream, offset, type);
 
   return TRUE;
 }
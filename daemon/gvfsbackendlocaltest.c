@@ -184,6 +184,11 @@ g_vfs_backend_localtest_init (GVfsBackendLocalTest *backend)
 	/*  Nothing in there */
 	g_print ("(II) g_vfs_backend_localtest_init \n");
 
+	/*  only forwards to the thread-safe local GFile */
+	g_vfs_backend_set_parallel_job_types (G_VFS_BACKEND (backend),
+					      G_VFS_TYPE_JOB,
+					      G_TYPE_INVALID);
+
 	/*  env var conversion */
 	backend->errorneous = -1;
 	backend->inject_op_types = -1;
@@ -55,6 +55,9 @@
 #include "gvfsjobqueryinforead.h"
 #include "gvfsjobqueryinfowrite.h"
 #include "gvfsjobmove.h"
+#include "gvfsjobcopy.h"
+#include "gvfsjobpush.h"
+#include "gvfsjobpull.h"
 #include "gvfsjobdelete.h"
 #include "gvfsjobqueryfsinfo.h"
 #include "gvfsjobqueryattributes.h"
@@ -74,6 +77,14 @@
 #define USE_PTY 1
 #endif
 
+/* Sequential reads keep this many READ requests of this size in flight */
+#define READ_AHEAD_CHUNK_SIZE (32*1024)
+#define READ_AHEAD_MAX_CHUNKS 16
+
+/* Writes are reported as done before the server replies, as long
+ * as there are less than this many WRITE requests in flight */
+#define WRITE_BEHIND_MAX_REQUESTS 16
+
 static GQuark id_q;
 
 typedef enum {
@@ -121,14 +132,45 @@ typedef struct {
   gsize size;
 } DataBuffer;
 
-typedef struct {
+typedef struct _SftpHandle SftpHandle;
+
+typedef void (*SftpHandleDrainedFunc) (GVfsBackendSftp *backend,
+                                       GVfsJob *job,
+                                       SftpHandle *handle);
+
+struct _SftpHandle {
   DataBuffer *raw_handle;
   goffset offset;
   char *filename;
   char *tempname;
   guint32 permissions;
   gboolean make_backup;
-} SftpHandle;
+
+  /* Read pipeline, see try_read() */
+  GQueue read_chunks;
+  goffset read_ahead_offset;
+  gboolean read_ahead_eof;
+  guint n_sequential_reads;
+  GVfsJobRead *pending_read;
+
+  /* Write behind, see try_write() */
+  guint n_outstanding_writes;
+  GError *write_error;
+  GVfsJobWrite *pending_write;
+  GVfsJob *drain_job;
+  SftpHandleDrainedFunc drain_func;
+};
+
+typedef struct {
+  SftpHandle *handle; /* NULL if dropped while the request was in flight */
+  goffset offset;
+  gboolean done;
+  gboolean eof;
+  GError *error;
+  guchar *data;
+  gsize size;
+  gsize pos;
+} ReadAheadChunk;
 
 
 typedef struct {
@@ -152,6 +194,7 @@ struct _GVfsBackendSftp
   guint32 my_gid;
   
   int protocol_version;
+  gboolean has_copy_data;
   
   GOutputStream *command_stream;
   GInputStream *reply_stream;
@@ -1510,7 +1553,8 @@ do_mount (GVfsBackend *backend,
       extension_data = read_string (reply, NULL);
       if (extension_data)
         {
-          /* TODO: Do something with this */
+          if (strcmp (extension_name, "copy-data") == 0)
+            op_backend->has_copy_data = TRUE;
         }
       g_free (extension_name);
       g_free (extension_data);
@@ -1947,9 +1991,38 @@ sftp_handle_new (GDataInputStream *reply)
   return handle;
 }
 
+static void
+read_ahead_chunk_free (ReadAheadChunk *chunk)
+{
+  if (chunk->error)
+    g_error_free (chunk->error);
+  g_free (chunk->data);
+  g_slice_free (ReadAheadChunk, chunk);
+}
+
+static void
+sftp_handle_drop_read_ahead (SftpHandle *handle)
+{
+  ReadAheadChunk *chunk;
+
+  while ((chunk = g_queue_pop_head (&handle->read_chunks)) != NULL)
+    {
+      if (chunk->done)
+        read_ahead_chunk_free (chunk);
+      else
+        chunk->handle = NULL; /* Freed when the reply arrives */
+    }
+
+  handle->read_ahead_eof = FALSE;
+  handle->n_sequential_reads = 0;
+}
+
 static void
 sftp_handle_free (SftpHandle *handle)
 {
+  sftp_handle_drop_read_ahead (handle);
+  if (handle->write_error)
+    g_error_free (handle->write_error);
   data_buffer_free (handle->raw_handle);
   g_free (handle->filename);
   g_free (handle->tempname);
@@ -2148,6 +2221,150 @@ read_reply (GVfsBackendSftp *backend,
   g_vfs_job_succeeded (job);
 }
 
+static void read_ahead_reply (GVfsBackendSftp *backend,
+                              int reply_type,
+                              GDataInputStream *reply,
+                              guint32 len,
+                              GVfsJob *job,
+                              gpointer user_data);
+
+static void
+read_ahead_fill (GVfsBackendSftp *backend,
+                 SftpHandle *handle,
+                 GVfsJob *job)
+{
+  GDataOutputStream *command;
+  ReadAheadChunk *chunk;
+
+  while (!handle->read_ahead_eof &&
+         g_queue_get_length (&handle->read_chunks) < READ_AHEAD_MAX_CHUNKS)
+    {
+      chunk = g_slice_new0 (ReadAheadChunk);
+      chunk->handle = handle;
+      chunk->offset = handle->read_ahead_offset;
+      handle->read_ahead_offset += READ_AHEAD_CHUNK_SIZE;
+      g_queue_push_tail (&handle->read_chunks, chunk);
+
+      command = new_command_stream (backend,
+                                    SSH_FXP_READ);
+      put_data_buffer (command, handle->raw_handle);
+      g_data_output_stream_put_uint64 (command, chunk->offset, NULL, NULL);
+      g_data_output_stream_put_uint32 (command, READ_AHEAD_CHUNK_SIZE, NULL, NULL);
+
+      queue_command_stream_and_free (backend, command, read_ahead_reply, job, chunk);
+    }
+}
+
+/* Completes job from the finished chunks at the head of the pipeline */
+static void
+read_ahead_serve (GVfsBackendSftp *backend,
+                  SftpHandle *handle,
+                  GVfsJobRead *job)
+{
+  ReadAheadChunk *chunk;
+  gsize count, n;
+
+  count = 0;
+  while (count < job->bytes_requested &&
+         (chunk = g_queue_peek_head (&handle->read_chunks)) != NULL &&
+         chunk->done &&
+         chunk->offset + chunk->pos == handle->offset + count)
+    {
+      if (chunk->error != NULL || chunk->eof)
+        {
+          /* Return what we have first, the error/eof on the next read */
+          if (count > 0)
+            break;
+
+          if (chunk->error != NULL)
+            {
+              g_vfs_job_failed_from_error (G_VFS_JOB (job), chunk->error);
+              sftp_handle_drop_read_ahead (handle);
+              return;
+            }
+
+          /* Leave the eof chunk so that further reads get eof too */
+          break;
+        }
+
+      n = MIN (chunk->size - chunk->pos, job->bytes_requested - count);
+      memcpy (job->buffer + count, chunk->data + chunk->pos, n);
+      chunk->pos += n;
+      count += n;
+
+      if (chunk->pos == chunk->size)
+        read_ahead_chunk_free (g_queue_pop_head (&handle->read_chunks));
+    }
+
+  handle->offset += count;
+  
+  read_ahead_fill (backend, handle, G_VFS_JOB (job));
+  
+  g_vfs_job_read_set_size (job, count);
+  g_vfs_job_succeeded (G_VFS_JOB (job));
+}
+
+static void
+read_ahead_reply (GVfsBackendSftp *backend,
+                  int reply_type,
+                  GDataInputStream *reply,
+                  guint32 len,
+                  GVfsJob *job,
+                  gpointer user_data)
+{
+  ReadAheadChunk *chunk;
+  SftpHandle *handle;
+  GVfsJobRead *pending;
+  guint32 count;
+
+  chunk = user_data;
+  chunk->done = TRUE;
+  
+  handle = chunk->handle;
+  if (handle == NULL)
+    {
+      read_ahead_chunk_free (chunk);
+      return;
+    }
+
+  if (reply_type == SSH_FXP_STATUS)
+    {
+      if (error_from_status (job, reply, -1, SSH_FX_EOF, &chunk->error))
+        chunk->eof = TRUE;
+      handle->read_ahead_eof = TRUE;
+    }
+  else if (reply_type == SSH_FXP_DATA)
+    {
+      count = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+      chunk->data = g_malloc (count);
+      if (g_input_stream_read_all (G_INPUT_STREAM (reply),
+                                   chunk->data, count,
+                                   NULL, NULL, NULL))
+        chunk->size = count;
+      else
+        chunk->error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                            _("Invalid reply received"));
+    }
+  else
+    chunk->error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                        _("Invalid reply received"));
+
+  if (chunk->error != NULL)
+    handle->read_ahead_eof = TRUE;
+
+  if (handle->pending_read != NULL &&
+      g_queue_peek_head (&handle->read_chunks) == chunk)
+    {
+      pending = handle->pending_read;
+      handle->pending_read = NULL;
+      read_ahead_serve (backend, handle, pending);
+    }
+}
+
+/* The first read after open or seek is sent as is. If the next read
+ * continues where it left off we start keeping a window of READ requests
+ * at increasing offsets in flight, and serve the reads from their replies.
+ */
 static gboolean
 try_read (GVfsBackend *backend,
           GVfsJobRead *job,
@@ -2158,14 +2375,40 @@ try_read (GVfsBackend *backend,
   SftpHandle *handle = _handle;
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
+  ReadAheadChunk *head;
 
-  command = new_command_stream (op_backend,
-                                SSH_FXP_READ);
-  put_data_buffer (command, handle->raw_handle);
-  g_data_output_stream_put_uint64 (command, handle->offset, NULL, NULL);
-  g_data_output_stream_put_uint32 (command, bytes_requested, NULL, NULL);
+  if (handle->n_sequential_reads++ == 0)
+    {
+      command = new_command_stream (op_backend,
+                                    SSH_FXP_READ);
+      put_data_buffer (command, handle->raw_handle);
+      g_data_output_stream_put_uint64 (command, handle->offset, NULL, NULL);
+      g_data_output_stream_put_uint32 (command, bytes_requested, NULL, NULL);
   
-  queue_command_stream_and_free (op_backend, command, read_reply, G_VFS_JOB (job), handle);
+      queue_command_stream_and_free (op_backend, command, read_reply, G_VFS_JOB (job), handle);
+
+      return TRUE;
+    }
+
+  head = g_queue_peek_head (&handle->read_chunks);
+  if (head != NULL && head->offset + head->pos != handle->offset)
+    {
+      /* The server returned a short read, restart the pipeline */
+      sftp_handle_drop_read_ahead (handle);
+      handle->n_sequential_reads = 1;
+      head = NULL;
+    }
+
+  if (head == NULL)
+    handle->read_ahead_offset = handle->offset;
+
+  read_ahead_fill (op_backend, handle, G_VFS_JOB (job));
+
+  head = g_queue_peek_head (&handle->read_chunks);
+  if (head == NULL || head->done)
+    read_ahead_serve (op_backend, handle, job);
+  else
+    handle->pending_read = job;
 
   return TRUE;
 }
@@ -2239,6 +2482,8 @@ try_seek_on_read (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
 
+  sftp_handle_drop_read_ahead (handle);
+
   command = new_command_stream (op_backend,
                                 SSH_FXP_FSTAT);
   put_data_buffer (command, handle->raw_handle);
@@ -2453,6 +2698,15 @@ close_write_reply (GVfsBackendSftp *backend,
     g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
 	                 _("Invalid reply received"));
 
+  /* A write that was already reported as done failed */
+  if (handle->write_error)
+    {
+      g_clear_error (&error);
+      error = handle->write_error;
+      handle->write_error = NULL;
+      res = FALSE;
+    }
+
   if (res)
     {
       if (handle->tempname)
@@ -2524,6 +2778,24 @@ close_write_fstat_reply (GVfsBackendSftp *backend,
   queue_command_stream_and_free (backend, command, close_write_reply, G_VFS_JOB (job), handle);
 }
 
+static void
+close_write_start (GVfsBackendSftp *backend,
+                   GVfsJob *job,
+                   SftpHandle *handle)
+{
+  GDataOutputStream *command;
+
+  command = new_command_stream (backend, SSH_FXP_FSTAT);
+  put_data_buffer (command, handle->raw_handle);
+
+  queue_command_stream_and_free (backend, command, close_write_fstat_reply, job, handle);
+}
+
+static void sftp_handle_when_drained (GVfsBackendSftp *backend,
+                                      SftpHandle *handle,
+                                      GVfsJob *job,
+                                      SftpHandleDrainedFunc func);
+
 static gboolean
 try_close_write (GVfsBackend *backend,
                  GVfsJobCloseWrite *job,
@@ -2531,12 +2803,8 @@ try_close_write (GVfsBackend *backend,
 {
   SftpHandle *handle = _handle;
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
 
-  command = new_command_stream (op_backend, SSH_FXP_FSTAT);
-  put_data_buffer (command, handle->raw_handle);
-
-  queue_command_stream_and_free (op_backend, command, close_write_fstat_reply, G_VFS_JOB (job), handle);
+  sftp_handle_when_drained (op_backend, handle, G_VFS_JOB (job), close_write_start);
 
   return TRUE;
 }
@@ -2571,6 +2839,8 @@ try_close_read (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
 
+  sftp_handle_drop_read_ahead (handle);
+
   command = new_command_stream (op_backend, SSH_FXP_CLOSE);
   put_data_buffer (command, handle->raw_handle);
 
@@ -3068,6 +3338,22 @@ try_replace (GVfsBackend *backend,
   return TRUE;
 }
 
+/* Calls func once all WRITE requests of the handle have been replied to */
+static void
+sftp_handle_when_drained (GVfsBackendSftp *backend,
+                          SftpHandle *handle,
+                          GVfsJob *job,
+                          SftpHandleDrainedFunc func)
+{
+  if (handle->n_outstanding_writes == 0)
+    func (backend, job, handle);
+  else
+    {
+      handle->drain_job = job;
+      handle->drain_func = func;
+    }
+}
+
 static void
 write_reply (GVfsBackendSftp *backend,
              int reply_type,
@@ -3077,21 +3363,55 @@ write_reply (GVfsBackendSftp *backend,
              gpointer user_data)
 {
   SftpHandle *handle;
+  GVfsJob *waiting_job;
+  GError *error;
   
   handle = user_data;
+  handle->n_outstanding_writes--;
 
+  /* job was already reported as done, so keep the error for
+   * the next operation on the handle */
+  error = NULL;
   if (reply_type == SSH_FXP_STATUS)
+    error_from_status (job, reply, -1, -1, &error);
+  else
+    g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         _("Invalid reply received"));
+
+  if (error)
+    {
+      if (handle->write_error == NULL)
+        handle->write_error = error;
+      else
+        g_error_free (error);
+    }
+
+  if (handle->pending_write)
     {
-      if (result_from_status (job, reply, -1, -1))
+      waiting_job = G_VFS_JOB (handle->pending_write);
+      handle->pending_write = NULL;
+      
+      if (handle->write_error)
         {
-          handle->offset += G_VFS_JOB_WRITE (job)->data_size;
+          g_vfs_job_failed_from_error (waiting_job, handle->write_error);
+          g_clear_error (&handle->write_error);
         }
+      else
+        g_vfs_job_succeeded (waiting_job);
+    }
+
+  if (handle->drain_job && handle->n_outstanding_writes == 0)
+    {
+      waiting_job = handle->drain_job;
+      handle->drain_job = NULL;
+      handle->drain_func (backend, waiting_job, handle);
     }
-  else
-    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
-                      _("Invalid reply received"));
 }
 
+/* Writes are reported as done as soon as the WRITE request is queued,
+ * keeping up to WRITE_BEHIND_MAX_REQUESTS in flight. If one of them
+ * fails the error is returned by the next write, or by close.
+ */
 static gboolean
 try_write (GVfsBackend *backend,
            GVfsJobWrite *job,
@@ -3103,6 +3423,13 @@ try_write (GVfsBackend *backend,
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
   GDataOutputStream *command;
 
+  if (handle->write_error)
+    {
+      g_vfs_job_failed_from_error (G_VFS_JOB (job), handle->write_error);
+      g_clear_error (&handle->write_error);
+      return TRUE;
+    }
+
   command = new_command_stream (op_backend,
                                 SSH_FXP_WRITE);
   put_data_buffer (command, handle->raw_handle);
@@ -3115,10 +3442,17 @@ try_write (GVfsBackend *backend,
                              NULL, NULL, NULL);
   
   queue_command_stream_and_free (op_backend, command, write_reply, G_VFS_JOB (job), handle);
+  handle->n_outstanding_writes++;
+  handle->offset += buffer_size;
 
   /* We always write the full size (on success) */
   g_vfs_job_write_set_written_size (job, buffer_size);
 
+  if (handle->n_outstanding_writes < WRITE_BEHIND_MAX_REQUESTS)
+    g_vfs_job_succeeded (G_VFS_JOB (job));
+  else
+    handle->pending_write = job;
+
   return TRUE;
 }
 
@@ -3180,6 +3514,27 @@ seek_write_fstat_reply (GVfsBackendSftp *backend,
   g_vfs_job_succeeded (job);
 }
 
+static void
+seek_on_write_start (GVfsBackendSftp *backend,
+                     GVfsJob *job,
+                     SftpHandle *handle)
+{
+  GDataOutputStream *command;
+
+  if (handle->write_error)
+    {
+      g_vfs_job_failed_from_error (job, handle->write_error);
+      g_clear_error (&handle->write_error);
+      return;
+    }
+
+  command = new_command_stream (backend,
+                                SSH_FXP_FSTAT);
+  put_data_buffer (command, handle->raw_handle);
+  
+  queue_command_stream_and_free (backend, command, seek_write_fstat_reply, job, handle);
+}
+
 static gboolean
 try_seek_on_write (GVfsBackend *backend,
                    GVfsJobSeekWrite *job,
@@ -3189,13 +3544,9 @@ try_seek_on_write (GVfsBackend *backend,
 {
   SftpHandle *handle = _handle;
   GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
-  GDataOutputStream *command;
 
-  command = new_command_stream (op_backend,
-                                SSH_FXP_FSTAT);
-  put_data_buffer (command, handle->raw_handle);
-  
-  queue_command_stream_and_free (op_backend, command, seek_write_fstat_reply, G_VFS_JOB (job), handle);
+  /* The file size must include all writes for G_SEEK_END */
+  sftp_handle_when_drained (op_backend, handle, G_VFS_JOB (job), seek_on_write_start);
 
   return TRUE;
 }
@@ -4165,6 +4516,1014 @@ setup_icon (GVfsBackendSftp *op_backend,
                                   NULL);
 }
 
+/* Push, pull and server side copy. The transfers keep up to
+ * TRANSFER_MAX_REQUESTS READ or WRITE requests in flight, like
+ * the read pipeline and write behind of the streams. */
+
+#define TRANSFER_CHUNK_SIZE (32*1024)
+#define TRANSFER_MAX_REQUESTS 16
+
+typedef struct {
+  GFileCopyFlags flags;
+  gboolean remove_source;
+  GFileProgressCallback progress_callback;
+  gpointer progress_callback_data;
+
+  char *remote_path;
+  char *local_path;
+  char *dest_path; /* Only for copy */
+  int fd;
+
+  DataBuffer *raw_handle;
+  DataBuffer *raw_dest_handle; /* Only for copy */
+  GFileInfo *info;
+
+  goffset size;
+  goffset offset;
+  goffset transferred;
+  guint n_outstanding;
+  gboolean eof;
+  GError *error;
+} TransferData;
+
+typedef struct {
+  TransferData *data;
+  goffset offset;
+  guint32 len;
+} TransferChunk;
+
+static TransferData *
+transfer_data_new (const char *remote_path,
+                   const char *local_path,
+                   GFileCopyFlags flags,
+                   gboolean remove_source,
+                   GFileProgressCallback progress_callback,
+                   gpointer progress_callback_data)
+{
+  TransferData *data;
+
+  data = g_slice_new0 (TransferData);
+  data->remote_path = g_strdup (remote_path);
+  data->local_path = g_strdup (local_path);
+  data->fd = -1;
+  data->flags = flags;
+  data->remove_source = remove_source;
+  data->progress_callback = progress_callback;
+  data->progress_callback_data = progress_callback_data;
+
+  return data;
+}
+
+static void
+transfer_data_free (TransferData *data)
+{
+  if (data->fd != -1)
+    close (data->fd);
+  data_buffer_free (data->raw_handle);
+  data_buffer_free (data->raw_dest_handle);
+  if (data->info)
+    g_object_unref (data->info);
+  if (data->error)
+    g_error_free (data->error);
+  g_free (data->remote_path);
+  g_free (data->local_path);
+  g_free (data->dest_path);
+  g_slice_free (TransferData, data);
+}
+
+static void
+transfer_set_error_from_errno (TransferData *data, int errsv)
+{
+  if (data->error == NULL)
+    data->error = g_error_new_literal (G_IO_ERROR,
+                                       g_io_error_from_errno (errsv),
+                                       g_strerror (errsv));
+}
+
+/* Returns FALSE and fails the job if the reply isn't a successful STATUS */
+static gboolean
+transfer_check_status (GVfsJob *job,
+                       int reply_type,
+                       GDataInputStream *reply)
+{
+  if (reply_type != SSH_FXP_STATUS)
+    {
+      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                        _("Invalid reply received"));
+      return FALSE;
+    }
+
+  return failure_from_status (job, reply, -1, -1);
+}
+
+/* Fails the job for a reply that should have been something else */
+static void
+transfer_fail_from_reply (GVfsJob *job,
+                          int reply_type,
+                          GDataInputStream *reply,
+                          int failure_error)
+{
+  if (reply_type != SSH_FXP_STATUS ||
+      failure_from_status (job, reply, failure_error, -1))
+    g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                      _("Invalid reply received"));
+}
+
+static GFileInfo *
+transfer_parse_attributes (GVfsBackendSftp *backend,
+                           GDataInputStream *reply)
+{
+  GFileAttributeMatcher *matcher;
+  GFileInfo *info;
+
+  matcher = g_file_attribute_matcher_new (G_FILE_ATTRIBUTE_STANDARD_TYPE ","
+                                          G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+                                          G_FILE_ATTRIBUTE_UNIX_MODE ","
+                                          "time::*");
+  info = g_file_info_new ();
+  parse_attributes (backend, info, NULL, reply, matcher);
+  g_file_attribute_matcher_unref (matcher);
+
+  return info;
+}
+
+static gboolean
+transfer_check_source_type (GVfsJob *job,
+                            GFileInfo *info)
+{
+  switch (g_file_info_get_file_type (info))
+    {
+    case G_FILE_TYPE_DIRECTORY:
+      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_WOULD_RECURSE,
+                        _("Can't recursively copy directory"));
+      return FALSE;
+    case G_FILE_TYPE_SYMBOLIC_LINK:
+    case G_FILE_TYPE_SPECIAL:
+      /* Let the generic code handle this */
+      g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        _("Operation not supported by backend"));
+      return FALSE;
+    default:
+      return TRUE;
+    }
+}
+
+/* Checks the reply to a stat of the destination, it either has to
+ * not exist or be a file we may overwrite. Fails the job and returns
+ * FALSE otherwise. */
+static gboolean
+transfer_check_dest_stat (GVfsBackendSftp *backend,
+                          int reply_type,
+                          GDataInputStream *reply,
+                          GVfsJob *job,
+                          TransferData *data)
+{
+  GFileInfo *info;
+  GError *error;
+
+  if (reply_type == SSH_FXP_ATTRS)
+    {
+      info = transfer_parse_attributes (backend, reply);
+      
+      if (!(data->flags & G_FILE_COPY_OVERWRITE))
+        g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                          _("Target file exists"));
+      else if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY)
+        g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_IS_DIRECTORY,
+                          _("Can't copy file over directory"));
+      g_object_unref (info);
+
+      return !g_vfs_job_is_finished (job);
+    }
+
+  /* Not existing is what we want */
+  error = NULL;
+  if (reply_type != SSH_FXP_STATUS ||
+      error_from_status (job, reply, -1, -1, &error) ||
+      !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    {
+      if (error)
+        {
+          g_vfs_job_failed_from_error (job, error);
+          g_error_free (error);
+        }
+      else
+        g_vfs_job_failed (job, G_IO_ERROR, G_IO_ERROR_FAILED,
+                          _("Invalid reply received"));
+      return FALSE;
+    }
+  g_error_free (error);
+
+  return TRUE;
+}
+
+static void
+transfer_progress (TransferData *data)
+{
+  if (data->progress_callback)
+    data->progress_callback (data->transferred,
+                             MAX (data->size, data->transferred),
+                             data->progress_callback_data);
+}
+
+/*** PULL ***/
+
+static void pull_fill (GVfsBackendSftp *backend,
+                       GVfsJob *job,
+                       TransferData *data);
+
+static void
+pull_remove_reply (GVfsBackendSftp *backend,
+                   int reply_type,
+                   GDataInputStream *reply,
+                   guint32 len,
+                   GVfsJob *job,
+                   gpointer user_data)
+{
+  TransferData *data = user_data;
+
+  if (transfer_check_status (job, reply_type, reply))
+    g_vfs_job_succeeded (job);
+
+  transfer_data_free (data);
+}
+
+static void
+pull_close_reply (GVfsBackendSftp *backend,
+                  int reply_type,
+                  GDataInputStream *reply,
+                  guint32 len,
+                  GVfsJob *job,
+                  gpointer user_data)
+{
+  TransferData *data = user_data;
+  GDataOutputStream *command;
+  struct timeval times[2];
+  int res;
+
+  res = close (data->fd);
+  data->fd = -1;
+  if (res == -1)
+    transfer_set_error_from_errno (data, errno);
+
+  if (data->error)
+    {
+      g_unlink (data->local_path);
+      g_vfs_job_failed_from_error (job, data->error);
+      transfer_data_free (data);
+      return;
+    }
+
+  if (g_file_info_has_attribute (data->info, G_FILE_ATTRIBUTE_UNIX_MODE))
+    g_chmod (data->local_path,
+             g_file_info_get_attribute_uint32 (data->info, G_FILE_ATTRIBUTE_UNIX_MODE) & 07777);
+
+  if ((data->flags & G_FILE_COPY_ALL_METADATA) &&
+      g_file_info_has_attribute (data->info, G_FILE_ATTRIBUTE_TIME_MODIFIED))
+    {
+      times[0].tv_sec = g_file_info_get_attribute_uint64 (data->info, G_FILE_ATTRIBUTE_TIME_ACCESS);
+      times[0].tv_usec = 0;
+      times[1].tv_sec = g_file_info_get_attribute_uint64 (data->info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+      times[1].tv_usec = 0;
+      utimes (data->local_path, times);
+    }
+
+  if (data->remove_source)
+    {
+      command = new_command_stream (backend, SSH_FXP_REMOVE);
+      put_string (command, data->remote_path);
+      queue_command_stream_and_free (backend, command, pull_remove_reply, job, data);
+      return;
+    }
+
+  g_vfs_job_succeeded (job);
+  transfer_data_free (data);
+}
+
+static void
+pull_read_reply (GVfsBackendSftp *backend,
+                 int reply_type,
+                 GDataInputStream *reply,
+                 guint32 len,
+                 GVfsJob *job,
+                 gpointer user_data)
+{
+  TransferChunk *chunk = user_data;
+  TransferData *data = chunk->data;
+  GDataOutputStream *command;
+  GError *error;
+  guint32 count;
+  gssize res;
+  char *buffer;
+
+  data->n_outstanding--;
+
+  if (reply_type == SSH_FXP_STATUS)
+    {
+      error = NULL;
+      if (error_from_status (job, reply, -1, SSH_FX_EOF, &error))
+        data->eof = TRUE;
+      else if (data->error == NULL)
+        data->error = error;
+      else
+        g_error_free (error);
+    }
+  else if (reply_type == SSH_FXP_DATA)
+    {
+      count = g_data_input_stream_read_uint32 (reply, NULL, NULL);
+      buffer = g_malloc (count);
+      if (!g_input_stream_read_all (G_INPUT_STREAM (reply),
+                                    buffer, count,
+                                    NULL, NULL, NULL))
+        {
+          if (data->error == NULL)
+            data->error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                               _("Invalid reply received"));
+        }
+      else if (count == 0)
+        data->eof = TRUE;
+      else if (data->error == NULL)
+        {
+          res = pwrite (data->fd, buffer, count, chunk->offset);
+          if (res != count)
+            transfer_set_error_from_errno (data, res == -1 ? errno : ENOSPC);
+          else
+            {
+              data->transferred += count;
+              transfer_progress (data);
+
+              /* Short read, ask for the rest */
+              if (count < chunk->len)
+                {
+                  chunk->offset += count;
+                  chunk->len -= count;
+
+                  command = new_command_stream (backend, SSH_FXP_READ);
+                  put_data_buffer (command, data->raw_handle);
+                  g_data_output_stream_put_uint64 (command, chunk->offset, NULL, NULL);
+                  g_data_output_stream_put_uint32 (command, chunk->len, NULL, NULL);
+                  queue_command_stream_and_free (backend, command, pull_read_reply, job, chunk);
+                  data->n_outstanding++;
+                  chunk = NULL;
+                }
+            }
+        }
+      g_free (buffer);
+    }
+  else if (data->error == NULL)
+    data->error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                       _("Invalid reply received"));
+
+  if (chunk)
+    g_slice_free (TransferChunk, chunk);
+
+  pull_fill (backend, job, data);
+}
+
+static void
+pull_fill (GVfsBackendSftp *backend,
+           GVfsJob *job,
+           TransferData *data)
+{
+  GDataOutputStream *command;
+  TransferChunk *chunk;
+
+  if (g_vfs_job_is_cancelled (job) && data->error == NULL)
+    data->error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                       _("Operation was cancelled"));
+
+  /* Past the size from the stat we look for EOF one request at a time */
+  while (!data->eof && data->error == NULL &&
+         data->n_outstanding < TRANSFER_MAX_REQUESTS &&
+         (data->offset < data->size || data->n_outstanding == 0))
+    {
+      chunk = g_slice_new (TransferChunk);
+      chunk->data = data;
+      chunk->offset = data->offset;
+      chunk->len = TRANSFER_CHUNK_SIZE;
+      data->offset += TRANSFER_CHUNK_SIZE;
+
+      command = new_command_stream (backend, SSH_FXP_READ);
+      put_data_buffer (command, data->raw_handle);
+      g_data_output_stream_put_uint64 (command, chunk->offset, NULL, NULL);
+      g_data_output_stream_put_uint32 (command, chunk->len, NULL, NULL);
+      queue_command_stream_and_free (backend, command, pull_read_reply, job, chunk);
+      data->n_outstanding++;
+    }
+
+  if (data->n_outstanding == 0)
+    {
+      command = new_command_stream (backend, SSH_FXP_CLOSE);
+      put_data_buffer (command, data->raw_handle);
+      queue_command_stream_and_free (backend, command, pull_close_reply, job, data);
+    }
+}
+
+static void
+pull_open_reply (GVfsBackendSftp *backend,
+                 int reply_type,
+                 GDataInputStream *reply,
+                 guint32 len,
+                 GVfsJob *job,
+                 gpointer user_data)
+{
+  TransferData *data = user_data;
+  GDataOutputStream *command;
+  int open_flags;
+  
+  if (reply_type != SSH_FXP_HANDLE)
+    {
+      transfer_fail_from_reply (job, reply_type, reply, -1);
+      transfer_data_free (data);
+      return;
+    }
+
+  data->raw_handle = read_data_buffer (reply);
+
+  /* Only touch the local file once we know we can read the source */
+  open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+  if (!(data->flags & G_FILE_COPY_OVERWRITE))
+    open_flags |= O_EXCL;
+  
+  data->fd = g_open (data->local_path, open_flags, 0666);
+  if (data->fd == -1)
+    {
+      g_vfs_job_failed_from_errno (job, errno);
+      
+      command = new_command_stream (backend, SSH_FXP_CLOSE);
+      put_data_buffer (command, data->raw_handle);
+      queue_command_stream_and_free (backend, command, NULL, job, NULL);
+      
+      transfer_data_free (data);
+      return;
+    }
+
+  pull_fill (backend, job, data);
+}
+
+static void
+pull_stat_reply (GVfsBackendSftp *backend,
+                 int reply_type,
+                 GDataInputStream *reply,
+                 guint32 len,
+                 GVfsJob *job,
+                 gpointer user_data)
+{
+  TransferData *data = user_data;
+  GDataOutputStream *command;
+
+  if (reply_type != SSH_FXP_ATTRS)
+    {
+      transfer_fail_from_reply (job, reply_type, reply, -1);
+      transfer_data_free (data);
+      return;
+    }
+
+  data->info = transfer_parse_attributes (backend, reply);
+  data->size = g_file_info_get_size (data->info);
+  if (!transfer_check_source_type (job, data->info))
+    {
+      transfer_data_free (data);
+      return;
+    }
+
+  command = new_command_stream (backend, SSH_FXP_OPEN);
+  put_string (command, data->remote_path);
+  g_data_output_stream_put_uint32 (command, SSH_FXF_READ, NULL, NULL); /* open flags */
+  g_data_output_stream_put_uint32 (command, 0, NULL, NULL); /* Attr flags */
+  queue_command_stream_and_free (backend, command, pull_open_reply, job, data);
+}
+
+static gboolean
+try_pull (GVfsBackend *backend,
+          GVfsJobPull *job,
+          const char *source,
+          const char *local_path,
+          GFileCopyFlags flags,
+          gboolean remove_source,
+          GFileProgressCallback progress_callback,
+          gpointer progress_callback_data)
+{
+  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  GDataOutputStream *command;
+  TransferData *data;
+
+  if (flags & G_FILE_COPY_BACKUP)
+    {
+      /* Let the generic code handle backups */
+      g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        _("Operation not supported by backend"));
+      return TRUE;
+    }
+
+  if (g_file_test (local_path, G_FILE_TEST_IS_DIR))
+    {
+      if (flags & G_FILE_COPY_OVERWRITE)
+        g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_IS_DIRECTORY,
+                          _("Can't copy file over directory"));
+      else
+        g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_EXISTS,
+                          _("Target file exists"));
+      return TRUE;
+    }
+
+  data = transfer_data_new (source, local_path, flags, remove_source,
+                            progress_callback, progress_callback_data);
+
+  command = new_command_stream (op_backend,
+                                (flags & G_FILE_COPY_NOFOLLOW_SYMLINKS) ?
+                                SSH_FXP_LSTAT : SSH_FXP_STAT);
+  put_string (command, source);
+  queue_command_stream_and_free (op_backend, command, pull_stat_reply, G_VFS_JOB (job), data);
+
+  return TRUE;
+}
+
+/*** PUSH ***/
+
+static void
+push_close_reply (GVfsBackendSftp *backend,
+                  int reply_type,
+                  GDataInputStream *reply,
+                  guint32 len,
+                  GVfsJob *job,
+                  gpointer user_data)
+{
+  TransferData *data = user_data;
+
+  if (data->error)
+    g_vfs_job_failed_from_error (job, data->error);
+  else if (transfer_check_status (job, reply_type, reply))
+    {
+      if (data->remove_source)
+        {
+          close (data->fd);
+          data->fd = -1;
+          if (g_unlink (data->local_path) == -1)
+            {
+              g_vfs_job_failed_from_errno (job, errno);
+              transfer_data_free (data);
+              return;
+            }
+        }
+      
+      g_vfs_job_succeeded (job);
+    }
+
+  transfer_data_free (data);
+}
+
+static void push_fill (GVfsBackendSftp *backend,
+                       GVfsJob *job,
+                       TransferData *data);
+
+static void
+push_write_reply (GVfsBackendSftp *backend,
+                  int reply_type,
+                  GDataInputStream *reply,
+                  guint32 len,
+                  GVfsJob *job,
+                  gpointer user_data)
+{
+  TransferChunk *chunk = user_data;
+  TransferData *data = chunk->data;
+  GError *error;
+
+  data->n_outstanding--;
+
+  error = NULL;
+  if (reply_type != SSH_FXP_STATUS)
+    g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         _("Invalid reply received"));
+  else
+    error_from_status (job, reply, -1, -1, &error);
+
+  if (error)
+    {
+      if (data->error == NULL)
+        data->error = error;
+      else
+        g_error_free (error);
+    }
+  else
+    {
+      data->transferred += chunk->len;
+      transfer_progress (data);
+    }
+  
+  g_slice_free (TransferChunk, chunk);
+
+  push_fill (backend, job, data);
+}
+
+static void
+push_fill (GVfsBackendSftp *backend,
+           GVfsJob *job,
+           TransferData *data)
+{
+  GDataOutputStream *command;
+  TransferChunk *chunk;
+  char buffer[TRANSFER_CHUNK_SIZE];
+  gssize res;
+
+  if (g_vfs_job_is_cancelled (job) && data->error == NULL)
+    data->error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                       _("Operation was cancelled"));
+
+  while (!data->eof && data->error == NULL &&
+         data->n_outstanding < TRANSFER_MAX_REQUESTS)
+    {
+      res = read (data->fd, buffer, sizeof (buffer));
+      if (res == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          transfer_set_error_from_errno (data, errno);
+          break;
+        }
+
+      if (res == 0)
+        {
+          data->eof = TRUE;
+          break;
+        }
+
+      chunk = g_slice_new (TransferChunk);
+      chunk->data = data;
+      chunk->offset = data->offset;
+      chunk->len = res;
+      data->offset += res;
+
+      command = new_command_stream (backend, SSH_FXP_WRITE);
+      put_data_buffer (command, data->raw_handle);
+      g_data_output_stream_put_uint64 (command, chunk->offset, NULL, NULL);
+      g_data_output_stream_put_uint32 (command, chunk->len, NULL, NULL);
+      g_output_stream_write_all (G_OUTPUT_STREAM (command),
+                                 buffer, chunk->len,
+                                 NULL, NULL, NULL);
+      queue_command_stream_and_free (backend, command, push_write_reply, job, chunk);
+      data->n_outstanding++;
+    }
+
+  if (data->n_outstanding == 0)
+    {
+      if (data->error == NULL &&
+          (data->flags & G_FILE_COPY_ALL_METADATA) &&
+          g_file_info_has_attribute (data->info, G_FILE_ATTRIBUTE_TIME_MODIFIED))
+        {
+          command = new_command_stream (backend, SSH_FXP_FSETSTAT);
+          put_data_buffer (command, data->raw_handle);
+          g_data_output_stream_put_uint32 (command, SSH_FILEXFER_ATTR_ACMODTIME, NULL, NULL);
+          g_data_output_stream_put_uint32 (command,
+                                           g_file_info_get_attribute_uint64 (data->info, G_FILE_ATTRIBUTE_TIME_ACCESS),
+                                           NULL, NULL);
+          g_data_output_stream_put_uint32 (command,
+                                           g_file_info_get_attribute_uint64 (data->info, G_FILE_ATTRIBUTE_TIME_MODIFIED),
+                                           NULL, NULL);
+          queue_command_stream_and_free (backend, command, NULL, job, NULL);
+        }
+      
+      command = new_command_stream (backend, SSH_FXP_CLOSE);
+      put_data_buffer (command, data->raw_handle);
+      queue_command_stream_and_free (backend, command, push_close_reply, job, data);
+    }
+}
+
+static void
+push_open_reply (GVfsBackendSftp *backend,
+                 int reply_type,
+                 GDataInputStream *reply,
+                 guint32 len,
+                 GVfsJob *job,
+                 gpointer user_data)
+{
+  TransferData *data = user_data;
+  
+  if (reply_type != SSH_FXP_HANDLE)
+    {
+      transfer_fail_from_reply (job, reply_type, reply,
+                                (data->flags & G_FILE_COPY_OVERWRITE) ? -1 : G_IO_ERROR_EXISTS);
+      transfer_data_free (data);
+      return;
+    }
+
+  data->raw_handle = read_data_buffer (reply);
+  push_fill (backend, job, data);
+}
+
+static void
+push_stat_reply (GVfsBackendSftp *backend,
+                 int reply_type,
+                 GDataInputStream *reply,
+                 guint32 len,
+                 GVfsJob *job,
+                 gpointer user_data)
+{
+  TransferData *data = user_data;
+  GDataOutputStream *command;
+  guint32 open_flags;
+
+  if (!transfer_check_dest_stat (backend, reply_type, reply, job, data))
+    {
+      transfer_data_free (data);
+      return;
+    }
+
+  open_flags = SSH_FXF_WRITE | SSH_FXF_CREAT | SSH_FXF_TRUNC;
+  if (!(data->flags & G_FILE_COPY_OVERWRITE))
+    open_flags |= SSH_FXF_EXCL;
+  
+  command = new_command_stream (backend, SSH_FXP_OPEN);
+  put_string (command, data->remote_path);
+  g_data_output_stream_put_uint32 (command, open_flags, NULL, NULL); /* open flags */
+  g_data_output_stream_put_uint32 (command, SSH_FILEXFER_ATTR_PERMISSIONS, NULL, NULL); /* Attr flags */
+  g_data_output_stream_put_uint32 (command,
+                                   g_file_info_get_attribute_uint32 (data->info, G_FILE_ATTRIBUTE_UNIX_MODE) & 0777,
+                                   NULL, NULL);
+  queue_command_stream_and_free (backend, command, push_open_reply, job, data);
+}
+
+static gboolean
+try_push (GVfsBackend *backend,
+          GVfsJobPush *job,
+          const char *destination,
+          const char *local_path,
+          GFileCopyFlags flags,
+          gboolean remove_source,
+          GFileProgressCallback progress_callback,
+          gpointer progress_callback_data)
+{
+  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  GDataOutputStream *command;
+  TransferData *data;
+  struct stat statbuf;
+  int res;
+
+  if (flags & G_FILE_COPY_NOFOLLOW_SYMLINKS)
+    res = g_lstat (local_path, &statbuf);
+  else
+    res = g_stat (local_path, &statbuf);
+
+  if (res == -1)
+    {
+      g_vfs_job_failed_from_errno (G_VFS_JOB (job), errno);
+      return TRUE;
+    }
+
+  if (S_ISDIR (statbuf.st_mode))
+    {
+      g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_WOULD_RECURSE,
+                        _("Can't recursively copy directory"));
+      return TRUE;
+    }
+
+  if (!S_ISREG (statbuf.st_mode) || (flags & G_FILE_COPY_BACKUP))
+    {
+      /* Let the generic code handle symlinks, special files and backups */
+      g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        _("Operation not supported by backend"));
+      return TRUE;
+    }
+
+  data = transfer_data_new (destination, local_path, flags, remove_source,
+                            progress_callback, progress_callback_data);
+  data->size = statbuf.st_size;
+  data->info = g_file_info_new ();
+  g_file_info_set_attribute_uint32 (data->info, G_FILE_ATTRIBUTE_UNIX_MODE, statbuf.st_mode);
+  g_file_info_set_attribute_uint64 (data->info, G_FILE_ATTRIBUTE_TIME_ACCESS, statbuf.st_atime);
+  g_file_info_set_attribute_uint64 (data->info, G_FILE_ATTRIBUTE_TIME_MODIFIED, statbuf.st_mtime);
+  
+  data->fd = g_open (local_path, O_RDONLY, 0);
+  if (data->fd == -1)
+    {
+      g_vfs_job_failed_from_errno (G_VFS_JOB (job), errno);
+      transfer_data_free (data);
+      return TRUE;
+    }
+
+  command = new_command_stream (op_backend, SSH_FXP_LSTAT);
+  put_string (command, destination);
+  queue_command_stream_and_free (op_backend, command, push_stat_reply, G_VFS_JOB (job), data);
+
+  return TRUE;
+}
+
+/*** COPY ***/
+
+static void
+copy_close_reply (GVfsBackendSftp *backend,
+                  int reply_type,
+                  GDataInputStream *reply,
+                  guint32 len,
+                  GVfsJob *job,
+                  gpointer user_data)
+{
+  TransferData *data = user_data;
+
+  if (data->error)
+    g_vfs_job_failed_from_error (job, data->error);
+  else if (transfer_check_status (job, reply_type, reply))
+    {
+      data->transferred = data->size;
+      transfer_progress (data);
+      g_vfs_job_succeeded (job);
+    }
+
+  transfer_data_free (data);
+}
+
+static void
+copy_data_reply (GVfsBackendSftp *backend,
+                 int reply_type,
+                 GDataInputStream *reply,
+                 guint32 len,
+                 GVfsJob *job,
+                 gpointer user_data)
+{
+  TransferData *data = user_data;
+  GDataOutputStream *command;
+
+  if (reply_type != SSH_FXP_STATUS)
+    data->error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                       _("Invalid reply received"));
+  else
+    error_from_status (job, reply, -1, -1, &data->error);
+
+  command = new_command_stream (backend, SSH_FXP_CLOSE);
+  put_data_buffer (command, data->raw_handle);
+  queue_command_stream_and_free (backend, command, NULL, job, NULL);
+  
+  command = new_command_stream (backend, SSH_FXP_CLOSE);
+  put_data_buffer (command, data->raw_dest_handle);
+  queue_command_stream_and_free (backend, command, copy_close_reply, job, data);
+}
+
+static void
+copy_open_dest_reply (GVfsBackendSftp *backend,
+                      int reply_type,
+                      GDataInputStream *reply,
+                      guint32 len,
+                      GVfsJob *job,
+                      gpointer user_data)
+{
+  TransferData *data = user_data;
+  GDataOutputStream *command;
+
+  if (reply_type != SSH_FXP_HANDLE)
+    {
+      transfer_fail_from_reply (job, reply_type, reply,
+                                (data->flags & G_FILE_COPY_OVERWRITE) ? -1 : G_IO_ERROR_EXISTS);
+
+      command = new_command_stream (backend, SSH_FXP_CLOSE);
+      put_data_buffer (command, data->raw_handle);
+      queue_command_stream_and_free (backend, command, NULL, job, NULL);
+      
+      transfer_data_free (data);
+      return;
+    }
+
+  data->raw_dest_handle = read_data_buffer (reply);
+
+  /* See PROTOCOL in the OpenSSH sources */
+  command = new_command_stream (backend, SSH_FXP_EXTENDED);
+  put_string (command, "copy-data");
+  put_data_buffer (command, data->raw_handle);
+  g_data_output_stream_put_uint64 (command, 0, NULL, NULL); /* read offset */
+  g_data_output_stream_put_uint64 (command, 0, NULL, NULL); /* length, 0 means to EOF */
+  put_data_buffer (command, data->raw_dest_handle);
+  g_data_output_stream_put_uint64 (command, 0, NULL, NULL); /* write offset */
+  queue_command_stream_and_free (backend, command, copy_data_reply, job, data);
+}
+
+static void
+copy_open_source_reply (GVfsBackendSftp *backend,
+                        int reply_type,
+                        GDataInputStream *reply,
+                        guint32 len,
+                        GVfsJob *job,
+                        gpointer user_data)
+{
+  TransferData *data = user_data;
+  GDataOutputStream *command;
+  guint32 open_flags;
+
+  if (reply_type != SSH_FXP_HANDLE)
+    {
+      transfer_fail_from_reply (job, reply_type, reply, -1);
+      transfer_data_free (data);
+      return;
+    }
+  
+  data->raw_handle = read_data_buffer (reply);
+  
+  open_flags = SSH_FXF_WRITE | SSH_FXF_CREAT | SSH_FXF_TRUNC;
+  if (!(data->flags & G_FILE_COPY_OVERWRITE))
+    open_flags |= SSH_FXF_EXCL;
+  
+  command = new_command_stream (backend, SSH_FXP_OPEN);
+  put_string (command, data->dest_path);
+  g_data_output_stream_put_uint32 (command, open_flags, NULL, NULL); /* open flags */
+  if (g_file_info_has_attribute (data->info, G_FILE_ATTRIBUTE_UNIX_MODE))
+    {
+      g_data_output_stream_put_uint32 (command, SSH_FILEXFER_ATTR_PERMISSIONS, NULL, NULL); /* Attr flags */
+      g_data_output_stream_put_uint32 (command,
+                                       g_file_info_get_attribute_uint32 (data->info, G_FILE_ATTRIBUTE_UNIX_MODE) & 0777,
+                                       NULL, NULL);
+    }
+  else
+    g_data_output_stream_put_uint32 (command, 0, NULL, NULL); /* Attr flags */
+  queue_command_stream_and_free (backend, command, copy_open_dest_reply, job, data);
+}
+
+static void
+copy_dest_stat_reply (GVfsBackendSftp *backend,
+                      int reply_type,
+                      GDataInputStream *reply,
+                      guint32 len,
+                      GVfsJob *job,
+                      gpointer user_data)
+{
+  TransferData *data = user_data;
+  GDataOutputStream *command;
+
+  if (!transfer_check_dest_stat (backend, reply_type, reply, job, data))
+    {
+      transfer_data_free (data);
+      return;
+    }
+
+  command = new_command_stream (backend, SSH_FXP_OPEN);
+  put_string (command, data->remote_path);
+  g_data_output_stream_put_uint32 (command, SSH_FXF_READ, NULL, NULL); /* open flags */
+  g_data_output_stream_put_uint32 (command, 0, NULL, NULL); /* Attr flags */
+  queue_command_stream_and_free (backend, command, copy_open_source_reply, job, data);
+}
+
+static void
+copy_stat_reply (GVfsBackendSftp *backend,
+                 int reply_type,
+                 GDataInputStream *reply,
+                 guint32 len,
+                 GVfsJob *job,
+                 gpointer user_data)
+{
+  TransferData *data = user_data;
+  GDataOutputStream *command;
+
+  if (reply_type != SSH_FXP_ATTRS)
+    {
+      transfer_fail_from_reply (job, reply_type, reply, -1);
+      transfer_data_free (data);
+      return;
+    }
+
+  data->info = transfer_parse_attributes (backend, reply);
+  data->size = g_file_info_get_size (data->info);
+  if (!transfer_check_source_type (job, data->info))
+    {
+      transfer_data_free (data);
+      return;
+    }
+
+  command = new_command_stream (backend, SSH_FXP_STAT);
+  put_string (command, data->dest_path);
+  queue_command_stream_and_free (backend, command, copy_dest_stat_reply, job, data);
+}
+
+static gboolean
+try_copy (GVfsBackend *backend,
+          GVfsJobCopy *job,
+          const char *source,
+          const char *destination,
+          GFileCopyFlags flags,
+          GFileProgressCallback progress_callback,
+          gpointer progress_callback_data)
+{
+  GVfsBackendSftp *op_backend = G_VFS_BACKEND_SFTP (backend);
+  GDataOutputStream *command;
+  TransferData *data;
+
+  if (!op_backend->has_copy_data || (flags & G_FILE_COPY_BACKUP))
+    {
+      /* Fall back to copying through the client */
+      g_vfs_job_failed (G_VFS_JOB (job), G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        _("Operation not supported by backend"));
+      return TRUE;
+    }
+
+  data = transfer_data_new (source, NULL, flags, FALSE,
+                            progress_callback, progress_callback_data);
+  data->dest_path = g_strdup (destination);
+
+  command = new_command_stream (op_backend,
+                                (flags & G_FILE_COPY_NOFOLLOW_SYMLINKS) ?
+                                SSH_FXP_LSTAT : SSH_FXP_STAT);
+  put_string (command, source);
+  queue_command_stream_and_free (op_backend, command, copy_stat_reply, G_VFS_JOB (job), data);
+
+  return TRUE;
+}
+
 static void
 g_vfs_backend_sftp_class_init (GVfsBackendSftpClass *klass)
 {
@@ -4197,6 +5556,9 @@ g_vfs_backend_sftp_class_init (GVfsBackendSftpClass *klass)
   backend_class->try_make_directory = try_make_directory;
   backend_class->try_delete = try_delete;
   backend_class->try_set_display_name = try_set_display_name;
+  backend_class->try_copy = try_copy;
+  backend_class->try_push = try_push;
+  backend_class->try_pull = try_pull;
   backend_class->try_query_settable_attributes = try_query_settable_attributes;
   backend_class->try_set_attribute = try_set_attribute;
 }
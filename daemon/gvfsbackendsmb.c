@@ -121,6 +121,9 @@ g_vfs_backend_smb_finalize (GObject *object)
 static void
 g_vfs_backend_smb_init (GVfsBackendSmb *backend)
 {
+  /* The libsmbclient context is not threadsafe */
+  g_vfs_backend_set_parallel_job_types (G_VFS_BACKEND (backend),
+					G_TYPE_INVALID);
 }
 
 /**
@@ -1364,28 +1367,18 @@ do_close_write (GVfsBackend *backend,
 }
 
 static void
-set_info_from_stat (GVfsBackendSmb *backend,
-		    GFileInfo *info,
-		    struct stat *statbuf,
-		    const char *basename,
-		    GFileAttributeMatcher *matcher)
+set_name_info (GVfsBackendSmb *backend,
+	       GFileInfo *info,
+	       const char *basename,
+	       GFileAttributeMatcher *matcher)
 {
-  GFileType file_type;
-  GTimeVal t;
-  GIcon *icon;
-  char *content_type;
   char *display_name;
 
-  if (basename)
-    {
-      g_file_info_set_name (info, basename);
-      if (*basename == '.')
-	g_file_info_set_is_hidden (info, TRUE);
-    }
+  g_file_info_set_name (info, basename);
+  if (*basename == '.')
+    g_file_info_set_is_hidden (info, TRUE);
 
-  
-  if (basename != NULL &&
-      g_file_attribute_matcher_matches (matcher,
+  if (g_file_attribute_matcher_matches (matcher,
                                         G_FILE_ATTRIBUTE_STANDARD_DISPLAY_NAME))
     {
       if (strcmp (basename, "/") == 0)
@@ -1403,46 +1396,25 @@ set_info_from_stat (GVfsBackendSmb *backend,
       g_free (display_name);
     }
   
-  if (basename != NULL &&
-      g_file_attribute_matcher_matches (matcher,
+  if (g_file_attribute_matcher_matches (matcher,
                                         G_FILE_ATTRIBUTE_STANDARD_EDIT_NAME))
     {
       char *edit_name = g_filename_display_name (basename);
       g_file_info_set_edit_name (info, edit_name);
       g_free (edit_name);
     }
+}
 
-  
-  file_type = G_FILE_TYPE_UNKNOWN;
-
-  if (S_ISREG (statbuf->st_mode))
-    file_type = G_FILE_TYPE_REGULAR;
-  else if (S_ISDIR (statbuf->st_mode))
-    file_type = G_FILE_TYPE_DIRECTORY;
-  else if (S_ISCHR (statbuf->st_mode) ||
-	   S_ISBLK (statbuf->st_mode) ||
-	   S_ISFIFO (statbuf->st_mode)
-#ifdef S_ISSOCK
-	   || S_ISSOCK (statbuf->st_mode)
-#endif
-	   )
-    file_type = G_FILE_TYPE_SPECIAL;
-  else if (S_ISLNK (statbuf->st_mode))
-    file_type = G_FILE_TYPE_SYMBOLIC_LINK;
+static void
+set_type_info (GFileInfo *info,
+	       GFileType file_type,
+	       const char *basename,
+	       GFileAttributeMatcher *matcher)
+{
+  GIcon *icon;
+  char *content_type;
 
   g_file_info_set_file_type (info, file_type);
-  g_file_info_set_size (info, statbuf->st_size);
-
-  t.tv_sec = statbuf->st_mtime;
-#if defined (HAVE_STRUCT_STAT_ST_MTIMENSEC)
-  t.tv_usec = statbuf->st_mtimensec / 1000;
-#elif defined (HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC)
-  t.tv_usec = statbuf->st_mtim.tv_nsec / 1000;
-#else
-  t.tv_usec = 0;
-#endif
-  g_file_info_set_modification_time (info, &t);
-
 
   if (g_file_attribute_matcher_matches (matcher,
 					G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE) ||
@@ -1450,7 +1422,7 @@ set_info_from_stat (GVfsBackendSmb *backend,
 					G_FILE_ATTRIBUTE_STANDARD_ICON))
     {
       icon = NULL;
-      if (S_ISDIR(statbuf->st_mode))
+      if (file_type == G_FILE_TYPE_DIRECTORY)
 	{
 	  content_type = g_strdup ("inode/directory");
 	  if (strcmp (basename, "/") == 0)
@@ -1476,8 +1448,52 @@ set_info_from_stat (GVfsBackendSmb *backend,
       
       g_file_info_set_icon (info, icon);
       g_object_unref (icon);
-  }
+    }
+}
+
+static void
+set_info_from_stat (GVfsBackendSmb *backend,
+		    GFileInfo *info,
+		    struct stat *statbuf,
+		    const char *basename,
+		    GFileAttributeMatcher *matcher)
+{
+  GFileType file_type;
+  GTimeVal t;
+
+  if (basename)
+    set_name_info (backend, info, basename, matcher);
   
+  file_type = G_FILE_TYPE_UNKNOWN;
+
+  if (S_ISREG (statbuf->st_mode))
+    file_type = G_FILE_TYPE_REGULAR;
+  else if (S_ISDIR (statbuf->st_mode))
+    file_type = G_FILE_TYPE_DIRECTORY;
+  else if (S_ISCHR (statbuf->st_mode) ||
+	   S_ISBLK (statbuf->st_mode) ||
+	   S_ISFIFO (statbuf->st_mode)
+#ifdef S_ISSOCK
+	   || S_ISSOCK (statbuf->st_mode)
+#endif
+	   )
+    file_type = G_FILE_TYPE_SPECIAL;
+  else if (S_ISLNK (statbuf->st_mode))
+    file_type = G_FILE_TYPE_SYMBOLIC_LINK;
+
+  set_type_info (info, file_type, basename, matcher);
+  g_file_info_set_size (info, statbuf->st_size);
+
+  t.tv_sec = statbuf->st_mtime;
+#if defined (HAVE_STRUCT_STAT_ST_MTIMENSEC)
+  t.tv_usec = statbuf->st_mtimensec / 1000;
+#elif defined (HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC)
+  t.tv_usec = statbuf->st_mtim.tv_nsec / 1000;
+#else
+  t.tv_usec = 0;
+#endif
+  g_file_info_set_modification_time (info, &t);
+
   /* Don't trust n_link, uid, gid, etc returned from libsmb, its just made up.
      These are ok though: */
 
@@ -1670,6 +1686,91 @@ do_set_attribute (GVfsBackend *backend,
     g_vfs_job_succeeded (G_VFS_JOB (job));
 }
 
+/* Everything set_info_from_stat() fills in that can't be derived from
+   the dirent name and type alone */
+static const char *stat_attributes[] = {
+  G_FILE_ATTRIBUTE_STANDARD_IS_HIDDEN,
+  G_FILE_ATTRIBUTE_STANDARD_SIZE,
+  G_FILE_ATTRIBUTE_TIME_MODIFIED,
+  G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC,
+  G_FILE_ATTRIBUTE_TIME_ACCESS,
+  G_FILE_ATTRIBUTE_TIME_ACCESS_USEC,
+  G_FILE_ATTRIBUTE_TIME_CHANGED,
+  G_FILE_ATTRIBUTE_TIME_CHANGED_USEC,
+  G_FILE_ATTRIBUTE_UNIX_DEVICE,
+  G_FILE_ATTRIBUTE_UNIX_INODE,
+  G_FILE_ATTRIBUTE_ACCESS_CAN_WRITE,
+  G_FILE_ATTRIBUTE_DOS_IS_ARCHIVE,
+  G_FILE_ATTRIBUTE_DOS_IS_SYSTEM,
+  G_FILE_ATTRIBUTE_ETAG_VALUE
+};
+
+static gboolean
+matcher_needs_stat (GFileAttributeMatcher *matcher)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (stat_attributes); i++)
+    if (g_file_attribute_matcher_matches (matcher, stat_attributes[i]))
+      return TRUE;
+
+  return FALSE;
+}
+
+#ifdef HAVE_SAMBA_READDIRPLUS2
+#define READDIRPLUS_BATCH_SIZE 100
+
+/* readdirplus2 returns the stat data along with each entry, so the whole
+   listing takes no more round trips than a bare readdir */
+static void
+enumerate_with_readdirplus (GVfsBackendSmb *op_backend,
+			    GVfsJobEnumerate *job,
+			    SMBCFILE *dir,
+			    GFileAttributeMatcher *matcher)
+{
+  smbc_readdirplus2_fn smbc_readdirplus2;
+  const struct libsmb_file_info *entry;
+  struct stat st;
+  GList *files;
+  GFileInfo *info;
+  int n_files;
+
+  smbc_readdirplus2 = smbc_getFunctionReaddirPlus2 (op_backend->smb_context);
+
+  files = NULL;
+  n_files = 0;
+  while ((entry = smbc_readdirplus2 (op_backend->smb_context, dir, &st)) != NULL)
+    {
+      if (entry->name == NULL ||
+	  strcmp (entry->name, ".") == 0 ||
+	  strcmp (entry->name, "..") == 0)
+	continue;
+
+      info = g_file_info_new ();
+      set_info_from_stat (op_backend, info, &st, entry->name, matcher);
+      files = g_list_prepend (files, info);
+
+      if (++n_files == READDIRPLUS_BATCH_SIZE)
+	{
+	  files = g_list_reverse (files);
+	  g_vfs_job_enumerate_add_infos (job, files);
+	  g_list_foreach (files, (GFunc)g_object_unref, NULL);
+	  g_list_free (files);
+	  files = NULL;
+	  n_files = 0;
+	}
+    }
+
+  if (files)
+    {
+      files = g_list_reverse (files);
+      g_vfs_job_enumerate_add_infos (job, files);
+      g_list_foreach (files, (GFunc)g_object_unref, NULL);
+      g_list_free (files);
+    }
+}
+#endif
+
 static void
 do_enumerate (GVfsBackend *backend,
 	      GVfsJobEnumerate *job,
@@ -1688,6 +1789,7 @@ do_enumerate (GVfsBackend *backend,
   GFileInfo *info;
   GString *uri;
   int uri_start_len;
+  gboolean need_stat;
   smbc_opendir_fn smbc_opendir;
   smbc_getdents_fn smbc_getdents;
   smbc_stat_fn smbc_stat;
@@ -1719,6 +1821,13 @@ do_enumerate (GVfsBackend *backend,
     g_string_append_c (uri, '/');
   uri_start_len = uri->len;
 
+  need_stat = matcher != NULL && matcher_needs_stat (matcher);
+
+#ifdef HAVE_SAMBA_READDIRPLUS2
+  if (need_stat)
+    enumerate_with_readdirplus (op_backend, job, dir, matcher);
+  else
+#endif
   while (TRUE)
     {
       files = NULL;
@@ -1732,8 +1841,6 @@ do_enumerate (GVfsBackend *backend,
 	{
 	  unsigned int dirlen;
 
-	  /* TODO: Only do stat if required for flags */
-	  
 	  if ((dirp->smbc_type == SMBC_DIR ||
 	       dirp->smbc_type == SMBC_FILE ||
 	       dirp->smbc_type == SMBC_LINK) &&
@@ -1753,6 +1860,17 @@ do_enumerate (GVfsBackend *backend,
 		  g_file_info_set_name (info, dirp->name);
 		  files = g_list_prepend (files, info);
 		}
+	      else if (!need_stat && dirp->smbc_type != SMBC_LINK)
+		{
+		  /* Name and type are all we need, and the dirent has both */
+		  info = g_file_info_new ();
+		  set_name_info (op_backend, info, dirp->name, matcher);
+		  set_type_info (info,
+				 dirp->smbc_type == SMBC_DIR ?
+				 G_FILE_TYPE_DIRECTORY : G_FILE_TYPE_REGULAR,
+				 dirp->name, matcher);
+		  files = g_list_prepend (files, info);
+		}
 	      else
 		{
 		  stat_res = smbc_stat (op_backend->smb_context,
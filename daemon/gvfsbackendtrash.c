@@ -847,6 +847,11 @@ g_vfs_backend_trash_init (GVfsBackendTrash *backend)
   mount_spec = g_mount_spec_new ("trash");
   g_vfs_backend_set_mount_spec (vfs_backend, mount_spec);
   g_mount_spec_unref (mount_spec);
+
+  /* trashlib does its own locking */
+  g_vfs_backend_set_parallel_job_types (vfs_backend,
+					G_VFS_TYPE_JOB,
+					G_TYPE_INVALID);
 }
 
 static void
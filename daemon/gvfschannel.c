@@ -28,6 +28,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 
 #include <glib.h>
@@ -84,6 +85,7 @@ struct _GVfsChannelPrivate
   gboolean connection_closed;
   GInputStream *command_stream;
   GOutputStream *reply_stream;
+  int reply_fd;
   int remote_fd;
   
   GVfsBackendHandle backend_handle;
@@ -100,6 +102,11 @@ struct _GVfsChannelPrivate
   const char *output_data; /* Owned by job */
   gsize output_data_size;
   gsize output_data_pos;
+
+  /* Statistics, to see how much the reply path costs */
+  guint n_replies;
+  guint n_writes;
+  guint64 bytes_sent;
 };
 
 static void start_request_reader       (GVfsChannel  *channel);
@@ -120,6 +127,10 @@ g_vfs_channel_finalize (GObject *object)
 
   channel = G_VFS_CHANNEL (object);
 
+  g_debug ("channel %p: %u replies, %u writes, %"G_GUINT64_FORMAT" bytes sent\n",
+	   channel, channel->priv->n_replies, channel->priv->n_writes,
+	   channel->priv->bytes_sent);
+
   if (channel->priv->current_job)
     g_object_unref (channel->priv->current_job);
   channel->priv->current_job = NULL;
@@ -184,6 +195,7 @@ g_vfs_channel_init (GVfsChannel *channel)
 					       G_VFS_TYPE_CHANNEL,
 					       GVfsChannelPrivate);
   channel->priv->remote_fd = -1;
+  channel->priv->reply_fd = -1;
 
   ret = socketpair (AF_UNIX, SOCK_STREAM, 0, socket_fds);
   if (ret == -1) 
@@ -192,6 +204,7 @@ g_vfs_channel_init (GVfsChannel *channel)
     {
       channel->priv->command_stream = g_unix_input_stream_new (socket_fds[0], TRUE);
       channel->priv->reply_stream = g_unix_output_stream_new (socket_fds[0], FALSE);
+      channel->priv->reply_fd = socket_fds[0];
       channel->priv->remote_fd = socket_fds[1];
       
       start_request_reader (channel);
@@ -530,6 +543,8 @@ start_request_reader (GVfsChannel *channel)
   channel->priv->request_reader = reader;
 }
 
+static void reply_sent (GVfsChannel *channel);
+
 static void
 send_reply_cb (GObject *source_object,
 	       GAsyncResult *res,
@@ -538,17 +553,19 @@ send_reply_cb (GObject *source_object,
   GOutputStream *output_stream = G_OUTPUT_STREAM (source_object);
   gssize bytes_written;
   GVfsChannel *channel = user_data;
-  GVfsChannelClass *class;
-  GVfsJob *job;
 
   bytes_written = g_output_stream_write_finish (output_stream, res, NULL);
+  channel->priv->n_writes++;
   
   if (bytes_written <= 0)
     {
       g_vfs_channel_connection_closed (channel);
-      goto error_out;
+      reply_sent (channel);
+      return;
     }
 
+  channel->priv->bytes_sent += bytes_written;
+
   if (channel->priv->reply_buffer_pos < G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE)
     {
       channel->priv->reply_buffer_pos += bytes_written;
@@ -580,8 +597,27 @@ send_reply_cb (GObject *source_object,
       return;
     }
 
- error_out:
+  reply_sent (channel);
+}
+
+static gboolean
+reply_sent_idle_cb (gpointer data)
+{
+  GVfsChannel *channel = data;
+
+  reply_sent (channel);
+  g_object_unref (channel);
   
+  return FALSE;
+}
+
+/* Called on the main thread once the whole reply is written */
+static void
+reply_sent (GVfsChannel *channel)
+{
+  GVfsChannelClass *class;
+  GVfsJob *job;
+
   /* Sent full reply */
   channel->priv->output_data = NULL;
 
@@ -618,6 +654,56 @@ send_reply_cb (GObject *source_object,
   g_object_unref (job);
 }
 
+/* Try to send as much as possible of the reply header and data with
+   one non-blocking sendmsg(). Returns the number of bytes written. */
+static gsize
+send_reply_vectored (GVfsChannel *channel)
+{
+  struct iovec iov[2];
+  struct msghdr msg;
+  int n_iov, flags;
+  gssize res;
+
+  if (channel->priv->reply_fd == -1)
+    return 0;
+  
+  n_iov = 0;
+  if (channel->priv->reply_buffer_pos < G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE)
+    {
+      iov[n_iov].iov_base = channel->priv->reply_buffer + channel->priv->reply_buffer_pos;
+      iov[n_iov].iov_len = G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE - channel->priv->reply_buffer_pos;
+      n_iov++;
+    }
+  if (channel->priv->output_data_size > 0)
+    {
+      iov[n_iov].iov_base = (char *)channel->priv->output_data;
+      iov[n_iov].iov_len = channel->priv->output_data_size;
+      n_iov++;
+    }
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n_iov;
+
+  flags = MSG_DONTWAIT;
+#ifdef MSG_NOSIGNAL
+  flags |= MSG_NOSIGNAL;
+#endif
+  
+  do
+    res = sendmsg (channel->priv->reply_fd, &msg, flags);
+  while (res == -1 && errno == EINTR);
+
+  channel->priv->n_writes++;
+  
+  /* On errors we let the async write report them */
+  if (res <= 0)
+    return 0;
+  
+  channel->priv->bytes_sent += res;
+  return res;
+}
+
 /* Might be called on an i/o thread */
 void
 g_vfs_channel_send_reply (GVfsChannel *channel,
@@ -625,31 +711,53 @@ g_vfs_channel_send_reply (GVfsChannel *channel,
 			  const void *data,
 			  gsize data_len)
 {
+  gsize written, header_left;
   
   channel->priv->output_data = data;
   channel->priv->output_data_size = data_len;
   channel->priv->output_data_pos = 0;
+  channel->priv->n_replies++;
 
   if (reply != NULL)
     {
       memcpy (channel->priv->reply_buffer, reply, sizeof (GVfsDaemonSocketProtocolReply));
       channel->priv->reply_buffer_pos = 0;
+    }
+  else
+    channel->priv->reply_buffer_pos = G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE;
+
+  /* Usually the whole reply fits in the socket buffer, so we send
+     header and data in one go and avoid a round trip through the
+     main loop for each of them. */
+  written = send_reply_vectored (channel);
 
+  header_left = G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE - channel->priv->reply_buffer_pos;
+  if (written < header_left)
+    {
+      channel->priv->reply_buffer_pos += written;
       g_output_stream_write_async (channel->priv->reply_stream,
-				   channel->priv->reply_buffer,
-				   G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE,
+				   channel->priv->reply_buffer + channel->priv->reply_buffer_pos,
+				   G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE - channel->priv->reply_buffer_pos,
 				   0, NULL,
 				   send_reply_cb, channel);  
+      return;
     }
-  else
+
+  channel->priv->reply_buffer_pos = G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE;
+  channel->priv->output_data_pos = written - header_left;
+
+  if (channel->priv->output_data_pos < channel->priv->output_data_size)
     {
-      channel->priv->reply_buffer_pos = G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SIZE;
       g_output_stream_write_async (channel->priv->reply_stream,
-				   channel->priv->output_data,
-				   channel->priv->output_data_size,
+				   channel->priv->output_data + channel->priv->output_data_pos,
+				   channel->priv->output_data_size - channel->priv->output_data_pos,
 				   0, NULL,
 				   send_reply_cb, channel);  
+      return;
     }
+
+  /* All sent, finish up on the main thread like the async path does */
+  g_idle_add (reply_sent_idle_cb, g_object_ref (channel));
 }
 
 /* Might be called on an i/o thread
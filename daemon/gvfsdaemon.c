@@ -40,6 +40,7 @@
 #include <gvfsdaemonprotocol.h>
 #include <gvfsdaemonutils.h>
 #include <gvfsjobmount.h>
+#include <gvfschannel.h>
 #include <gdbusutils.h>
 
 enum {
@@ -68,8 +69,26 @@ struct _GVfsDaemon
   guint exit_tag;
   
   gint mount_counter;
+
+  /* job type name -> JobTypeStats, protected by lock */
+  GHashTable *job_stats;
 };
 
+/* A job waiting for, or running on, a worker thread */
+typedef struct {
+  GVfsJob *job;
+  GVfsBackend *backend;
+  GTimeVal queued_time;
+} QueuedJob;
+
+typedef struct {
+  guint queue_depth;
+  guint max_queue_depth;
+  guint64 n_jobs;
+  guint64 total_wait_usec;
+  guint64 max_wait_usec;
+} JobTypeStats;
+
 typedef struct {
   GVfsDaemon *daemon;
   char *socket_dir;
@@ -117,6 +136,7 @@ g_vfs_daemon_finalize (GObject *object)
   g_assert (daemon->jobs == NULL);
 
   g_hash_table_destroy (daemon->registered_paths);
+  g_hash_table_destroy (daemon->job_stats);
   g_mutex_free (daemon->lock);
 
   if (G_OBJECT_CLASS (g_vfs_daemon_parent_class)->finalize)
@@ -133,19 +153,101 @@ g_vfs_daemon_class_init (GVfsDaemonClass *klass)
   gobject_class->get_property = g_vfs_daemon_get_property;
 }
 
+static JobTypeStats *
+daemon_get_job_stats (GVfsDaemon *daemon,
+		      GVfsJob    *job)
+{
+  const char *type_name;
+  JobTypeStats *stats;
+
+  /* Type names are interned, so no need to copy them */
+  type_name = G_OBJECT_TYPE_NAME (job);
+  stats = g_hash_table_lookup (daemon->job_stats, type_name);
+  if (stats == NULL)
+    {
+      stats = g_new0 (JobTypeStats, 1);
+      g_hash_table_insert (daemon->job_stats, (char *)type_name, stats);
+    }
+
+  return stats;
+}
+
+static void
+print_job_stats (gpointer key,
+		 gpointer value,
+		 gpointer user_data)
+{
+  JobTypeStats *stats = value;
+
+  g_debug ("%s: %"G_GUINT64_FORMAT" jobs, avg wait %"G_GUINT64_FORMAT" usec, "
+	   "max wait %"G_GUINT64_FORMAT" usec, max queue depth %u\n",
+	   (char *)key, stats->n_jobs,
+	   stats->n_jobs > 0 ? stats->total_wait_usec / stats->n_jobs : 0,
+	   stats->max_wait_usec, stats->max_queue_depth);
+}
+
+static void
+daemon_print_job_stats (GVfsDaemon *daemon)
+{
+  g_mutex_lock (daemon->lock);
+  g_hash_table_foreach (daemon->job_stats, print_job_stats, NULL);
+  g_mutex_unlock (daemon->lock);
+}
+
+static void
+queued_job_free (QueuedJob *queued)
+{
+  g_object_unref (queued->job);
+  if (queued->backend)
+    g_object_unref (queued->backend);
+  g_free (queued);
+}
+
 static void
 job_handler_callback (gpointer       data,
 		      gpointer       user_data)
 {
-  GVfsJob *job = G_VFS_JOB (data);
+  GVfsDaemon *daemon = user_data;
+  QueuedJob *queued = data;
+  JobTypeStats *stats;
+  GTimeVal now;
+  gint64 diff;
+  guint64 wait_usec;
+
+  g_get_current_time (&now);
+  diff =
+    (gint64)(now.tv_sec - queued->queued_time.tv_sec) * G_USEC_PER_SEC +
+    (now.tv_usec - queued->queued_time.tv_usec);
+  /* The wall clock may have been changed while we waited */
+  wait_usec = MAX (diff, 0);
+
+  g_mutex_lock (daemon->lock);
+  stats = daemon_get_job_stats (daemon, queued->job);
+  stats->queue_depth--;
+  stats->n_jobs++;
+  stats->total_wait_usec += wait_usec;
+  stats->max_wait_usec = MAX (stats->max_wait_usec, wait_usec);
+  g_mutex_unlock (daemon->lock);
+  
+  g_debug ("Running job %p (%s) after waiting %"G_GUINT64_FORMAT" usec\n",
+	   queued->job, G_OBJECT_TYPE_NAME (queued->job), wait_usec);
+
+  if (queued->backend)
+    g_vfs_backend_job_enter (queued->backend, queued->job);
+  
+  g_vfs_job_run (queued->job);
+  
+  if (queued->backend)
+    g_vfs_backend_job_leave (queued->backend, queued->job);
 
-  g_vfs_job_run (job);
+  queued_job_free (queued);
 }
 
 static void
 g_vfs_daemon_init (GVfsDaemon *daemon)
 {
-  gint max_threads = 1; /* TODO: handle max threads */
+  /* Raised by g_vfs_daemon_set_max_threads() for backend daemons */
+  gint max_threads = 1;
   DBusError error;
   
   daemon->lock = g_mutex_new ();
@@ -163,6 +265,9 @@ g_vfs_daemon_init (GVfsDaemon *daemon)
   daemon->registered_paths =
     g_hash_table_new_full (g_str_hash, g_str_equal,
 			   NULL, (GDestroyNotify)registered_path_free);
+  daemon->job_stats =
+    g_hash_table_new_full (g_str_hash, g_str_equal,
+			   NULL, g_free);
 
   dbus_error_init (&error);
   dbus_bus_add_match (daemon->session_bus,
@@ -291,6 +396,9 @@ g_vfs_daemon_set_max_threads (GVfsDaemon                    *daemon,
 static gboolean
 exit_at_idle (gpointer data)
 {
+  GVfsDaemon *daemon = data;
+  
+  daemon_print_job_stats (daemon);
   exit (0);
   return FALSE;
 }
@@ -312,12 +420,24 @@ daemon_schedule_exit (GVfsDaemon *daemon)
     daemon->exit_tag = g_timeout_add_seconds (1, exit_at_idle, daemon);
 }
 
+static void daemon_queue_job (GVfsDaemon  *daemon,
+			      GVfsJob     *job,
+			      GVfsBackend *backend);
+
 static void
 job_source_new_job_callback (GVfsJobSource *job_source,
 			     GVfsJob *job,
 			     GVfsDaemon *daemon)
 {
-  g_vfs_daemon_queue_job (daemon, job);
+  GVfsBackend *backend;
+
+  backend = NULL;
+  if (G_VFS_IS_BACKEND (job_source))
+    backend = G_VFS_BACKEND (job_source);
+  else if (G_VFS_IS_CHANNEL (job_source))
+    backend = g_vfs_channel_get_backend (G_VFS_CHANNEL (job_source));
+  
+  daemon_queue_job (daemon, job, backend);
 }
 
 static void
@@ -435,10 +555,14 @@ job_finished_callback (GVfsJob *job,
   g_object_unref (job);
 }
 
-void
-g_vfs_daemon_queue_job (GVfsDaemon *daemon,
-			GVfsJob *job)
+static void
+daemon_queue_job (GVfsDaemon  *daemon,
+		  GVfsJob     *job,
+		  GVfsBackend *backend)
 {
+  QueuedJob *queued;
+  JobTypeStats *stats;
+  
   g_debug ("Queued new job %p (%s)\n", job, g_type_name_from_instance ((gpointer)job));
   
   g_object_ref (job);
@@ -453,10 +577,28 @@ g_vfs_daemon_queue_job (GVfsDaemon *daemon,
   if (!g_vfs_job_try (job))
     {
       /* Couldn't finish / run async, queue worker thread */
-      g_thread_pool_push (daemon->thread_pool, job, NULL); /* TODO: Check error */
+      queued = g_new0 (QueuedJob, 1);
+      queued->job = g_object_ref (job);
+      queued->backend = backend ? g_object_ref (backend) : NULL;
+      g_get_current_time (&queued->queued_time);
+
+      g_mutex_lock (daemon->lock);
+      stats = daemon_get_job_stats (daemon, job);
+      stats->queue_depth++;
+      stats->max_queue_depth = MAX (stats->max_queue_depth, stats->queue_depth);
+      g_mutex_unlock (daemon->lock);
+      
+      g_thread_pool_push (daemon->thread_pool, queued, NULL); /* TODO: Check error */
     }
 }
 
+void
+g_vfs_daemon_queue_job (GVfsDaemon *daemon,
+			GVfsJob *job)
+{
+  daemon_queue_job (daemon, job, NULL);
+}
+
 static void
 new_connection_data_free (void *memory)
 {
@@ -1056,5 +1198,5 @@ g_vfs_daemon_initiate_mount (GVfsDaemon *daemon,
   g_object_unref (backend);
 
   job = g_vfs_job_mount_new (mount_spec, mount_source, is_automount, request, backend);
-  g_vfs_daemon_queue_job (daemon, job);
+  daemon_queue_job (daemon, job, backend);
 }
@@ -33,6 +33,7 @@
 #include "gvfsjobenumerate.h"
 #include "gdbusutils.h"
 #include "gvfsdaemonprotocol.h"
+#include "gvfsfileinfo.h"
 
 G_DEFINE_TYPE (GVfsJobEnumerate, g_vfs_job_enumerate, G_VFS_TYPE_JOB_DBUS)
 
@@ -55,6 +56,15 @@ g_vfs_job_enumerate_finalize (GObject *object)
   g_file_attribute_matcher_unref (job->attribute_matcher);
   g_free (job->object_path);
   g_free (job->uri);
+
+  if (job->building_data)
+    g_object_unref (job->building_data);
+  if (job->building_infos)
+    dbus_message_unref (job->building_infos);
+  if (job->new_attributes)
+    g_ptr_array_free (job->new_attributes, TRUE);
+  if (job->attribute_ids)
+    g_hash_table_destroy (job->attribute_ids);
   
   if (G_OBJECT_CLASS (g_vfs_job_enumerate_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_job_enumerate_parent_class)->finalize) (object);
@@ -92,6 +102,7 @@ g_vfs_job_enumerate_new (DBusConnection *connection,
   const char *path_data;
   char *attributes, *uri;
   dbus_uint32_t flags;
+  dbus_bool_t compact;
   DBusMessageIter iter;
   
   dbus_message_iter_init (message, &iter);
@@ -119,6 +130,13 @@ g_vfs_job_enumerate_new (DBusConnection *connection,
 				      0))
     uri = NULL;
 
+  /* Optional arg, TRUE if the client understands GotInfoCompact */
+  if (uri == NULL ||
+      !_g_dbus_message_iter_get_args (&iter, NULL,
+				      DBUS_TYPE_BOOLEAN, &compact,
+				      0))
+    compact = FALSE;
+
   job = g_object_new (G_VFS_TYPE_JOB_ENUMERATE,
 		      "message", message,
 		      "connection", connection,
@@ -131,6 +149,14 @@ g_vfs_job_enumerate_new (DBusConnection *connection,
   job->attribute_matcher = g_file_attribute_matcher_new (attributes);
   job->flags = flags;
   job->uri = g_strdup (uri);
+  job->compact = compact;
+
+  if (job->compact)
+    {
+      job->attribute_ids = g_hash_table_new_full (g_str_hash, g_str_equal,
+						  g_free, NULL);
+      job->new_attributes = g_ptr_array_new ();
+    }
   
   return G_VFS_JOB (job);
 }
@@ -138,7 +164,34 @@ g_vfs_job_enumerate_new (DBusConnection *connection,
 static void
 send_infos (GVfsJobEnumerate *job)
 {
-  if (!dbus_message_iter_close_container (&job->building_iter, &job->building_array_iter))
+  GMemoryOutputStream *memstream;
+  GOutputStream *base_stream;
+  dbus_uint32_t n_infos;
+  char *data;
+  int data_len;
+
+  if (job->compact)
+    {
+      base_stream = g_filter_output_stream_get_base_stream (G_FILTER_OUTPUT_STREAM (job->building_data));
+      memstream = G_MEMORY_OUTPUT_STREAM (base_stream);
+      data = g_memory_output_stream_get_data (memstream);
+      data_len = g_memory_output_stream_get_data_size (memstream);
+      n_infos = job->n_building_infos;
+
+      _g_dbus_message_append_args (job->building_infos,
+				   DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+				   &job->new_attributes->pdata, job->new_attributes->len,
+				   DBUS_TYPE_UINT32, &n_infos,
+				   DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+				   &data, data_len,
+				   0);
+
+      /* The names are owned by attribute_ids */
+      g_ptr_array_set_size (job->new_attributes, 0);
+      g_object_unref (job->building_data);
+      job->building_data = NULL;
+    }
+  else if (!dbus_message_iter_close_container (&job->building_iter, &job->building_array_iter))
     _g_dbus_oom ();
   
   dbus_connection_send (g_vfs_job_dbus_get_connection (G_VFS_JOB_DBUS (job)),
@@ -153,6 +206,7 @@ g_vfs_job_enumerate_add_info (GVfsJobEnumerate *job,
 			      GFileInfo *info)
 {
   DBusMessage *message, *orig_message;
+  GOutputStream *memstream;
   char *uri, *escaped_name;
   
   if (job->building_infos == NULL)
@@ -162,16 +216,28 @@ g_vfs_job_enumerate_add_info (GVfsJobEnumerate *job,
       message = dbus_message_new_method_call (dbus_message_get_sender (orig_message),
 					      job->object_path,
 					      G_VFS_DBUS_ENUMERATOR_INTERFACE,
+					      job->compact ?
+					      G_VFS_DBUS_ENUMERATOR_OP_GOT_INFO_COMPACT :
 					      G_VFS_DBUS_ENUMERATOR_OP_GOT_INFO);
       dbus_message_set_no_reply (message, TRUE);
+
+      if (job->compact)
+	{
+	  /* The args are appended in send_infos() */
+	  memstream = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+	  job->building_data = g_data_output_stream_new (memstream);
+	  g_object_unref (memstream);
+	}
+      else
+	{
+	  dbus_message_iter_init_append (message, &job->building_iter);
       
-      dbus_message_iter_init_append (message, &job->building_iter);
-      
-      if (!dbus_message_iter_open_container (&job->building_iter,
-					     DBUS_TYPE_ARRAY,
-					     G_FILE_INFO_TYPE_AS_STRING, 
-					     &job->building_array_iter))
-	_g_dbus_oom ();
+	  if (!dbus_message_iter_open_container (&job->building_iter,
+						 DBUS_TYPE_ARRAY,
+						 G_FILE_INFO_TYPE_AS_STRING, 
+						 &job->building_array_iter))
+	    _g_dbus_oom ();
+	}
 
       job->building_infos = message;
       job->n_building_infos = 0;
@@ -198,7 +264,11 @@ g_vfs_job_enumerate_add_info (GVfsJobEnumerate *job,
 
   g_file_info_set_attribute_mask (info, job->attribute_matcher);
   
-  _g_dbus_append_file_info (&job->building_array_iter, info);
+  if (job->compact)
+    gvfs_file_info_marshal_compact (info, job->building_data,
+				    job->attribute_ids, job->new_attributes);
+  else
+    _g_dbus_append_file_info (&job->building_array_iter, info);
   job->n_building_infos++;
 
   if (job->n_building_infos == 50)
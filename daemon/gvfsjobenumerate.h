@@ -50,11 +50,17 @@ struct _GVfsJobEnumerate
   GFileAttributeMatcher *attribute_matcher;
   GFileQueryInfoFlags flags;
   char *uri;
+  gboolean compact;
 
   DBusMessage *building_infos;
   DBusMessageIter building_iter;
   DBusMessageIter building_array_iter;
   int n_building_infos;
+
+  /* For GotInfoCompact */
+  GHashTable *attribute_ids;
+  GPtrArray *new_attributes;
+  GDataOutputStream *building_data;
 };
 
 struct _GVfsJobEnumerateClass
@@ -38,6 +38,7 @@ G_DEFINE_TYPE (GVfsJobRead, g_vfs_job_read, G_VFS_TYPE_JOB)
 static void     run        (GVfsJob *job);
 static gboolean try        (GVfsJob *job);
 static void     send_reply (GVfsJob *job);
+static void     finished   (GVfsJob *job);
 
 static void
 g_vfs_job_read_finalize (GObject *object)
@@ -47,7 +48,6 @@ g_vfs_job_read_finalize (GObject *object)
   job = G_VFS_JOB_READ (object);
 
   g_object_unref (job->channel);
-  g_free (job->buffer);
   
   if (G_OBJECT_CLASS (g_vfs_job_read_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_job_read_parent_class)->finalize) (object);
@@ -64,6 +64,7 @@ g_vfs_job_read_class_init (GVfsJobReadClass *klass)
   job_class->run = run;
   job_class->try = try;
   job_class->send_reply = send_reply;
+  job_class->finished = finished;
 }
 
 static void
@@ -85,7 +86,7 @@ g_vfs_job_read_new (GVfsReadChannel *channel,
   job->backend = backend;
   job->channel = g_object_ref (channel);
   job->handle = handle;
-  job->buffer = g_malloc (bytes_requested);
+  job->buffer = g_vfs_read_channel_get_read_buffer (channel, bytes_requested);
   job->bytes_requested = bytes_requested;
   
   return G_VFS_JOB (job);
@@ -108,6 +109,15 @@ send_reply (GVfsJob *job)
     }
 }
 
+/* The reply is sent, the channel can have its buffer back */
+static void
+finished (GVfsJob *job)
+{
+  GVfsJobRead *op_job = G_VFS_JOB_READ (job);
+
+  g_vfs_read_channel_release_read_buffer (op_job->channel);
+}
+
 static void
 run (GVfsJob *job)
 {
@@ -46,7 +46,7 @@ struct _GVfsJobRead
   GVfsBackend *backend;
   GVfsBackendHandle handle;
   gsize bytes_requested;
-  char *buffer;
+  char *buffer; /* Owned by the channel */
   gsize data_count;
 };
 
@@ -22,6 +22,7 @@
 
 #include <config.h>
 
+#include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
@@ -41,12 +42,43 @@
 #include <gvfsjobcloseread.h>
 #include <gvfsfileinfo.h>
 
+/* Read sizes start small so random access stays cheap, and double
+   for every full sequential read that the backend serves quickly,
+   up to READ_SIZE_MAX. Slow reads shrink the window again so a
+   single request doesn't block the channel for too long. */
+#define READ_SIZE_INITIAL (16*1024)
+#define READ_SIZE_MAX (4*1024*1024)
+#define READ_FAST_USEC (G_USEC_PER_SEC / 5)
+#define READ_SLOW_USEC G_USEC_PER_SEC
+
+/* The read buffer is page aligned and a whole number of pages */
+#define READ_BUFFER_ALIGN 4096
+
 struct _GVfsReadChannel
 {
   GVfsChannel parent_instance;
 
   guint read_count;
   int seek_generation;
+
+  /* Readahead state, only touched by the current job of the channel */
+  guint32 read_size;        /* Current window */
+  guint32 last_read_size;   /* Size asked of the backend by the last read */
+  GTimeVal read_start;
+  goffset position;
+  goffset size;             /* -1 if unknown */
+  goffset seek_end_offset;  /* Offset of a pending G_SEEK_END */
+  gboolean seek_to_end;
+
+  /* Shared by all read jobs, there is only one at a time */
+  char *read_buffer;
+  gsize read_buffer_size;
+
+  /* Statistics, what a buffer per job would have cost */
+  guint n_read_buffer_requests;
+  guint n_read_buffer_allocs;
+  guint64 bytes_requested;  /* allocated by a buffer per job */
+  guint64 bytes_allocated;  /* allocated by the shared buffer */
 };
 
 G_DEFINE_TYPE (GVfsReadChannel, g_vfs_read_channel, G_VFS_TYPE_CHANNEL)
@@ -63,9 +95,33 @@ static GVfsJob *read_channel_handle_request (GVfsChannel  *channel,
 static GVfsJob *read_channel_readahead      (GVfsChannel  *channel,
 					     GVfsJob       *job);
   
+static void
+read_buffer_free (GVfsReadChannel *channel)
+{
+#ifdef HAVE_POSIX_MEMALIGN
+  free (channel->read_buffer);
+#else
+  g_free (channel->read_buffer);
+#endif
+  channel->read_buffer = NULL;
+  channel->read_buffer_size = 0;
+}
+
 static void
 g_vfs_read_channel_finalize (GObject *object)
 {
+  GVfsReadChannel *channel;
+
+  channel = G_VFS_READ_CHANNEL (object);
+
+  if (channel->n_read_buffer_requests > 0)
+    g_debug ("read channel %p: %u reads, %u buffer allocations, "
+	     "%"G_GUINT64_FORMAT" bytes allocated per read instead of %"G_GUINT64_FORMAT"\n",
+	     channel, channel->n_read_buffer_requests, channel->n_read_buffer_allocs,
+	     channel->bytes_allocated / channel->n_read_buffer_requests,
+	     channel->bytes_requested / channel->n_read_buffer_requests);
+  read_buffer_free (channel);
+  
   if (G_OBJECT_CLASS (g_vfs_read_channel_parent_class)->finalize)
     (*G_OBJECT_CLASS (g_vfs_read_channel_parent_class)->finalize) (object);
 }
@@ -85,6 +141,9 @@ g_vfs_read_channel_class_init (GVfsReadChannelClass *klass)
 static void
 g_vfs_read_channel_init (GVfsReadChannel *channel)
 {
+  channel->read_size = READ_SIZE_INITIAL;
+  channel->position = 0;
+  channel->size = -1;
 }
 
 static GVfsJob *
@@ -95,6 +154,13 @@ read_channel_close (GVfsChannel *channel)
 				   g_vfs_channel_get_backend (channel));
 } 
 
+static void
+reset_read_size (GVfsReadChannel *channel)
+{
+  channel->read_count = 0;
+  channel->read_size = READ_SIZE_INITIAL;
+}
+
 /* Always request large chunks. Its very inefficient
    to do network requests for smaller chunks. */
 static guint32
@@ -102,25 +168,76 @@ modify_read_size (GVfsReadChannel *channel,
 		  guint32 requested_size)
 {
   guint32 real_size;
-  
-  if (channel->read_count <= 1)
-    real_size = 16*1024;
-  else if (channel->read_count <= 2)
-    real_size = 32*1024;
-  else
-    real_size = 64*1024;
-  
-  if (requested_size > real_size)
-    real_size = requested_size;
+  goffset remaining;
 
-  /* Don't do ridicoulously large requests as this
-     is just stupid on the network */
-  if (real_size > 512 * 1024)
-    real_size = 512 * 1024;
+  real_size = MAX (channel->read_size, requested_size);
+  if (real_size > READ_SIZE_MAX)
+    real_size = READ_SIZE_MAX;
+
+  /* Don't read ahead past the end we know about, but always
+     give the client what it asked for in case the file grew */
+  if (channel->size != -1)
+    {
+      remaining = channel->size - channel->position;
+      if (remaining < real_size)
+	real_size = MAX (MAX (remaining, 0), requested_size);
+    }
 
   return real_size;
 }
 
+static GVfsJob *
+read_channel_new_read_job (GVfsReadChannel *channel,
+			   guint32 size)
+{
+  channel->read_count++;
+  channel->last_read_size = size;
+  g_get_current_time (&channel->read_start);
+
+  return g_vfs_job_read_new (channel,
+			     g_vfs_channel_get_backend_handle (G_VFS_CHANNEL (channel)),
+			     size,
+			     g_vfs_channel_get_backend (G_VFS_CHANNEL (channel)));
+}
+
+/* Called when a read finished, with how much data we got back */
+static void
+update_read_size (GVfsReadChannel *channel,
+		  gsize count)
+{
+  GTimeVal now;
+  glong elapsed;
+
+  if (count == 0)
+    {
+      channel->size = channel->position;
+      return;
+    }
+
+  channel->position += count;
+  if (channel->size != -1 && channel->position > channel->size)
+    channel->size = -1; /* File grew */
+
+  /* Short reads don't tell us much, keep the window as is */
+  if (count < channel->last_read_size)
+    return;
+
+  g_get_current_time (&now);
+  elapsed = (now.tv_sec - channel->read_start.tv_sec) * G_USEC_PER_SEC +
+    (now.tv_usec - channel->read_start.tv_usec);
+
+  if (elapsed < READ_FAST_USEC)
+    {
+      if (channel->read_count > 1 && channel->read_size < READ_SIZE_MAX)
+	channel->read_size = MIN (channel->read_size * 2, READ_SIZE_MAX);
+    }
+  else if (elapsed > READ_SLOW_USEC)
+    {
+      if (channel->read_size > READ_SIZE_INITIAL)
+	channel->read_size /= 2;
+    }
+}
+
 static GVfsJob *
 read_channel_handle_request (GVfsChannel *channel,
 			     guint32 command,
@@ -136,6 +253,7 @@ read_channel_handle_request (GVfsChannel *channel,
   GVfsBackendHandle backend_handle;
   GVfsBackend *backend;
   GVfsReadChannel *read_channel;
+  goffset offset;
   char *attrs;
 
   read_channel = G_VFS_READ_CHANNEL (channel);
@@ -146,11 +264,8 @@ read_channel_handle_request (GVfsChannel *channel,
   switch (command)
     {
     case G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_READ:
-      read_channel->read_count++;
-      job = g_vfs_job_read_new (read_channel,
-				backend_handle,
-				modify_read_size (read_channel, arg1),
-				backend);
+      job = read_channel_new_read_job (read_channel,
+				       modify_read_size (read_channel, arg1));
       break;
     case G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_CLOSE:
       job = g_vfs_job_close_read_new (read_channel,
@@ -162,13 +277,20 @@ read_channel_handle_request (GVfsChannel *channel,
       seek_type = G_SEEK_SET;
       if (command == G_VFS_DAEMON_SOCKET_PROTOCOL_REQUEST_SEEK_END)
 	seek_type = G_SEEK_END;
-      
-      read_channel->read_count = 0;
+
+      offset = ((goffset)arg1) | (((goffset)arg2) << 32);
+
+      /* Seeking to where we already are doesn't break the stream */
+      if (seek_type != G_SEEK_SET || offset != read_channel->position)
+	reset_read_size (read_channel);
+
+      read_channel->seek_to_end = seek_type == G_SEEK_END;
+      read_channel->seek_end_offset = offset;
       read_channel->seek_generation++;
       job = g_vfs_job_seek_read_new (read_channel,
 				     backend_handle,
 				     seek_type,
-				     ((goffset)arg1) | (((goffset)arg2) << 32),
+				     offset,
 				     backend);
       break;
 
@@ -201,28 +323,86 @@ read_channel_readahead (GVfsChannel  *channel,
   GVfsJob *readahead_job;
   GVfsReadChannel *read_channel;
   GVfsJobRead *read_job;
+  GFileInfo *info;
+
+  read_channel = G_VFS_READ_CHANNEL (channel);
+  
+  if (G_VFS_IS_JOB_QUERY_INFO_READ (job) && !job->failed)
+    {
+      info = G_VFS_JOB_QUERY_INFO_READ (job)->file_info;
+      if (g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_STANDARD_SIZE))
+	read_channel->size = g_file_info_get_size (info);
+    }
 
   readahead_job = NULL;
   if (!job->failed &&
       G_VFS_IS_JOB_READ (job))
     {
       read_job = G_VFS_JOB_READ (job);
-      read_channel = G_VFS_READ_CHANNEL (channel);
-
-      if (read_job->data_count != 0)
-	{
-	  read_channel->read_count++;
-	  readahead_job = g_vfs_job_read_new (read_channel,
-					      g_vfs_channel_get_backend_handle (channel),
-					      modify_read_size (read_channel, 8192),
-					      g_vfs_channel_get_backend (channel));
-	}
+
+      if (read_job->data_count != 0 &&
+	  (read_channel->size == -1 ||
+	   read_channel->position < read_channel->size))
+	readahead_job = read_channel_new_read_job (read_channel,
+						   modify_read_size (read_channel, 0));
     }
   
   return readahead_job;
 }
 
 
+/* Returns a buffer of at least size bytes for the current read
+ * job. It is owned by the channel and reused by the next read job,
+ * which can't start before the reply of the current one is sent.
+ */
+char *
+g_vfs_read_channel_get_read_buffer (GVfsReadChannel *read_channel,
+				    gsize            size)
+{
+  gsize buffer_size;
+
+  /* Round up to whole pages to avoid reallocating for every step
+     of the read size ramp */
+  buffer_size = (MAX (size, 1) + READ_BUFFER_ALIGN - 1) & ~(gsize)(READ_BUFFER_ALIGN - 1);
+
+  read_channel->n_read_buffer_requests++;
+  read_channel->bytes_requested += size;
+
+  /* Also give memory back when the window shrank, so a channel
+     that went slow doesn't keep the largest buffer around */
+  if (buffer_size > read_channel->read_buffer_size ||
+      buffer_size <= read_channel->read_buffer_size / 2)
+    {
+      read_buffer_free (read_channel);
+#ifdef HAVE_POSIX_MEMALIGN
+      if (posix_memalign ((void **)&read_channel->read_buffer,
+			  READ_BUFFER_ALIGN, buffer_size) != 0)
+	g_error ("%s: failed to allocate %"G_GSIZE_FORMAT" bytes",
+		 G_STRLOC, buffer_size);
+#else
+      read_channel->read_buffer = g_malloc (buffer_size);
+#endif
+      read_channel->read_buffer_size = buffer_size;
+      read_channel->n_read_buffer_allocs++;
+      read_channel->bytes_allocated += buffer_size;
+    }
+
+  return read_channel->read_buffer;
+}
+
+/* Called when the reply using the read buffer was sent. If the read
+ * window shrank since the buffer was allocated it is freed, so a
+ * channel that sits idle after slow reads doesn't keep it. */
+void
+g_vfs_read_channel_release_read_buffer (GVfsReadChannel *read_channel)
+{
+  gsize needed;
+
+  needed = MAX (read_channel->read_size, read_channel->last_read_size);
+  if (read_channel->read_buffer_size >= 2 * needed)
+    read_buffer_free (read_channel);
+}
+
 /* Might be called on an i/o thread
  */
 void
@@ -233,6 +413,11 @@ g_vfs_read_channel_send_seek_offset (GVfsReadChannel *read_channel,
   GVfsChannel *channel;
 
   channel = G_VFS_CHANNEL (read_channel);
+
+  if (read_channel->seek_to_end && read_channel->seek_end_offset <= 0)
+    read_channel->size = offset - read_channel->seek_end_offset;
+  read_channel->seek_to_end = FALSE;
+  read_channel->position = offset;
   
   reply.type = g_htonl (G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_SEEK_POS);
   reply.seq_nr = g_htonl (g_vfs_channel_get_current_seq_nr (channel));
@@ -272,6 +457,8 @@ g_vfs_read_channel_send_data (GVfsReadChannel  *read_channel,
 
   channel = G_VFS_CHANNEL (read_channel);
 
+  update_read_size (read_channel, count);
+
   reply.type = g_htonl (G_VFS_DAEMON_SOCKET_PROTOCOL_REPLY_DATA);
   reply.seq_nr = g_htonl (g_vfs_channel_get_current_seq_nr (channel));
   reply.arg1 = g_htonl (count);
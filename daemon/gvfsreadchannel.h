@@ -48,6 +48,9 @@ struct _GVfsReadChannelClass
 GType g_vfs_read_channel_get_type (void) G_GNUC_CONST;
 
 GVfsReadChannel *g_vfs_read_channel_new                (GVfsBackend        *backend);
+char *          g_vfs_read_channel_get_read_buffer    (GVfsReadChannel     *read_channel,
+						       gsize               size);
+void            g_vfs_read_channel_release_read_buffer (GVfsReadChannel    *read_channel);
 void            g_vfs_read_channel_send_data          (GVfsReadChannel     *read_channel,
 						       char               *buffer,
 						       gsize               count);
@@ -62,6 +62,7 @@ typedef struct  {
   char **scheme_aliases;
   int default_port;
   gboolean hostname_is_inet;
+  int max_job_threads;
 } VfsMountable; 
 
 typedef void (*MountCallback) (VfsMountable *mountable,
@@ -505,7 +506,14 @@ spawn_mount (MountData *data)
 						 data))
 	_g_dbus_oom ();
       
-      exec = g_strconcat (data->mountable->exec, " --spawner ", dbus_bus_get_unique_name (connection), " ", data->obj_path, NULL);
+      if (data->mountable->max_job_threads > 0)
+	exec = g_strdup_printf ("%s --max-job-threads %d --spawner %s %s",
+				data->mountable->exec,
+				data->mountable->max_job_threads,
+				dbus_bus_get_unique_name (connection),
+				data->obj_path);
+      else
+	exec = g_strconcat (data->mountable->exec, " --spawner ", dbus_bus_get_unique_name (connection), " ", data->obj_path, NULL);
 
       if (!g_spawn_command_line_async (exec, &error))
 	{
@@ -585,6 +593,7 @@ read_mountable_config (void)
 			    g_key_file_get_string_list (keyfile, "Mount", "SchemeAliases", NULL, NULL);
 			  mountable->default_port = g_key_file_get_integer (keyfile, "Mount", "DefaultPort", NULL);
 			  mountable->hostname_is_inet = g_key_file_get_boolean (keyfile, "Mount", "HostnameIsInetAddress", NULL);
+			  mountable->max_job_threads = g_key_file_get_integer (keyfile, "Mount", "MaxJobThreads", NULL);
 
 			  if (mountable->scheme == NULL)
 			    mountable->scheme = g_strdup (mountable->type);
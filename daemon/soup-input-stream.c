@@ -37,12 +37,27 @@ G_DEFINE_TYPE_WITH_CODE (SoupInputStream, soup_input_stream, G_TYPE_INPUT_STREAM
 
 typedef void (*SoupInputStreamCallback) (GInputStream *);
 
+/* Recently received data is kept in a few blocks, so seeking back and
+ * forth over small distances doesn't need a new request */
+#define SOUP_INPUT_STREAM_BLOCK_SIZE   (64 * 1024)
+#define SOUP_INPUT_STREAM_CACHE_BLOCKS 16
+
+typedef struct {
+  goffset offset;	/* position of the block in the file */
+  gsize start, end;	/* the part of data that is valid */
+  guchar data[SOUP_INPUT_STREAM_BLOCK_SIZE];
+} SoupInputStreamBlock;
+
 typedef struct {
   SoupSession *session;
   GMainContext *async_context;
   SoupMessage *msg;
   gboolean got_headers, finished;
-  goffset offset;
+  goffset offset;	/* position of the next read */
+  goffset net_offset;	/* position of the next byte from the network */
+  goffset length;	/* size of the file or -1 if not known */
+
+  GQueue *cache;	/* most recently used block first */
 
   GCancellable *cancellable;
   GSource *cancel_watch;
@@ -123,6 +138,9 @@ soup_input_stream_finalize (GObject *object)
   g_object_unref (priv->msg);
   g_free (priv->leftover_buffer);
 
+  g_queue_foreach (priv->cache, (GFunc) g_free, NULL);
+  g_queue_free (priv->cache);
+
   if (G_OBJECT_CLASS (soup_input_stream_parent_class)->finalize)
     (*G_OBJECT_CLASS (soup_input_stream_parent_class)->finalize) (object);
 }
@@ -158,7 +176,10 @@ soup_input_stream_seekable_iface_init (GSeekableIface *seekable_iface)
 static void
 soup_input_stream_init (SoupInputStream *stream)
 {
-  ;
+  SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
+
+  priv->length = -1;
+  priv->cache = g_queue_new ();
 }
 
 static void
@@ -225,6 +246,103 @@ soup_input_stream_new (SoupSession *session, SoupMessage *msg)
   return G_INPUT_STREAM (stream);
 }
 
+static SoupInputStreamBlock *
+soup_input_stream_cache_lookup (SoupInputStreamPrivate *priv, goffset offset)
+{
+  SoupInputStreamBlock *block;
+  GList *l;
+
+  for (l = priv->cache->head; l; l = l->next)
+    {
+      block = l->data;
+      if (block->offset == offset)
+	{
+	  g_queue_unlink (priv->cache, l);
+	  g_queue_push_head_link (priv->cache, l);
+	  return block;
+	}
+    }
+
+  return NULL;
+}
+
+static void
+soup_input_stream_cache_add (SoupInputStreamPrivate *priv, goffset offset,
+			     const guchar *data, gsize size)
+{
+  SoupInputStreamBlock *block;
+  goffset block_offset;
+  gsize pos, n;
+
+  while (size > 0)
+    {
+      pos = offset % SOUP_INPUT_STREAM_BLOCK_SIZE;
+      block_offset = offset - pos;
+      n = MIN (size, SOUP_INPUT_STREAM_BLOCK_SIZE - pos);
+
+      block = soup_input_stream_cache_lookup (priv, block_offset);
+      if (block == NULL)
+	{
+	  if (priv->cache->length >= SOUP_INPUT_STREAM_CACHE_BLOCKS)
+	    block = g_queue_pop_tail (priv->cache);
+	  else
+	    block = g_new (SoupInputStreamBlock, 1);
+	  block->offset = block_offset;
+	  block->start = block->end = pos;
+	  g_queue_push_head (priv->cache, block);
+	}
+      else if (pos > block->end || pos + n < block->start)
+	{
+	  /* Only one range per block, drop the old one */
+	  block->start = block->end = pos;
+	}
+
+      memcpy (block->data + pos, data, n);
+      block->start = MIN (block->start, pos);
+      block->end = MAX (block->end, pos + n);
+
+      offset += n;
+      data += n;
+      size -= n;
+    }
+}
+
+static gsize
+soup_input_stream_cache_read (SoupInputStreamPrivate *priv,
+			      gpointer buffer, gsize bufsize)
+{
+  SoupInputStreamBlock *block;
+  gsize pos, nread;
+
+  pos = priv->offset % SOUP_INPUT_STREAM_BLOCK_SIZE;
+  block = soup_input_stream_cache_lookup (priv, priv->offset - pos);
+  if (block == NULL || pos < block->start || pos >= block->end)
+    return 0;
+
+  nread = MIN (bufsize, block->end - pos);
+  memcpy (buffer, block->data + pos, nread);
+  priv->offset += nread;
+  return nread;
+}
+
+static void
+soup_input_stream_update_length (SoupInputStreamPrivate *priv, SoupMessage *msg)
+{
+  const char *range, *total;
+
+  if (msg->status_code == SOUP_STATUS_PARTIAL_CONTENT)
+    {
+      /* Content-Range: bytes first-last/length */
+      range = soup_message_headers_get (msg->response_headers, "Content-Range");
+      total = range ? strchr (range, '/') : NULL;
+      if (total && g_ascii_isdigit (total[1]))
+	priv->length = g_ascii_strtoull (total + 1, NULL, 10);
+    }
+  else if (priv->net_offset == 0 &&
+	   soup_message_headers_get_encoding (msg->response_headers) == SOUP_ENCODING_CONTENT_LENGTH)
+    priv->length = soup_message_headers_get_content_length (msg->response_headers);
+}
+
 static void
 soup_input_stream_got_headers (SoupMessage *msg, gpointer stream)
 {
@@ -239,6 +357,7 @@ soup_input_stream_got_headers (SoupMessage *msg, gpointer stream)
     return;
 
   priv->got_headers = TRUE;
+  soup_input_stream_update_length (priv, msg);
   if (!priv->caller_buffer)
     {
       /* Not ready to read the body yet */
@@ -267,6 +386,9 @@ soup_input_stream_got_chunk (SoupMessage *msg, SoupBuffer *chunk_buffer,
   if (priv->caller_bufsize == 0 || priv->leftover_bufsize != 0)
     g_warning ("soup_input_stream_got_chunk called again before previous chunk was processed");
 
+  soup_input_stream_cache_add (priv, priv->net_offset, (const guchar *) chunk, chunk_size);
+  priv->net_offset += chunk_size;
+
   /* Copy what we can into priv->caller_buffer */
   if (priv->caller_bufsize - priv->caller_nread > 0)
     {
@@ -414,6 +536,74 @@ read_from_leftover (SoupInputStreamPrivate *priv,
   return nread;
 }
 
+extern void soup_message_io_cleanup (SoupMessage *msg);
+
+/* Sends the request again, for the data starting at priv->offset */
+static void
+soup_input_stream_restart (GInputStream *stream)
+{
+  SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
+  char *range;
+
+  soup_session_cancel_message (priv->session, priv->msg, SOUP_STATUS_CANCELLED);
+  soup_message_io_cleanup (priv->msg);
+
+  g_free (priv->leftover_buffer);
+  priv->leftover_buffer = NULL;
+  priv->leftover_bufsize = priv->leftover_offset = 0;
+
+  range = g_strdup_printf ("bytes=%"G_GUINT64_FORMAT"-", (guint64)priv->offset);
+  soup_message_headers_remove (priv->msg->request_headers, "Range");
+  soup_message_headers_append (priv->msg->request_headers, "Range", range);
+  g_free (range);
+
+  priv->net_offset = priv->offset;
+  soup_input_stream_queue_message (SOUP_INPUT_STREAM (stream));
+}
+
+/* Tries to satisfy a read without going to the network: from the
+ * cache after a seek, or by noticing the end of the file. Returns -1
+ * if the data has to come from the message, which has been made to
+ * deliver the data at priv->offset next.
+ */
+static gssize
+soup_input_stream_read_local (GInputStream *stream,
+			      gpointer      buffer,
+			      gsize         count)
+{
+  SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
+  goffset position;
+  gsize nread;
+
+  if (priv->length >= 0 && priv->offset >= priv->length)
+    return 0;
+
+  /* the position of the next byte from the leftover buffer or network */
+  position = priv->net_offset - (priv->leftover_bufsize - priv->leftover_offset);
+  if (priv->offset == position)
+    return -1;
+
+  nread = soup_input_stream_cache_read (priv, buffer, count);
+  if (nread > 0)
+    return nread;
+
+  if (priv->offset > position && priv->offset <= priv->net_offset)
+    {
+      /* Skip forward in the leftover data */
+      priv->leftover_offset += priv->offset - position;
+      if (priv->leftover_offset == priv->leftover_bufsize)
+	{
+	  g_free (priv->leftover_buffer);
+	  priv->leftover_buffer = NULL;
+	  priv->leftover_bufsize = priv->leftover_offset = 0;
+	}
+    }
+  else
+    soup_input_stream_restart (stream);
+
+  return -1;
+}
+
 /* This does the work of soup_input_stream_send(), assuming that the
  * GInputStream pending flag has already been set. It is also used by
  * soup_input_stream_send_async() in some circumstances.
@@ -477,6 +667,11 @@ soup_input_stream_read (GInputStream *stream,
 			GError      **error)
 {
   SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
+  gssize nread;
+
+  nread = soup_input_stream_read_local (stream, buffer, count);
+  if (nread >= 0)
+    return nread;
 
   if (priv->finished)
     return 0;
@@ -728,6 +923,7 @@ soup_input_stream_read_async (GInputStream        *stream,
 {
   SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
   GSimpleAsyncResult *result;
+  gssize nread;
 
   /* If the session uses the default GMainContext, then we can do
    * async I/O directly. But if it has its own main context, we fall
@@ -745,6 +941,15 @@ soup_input_stream_read_async (GInputStream        *stream,
 				      callback, user_data,
 				      soup_input_stream_read_async);
 
+  nread = soup_input_stream_read_local (stream, buffer, count);
+  if (nread >= 0)
+    {
+      g_simple_async_result_set_op_res_gssize (result, nread);
+      g_simple_async_result_complete_in_idle (result);
+      g_object_unref (result);
+      return;
+    }
+
   if (priv->finished)
     {
       g_simple_async_result_set_op_res_gssize (result, 0);
@@ -833,8 +1038,105 @@ soup_input_stream_can_seek (GSeekable *seekable)
   return TRUE;
 }
 
-extern void soup_message_io_cleanup (SoupMessage *msg);
+static void
+probe_length_finished (SoupSession *session,
+		       SoupMessage *msg,
+		       gpointer     user_data)
+{
+  GSimpleAsyncResult *result = user_data;
+  GInputStream *stream;
+  SoupInputStreamPrivate *priv;
+  GError *error = NULL;
+
+  stream = G_INPUT_STREAM (g_async_result_get_source_object (G_ASYNC_RESULT (result)));
+  priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
 
+  if (!set_error_if_http_failed (msg, &error))
+    {
+      if (soup_message_headers_get_encoding (msg->response_headers) == SOUP_ENCODING_CONTENT_LENGTH)
+	priv->length = soup_message_headers_get_content_length (msg->response_headers);
+      else
+	g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+			     "G_SEEK_END not supported, the size of the file is not known");
+    }
+
+  if (error)
+    {
+      g_simple_async_result_set_from_error (result, error);
+      g_error_free (error);
+    }
+
+  g_simple_async_result_complete (result);
+  g_object_unref (result);
+  g_object_unref (stream);
+}
+
+/**
+ * soup_input_stream_probe_length_async:
+ * @stream: a #SoupInputStream
+ * @callback: callback to call when the length is known
+ * @user_data: the data to pass to callback function
+ *
+ * Asynchronously finds out the size of the file with a HEAD request,
+ * unless it is already known from an earlier response. Seeking with
+ * %G_SEEK_END only succeeds once the size is known, so call this
+ * first instead of blocking inside g_seekable_seek().
+ **/
+void
+soup_input_stream_probe_length_async (GInputStream        *stream,
+				      GAsyncReadyCallback  callback,
+				      gpointer             user_data)
+{
+  SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (stream);
+  GSimpleAsyncResult *result;
+  SoupMessage *msg;
+
+  g_return_if_fail (SOUP_IS_INPUT_STREAM (stream));
+
+  result = g_simple_async_result_new (G_OBJECT (stream),
+				      callback, user_data,
+				      soup_input_stream_probe_length_async);
+
+  if (priv->length >= 0)
+    {
+      g_simple_async_result_complete_in_idle (result);
+      g_object_unref (result);
+      return;
+    }
+
+  msg = soup_message_new_from_uri (SOUP_METHOD_HEAD, soup_message_get_uri (priv->msg));
+  soup_session_queue_message (priv->session, msg,
+			      probe_length_finished, result);
+}
+
+/**
+ * soup_input_stream_probe_length_finish:
+ * @stream: a #SoupInputStream
+ * @result: a #GAsyncResult.
+ * @error: a #GError location to store the error occuring, or %NULL to
+ * ignore.
+ *
+ * Finishes a soup_input_stream_probe_length_async() operation.
+ *
+ * Return value: %TRUE if the size of the file is known.
+ **/
+gboolean
+soup_input_stream_probe_length_finish (GInputStream  *stream,
+				       GAsyncResult  *result,
+				       GError       **error)
+{
+  GSimpleAsyncResult *simple;
+
+  g_return_val_if_fail (G_IS_SIMPLE_ASYNC_RESULT (result), FALSE);
+  simple = G_SIMPLE_ASYNC_RESULT (result);
+
+  g_return_val_if_fail (g_simple_async_result_get_source_tag (simple) == soup_input_stream_probe_length_async, FALSE);
+
+  return !g_simple_async_result_propagate_error (simple, error);
+}
+
+/* Seeking only moves the position. The next read is served from the
+ * cache if possible, and restarts the request otherwise. */
 static gboolean
 soup_input_stream_seek (GSeekable     *seekable,
 			goffset        offset,
@@ -844,53 +1146,47 @@ soup_input_stream_seek (GSeekable     *seekable,
 {
   GInputStream *stream = G_INPUT_STREAM (seekable);
   SoupInputStreamPrivate *priv = SOUP_INPUT_STREAM_GET_PRIVATE (seekable);
-  char *range;
-
-  if (type == G_SEEK_END)
-    {
-      /* FIXME: we could send "bytes=-offset", but unless we know the
-       * Content-Length, we wouldn't be able to answer a tell() properly.
-       * We could find the Content-Length by doing a HEAD...
-       */
-
-      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
-	                   "G_SEEK_END not currently supported");
-      return FALSE;
-    }
 
   if (!g_input_stream_set_pending (stream, error))
       return FALSE;
 
-  soup_session_cancel_message (priv->session, priv->msg, SOUP_STATUS_CANCELLED);
-  soup_message_io_cleanup (priv->msg);
-
   switch (type)
     {
     case G_SEEK_CUR:
       offset += priv->offset;
-      /* fall through */
+      break;
 
     case G_SEEK_SET:
-      range = g_strdup_printf ("bytes=%"G_GUINT64_FORMAT"-", (guint64)offset);
-      priv->offset = offset;
       break;
 
     case G_SEEK_END:
-      range = NULL; /* keep compilers happy */
-      g_return_val_if_reached (FALSE);
+      if (priv->length < 0)
+	{
+	  /* Never block on a HEAD request here, callers must use
+	   * soup_input_stream_probe_length_async() first. */
+	  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+			       "G_SEEK_END not supported, the size of the file is not known");
+	  g_input_stream_clear_pending (stream);
+	  return FALSE;
+	}
+      offset += priv->length;
       break;
 
     default:
+      g_input_stream_clear_pending (stream);
       g_return_val_if_reached (FALSE);
     }
 
-  soup_message_headers_remove (priv->msg->request_headers, "Range");
-  soup_message_headers_append (priv->msg->request_headers, "Range", range);
-  g_free (range);
+  g_input_stream_clear_pending (stream);
 
-  soup_input_stream_queue_message (SOUP_INPUT_STREAM (stream));
+  if (offset < 0)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+			   "Invalid seek request");
+      return FALSE;
+    }
 
-  g_input_stream_clear_pending (stream);
+  priv->offset = offset;
   return TRUE;
 }
   
@@ -70,6 +70,13 @@ gboolean      soup_input_stream_send_finish (GInputStream        *stream,
 					     GAsyncResult        *result,
 					     GError             **error);
 
+void          soup_input_stream_probe_length_async  (GInputStream        *stream,
+						     GAsyncReadyCallback  callback,
+						     gpointer             user_data);
+gboolean      soup_input_stream_probe_length_finish (GInputStream        *stream,
+						     GAsyncResult        *result,
+						     GError             **error);
+
 #define SOUP_HTTP_ERROR soup_http_error_quark()
 GQuark soup_http_error_quark (void);
 
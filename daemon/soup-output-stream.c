@@ -32,21 +32,27 @@
 
 G_DEFINE_TYPE (SoupOutputStream, soup_output_stream, G_TYPE_OUTPUT_STREAM)
 
+/* Number of bytes that may be queued on the message but not yet sent
+ * before writes start to block */
+#define SOUP_OUTPUT_STREAM_WINDOW_SIZE (256 * 1024)
+
 typedef void (*SoupOutputStreamCallback) (GOutputStream *);
 
 typedef struct {
   SoupSession *session;
   GMainContext *async_context;
   SoupMessage *msg;
-  gboolean finished;
+  gboolean queued, io_started, finished;
+  gboolean complete, buffered;
 
   goffset size, offset;
-  GByteArray *ba;
+  goffset sent;
+  gsize in_flight;
 
   GCancellable *cancellable;
   GSource *cancel_watch;
+  SoupOutputStreamCallback drained_cb;
   SoupOutputStreamCallback finished_cb;
-  SoupOutputStreamCallback cancelled_cb;
 
   GSimpleAsyncResult *result;
 } SoupOutputStreamPrivate;
@@ -79,6 +85,9 @@ static gboolean soup_output_stream_close_finish (GOutputStream        *stream,
 						 GAsyncResult         *result,
 						 GError              **error);
 
+static void soup_output_stream_wrote_headers (SoupMessage *msg, gpointer stream);
+static void soup_output_stream_wrote_body_data (SoupMessage *msg, SoupBuffer *chunk, gpointer stream);
+static void soup_output_stream_restarted (SoupMessage *msg, gpointer stream);
 static void soup_output_stream_finished (SoupMessage *msg, gpointer stream);
 
 static void
@@ -86,13 +95,18 @@ soup_output_stream_finalize (GObject *object)
 {
   SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (object);
 
-  g_object_unref (priv->session);
-
+  g_signal_handlers_disconnect_by_func (priv->msg, G_CALLBACK (soup_output_stream_wrote_headers), object);
+  g_signal_handlers_disconnect_by_func (priv->msg, G_CALLBACK (soup_output_stream_wrote_body_data), object);
+  g_signal_handlers_disconnect_by_func (priv->msg, G_CALLBACK (soup_output_stream_restarted), object);
   g_signal_handlers_disconnect_by_func (priv->msg, G_CALLBACK (soup_output_stream_finished), object);
-  g_object_unref (priv->msg);
 
-  if (priv->ba)
-    g_byte_array_free (priv->ba, TRUE);
+  /* The stream went away without being closed, don't leave a
+   * half-sent request behind */
+  if (priv->queued && !priv->finished)
+    soup_session_cancel_message (priv->session, priv->msg, SOUP_STATUS_CANCELLED);
+
+  g_object_unref (priv->session);
+  g_object_unref (priv->msg);
 
   if (G_OBJECT_CLASS (soup_output_stream_parent_class)->finalize)
     (*G_OBJECT_CLASS (soup_output_stream_parent_class)->finalize) (object);
@@ -119,9 +133,7 @@ soup_output_stream_class_init (SoupOutputStreamClass *klass)
 static void
 soup_output_stream_init (SoupOutputStream *stream)
 {
-  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
-
-  priv->ba = g_byte_array_new ();
+  ;
 }
 
 
@@ -143,17 +155,26 @@ soup_output_stream_init (SoupOutputStream *stream)
  * that, or closing the stream without having written enough, will
  * result in an error.
  *
- * In some situations, the request will not actually be sent until you
- * call g_output_stream_close(). (In fact, currently this is *always*
- * true.)
+ * The request is sent while data is written to the stream, with a
+ * Content-Length header if @size is known and with chunked encoding
+ * otherwise. Only a limited amount of written data is kept in memory;
+ * once that is reached, writes don't complete until some of it has
+ * been sent. Since the data that was sent is not kept, the request
+ * fails if it has to be restarted (eg, for authentication) after the
+ * body started going out. "Expect: 100-continue" is used to make that
+ * unlikely. If the server refuses the chunked request with "411 Length
+ * Required" before any of it was sent, all further data is kept and
+ * the request is sent again with a Content-Length when the stream is
+ * closed.
  *
  * Internally, #SoupOutputStream is implemented using asynchronous
- * I/O, so if you are using the synchronous API (eg,
- * g_output_stream_write()), you should create a new #GMainContext and
- * set it as the %SOUP_SESSION_ASYNC_CONTEXT property on @session. (If
- * you don't, then synchronous #GOutputStream calls will cause the
- * main loop to be run recursively.) The async #GOutputStream API
- * works fine with %SOUP_SESSION_ASYNC_CONTEXT either set or unset.
+ * I/O, so @session must be a #SoupSessionAsync. If you are using the
+ * synchronous API (eg, g_output_stream_write()), you should create a
+ * new #GMainContext and set it as the %SOUP_SESSION_ASYNC_CONTEXT
+ * property on @session. (If you don't, then synchronous
+ * #GOutputStream calls will cause the main loop to be run
+ * recursively.) The async #GOutputStream API works fine with
+ * %SOUP_SESSION_ASYNC_CONTEXT either set or unset.
  *
  * Returns: a new #GOutputStream.
  **/
@@ -176,6 +197,163 @@ soup_output_stream_new (SoupSession *session, SoupMessage *msg, goffset size)
   return G_OUTPUT_STREAM (stream);
 }
 
+static void
+soup_output_stream_queue_message (GOutputStream *stream)
+{
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+  SoupMessage *msg = priv->msg;
+
+  priv->queued = TRUE;
+
+  /* Drop every chunk of the body once it has been written */
+  soup_message_body_set_accumulate (msg->request_body, FALSE);
+  soup_message_set_flags (msg, soup_message_get_flags (msg) | SOUP_MESSAGE_CAN_REBUILD);
+
+  if (priv->size > 0)
+    soup_message_headers_set_content_length (msg->request_headers, priv->size);
+  else
+    soup_message_headers_set_encoding (msg->request_headers, SOUP_ENCODING_CHUNKED);
+  soup_message_headers_set_expectations (msg->request_headers, SOUP_EXPECTATION_CONTINUE);
+
+  g_signal_connect (msg, "wrote_headers",
+		    G_CALLBACK (soup_output_stream_wrote_headers), stream);
+  g_signal_connect (msg, "wrote_body_data",
+		    G_CALLBACK (soup_output_stream_wrote_body_data), stream);
+  g_signal_connect (msg, "restarted",
+		    G_CALLBACK (soup_output_stream_restarted), stream);
+  g_signal_connect (msg, "finished",
+		    G_CALLBACK (soup_output_stream_finished), stream);
+
+  /* Add an extra ref since soup_session_queue_message steals one */
+  g_object_ref (msg);
+  soup_session_queue_message (priv->session, msg, NULL, NULL);
+}
+
+/* Sends the message of a buffered stream, which holds the whole body */
+static void
+soup_output_stream_queue_buffered (GOutputStream *stream)
+{
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+  SoupMessage *msg = priv->msg;
+
+  priv->queued = TRUE;
+
+  soup_message_headers_set_content_length (msg->request_headers, priv->offset);
+  soup_message_body_complete (msg->request_body);
+
+  g_signal_connect (msg, "finished",
+		    G_CALLBACK (soup_output_stream_finished), stream);
+
+  g_object_ref (msg);
+  soup_session_queue_message (priv->session, msg, NULL, NULL);
+}
+
+static void
+copy_request_header (const char *name, const char *value, gpointer headers)
+{
+  if (g_ascii_strcasecmp (name, "Transfer-Encoding") != 0 &&
+      g_ascii_strcasecmp (name, "Content-Length") != 0 &&
+      g_ascii_strcasecmp (name, "Expect") != 0)
+    soup_message_headers_append (headers, name, value);
+}
+
+/* None of the body was sent, so it is all still queued on the message.
+ * Move it to a new message that keeps the whole body and is sent with
+ * a Content-Length once the stream is complete. */
+static void
+soup_output_stream_fall_back_to_buffered (GOutputStream *stream)
+{
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+  SoupMessage *msg;
+  SoupBuffer *chunk;
+  goffset offset;
+
+  msg = soup_message_new_from_uri (priv->msg->method,
+				   soup_message_get_uri (priv->msg));
+  soup_message_headers_foreach (priv->msg->request_headers,
+				copy_request_header, msg->request_headers);
+
+  offset = 0;
+  while (offset < priv->offset &&
+	 (chunk = soup_message_body_get_chunk (priv->msg->request_body, offset)) != NULL)
+    {
+      soup_message_body_append_buffer (msg->request_body, chunk);
+      offset += chunk->length;
+      soup_buffer_free (chunk);
+    }
+
+  g_object_unref (priv->msg);
+  priv->msg = msg;
+  priv->buffered = TRUE;
+  priv->queued = FALSE;
+  priv->io_started = FALSE;
+  priv->in_flight = 0;
+
+  if (priv->complete)
+    soup_output_stream_queue_buffered (stream);
+  else if (priv->drained_cb)
+    priv->drained_cb (stream);
+}
+
+static void
+soup_output_stream_wrote_headers (SoupMessage *msg, gpointer stream)
+{
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+
+  /* From now on the message pauses itself when it runs out of data */
+  priv->io_started = TRUE;
+}
+
+static void
+soup_output_stream_wrote_body_data (SoupMessage *msg, SoupBuffer *chunk,
+				    gpointer stream)
+{
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+
+  priv->sent += chunk->length;
+  priv->in_flight -= MIN (priv->in_flight, chunk->length);
+
+  if (priv->in_flight <= SOUP_OUTPUT_STREAM_WINDOW_SIZE && priv->drained_cb)
+    priv->drained_cb (stream);
+}
+
+static void
+soup_output_stream_restarted (SoupMessage *msg, gpointer stream)
+{
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+
+  priv->io_started = FALSE;
+
+  /* The data that was already sent is gone, so the request can't be
+   * sent again */
+  if (priv->sent > 0)
+    soup_session_cancel_message (priv->session, msg, SOUP_STATUS_IO_ERROR);
+}
+
+static void
+soup_output_stream_finished (SoupMessage *msg, gpointer stream)
+{
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+
+  g_signal_handlers_disconnect_by_func (msg, G_CALLBACK (soup_output_stream_wrote_headers), stream);
+  g_signal_handlers_disconnect_by_func (msg, G_CALLBACK (soup_output_stream_wrote_body_data), stream);
+  g_signal_handlers_disconnect_by_func (msg, G_CALLBACK (soup_output_stream_restarted), stream);
+  g_signal_handlers_disconnect_by_func (msg, G_CALLBACK (soup_output_stream_finished), stream);
+
+  /* Some servers don't accept chunked requests */
+  if (msg->status_code == SOUP_STATUS_LENGTH_REQUIRED &&
+      !priv->buffered && priv->sent == 0)
+    {
+      soup_output_stream_fall_back_to_buffered (stream);
+      return;
+    }
+
+  priv->finished = TRUE;
+
+  if (priv->finished_cb)
+    priv->finished_cb (stream);
+}
+
 static gboolean
 soup_output_stream_cancelled (GIOChannel *chan, GIOCondition condition,
 			      gpointer stream)
@@ -184,9 +362,8 @@ soup_output_stream_cancelled (GIOChannel *chan, GIOCondition condition,
 
   priv->cancel_watch = NULL;
 
-  soup_session_pause_message (priv->session, priv->msg);
-  if (priv->cancelled_cb)
-    priv->cancelled_cb (stream);
+  /* This emits "finished", which completes the pending operation */
+  soup_session_cancel_message (priv->session, priv->msg, SOUP_STATUS_CANCELLED);
 
   return FALSE;
 }  
@@ -197,12 +374,6 @@ soup_output_stream_prepare_for_io (GOutputStream *stream, GCancellable *cancella
   SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
   int cancel_fd;
 
-  /* Move the buffer to the SoupMessage */
-  soup_message_body_append (priv->msg->request_body, SOUP_MEMORY_TAKE,
-			    priv->ba->data, priv->ba->len);
-  g_byte_array_free (priv->ba, FALSE);
-  priv->ba = NULL;
-
   /* Set up cancellation */
   priv->cancellable = cancellable;
   cancel_fd = g_cancellable_get_fd (cancellable);
@@ -215,10 +386,6 @@ soup_output_stream_prepare_for_io (GOutputStream *stream, GCancellable *cancella
 					      stream);
       g_io_channel_unref (chan);
     }
-
-  /* Add an extra ref since soup_session_queue_message steals one */
-  g_object_ref (priv->msg);
-  soup_session_queue_message (priv->session, priv->msg, NULL, NULL);
 }
 
 static void
@@ -246,6 +413,85 @@ set_error_if_http_failed (SoupMessage *msg, GError **error)
   return FALSE;
 }
 
+/* The server may answer before it got the whole body, usually to
+ * refuse it. Writing more data is an error then. */
+static gboolean
+set_error_if_finished (SoupOutputStreamPrivate *priv, GError **error)
+{
+  if (!priv->finished)
+    return FALSE;
+
+  if (!set_error_if_http_failed (priv->msg, error))
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+			 "Request finished before all data was sent");
+  return TRUE;
+}
+
+/* Hands @buffer to the message, which sends it as soon as it can */
+static gboolean
+soup_output_stream_append (GOutputStream  *stream,
+			   const void     *buffer,
+			   gsize           count,
+			   GError        **error)
+{
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+
+  if (priv->size > 0 && priv->offset + count > priv->size)
+    {
+      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+			   "Write would exceed caller-defined file size");
+      return FALSE;
+    }
+
+  if (set_error_if_finished (priv, error))
+    return FALSE;
+
+  /* an empty chunk would end a chunked body */
+  if (count == 0)
+    return TRUE;
+
+  if (!priv->queued && !priv->buffered)
+    soup_output_stream_queue_message (stream);
+
+  soup_message_body_append (priv->msg->request_body, SOUP_MEMORY_COPY,
+			    buffer, count);
+  priv->offset += count;
+  /* a buffered stream sends everything when it is closed */
+  if (!priv->buffered)
+    priv->in_flight += count;
+
+  if (priv->io_started)
+    soup_session_unpause_message (priv->session, priv->msg);
+
+  return TRUE;
+}
+
+/* Ends the body and makes sure the message gets sent */
+static void
+soup_output_stream_complete (GOutputStream *stream)
+{
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+
+  priv->complete = TRUE;
+
+  if (priv->buffered)
+    {
+      if (!priv->queued)
+	soup_output_stream_queue_buffered (stream);
+      return;
+    }
+
+  if (!priv->queued)
+    soup_output_stream_queue_message (stream);
+
+  if (priv->finished)
+    return;
+
+  soup_message_body_complete (priv->msg->request_body);
+  if (priv->io_started)
+    soup_session_unpause_message (priv->session, priv->msg);
+}
+
 static gssize
 soup_output_stream_write (GOutputStream  *stream,
 			  const void     *buffer,
@@ -255,14 +501,23 @@ soup_output_stream_write (GOutputStream  *stream,
 {
   SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
 
-  if (priv->size > 0 && priv->offset + count > priv->size) {
-      g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
-			   "Write would exceed caller-defined file size");
-      return -1;
-  }
+  if (!soup_output_stream_append (stream, buffer, count, error))
+    return -1;
+
+  if (priv->in_flight > SOUP_OUTPUT_STREAM_WINDOW_SIZE)
+    {
+      soup_output_stream_prepare_for_io (stream, cancellable);
+      while (priv->in_flight > SOUP_OUTPUT_STREAM_WINDOW_SIZE &&
+	     !priv->finished && !g_cancellable_is_cancelled (cancellable))
+	g_main_context_iteration (priv->async_context, TRUE);
+      soup_output_stream_done_io (stream);
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+	return -1;
+      if (priv->in_flight > 0 && set_error_if_finished (priv, error))
+	return -1;
+    }
 
-  g_byte_array_append (priv->ba, buffer, count);
-  priv->offset += count;
   return count;
 }
 
@@ -279,14 +534,44 @@ soup_output_stream_close (GOutputStream  *stream,
       return -1;
   }
 
+  soup_output_stream_complete (stream);
   soup_output_stream_prepare_for_io (stream, cancellable);
   while (!priv->finished && !g_cancellable_is_cancelled (cancellable))
     g_main_context_iteration (priv->async_context, TRUE);
   soup_output_stream_done_io (stream);
 
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
   return !set_error_if_http_failed (priv->msg, error);
 }
 
+static void
+write_async_done (GOutputStream *stream)
+{
+  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
+  GSimpleAsyncResult *result;
+  GError *error = NULL;
+
+  result = priv->result;
+  priv->result = NULL;
+
+  if (g_cancellable_set_error_if_cancelled (priv->cancellable, &error) ||
+      (priv->in_flight > 0 && set_error_if_finished (priv, &error)))
+    {
+      g_simple_async_result_set_from_error (result, error);
+      g_error_free (error);
+    }
+
+  priv->drained_cb = NULL;
+  priv->finished_cb = NULL;
+  soup_output_stream_done_io (stream);
+
+  /* We are called from inside the message's I/O */
+  g_simple_async_result_complete_in_idle (result);
+  g_object_unref (result);
+}
+
 static void
 soup_output_stream_write_async (GOutputStream       *stream,
 				const void          *buffer,
@@ -298,28 +583,35 @@ soup_output_stream_write_async (GOutputStream       *stream,
 {
   SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
   GSimpleAsyncResult *result;
+  GError *error = NULL;
 
   result = g_simple_async_result_new (G_OBJECT (stream),
 				      callback, user_data,
 				      soup_output_stream_write_async);
 
-  if (priv->size > 0 && priv->offset + count > priv->size)
+  if (!soup_output_stream_append (stream, buffer, count, &error))
     {
-      GError *error;
-
-      error = g_error_new (G_IO_ERROR, G_IO_ERROR_NO_SPACE,
-			   "Write would exceed caller-defined file size");
       g_simple_async_result_set_from_error (result, error);
       g_error_free (error);
+      g_simple_async_result_complete_in_idle (result);
+      g_object_unref (result);
+      return;
     }
-  else
+
+  g_simple_async_result_set_op_res_gssize (result, count);
+
+  if (priv->in_flight <= SOUP_OUTPUT_STREAM_WINDOW_SIZE)
     {
-      g_byte_array_append (priv->ba, buffer, count);
-      priv->offset += count;
-      g_simple_async_result_set_op_res_gssize (result, count);
+      g_simple_async_result_complete_in_idle (result);
+      g_object_unref (result);
+      return;
     }
 
-  g_simple_async_result_complete_in_idle (result);
+  /* Too much data waiting to be sent, complete once some of it is out */
+  priv->result = result;
+  priv->drained_cb = write_async_done;
+  priv->finished_cb = write_async_done;
+  soup_output_stream_prepare_for_io (stream, cancellable);
 }
 
 static gssize
@@ -357,21 +649,10 @@ close_async_done (GOutputStream *stream)
     g_simple_async_result_set_op_res_gboolean (result, TRUE);
 
   priv->finished_cb = NULL;
-  priv->cancelled_cb = NULL;
   soup_output_stream_done_io (stream);
 
-  g_simple_async_result_complete (result);
-}
-
-static void
-soup_output_stream_finished (SoupMessage *msg, gpointer stream)
-{
-  SoupOutputStreamPrivate *priv = SOUP_OUTPUT_STREAM_GET_PRIVATE (stream);
-
-  priv->finished = TRUE;
-
-  g_signal_handlers_disconnect_by_func (priv->msg, G_CALLBACK (soup_output_stream_finished), stream);
-  close_async_done (stream);
+  g_simple_async_result_complete_in_idle (result);
+  g_object_unref (result);
 }
 
 static void
@@ -397,14 +678,18 @@ soup_output_stream_close_async (GOutputStream        *stream,
       g_simple_async_result_set_from_error (result, error);
       g_error_free (error);
       g_simple_async_result_complete_in_idle (result);
+      g_object_unref (result);
       return;
     }
 
   priv->result = result;
-  priv->cancelled_cb = close_async_done;
-  g_signal_connect (priv->msg, "finished",
-		    G_CALLBACK (soup_output_stream_finished), stream);
+  priv->finished_cb = close_async_done;
   soup_output_stream_prepare_for_io (stream, cancellable);
+  soup_output_stream_complete (stream);
+
+  /* The server may have answered already */
+  if (priv->finished && priv->result)
+    close_async_done (stream);
 }
 
 static gboolean
@@ -0,0 +1,320 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * Copyright (C) 2006-2007 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include <config.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <locale.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#define BENCHMARK_UNIT_NAME "gvfs-archive"
+
+#include "benchmark-common.c"
+
+#define ENTRIES_NUM    500000
+#define DIRS_NUM       8
+#define QUERIES_NUM    100000
+
+/* Set when running on the private session bus, see run_with_private_cache() */
+#define CACHE_DIR_ENV  "GVFS_BENCHMARK_ARCHIVE_CACHE_DIR"
+
+static gboolean operation_ok;
+
+static void
+write_octal (char *field, gsize len, guint64 value)
+{
+  g_snprintf (field, len, "%0*" G_GINT64_MODIFIER "o", (int) len - 1, value);
+}
+
+/* Writes a tar of empty files: half of them in one big directory,
+ * the rest spread over a few small ones */
+static gboolean
+create_tar (const char *filename)
+{
+  FILE  *f;
+  char   header[512];
+  guint  checksum, j;
+  gint   i;
+
+  f = fopen (filename, "w");
+  if (f == NULL)
+    {
+      g_printerr ("Failed to create %s: %s\n", filename, g_strerror (errno));
+      return FALSE;
+    }
+
+  for (i = 0; i < ENTRIES_NUM; i++)
+    {
+      memset (header, 0, sizeof (header));
+      if (i % 2 == 0)
+        g_snprintf (header, 100, "big/file-%d", i);
+      else
+        g_snprintf (header, 100, "dir-%d/file-%d", i % DIRS_NUM, i);
+      write_octal (header + 100, 8, 0644);
+      write_octal (header + 108, 8, 0);
+      write_octal (header + 116, 8, 0);
+      write_octal (header + 124, 12, 0);
+      write_octal (header + 136, 12, 1234567890);
+      header[156] = '0';
+      memcpy (header + 257, "ustar", 6);
+      memcpy (header + 263, "00", 2);
+
+      memset (header + 148, ' ', 8);
+      for (checksum = 0, j = 0; j < sizeof (header); j++)
+        checksum += (guchar) header[j];
+      g_snprintf (header + 148, 8, "%06o", checksum);
+
+      if (fwrite (header, sizeof (header), 1, f) != 1)
+        {
+          g_printerr ("Failed to write %s: %s\n", filename, g_strerror (errno));
+          fclose (f);
+          return FALSE;
+        }
+    }
+
+  /* End of archive */
+  memset (header, 0, sizeof (header));
+  fwrite (header, sizeof (header), 1, f);
+  fwrite (header, sizeof (header), 1, f);
+
+  return fclose (f) == 0;
+}
+
+static void
+mount_done_cb (GObject *object, GAsyncResult *res, gpointer user_data)
+{
+  GError *error = NULL;
+
+  operation_ok = g_file_mount_enclosing_volume_finish (G_FILE (object), res, &error);
+  if (!operation_ok)
+    {
+      g_printerr ("Failed to mount archive: %s\n", error->message);
+      g_error_free (error);
+    }
+
+  benchmark_quit_main_loop ();
+}
+
+static void
+unmount_done_cb (GObject *object, GAsyncResult *res, gpointer user_data)
+{
+  GError *error = NULL;
+
+  operation_ok = g_mount_unmount_finish (G_MOUNT (object), res, &error);
+  if (!operation_ok)
+    {
+      g_printerr ("Failed to unmount archive: %s\n", error->message);
+      g_error_free (error);
+    }
+
+  benchmark_quit_main_loop ();
+}
+
+static gboolean
+query_random_files (GFile *root)
+{
+  GFileInfo *info;
+  GError    *error = NULL;
+  GFile     *file;
+  char      *path;
+  gint       i, n;
+
+  for (i = 0; i < QUERIES_NUM; i++)
+    {
+      n = g_random_int_range (0, ENTRIES_NUM);
+      if (n % 2 == 0)
+        path = g_strdup_printf ("big/file-%d", n);
+      else
+        path = g_strdup_printf ("dir-%d/file-%d", n % DIRS_NUM, n);
+
+      file = g_file_resolve_relative_path (root, path);
+      info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_SIZE, 0, NULL, &error);
+      g_object_unref (file);
+      g_free (path);
+
+      if (info == NULL)
+        {
+          g_printerr ("Failed to query file: %s\n", error->message);
+          g_error_free (error);
+          return FALSE;
+        }
+      g_object_unref (info);
+    }
+
+  return TRUE;
+}
+
+static gboolean
+mount_archive (GFile *root)
+{
+  g_file_mount_enclosing_volume (root, 0, NULL, NULL, mount_done_cb, NULL);
+  benchmark_run_main_loop ();
+  return operation_ok;
+}
+
+static void
+unmount_archive (GFile *root)
+{
+  GMount *mount;
+
+  mount = g_file_find_enclosing_mount (root, NULL, NULL);
+  if (mount)
+    {
+      g_mount_unmount (mount, 0, NULL, unmount_done_cb, NULL);
+      benchmark_run_main_loop ();
+      g_object_unref (mount);
+    }
+}
+
+static void
+remove_dir (const char *dirname)
+{
+  GDir       *dir;
+  const char *name;
+  char       *path;
+
+  dir = g_dir_open (dirname, 0, NULL);
+  if (dir)
+    {
+      while ((name = g_dir_read_name (dir)) != NULL)
+        {
+          path = g_build_filename (dirname, name, NULL);
+          if (g_file_test (path, G_FILE_TEST_IS_DIR))
+            remove_dir (path);
+          else
+            unlink (path);
+          g_free (path);
+        }
+      g_dir_close (dir);
+    }
+
+  rmdir (dirname);
+}
+
+/* The archive daemon saves an index of each archive in its cache dir.
+ * Run the benchmark again on a private session bus, so the daemons
+ * started for it use a temporary cache dir that is removed afterwards */
+static gint
+run_with_private_cache (const char *program)
+{
+  char   *spawn_argv[] = { "dbus-launch", "--exit-with-session", NULL, NULL };
+  char   *cache_dir;
+  GError *error = NULL;
+  gint    status;
+
+  cache_dir = g_build_filename (g_get_tmp_dir (), "gvfs-benchmark-archive-XXXXXX", NULL);
+  if (mkdtemp (cache_dir) == NULL)
+    {
+      g_printerr ("Failed to create %s: %s\n", cache_dir, g_strerror (errno));
+      g_free (cache_dir);
+      return 1;
+    }
+
+  g_setenv (CACHE_DIR_ENV, cache_dir, TRUE);
+  g_setenv ("XDG_CACHE_HOME", cache_dir, TRUE);
+
+  spawn_argv[2] = (char *) program;
+  if (!g_spawn_sync (NULL, spawn_argv, NULL,
+                     G_SPAWN_SEARCH_PATH | G_SPAWN_CHILD_INHERITS_STDIN,
+                     NULL, NULL, NULL, NULL, &status, &error))
+    {
+      g_printerr ("Failed to run %s: %s\n", spawn_argv[0], error->message);
+      g_error_free (error);
+      status = 1;
+    }
+  else if (WIFEXITED (status))
+    status = WEXITSTATUS (status);
+  else
+    status = 1;
+
+  remove_dir (cache_dir);
+  g_free (cache_dir);
+  return status;
+}
+
+static gint
+benchmark_run (gint argc, gchar *argv [])
+{
+  GFile  *root;
+  GTimer *timer;
+  char   *filename, *file_uri, *escaped, *uri;
+  gint    result = 1;
+
+  setlocale (LC_ALL, "");
+
+  g_type_init ();
+
+  if (g_getenv (CACHE_DIR_ENV) == NULL)
+    return run_with_private_cache (argv[0]);
+
+  /* The cache dir starts out empty, so the first mount reads the archive */
+  filename = g_strdup_printf ("%s/gvfs-benchmark-archive-%d.tar", g_get_tmp_dir (), getpid ());
+  if (!create_tar (filename))
+    {
+      g_free (filename);
+      return 1;
+    }
+
+  file_uri = g_filename_to_uri (filename, NULL, NULL);
+  escaped = g_uri_escape_string (file_uri, NULL, FALSE);
+  uri = g_strconcat ("archive://", escaped, "/", NULL);
+  root = g_file_new_for_uri (uri);
+  g_free (file_uri);
+  g_free (escaped);
+  g_free (uri);
+
+  timer = g_timer_new ();
+
+  if (!mount_archive (root))
+    goto out;
+  g_print ("mount (%d entries): %f s\n", ENTRIES_NUM, g_timer_elapsed (timer, NULL));
+
+  g_timer_start (timer);
+  if (!query_random_files (root))
+    goto unmount;
+  g_print ("query_info (%d files): %f s\n", QUERIES_NUM, g_timer_elapsed (timer, NULL));
+
+  /* The first mount saved an index, the second one reads it */
+  unmount_archive (root);
+  g_timer_start (timer);
+  if (!mount_archive (root))
+    goto out;
+  g_print ("mount from index (%d entries): %f s\n", ENTRIES_NUM, g_timer_elapsed (timer, NULL));
+
+  result = 0;
+
+ unmount:
+  unmount_archive (root);
+
+ out:
+  g_timer_destroy (timer);
+  g_object_unref (root);
+  unlink (filename);
+  g_free (filename);
+  return result;
+}
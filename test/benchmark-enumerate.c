@@ -0,0 +1,314 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * Copyright (C) 2006-2007 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include <config.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <locale.h>
+#include <errno.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#define BENCHMARK_UNIT_NAME "gvfs-enumerate"
+
+#include "benchmark-common.c"
+
+#define ENTRIES_NUM    10000
+#define ITERATIONS_NUM 10
+#define FILES_PER_REQUEST 100
+
+static gboolean operation_ok;
+static gint     n_enumerated;
+
+static gboolean
+is_dir (GFile *file)
+{
+  GFileInfo *info;
+  gboolean res;
+
+  info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_TYPE, 0, NULL, NULL);
+  res = info && g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY;
+  if (info)
+    g_object_unref (info);
+  return res;
+}
+
+static gboolean
+populate_dir (GFile *dir)
+{
+  GFileOutputStream *stream;
+  GError            *error = NULL;
+  GFile             *file;
+  gchar             *name;
+  gint               i;
+
+  if (!g_file_make_directory (dir, NULL, &error))
+    {
+      g_printerr ("Failed to create directory: %s\n", error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+
+  for (i = 0; i < ENTRIES_NUM; i++)
+    {
+      name = g_strdup_printf ("file-%d", i);
+      file = g_file_get_child (dir, name);
+      g_free (name);
+
+      stream = g_file_create (file, 0, NULL, &error);
+      g_object_unref (file);
+      if (stream == NULL)
+        {
+          g_printerr ("Failed to create file: %s\n", error->message);
+          g_error_free (error);
+          return FALSE;
+        }
+
+      g_output_stream_close (G_OUTPUT_STREAM (stream), NULL, NULL);
+      g_object_unref (stream);
+    }
+
+  return TRUE;
+}
+
+static void
+clear_dir (GFile *dir)
+{
+  GFileEnumerator *enumerator;
+  GFileInfo       *info;
+  GFile           *file;
+
+  enumerator = g_file_enumerate_children (dir, G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                          0, NULL, NULL);
+  if (enumerator)
+    {
+      while ((info = g_file_enumerator_next_file (enumerator, NULL, NULL)) != NULL)
+        {
+          file = g_file_get_child (dir, g_file_info_get_name (info));
+          g_file_delete (file, NULL, NULL);
+          g_object_unref (file);
+          g_object_unref (info);
+        }
+      g_object_unref (enumerator);
+    }
+
+  g_file_delete (dir, NULL, NULL);
+}
+
+static gboolean
+enumerate_sync (GFile *dir, const char *attributes)
+{
+  GFileEnumerator *enumerator;
+  GFileInfo       *info;
+  GError          *error = NULL;
+  gint             n = 0;
+
+  enumerator = g_file_enumerate_children (dir, attributes, 0, NULL, &error);
+  if (enumerator == NULL)
+    {
+      g_printerr ("Failed to enumerate directory: %s\n", error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+
+  while ((info = g_file_enumerator_next_file (enumerator, NULL, &error)) != NULL)
+    {
+      n++;
+      g_object_unref (info);
+    }
+  g_object_unref (enumerator);
+
+  if (error)
+    {
+      g_printerr ("Failed to enumerate directory: %s\n", error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+
+  if (n != ENTRIES_NUM)
+    {
+      g_printerr ("Expected %d entries, got %d\n", ENTRIES_NUM, n);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+next_files_cb (GObject *object, GAsyncResult *res, gpointer user_data)
+{
+  GFileEnumerator *enumerator = G_FILE_ENUMERATOR (object);
+  GError          *error = NULL;
+  GList           *infos;
+
+  infos = g_file_enumerator_next_files_finish (enumerator, res, &error);
+  if (error)
+    {
+      g_printerr ("Failed to enumerate directory: %s\n", error->message);
+      g_error_free (error);
+      operation_ok = FALSE;
+      benchmark_quit_main_loop ();
+      return;
+    }
+
+  if (infos == NULL)
+    {
+      benchmark_quit_main_loop ();
+      return;
+    }
+
+  n_enumerated += g_list_length (infos);
+  g_list_foreach (infos, (GFunc) g_object_unref, NULL);
+  g_list_free (infos);
+
+  g_file_enumerator_next_files_async (enumerator, FILES_PER_REQUEST, 0, NULL,
+                                      next_files_cb, NULL);
+}
+
+static void
+enumerate_children_cb (GObject *object, GAsyncResult *res, gpointer user_data)
+{
+  GFileEnumerator *enumerator;
+  GError          *error = NULL;
+
+  enumerator = g_file_enumerate_children_finish (G_FILE (object), res, &error);
+  if (enumerator == NULL)
+    {
+      g_printerr ("Failed to enumerate directory: %s\n", error->message);
+      g_error_free (error);
+      operation_ok = FALSE;
+      benchmark_quit_main_loop ();
+      return;
+    }
+
+  /* The callbacks keep it alive while the requests are running */
+  g_file_enumerator_next_files_async (enumerator, FILES_PER_REQUEST, 0, NULL,
+                                      next_files_cb, NULL);
+  g_object_unref (enumerator);
+}
+
+static gboolean
+enumerate_async (GFile *dir, const char *attributes)
+{
+  operation_ok = TRUE;
+  n_enumerated = 0;
+
+  g_file_enumerate_children_async (dir, attributes, 0, 0, NULL,
+                                   enumerate_children_cb, NULL);
+  benchmark_run_main_loop ();
+
+  if (operation_ok && n_enumerated != ENTRIES_NUM)
+    {
+      g_printerr ("Expected %d entries, got %d\n", ENTRIES_NUM, n_enumerated);
+      operation_ok = FALSE;
+    }
+
+  return operation_ok;
+}
+
+/* Times the enumeration with the infos sent in the compact form and,
+ * by setting GVFS_ENUMERATE_NO_COMPACT for the client, one attribute
+ * at a time */
+static gboolean
+time_enumerate (GFile *dir, const char *attributes, gboolean async)
+{
+  GTimer  *timer;
+  gboolean compact;
+  gint     i;
+
+  timer = g_timer_new ();
+
+  for (compact = FALSE; compact <= TRUE; compact++)
+    {
+      if (compact)
+        g_unsetenv ("GVFS_ENUMERATE_NO_COMPACT");
+      else
+        g_setenv ("GVFS_ENUMERATE_NO_COMPACT", "1", TRUE);
+
+      g_timer_start (timer);
+      for (i = 0; i < ITERATIONS_NUM; i++)
+        {
+          if (!(async ? enumerate_async (dir, attributes) : enumerate_sync (dir, attributes)))
+            {
+              g_timer_destroy (timer);
+              return FALSE;
+            }
+        }
+
+      g_print ("enumerate %s %s %s (%d entries, %d times): %f s\n",
+               async ? "async" : "sync", compact ? "compact" : "plain",
+               attributes, ENTRIES_NUM, ITERATIONS_NUM,
+               g_timer_elapsed (timer, NULL));
+    }
+
+  g_timer_destroy (timer);
+  return TRUE;
+}
+
+static gint
+benchmark_run (gint argc, gchar *argv [])
+{
+  GFile *base_dir;
+  GFile *dir;
+  gchar *name;
+  gint   result = 1;
+
+  setlocale (LC_ALL, "");
+
+  g_type_init ();
+
+  if (argc < 2)
+    {
+      g_printerr ("Usage: %s <mounted scratch URI>\n", argv [0]);
+      return 1;
+    }
+
+  base_dir = g_file_new_for_commandline_arg (argv [1]);
+
+  if (!is_dir (base_dir))
+    {
+      g_printerr ("Scratch URI %s is not a directory\n", argv [1]);
+      g_object_unref (base_dir);
+      return 1;
+    }
+
+  name = g_strdup_printf ("gvfs-benchmark-enumerate-%d", getpid ());
+  dir = g_file_get_child (base_dir, name);
+  g_free (name);
+
+  /* The time spent moving the infos from the daemon shows most with
+   * many attributes per file */
+  if (populate_dir (dir) &&
+      time_enumerate (dir, G_FILE_ATTRIBUTE_STANDARD_NAME, FALSE) &&
+      time_enumerate (dir, "*", FALSE) &&
+      time_enumerate (dir, G_FILE_ATTRIBUTE_STANDARD_NAME, TRUE) &&
+      time_enumerate (dir, "*", TRUE))
+    result = 0;
+
+  clear_dir (dir);
+
+  g_object_unref (dir);
+  g_object_unref (base_dir);
+  return result;
+}
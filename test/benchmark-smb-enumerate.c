@@ -0,0 +1,225 @@
+/* GIO - GLib Input, Output and Streaming Library
+ *
+ * Copyright (C) 2006-2007 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include <config.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <locale.h>
+#include <errno.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#define BENCHMARK_UNIT_NAME "gvfs-smb-enumerate"
+
+#include "benchmark-common.c"
+
+#define ENTRIES_NUM    5000
+#define ITERATIONS_NUM 10
+
+/* Served from the dirent alone */
+#define NAME_ATTRIBUTES  G_FILE_ATTRIBUTE_STANDARD_NAME "," \
+                         G_FILE_ATTRIBUTE_STANDARD_TYPE "," \
+                         G_FILE_ATTRIBUTE_STANDARD_DISPLAY_NAME
+/* Needs the stat data for every entry */
+#define STAT_ATTRIBUTES  "standard::*,time::modified"
+
+static gboolean
+is_dir (GFile *file)
+{
+  GFileInfo *info;
+  gboolean res;
+
+  info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_TYPE, 0, NULL, NULL);
+  res = info && g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY;
+  if (info)
+    g_object_unref (info);
+  return res;
+}
+
+static gboolean
+populate_dir (GFile *dir)
+{
+  GFileOutputStream *stream;
+  GError            *error = NULL;
+  GFile             *file;
+  gchar             *name;
+  gint               i;
+
+  if (!g_file_make_directory (dir, NULL, &error))
+    {
+      g_printerr ("Failed to create directory: %s\n", error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+
+  for (i = 0; i < ENTRIES_NUM; i++)
+    {
+      name = g_strdup_printf ("file-%d", i);
+      file = g_file_get_child (dir, name);
+      g_free (name);
+
+      stream = g_file_create (file, 0, NULL, &error);
+      g_object_unref (file);
+      if (stream == NULL)
+        {
+          g_printerr ("Failed to create file: %s\n", error->message);
+          g_error_free (error);
+          return FALSE;
+        }
+
+      g_output_stream_close (G_OUTPUT_STREAM (stream), NULL, NULL);
+      g_object_unref (stream);
+    }
+
+  return TRUE;
+}
+
+static void
+clear_dir (GFile *dir)
+{
+  GFileEnumerator *enumerator;
+  GFileInfo       *info;
+  GFile           *file;
+
+  enumerator = g_file_enumerate_children (dir, G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                          0, NULL, NULL);
+  if (enumerator)
+    {
+      while ((info = g_file_enumerator_next_file (enumerator, NULL, NULL)) != NULL)
+        {
+          file = g_file_get_child (dir, g_file_info_get_name (info));
+          g_file_delete (file, NULL, NULL);
+          g_object_unref (file);
+          g_object_unref (info);
+        }
+      g_object_unref (enumerator);
+    }
+
+  g_file_delete (dir, NULL, NULL);
+}
+
+static gboolean
+enumerate_dir (GFile *dir, const char *attributes)
+{
+  GFileEnumerator *enumerator;
+  GFileInfo       *info;
+  GError          *error = NULL;
+  gint             n = 0;
+
+  enumerator = g_file_enumerate_children (dir, attributes, 0, NULL, &error);
+  if (enumerator == NULL)
+    {
+      g_printerr ("Failed to enumerate directory: %s\n", error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+
+  while ((info = g_file_enumerator_next_file (enumerator, NULL, &error)) != NULL)
+    {
+      n++;
+      g_object_unref (info);
+    }
+  g_object_unref (enumerator);
+
+  if (error)
+    {
+      g_printerr ("Failed to enumerate directory: %s\n", error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+
+  if (n != ENTRIES_NUM)
+    {
+      g_printerr ("Expected %d entries, got %d\n", ENTRIES_NUM, n);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+time_enumerate (GFile *dir, const char *attributes)
+{
+  GTimer *timer;
+  gint    i;
+
+  timer = g_timer_new ();
+
+  for (i = 0; i < ITERATIONS_NUM; i++)
+    {
+      if (!enumerate_dir (dir, attributes))
+        {
+          g_timer_destroy (timer);
+          return FALSE;
+        }
+    }
+
+  g_print ("enumerate %s (%d entries, %d times): %f s\n",
+           attributes, ENTRIES_NUM, ITERATIONS_NUM, g_timer_elapsed (timer, NULL));
+  g_timer_destroy (timer);
+  return TRUE;
+}
+
+static gint
+benchmark_run (gint argc, gchar *argv [])
+{
+  GFile *base_dir;
+  GFile *dir;
+  gchar *name;
+  gint   result = 1;
+
+  setlocale (LC_ALL, "");
+
+  g_type_init ();
+
+  if (argc < 2)
+    {
+      g_printerr ("Usage: %s <mounted smb:// scratch URI>\n", argv [0]);
+      return 1;
+    }
+
+  base_dir = g_file_new_for_commandline_arg (argv [1]);
+
+  if (!is_dir (base_dir))
+    {
+      g_printerr ("Scratch URI %s is not a directory\n", argv [1]);
+      g_object_unref (base_dir);
+      return 1;
+    }
+
+  name = g_strdup_printf ("gvfs-benchmark-enumerate-%d", getpid ());
+  dir = g_file_get_child (base_dir, name);
+  g_free (name);
+
+  if (populate_dir (dir) &&
+      time_enumerate (dir, NAME_ATTRIBUTES) &&
+      time_enumerate (dir, STAT_ATTRIBUTES))
+    result = 0;
+
+  clear_dir (dir);
+
+  g_object_unref (dir);
+  g_object_unref (base_dir);
+  return result;
+}